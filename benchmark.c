@@ -0,0 +1,1733 @@
+/*  Micro-benchmarks for jpt.
+    Copyright (C) 2007, 2008, 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "jpt.h"
+#include "libjpt/jpt_internal.h"
+#include "libjpt/patricia.h"
+
+static struct option long_options[] =
+{
+  { "help", 0, 0, 'h' },
+  { "skiplist", 0, 0, 's' },
+  { "table", 1, 0, 't' },
+  { 0, 0, 0, 0 }
+};
+
+static int table_flags = 0;
+static const char* table_name = "benchmark.tab";
+
+struct benchmark
+{
+  const char* name;
+  const char* description;
+  void (*run)();
+};
+
+static void
+fail(const char* what)
+{
+  fprintf(stderr, "%s failed: %s\n", what, jpt_last_error());
+
+  exit(EXIT_FAILURE);
+}
+
+static void
+remove_table()
+{
+  char* logname;
+
+  if(-1 == asprintf(&logname, "%s.log", table_name))
+    fail("asprintf");
+
+  if(-1 == unlink(table_name) && errno != ENOENT)
+    fail("unlink");
+
+  if(-1 == unlink(logname) && errno != ENOENT)
+    fail("unlink");
+
+  free(logname);
+}
+
+static struct JPT_info*
+create_table(size_t buffer_size)
+{
+  struct JPT_info* result;
+
+  remove_table();
+
+  result = jpt_init(table_name, buffer_size, table_flags);
+
+  if(!result)
+    fail("jpt_init");
+
+  return result;
+}
+
+static void
+report(const char* name, const char* what, uint64_t usec, size_t count)
+{
+  printf("%-16s %-40s %10.3f ms %12.3f us/op\n",
+         name, what, usec / 1000.0, (double) usec / (count ? count : 1));
+}
+
+/*****************************************************************************/
+
+#define COLUMN_SCAN_BIG_ROWS   200000
+#define COLUMN_SCAN_SMALL_ROWS 16
+#define COLUMN_SCAN_REPEAT     1000
+
+static int
+count_callback(const char* row, const char* column, const void* data,
+               size_t data_size, uint64_t* timestamp, void* arg)
+{
+  ++*(size_t*) arg;
+
+  return 0;
+}
+
+/* Scans a tiny column while the memtable is full of another column */
+static void
+benchmark_column_scan()
+{
+  struct JPT_info* db;
+  char row[32];
+  uint64_t start;
+  size_t i, count = 0;
+
+  db = create_table(256 * 1024 * 1024);
+
+  for(i = 0; i < COLUMN_SCAN_BIG_ROWS; ++i)
+  {
+    sprintf(row, "%010zu", (i * 7919) % COLUMN_SCAN_BIG_ROWS);
+
+    if(-1 == jpt_insert(db, row, "big", row, strlen(row), 0))
+      fail("jpt_insert");
+
+    if(i % (COLUMN_SCAN_BIG_ROWS / COLUMN_SCAN_SMALL_ROWS))
+      continue;
+
+    if(-1 == jpt_insert(db, row, "small", row, strlen(row), 0))
+      fail("jpt_insert");
+  }
+
+  start = jpt_gettime();
+
+  for(i = 0; i < COLUMN_SCAN_REPEAT; ++i)
+  {
+    if(-1 == jpt_column_scan(db, "small", count_callback, &count))
+      fail("jpt_column_scan");
+  }
+
+  report("column-scan", "scan 16-cell column, 200000 cells total",
+         jpt_gettime() - start, COLUMN_SCAN_REPEAT);
+
+  if(count != COLUMN_SCAN_SMALL_ROWS * COLUMN_SCAN_REPEAT)
+  {
+    fprintf(stderr, "column-scan: expected %zu cells, got %zu\n",
+            (size_t) COLUMN_SCAN_SMALL_ROWS * COLUMN_SCAN_REPEAT, count);
+
+    exit(EXIT_FAILURE);
+  }
+
+  start = jpt_gettime();
+
+  count = 0;
+
+  if(-1 == jpt_column_scan(db, "big", count_callback, &count))
+    fail("jpt_column_scan");
+
+  report("column-scan", "scan 200000-cell column",
+         jpt_gettime() - start, count);
+
+  jpt_close(db);
+  remove_table();
+}
+
+/*****************************************************************************/
+
+#define COLUMN_SEEK_DISKTABLES 32
+#define COLUMN_SEEK_COLUMNS    64
+#define COLUMN_SEEK_ROWS       512
+#define COLUMN_SEEK_REPEAT     10000
+
+static int
+first_callback(const char* row, const char* column, const void* data,
+               size_t data_size, uint64_t* timestamp, void* arg)
+{
+  ++*(size_t*) arg;
+
+  return 1;
+}
+
+/* Finds columns in many disktables that each hold many columns */
+static void
+benchmark_column_seek()
+{
+  struct JPT_info* db;
+  char row[32], column[32];
+  uint64_t start;
+  size_t i, j, k, count = 0;
+
+  db = create_table(256 * 1024 * 1024);
+
+  /* Created first, so it sorts before the other columns */
+  if(-1 == jpt_create_column(db, "rare", 0))
+    fail("jpt_create_column");
+
+  for(i = 0; i < COLUMN_SEEK_DISKTABLES; ++i)
+  {
+    for(j = 0; j < COLUMN_SEEK_COLUMNS; ++j)
+    {
+      sprintf(column, "c%02zu", j);
+
+      for(k = 0; k < COLUMN_SEEK_ROWS; ++k)
+      {
+        sprintf(row, "%010zu", k * COLUMN_SEEK_DISKTABLES + i);
+
+        if(-1 == jpt_insert(db, row, column, row, strlen(row), 0))
+          fail("jpt_insert");
+      }
+    }
+
+    /* A column that exists only in the last disktable */
+    if(i == COLUMN_SEEK_DISKTABLES - 1)
+    {
+      for(k = 0; k < 16; ++k)
+      {
+        sprintf(row, "%010zu", k);
+
+        if(-1 == jpt_insert(db, row, "rare", row, strlen(row), 0))
+          fail("jpt_insert");
+      }
+    }
+
+    if(-1 == jpt_compact(db))
+      fail("jpt_compact");
+  }
+
+  start = jpt_gettime();
+
+  for(i = 0; i < COLUMN_SEEK_REPEAT; ++i)
+  {
+    sprintf(column, "c%02zu", i % COLUMN_SEEK_COLUMNS);
+
+    if(-1 == jpt_column_scan(db, column, first_callback, &count))
+      fail("jpt_column_scan");
+  }
+
+  report("column-seek", "first cell of column, 32 disktables",
+         jpt_gettime() - start, COLUMN_SEEK_REPEAT);
+
+  start = jpt_gettime();
+
+  for(i = 0; i < COLUMN_SEEK_REPEAT; ++i)
+  {
+    if(-1 == jpt_column_scan(db, "rare", count_callback, &count))
+      fail("jpt_column_scan");
+  }
+
+  report("column-seek", "scan column found in 1 of 32 disktables",
+         jpt_gettime() - start, COLUMN_SEEK_REPEAT);
+
+  if(count != COLUMN_SEEK_REPEAT * 17)
+  {
+    fprintf(stderr, "column-seek: expected %zu cells, got %zu\n",
+            (size_t) COLUMN_SEEK_REPEAT * 17, count);
+
+    exit(EXIT_FAILURE);
+  }
+
+  jpt_close(db);
+  remove_table();
+}
+
+/*****************************************************************************/
+
+#define APPEND_CELLS     64
+#define APPEND_POSTINGS  20000
+
+/* Builds an inverted index from many tiny appends, then reads and flushes it */
+static void
+benchmark_append()
+{
+  struct JPT_info* db;
+  char row[32];
+  void* value;
+  size_t value_size;
+  uint64_t start;
+  uint32_t posting;
+  size_t i, cell;
+
+  db = create_table(256 * 1024 * 1024);
+
+  start = jpt_gettime();
+
+  for(i = 0; i < APPEND_POSTINGS; ++i)
+  {
+    for(cell = 0; cell < APPEND_CELLS; ++cell)
+    {
+      sprintf(row, "%08zu", cell);
+      posting = i;
+
+      if(-1 == jpt_insert(db, row, "postings", &posting, sizeof(posting), JPT_APPEND))
+        fail("jpt_insert");
+    }
+  }
+
+  report("append", "append 4 bytes to one of 64 cells",
+         jpt_gettime() - start, APPEND_CELLS * APPEND_POSTINGS);
+
+  start = jpt_gettime();
+
+  for(i = 0; i < 10; ++i)
+  {
+    for(cell = 0; cell < APPEND_CELLS; ++cell)
+    {
+      sprintf(row, "%08zu", cell);
+
+      if(-1 == jpt_get(db, row, "postings", &value, &value_size))
+        fail("jpt_get");
+
+      free(value);
+    }
+  }
+
+  report("append", "get 80000-byte cell from memtable",
+         jpt_gettime() - start, APPEND_CELLS * 10);
+
+  start = jpt_gettime();
+
+  if(-1 == jpt_compact(db))
+    fail("jpt_compact");
+
+  report("append", "flush memtable to disktable", jpt_gettime() - start, 1);
+
+  jpt_close(db);
+  remove_table();
+}
+
+/*****************************************************************************/
+
+#define FLUSH_ROWS 2000000
+
+/* Returns the peak resident set size of the process, in kilobytes */
+static long
+peak_rss()
+{
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+
+  return usage.ru_maxrss;
+}
+
+/* Writes a large memtable to a disktable */
+static void
+benchmark_flush()
+{
+  struct JPT_info* db;
+  char row[32];
+  long rss_before;
+  uint64_t start;
+  size_t i;
+
+  db = create_table((size_t) 1024 * 1024 * 1024);
+
+  for(i = 0; i < FLUSH_ROWS; ++i)
+  {
+    sprintf(row, "%010zu", (i * 7919) % FLUSH_ROWS);
+
+    if(-1 == jpt_insert(db, row, "column", "0123456789abcdef", 16, 0))
+      fail("jpt_insert");
+  }
+
+  rss_before = peak_rss();
+  start = jpt_gettime();
+
+  if(-1 == jpt_compact(db))
+    fail("jpt_compact");
+
+  report("flush", "flush 2000000-cell memtable",
+         jpt_gettime() - start, FLUSH_ROWS);
+
+  printf("%-16s %-40s %10ld kB %12ld kB\n",
+         "flush", "peak RSS before and during flush", rss_before, peak_rss());
+
+  jpt_close(db);
+  remove_table();
+}
+
+/*****************************************************************************/
+
+#define TRIE_KEYS 10000000
+
+static char (*trie_keys)[20];
+
+static const char*
+trie_key_callback(unsigned int idx, void* arg)
+{
+  return trie_keys[idx];
+}
+
+/* Builds the PATRICIA trie of a 10M-key disktable */
+static void
+benchmark_trie_build()
+{
+  struct patricia* pat;
+  uint64_t start;
+  unsigned int i;
+
+  if(!(trie_keys = malloc(sizeof(*trie_keys) * TRIE_KEYS)))
+    fail("malloc");
+
+  /* Sorted keys shaped like a column prefix followed by a row */
+  for(i = 0; i < TRIE_KEYS; ++i)
+    sprintf(trie_keys[i], "\001\001\002\003%010u", i * 3);
+
+  pat = patricia_create(trie_key_callback, 0);
+  start = jpt_gettime();
+
+  for(i = 0; i < TRIE_KEYS; ++i)
+    patricia_define(pat, trie_keys[i]);
+
+  report("trie-build", "patricia_define, 10M sorted keys",
+         jpt_gettime() - start, TRIE_KEYS);
+
+  patricia_destroy(pat);
+
+  pat = patricia_create(0, 0);
+  start = jpt_gettime();
+
+  for(i = 0; i < TRIE_KEYS; ++i)
+    patricia_define_sorted(pat, trie_keys[i]);
+
+  report("trie-build", "patricia_define_sorted, 10M sorted keys",
+         jpt_gettime() - start, TRIE_KEYS);
+
+  patricia_destroy(pat);
+  free(trie_keys);
+}
+
+/*****************************************************************************/
+
+#define GET_MISSING_ROWS       4000000
+#define GET_MISSING_DISKTABLES 32
+#define GET_MISSING_LOOKUPS    200000
+
+/* Row names are a bijective scramble of an index, so even indexes are
+ * inserted and odd indexes are absent, with no pattern a weak hash could
+ * pick up */
+static void
+get_missing_row(char* row, uint64_t idx)
+{
+  sprintf(row, "%016llx", (unsigned long long) (idx * 0x9e3779b97f4a7c15ULL));
+}
+
+/* Looks up absent keys in a table with several large disktables */
+static void
+benchmark_get_missing()
+{
+  struct JPT_info* db;
+  char row[32];
+  void* value;
+  size_t value_size;
+  uint64_t start;
+  size_t i;
+
+  db = create_table(256 * 1024 * 1024);
+
+  for(i = 0; i < GET_MISSING_ROWS; ++i)
+  {
+    get_missing_row(row, i * 2);
+
+    if(-1 == jpt_insert(db, row, "column", "0123456789abcdef", 16, 0))
+      fail("jpt_insert");
+
+    if((i + 1) % (GET_MISSING_ROWS / GET_MISSING_DISKTABLES))
+      continue;
+
+    if(-1 == jpt_compact(db))
+      fail("jpt_compact");
+  }
+
+  start = jpt_gettime();
+
+  for(i = 0; i < GET_MISSING_LOOKUPS; ++i)
+  {
+    get_missing_row(row, (i * 7919) % GET_MISSING_ROWS * 2 + 1);
+
+    if(0 == jpt_get(db, row, "column", &value, &value_size))
+      fail("jpt_get of missing key");
+  }
+
+  report("get-missing", "get absent key, 32 disktables of 125000",
+         jpt_gettime() - start, GET_MISSING_LOOKUPS);
+
+  start = jpt_gettime();
+
+  for(i = 0; i < GET_MISSING_LOOKUPS; ++i)
+  {
+    get_missing_row(row, (i * 7919) % GET_MISSING_ROWS * 2);
+
+    if(-1 == jpt_get(db, row, "column", &value, &value_size))
+      fail("jpt_get");
+
+    free(value);
+  }
+
+  report("get-missing", "get present key, 32 disktables of 125000",
+         jpt_gettime() - start, GET_MISSING_LOOKUPS);
+
+  /* With a one bit per key filter, most absent keys reach the trie */
+  if(-1 == jpt_set_bloom_bits(db, 1))
+    fail("jpt_set_bloom_bits");
+
+  if(-1 == jpt_major_compact(db))
+    fail("jpt_major_compact");
+
+  start = jpt_gettime();
+
+  for(i = 0; i < GET_MISSING_LOOKUPS; ++i)
+  {
+    get_missing_row(row, (i * 7919) % GET_MISSING_ROWS * 2 + 1);
+
+    if(0 == jpt_get(db, row, "column", &value, &value_size))
+      fail("jpt_get of missing key");
+  }
+
+  report("get-missing", "get absent key, 1 disktable, 1 bit/key",
+         jpt_gettime() - start, GET_MISSING_LOOKUPS);
+
+  jpt_close(db);
+  remove_table();
+}
+
+/*****************************************************************************/
+
+#define GET_BATCH_ROWS       640000
+#define GET_BATCH_DISKTABLES 32
+#define GET_BATCH_SIZE       200
+#define GET_BATCH_BATCHES    2000
+
+/* Fetches cells one batch at a time, with one jpt_get per cell and with
+ * jpt_get_batch; half of the requested cells are absent */
+static void
+benchmark_get_batch()
+{
+  struct JPT_info* db;
+  struct JPT_batch_cell cells[GET_BATCH_SIZE];
+  char rows[GET_BATCH_SIZE][32];
+  void* value;
+  size_t value_size;
+  uint64_t start;
+  size_t i, j, found = 0, batch_found = 0;
+
+  db = create_table(256 * 1024 * 1024);
+
+  for(i = 0; i < GET_BATCH_ROWS; ++i)
+  {
+    get_missing_row(rows[0], i * 2);
+
+    if(-1 == jpt_insert(db, rows[0], "column", "0123456789abcdef", 16, 0))
+      fail("jpt_insert");
+
+    if((i + 1) % (GET_BATCH_ROWS / GET_BATCH_DISKTABLES))
+      continue;
+
+    if(-1 == jpt_compact(db))
+      fail("jpt_compact");
+  }
+
+  for(i = 0; i < GET_BATCH_SIZE; ++i)
+  {
+    cells[i].row = rows[i];
+    cells[i].column = "column";
+  }
+
+  start = jpt_gettime();
+
+  for(i = 0; i < GET_BATCH_BATCHES; ++i)
+  {
+    for(j = 0; j < GET_BATCH_SIZE; ++j)
+    {
+      get_missing_row(rows[j], ((i * GET_BATCH_SIZE + j) * 7919) % (GET_BATCH_ROWS * 2));
+
+      if(-1 == jpt_get(db, rows[j], "column", &value, &value_size))
+        continue;
+
+      free(value);
+      ++found;
+    }
+  }
+
+  report("get-batch", "200 cells, one jpt_get per cell",
+         jpt_gettime() - start, GET_BATCH_BATCHES);
+
+  start = jpt_gettime();
+
+  for(i = 0; i < GET_BATCH_BATCHES; ++i)
+  {
+    int res;
+
+    for(j = 0; j < GET_BATCH_SIZE; ++j)
+      get_missing_row(rows[j], ((i * GET_BATCH_SIZE + j) * 7919) % (GET_BATCH_ROWS * 2));
+
+    if(-1 == (res = jpt_get_batch(db, cells, GET_BATCH_SIZE, &value)))
+      fail("jpt_get_batch");
+
+    free(value);
+    batch_found += res;
+  }
+
+  report("get-batch", "200 cells, jpt_get_batch",
+         jpt_gettime() - start, GET_BATCH_BATCHES);
+
+  if(found != batch_found)
+  {
+    fprintf(stderr, "get-batch: jpt_get found %zu cells, jpt_get_batch %zu\n",
+            found, batch_found);
+
+    exit(EXIT_FAILURE);
+  }
+
+  jpt_close(db);
+  remove_table();
+}
+
+/*****************************************************************************/
+
+#define GET_REF_ROWS       2000
+#define GET_REF_VALUE_SIZE (64 * 1024)
+#define GET_REF_LOOKUPS    100000
+
+/* Reads large values from a disktable, copying them and referencing them */
+static void
+benchmark_get_ref()
+{
+  struct JPT_info* db;
+  struct JPT_ref* ref;
+  char row[32];
+  char* blob;
+  const void* ref_value;
+  void* value;
+  size_t value_size;
+  uint64_t start;
+  size_t i, sum = 0;
+
+  db = create_table(256 * 1024 * 1024);
+
+  if(!(blob = malloc(GET_REF_VALUE_SIZE)))
+    fail("malloc");
+
+  memset(blob, 'x', GET_REF_VALUE_SIZE);
+
+  for(i = 0; i < GET_REF_ROWS; ++i)
+  {
+    sprintf(row, "%08zu", i);
+
+    if(-1 == jpt_insert(db, row, "column", blob, GET_REF_VALUE_SIZE, 0))
+      fail("jpt_insert");
+  }
+
+  free(blob);
+
+  if(-1 == jpt_compact(db))
+    fail("jpt_compact");
+
+  start = jpt_gettime();
+
+  for(i = 0; i < GET_REF_LOOKUPS; ++i)
+  {
+    sprintf(row, "%08zu", (i * 7919) % GET_REF_ROWS);
+
+    if(-1 == jpt_get(db, row, "column", &value, &value_size))
+      fail("jpt_get");
+
+    sum += ((const char*) value)[value_size - 1];
+    free(value);
+  }
+
+  report("get-ref", "jpt_get of 64 KiB value",
+         jpt_gettime() - start, GET_REF_LOOKUPS);
+
+  start = jpt_gettime();
+
+  for(i = 0; i < GET_REF_LOOKUPS; ++i)
+  {
+    sprintf(row, "%08zu", (i * 7919) % GET_REF_ROWS);
+
+    if(-1 == jpt_get_ref(db, row, "column", &ref_value, &value_size, &ref))
+      fail("jpt_get_ref");
+
+    sum -= ((const char*) ref_value)[value_size - 1];
+    jpt_release_ref(db, ref);
+  }
+
+  report("get-ref", "jpt_get_ref of 64 KiB value",
+         jpt_gettime() - start, GET_REF_LOOKUPS);
+
+  if(sum)
+  {
+    fprintf(stderr, "get-ref: jpt_get and jpt_get_ref returned different values\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  jpt_close(db);
+  remove_table();
+}
+
+/*****************************************************************************/
+
+#define CACHE_ROWS    200000
+#define CACHE_LOOKUPS 400000
+
+/* Looks up keys in an unmapped table, with and without a block cache */
+static void
+benchmark_cache()
+{
+  static const size_t cache_sizes[] = { 0, 64 * 1024 * 1024 };
+  struct JPT_info* db;
+  char row[32], what[64], value[32];
+  uint64_t start, hits, misses;
+  size_t i, j;
+
+  for(j = 0; j < sizeof(cache_sizes) / sizeof(cache_sizes[0]); ++j)
+  {
+    remove_table();
+
+    db = jpt_init_cache(table_name, 64 * 1024 * 1024, cache_sizes[j],
+                        table_flags | JPT_NO_MMAP);
+
+    if(!db)
+      fail("jpt_init_cache");
+
+    for(i = 0; i < CACHE_ROWS; ++i)
+    {
+      get_missing_row(row, i);
+
+      if(-1 == jpt_insert(db, row, "column", "0123456789abcdef", 16, 0))
+        fail("jpt_insert");
+    }
+
+    if(-1 == jpt_compact(db))
+      fail("jpt_compact");
+
+    start = jpt_gettime();
+
+    for(i = 0; i < CACHE_LOOKUPS; ++i)
+    {
+      get_missing_row(row, (i * 7919) % CACHE_ROWS);
+
+      if(-1 == jpt_get_fixed(db, row, "column", value, sizeof(value)))
+        fail("jpt_get_fixed");
+    }
+
+    jpt_cache_stats(db, &hits, &misses);
+
+    sprintf(what, "get without mmap, %zu MiB cache", cache_sizes[j] >> 20);
+    report("cache", what, jpt_gettime() - start, CACHE_LOOKUPS);
+
+    if(cache_sizes[j])
+      printf("cache            %llu block hits, %llu misses\n",
+             (unsigned long long) hits, (unsigned long long) misses);
+
+    jpt_close(db);
+  }
+
+  remove_table();
+}
+
+/*****************************************************************************/
+
+#define COLD_ROWS    1500000
+#define COLD_LOOKUPS 2000
+
+/* Writes the table to disk and evicts it from the page cache */
+static void
+drop_table_cache()
+{
+  int fd;
+
+  if(-1 == (fd = open(table_name, O_RDONLY)))
+    fail("open");
+
+  if(-1 == fdatasync(fd))
+    fail("fdatasync");
+
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+  close(fd);
+}
+
+/* Returns the number of kilobytes read from disk by the process */
+static long
+read_kbytes()
+{
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+
+  return usage.ru_inblock / 2;
+}
+
+/* Point lookups and a column scan in a table that is not in the page cache */
+static void
+benchmark_cold()
+{
+  static const int lookup_flags[] = { 0, JPT_RANDOM_ACCESS, JPT_RANDOM_ACCESS | JPT_LOCK_INDEX };
+  static const char* lookup_names[] = { "default", "JPT_RANDOM_ACCESS", "+ JPT_LOCK_INDEX" };
+  struct JPT_info* db;
+  char row[32], what[64], value[128];
+  uint64_t start;
+  long kbytes;
+  size_t i, j, count;
+
+  db = create_table(256 * 1024 * 1024);
+
+  memset(value, 'v', 100);
+
+  for(i = 0; i < COLD_ROWS; ++i)
+  {
+    get_missing_row(row, i);
+
+    if(-1 == jpt_insert(db, row, "column", value, 100, 0))
+      fail("jpt_insert");
+  }
+
+  jpt_close(db);
+
+  for(j = 0; j < sizeof(lookup_flags) / sizeof(lookup_flags[0]); ++j)
+  {
+    drop_table_cache();
+
+    if(!(db = jpt_init(table_name, 64 * 1024 * 1024, table_flags | lookup_flags[j])))
+      fail("jpt_init");
+
+    kbytes = read_kbytes();
+    start = jpt_gettime();
+
+    for(i = 0; i < COLD_LOOKUPS; ++i)
+    {
+      get_missing_row(row, (i * 7919) % COLD_ROWS);
+
+      if(-1 == jpt_get_fixed(db, row, "column", value, sizeof(value)))
+        fail("jpt_get_fixed");
+    }
+
+    sprintf(what, "cold get, %s", lookup_names[j]);
+    report("cold", what, jpt_gettime() - start, COLD_LOOKUPS);
+    printf("cold             %ld kB read from disk\n", read_kbytes() - kbytes);
+
+    jpt_close(db);
+  }
+
+  /* Scans request readahead themselves, also when MADV_RANDOM is in effect */
+  for(j = 0; j < 2; ++j)
+  {
+    drop_table_cache();
+
+    if(!(db = jpt_init(table_name, 64 * 1024 * 1024, table_flags | lookup_flags[j])))
+      fail("jpt_init");
+
+    count = 0;
+    kbytes = read_kbytes();
+    start = jpt_gettime();
+
+    if(-1 == jpt_column_scan(db, "column", count_callback, &count))
+      fail("jpt_column_scan");
+
+    sprintf(what, "cold column scan, %s", lookup_names[j]);
+    report("cold", what, jpt_gettime() - start, count);
+    printf("cold             %ld kB read from disk\n", read_kbytes() - kbytes);
+
+    jpt_close(db);
+  }
+
+  remove_table();
+}
+
+/*****************************************************************************/
+
+#define ASYNC_ROWS       200000
+#define ASYNC_DISKTABLES 8
+#define ASYNC_LOOKUPS    2000
+
+/* Lookups of cells spread over several disktables of a table evicted from
+ * the page cache, with synchronous and asynchronous reads */
+static void
+benchmark_async()
+{
+  static const int read_flags[] = { JPT_NO_MMAP, JPT_ASYNC_READ };
+  static const char* read_names[] = { "JPT_NO_MMAP", "JPT_ASYNC_READ" };
+  struct JPT_info* db;
+  char row[32], what[64], value[128];
+  uint64_t start;
+  size_t i, j;
+
+  db = create_table(256 * 1024 * 1024);
+
+  memset(value, 'v', 100);
+
+  /* Every cell gets a part of its value in each disktable */
+  for(j = 0; j < ASYNC_DISKTABLES; ++j)
+  {
+    for(i = 0; i < ASYNC_ROWS; ++i)
+    {
+      get_missing_row(row, i);
+
+      if(-1 == jpt_insert(db, row, "column", value, 100, JPT_APPEND))
+        fail("jpt_insert");
+    }
+
+    if(-1 == jpt_compact(db))
+      fail("jpt_compact");
+  }
+
+  jpt_close(db);
+
+  for(j = 0; j < sizeof(read_flags) / sizeof(read_flags[0]); ++j)
+  {
+    drop_table_cache();
+
+    if(!(db = jpt_init_cache(table_name, 64 * 1024 * 1024, 0, table_flags | read_flags[j])))
+      fail("jpt_init_cache");
+
+    start = jpt_gettime();
+
+    for(i = 0; i < ASYNC_LOOKUPS; ++i)
+    {
+      get_missing_row(row, (i * 7919) % ASYNC_ROWS);
+
+      if(-1 == jpt_get_fixed(db, row, "column", value, sizeof(value)))
+        fail("jpt_get_fixed");
+    }
+
+    sprintf(what, "cold get, %u disktables, %s", ASYNC_DISKTABLES, read_names[j]);
+    report("async", what, jpt_gettime() - start, ASYNC_LOOKUPS);
+
+    jpt_close(db);
+  }
+
+  remove_table();
+}
+
+/*****************************************************************************/
+
+#define COMPACT_ROWS     1000000
+#define COMPACT_ROUNDS   200
+#define COMPACT_INSERTS  500
+#define COMPACT_LOOKUPS  2000
+
+/* Returns the number of page faults served without disk access so far */
+static long
+minor_faults()
+{
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+
+  return usage.ru_minflt;
+}
+
+/* Many small compactions of a large mapped table, each followed by lookups,
+ * while a value returned by jpt_get_ref is held */
+static void
+benchmark_compact()
+{
+  struct JPT_info* db;
+  struct JPT_ref* held_ref;
+  struct JPT_ref* ref;
+  const void* held_value;
+  const void* mapped = 0;
+  const void* probe;
+  char row[32], value[128];
+  uint64_t start, compact_usec = 0, get_usec = 0;
+  long faults = 0;
+  size_t i, j, size, moves = 0;
+
+  db = create_table(256 * 1024 * 1024);
+
+  memset(value, 'v', 100);
+
+  for(i = 0; i < COMPACT_ROWS; ++i)
+  {
+    get_missing_row(row, i * 2);
+
+    if(-1 == jpt_insert(db, row, "column", value, 100, 0))
+      fail("jpt_insert");
+  }
+
+  if(-1 == jpt_compact(db))
+    fail("jpt_compact");
+
+  get_missing_row(row, 0);
+
+  if(-1 == jpt_get_ref(db, row, "column", &held_value, &size, &held_ref))
+    fail("jpt_get_ref");
+
+  /* Fault in the whole table once */
+  for(i = 0; i < COMPACT_ROWS; i += 16)
+  {
+    get_missing_row(row, i * 2);
+
+    if(-1 == jpt_get_fixed(db, row, "column", value, sizeof(value)))
+      fail("jpt_get_fixed");
+  }
+
+  for(j = 0; j < COMPACT_ROUNDS; ++j)
+  {
+    for(i = 0; i < COMPACT_INSERTS; ++i)
+    {
+      get_missing_row(row, (j * COMPACT_INSERTS + i) * 2 + 1);
+
+      if(-1 == jpt_insert(db, row, "column", value, 100, 0))
+        fail("jpt_insert");
+    }
+
+    start = jpt_gettime();
+
+    if(-1 == jpt_compact(db))
+      fail("jpt_compact");
+
+    compact_usec += jpt_gettime() - start;
+
+    faults -= minor_faults();
+    start = jpt_gettime();
+
+    for(i = 0; i < COMPACT_LOOKUPS; ++i)
+    {
+      get_missing_row(row, (i * 7919 + j) % COMPACT_ROWS * 2);
+
+      if(-1 == jpt_get_fixed(db, row, "column", value, sizeof(value)))
+        fail("jpt_get_fixed");
+    }
+
+    get_usec += jpt_gettime() - start;
+    faults += minor_faults();
+
+    get_missing_row(row, 2);
+
+    if(-1 == jpt_get_ref(db, row, "column", &probe, &size, &ref))
+      fail("jpt_get_ref");
+
+    if(mapped && probe != mapped)
+      ++moves;
+
+    mapped = probe;
+    jpt_release_ref(db, ref);
+  }
+
+  jpt_release_ref(db, held_ref);
+
+  report("compact", "small compaction of a large table", compact_usec, COMPACT_ROUNDS);
+  report("compact", "get after compaction", get_usec, COMPACT_ROUNDS * COMPACT_LOOKUPS);
+  printf("compact          mapping moved %zu times, %.2f page faults per get\n",
+         moves, (double) faults / (COMPACT_ROUNDS * COMPACT_LOOKUPS));
+
+  jpt_close(db);
+
+  remove_table();
+}
+
+/*****************************************************************************/
+
+#define COMPACT_BG_ROWS       640000
+#define COMPACT_BG_DISKTABLES 64
+#define COMPACT_BG_LOOKUPS    200000
+
+static uint64_t
+compact_bg_lookups(struct JPT_info* db, int present)
+{
+  char row[32], value[32];
+  uint64_t start;
+  size_t i;
+
+  start = jpt_gettime();
+
+  for(i = 0; i < COMPACT_BG_LOOKUPS; ++i)
+  {
+    get_missing_row(row, (i * 7919) % COMPACT_BG_ROWS * 2 + !present);
+
+    if(present != (-1 != jpt_get_fixed(db, row, "column", value, sizeof(value))))
+      fail("jpt_get_fixed");
+  }
+
+  return jpt_gettime() - start;
+}
+
+/* Looks up keys in many disktables, then again after background compaction
+ * has merged them */
+static void
+benchmark_compact_bg()
+{
+  struct JPT_compaction_policy policy;
+  struct JPT_info* db;
+  char row[32];
+  uint64_t start;
+  size_t i;
+
+  db = create_table(256 * 1024 * 1024);
+
+  for(i = 0; i < COMPACT_BG_ROWS; ++i)
+  {
+    get_missing_row(row, i * 2);
+
+    if(-1 == jpt_insert(db, row, "column", "0123456789abcdef", 16, 0))
+      fail("jpt_insert");
+
+    if((i + 1) % (COMPACT_BG_ROWS / COMPACT_BG_DISKTABLES))
+      continue;
+
+    if(-1 == jpt_compact(db))
+      fail("jpt_compact");
+  }
+
+  report("compact-bg", "get present key, 64 disktables",
+         compact_bg_lookups(db, 1), COMPACT_BG_LOOKUPS);
+  report("compact-bg", "get absent key, 64 disktables",
+         compact_bg_lookups(db, 0), COMPACT_BG_LOOKUPS);
+
+  jpt_get_compaction_policy(db, &policy);
+
+  start = jpt_gettime();
+
+  if(-1 == jpt_set_compaction_policy(db, &policy))
+    fail("jpt_set_compaction_policy");
+
+  /* Lookups made while merges run */
+  report("compact-bg", "get present key while merging",
+         compact_bg_lookups(db, 1), COMPACT_BG_LOOKUPS);
+
+  jpt_compaction_wait(db);
+
+  report("compact-bg", "background merges, default policy",
+         jpt_gettime() - start, 1);
+
+  report("compact-bg", "get present key, after merges",
+         compact_bg_lookups(db, 1), COMPACT_BG_LOOKUPS);
+  report("compact-bg", "get absent key, after merges",
+         compact_bg_lookups(db, 0), COMPACT_BG_LOOKUPS);
+
+  jpt_close(db);
+  remove_table();
+}
+
+/*****************************************************************************/
+
+#define MERGE_ROWS       1280000
+#define MERGE_DISKTABLES 64
+
+/* Scans a column spread over many disktables whose keys interleave, then
+ * merges them with jpt_major_compact and scans again */
+static void
+benchmark_merge()
+{
+  struct JPT_info* db;
+  char row[32];
+  uint64_t start;
+  size_t i, j, count;
+
+  db = create_table(256 * 1024 * 1024);
+
+  for(i = 0; i < MERGE_DISKTABLES; ++i)
+  {
+    for(j = i; j < MERGE_ROWS; j += MERGE_DISKTABLES)
+    {
+      sprintf(row, "%010zu", j);
+
+      if(-1 == jpt_insert(db, row, "column", "0123456789abcdef", 16, 0))
+        fail("jpt_insert");
+    }
+
+    if(-1 == jpt_compact(db))
+      fail("jpt_compact");
+  }
+
+  count = 0;
+  start = jpt_gettime();
+
+  if(-1 == jpt_column_scan(db, "column", count_callback, &count))
+    fail("jpt_column_scan");
+
+  if(count != MERGE_ROWS)
+    fail("jpt_column_scan");
+
+  report("merge", "column scan, 64 disktables", jpt_gettime() - start, MERGE_ROWS);
+
+  start = jpt_gettime();
+
+  if(-1 == jpt_major_compact(db))
+    fail("jpt_major_compact");
+
+  report("merge", "major compaction, 64 disktables", jpt_gettime() - start, MERGE_ROWS);
+
+  count = 0;
+  start = jpt_gettime();
+
+  if(-1 == jpt_column_scan(db, "column", count_callback, &count))
+    fail("jpt_column_scan");
+
+  if(count != MERGE_ROWS)
+    fail("jpt_column_scan");
+
+  report("merge", "column scan, 1 disktable", jpt_gettime() - start, MERGE_ROWS);
+
+  jpt_close(db);
+  remove_table();
+}
+
+/*****************************************************************************/
+
+#define OPEN_DISKTABLES 500
+#define OPEN_ROWS       1000
+
+/* Opens a table of many disktables and looks up one key, with and without
+ * the page cache.  JPT_RECOVER reads every disktable header and index like
+ * jpt_init did before tables had an index of their disktables */
+static void
+benchmark_open()
+{
+  static const int open_flags[] = { 0, JPT_LOCK_INDEX, JPT_RECOVER };
+  static const char* open_names[] = { "default", "JPT_LOCK_INDEX", "JPT_RECOVER" };
+  struct JPT_info* db;
+  char row[32], what[64], value[64];
+  uint64_t start;
+  long kbytes;
+  size_t i, j, k;
+
+  db = create_table(64 * 1024 * 1024);
+
+  memset(value, 'v', 32);
+
+  for(i = 0; i < OPEN_DISKTABLES; ++i)
+  {
+    for(j = 0; j < OPEN_ROWS; ++j)
+    {
+      get_missing_row(row, j * OPEN_DISKTABLES + i);
+
+      if(-1 == jpt_insert(db, row, "column", value, 32, 0))
+        fail("jpt_insert");
+    }
+
+    if(-1 == jpt_compact(db))
+      fail("jpt_compact");
+  }
+
+  jpt_close(db);
+
+  for(k = 0; k < 2; ++k)
+  {
+    for(j = 0; j < sizeof(open_flags) / sizeof(open_flags[0]); ++j)
+    {
+      if(k)
+        drop_table_cache();
+
+      kbytes = read_kbytes();
+      start = jpt_gettime();
+
+      if(!(db = jpt_init(table_name, 64 * 1024 * 1024, table_flags | open_flags[j])))
+        fail("jpt_init");
+
+      sprintf(what, "%s open, %s", k ? "cold" : "warm", open_names[j]);
+      report("open", what, jpt_gettime() - start, 1);
+
+      start = jpt_gettime();
+
+      get_missing_row(row, OPEN_DISKTABLES * OPEN_ROWS / 2);
+
+      if(-1 == jpt_get_fixed(db, row, "column", value, sizeof(value)))
+        fail("jpt_get_fixed");
+
+      sprintf(what, "%s first get, %s", k ? "cold" : "warm", open_names[j]);
+      report("open", what, jpt_gettime() - start, 1);
+
+      if(k)
+        printf("open             %ld kB read from disk\n", read_kbytes() - kbytes);
+
+      jpt_close(db);
+    }
+  }
+
+  remove_table();
+}
+
+/*****************************************************************************/
+
+#define GROUP_COMMIT_INSERTS 4096
+#define GROUP_COMMIT_THREADS 64
+
+static struct JPT_info* group_commit_db;
+static size_t group_commit_next;
+
+static void*
+group_commit_thread(void* arg)
+{
+  char row[32];
+  size_t i;
+
+  while((i = __sync_fetch_and_add(&group_commit_next, 1)) < GROUP_COMMIT_INSERTS)
+  {
+    get_missing_row(row, i);
+
+    if(-1 == jpt_insert(group_commit_db, row, "column", "0123456789abcdef", 16, 0))
+      fail("jpt_insert");
+  }
+
+  return 0;
+}
+
+/* Inserts with JPT_SYNC from 1 to 64 threads, which share log writes */
+static void
+benchmark_group_commit()
+{
+  pthread_t threads[GROUP_COMMIT_THREADS];
+  char what[64];
+  uint64_t start;
+  size_t i, thread_count;
+
+  for(thread_count = 1; thread_count <= GROUP_COMMIT_THREADS; thread_count *= 2)
+  {
+    remove_table();
+
+    if(!(group_commit_db = jpt_init(table_name, 64 * 1024 * 1024, table_flags | JPT_SYNC)))
+      fail("jpt_init");
+
+    if(-1 == jpt_create_column(group_commit_db, "column", 0))
+      fail("jpt_create_column");
+
+    group_commit_next = 0;
+    start = jpt_gettime();
+
+    for(i = 0; i < thread_count; ++i)
+    {
+      if(0 != (errno = pthread_create(&threads[i], 0, group_commit_thread, 0)))
+        fail("pthread_create");
+    }
+
+    for(i = 0; i < thread_count; ++i)
+      pthread_join(threads[i], 0);
+
+    sprintf(what, "JPT_SYNC insert, %zu thread%s", thread_count, (thread_count != 1) ? "s" : "");
+    report("group-commit", what, jpt_gettime() - start, GROUP_COMMIT_INSERTS);
+
+    jpt_close(group_commit_db);
+  }
+
+  remove_table();
+}
+
+/*****************************************************************************/
+
+#define LOG_DELAY_INSERTS 20000
+
+/* Inserts from one thread with and without delayed log writes, ending with
+ * jpt_flush_log */
+static void
+benchmark_log_delay()
+{
+  static const int log_flags[] = { 0, JPT_DELAY_LOG, JPT_SYNC, JPT_SYNC | JPT_DELAY_LOG };
+  static const char* log_names[] = { "default", "JPT_DELAY_LOG", "JPT_SYNC", "JPT_SYNC | JPT_DELAY_LOG" };
+  struct JPT_info* db;
+  char row[32], what[64];
+  uint64_t start;
+  size_t i, j;
+
+  for(j = 0; j < sizeof(log_flags) / sizeof(log_flags[0]); ++j)
+  {
+    remove_table();
+
+    if(!(db = jpt_init(table_name, 64 * 1024 * 1024, table_flags | log_flags[j])))
+      fail("jpt_init");
+
+    if(-1 == jpt_create_column(db, "column", 0))
+      fail("jpt_create_column");
+
+    start = jpt_gettime();
+
+    for(i = 0; i < LOG_DELAY_INSERTS; ++i)
+    {
+      get_missing_row(row, i);
+
+      if(-1 == jpt_insert(db, row, "column", "0123456789abcdef", 16, 0))
+        fail("jpt_insert");
+    }
+
+    if(-1 == jpt_flush_log(db))
+      fail("jpt_flush_log");
+
+    sprintf(what, "insert, %s", log_names[j]);
+    report("log-delay", what, jpt_gettime() - start, LOG_DELAY_INSERTS);
+
+    jpt_close(db);
+  }
+
+  remove_table();
+}
+
+/*****************************************************************************/
+
+#define REPLAY_ROWS           8000000
+#define REPLAY_VALUE_SIZE     100
+#define REPLAY_DISKTABLES     16
+#define REPLAY_DISKTABLE_ROWS 125000
+#define REPLAY_BUFFER         (2560ULL * 1024 * 1024)
+
+/* Leaves about 1 GB of log behind by exiting without closing the table, as
+ * if the process had crashed.  The table also has disktables, in which
+ * replayed inserts used to look for their keys.  */
+static void
+replay_child()
+{
+  struct JPT_info* db;
+  char row[32], value[REPLAY_VALUE_SIZE];
+  size_t i, j;
+
+  db = create_table(REPLAY_BUFFER);
+
+  memset(value, 'v', sizeof(value));
+
+  for(i = 0; i < REPLAY_DISKTABLES; ++i)
+  {
+    for(j = 0; j < REPLAY_DISKTABLE_ROWS; ++j)
+    {
+      get_missing_row(row, REPLAY_ROWS + i * REPLAY_DISKTABLE_ROWS + j);
+
+      if(-1 == jpt_insert(db, row, "column", value, sizeof(value), 0))
+        fail("jpt_insert");
+    }
+
+    if(-1 == jpt_compact(db))
+      fail("jpt_compact");
+  }
+
+  /* Batch the log writes */
+  if(-1 == jpt_set_log_delay(db, 1000, 0))
+    fail("jpt_set_log_delay");
+
+  for(i = 0; i < REPLAY_ROWS; ++i)
+  {
+    get_missing_row(row, i);
+
+    if(-1 == jpt_insert(db, row, "column", value, sizeof(value), 0))
+      fail("jpt_insert");
+  }
+
+  if(-1 == jpt_flush_log(db))
+    fail("jpt_flush_log");
+
+  _exit(EXIT_SUCCESS);
+}
+
+/* Opens a table left with a large log, with the log in the page cache and
+ * not.  Each open happens in a process of its own that exits without
+ * closing the table, so that the log is never consumed.  */
+static void
+benchmark_replay()
+{
+  struct JPT_info* db;
+  struct stat st;
+  char* logname;
+  char what[64];
+  uint64_t start;
+  pid_t pid;
+  int status, fd, k;
+
+  if(-1 == asprintf(&logname, "%s.log", table_name))
+    fail("asprintf");
+
+  if(!(pid = fork()))
+    replay_child();
+
+  if(pid == -1 || pid != waitpid(pid, &status, 0)
+  || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+    exit(EXIT_FAILURE);
+
+  if(-1 == stat(logname, &st))
+    fail("stat");
+
+  printf("replay           %.1f MB of log\n", st.st_size / (1024.0 * 1024.0));
+
+  for(k = 0; k < 2; ++k)
+  {
+    fflush(stdout);
+
+    if(!(pid = fork()))
+    {
+      if(k)
+      {
+        drop_table_cache();
+
+        if(-1 == (fd = open(logname, O_RDONLY)))
+          fail("open");
+
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+      }
+
+      start = jpt_gettime();
+
+      if(!(db = jpt_init(table_name, REPLAY_BUFFER, table_flags)))
+        fail("jpt_init");
+
+      sprintf(what, "%s open", k ? "cold" : "warm");
+      report("replay", what, jpt_gettime() - start, REPLAY_ROWS);
+
+      fflush(stdout);
+
+      _exit(EXIT_SUCCESS);
+    }
+
+    if(pid == -1 || pid != waitpid(pid, &status, 0)
+    || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+      exit(EXIT_FAILURE);
+  }
+
+  free(logname);
+  remove_table();
+}
+
+/*****************************************************************************/
+
+#define MAJOR_ROWS       65536
+#define MAJOR_COLUMNS    16
+#define MAJOR_DISKTABLES 16
+
+static void
+major_fill(struct JPT_info* db)
+{
+  char row[32], column[32];
+  size_t i, j, k;
+
+  for(k = 0; k < MAJOR_DISKTABLES; ++k)
+  {
+    for(j = 0; j < MAJOR_COLUMNS; ++j)
+    {
+      sprintf(column, "column%02zu", j);
+
+      for(i = k; i < MAJOR_ROWS; i += MAJOR_DISKTABLES)
+      {
+        sprintf(row, "%010zu", i);
+
+        if(-1 == jpt_insert(db, row, column, "0123456789abcdef", 16, 0))
+          fail("jpt_insert");
+      }
+    }
+
+    if(-1 == jpt_compact(db))
+      fail("jpt_compact");
+  }
+}
+
+/* Major compaction of a table with many columns, merged by one thread and by
+ * one thread per processor.  */
+static void
+benchmark_major()
+{
+  struct JPT_info* db;
+  char what[64];
+  uint64_t start;
+  size_t threads;
+
+  db = create_table(256 * 1024 * 1024);
+  threads = db->major_compact_threads;
+
+  major_fill(db);
+
+  db->major_compact_threads = 1;
+  start = jpt_gettime();
+
+  if(-1 == jpt_major_compact(db))
+    fail("jpt_major_compact");
+
+  report("major", "major compaction, 1 thread", jpt_gettime() - start, MAJOR_ROWS * MAJOR_COLUMNS);
+
+  jpt_close(db);
+
+  db = create_table(256 * 1024 * 1024);
+
+  major_fill(db);
+
+  db->major_compact_threads = threads;
+  start = jpt_gettime();
+
+  if(-1 == jpt_major_compact(db))
+    fail("jpt_major_compact");
+
+  sprintf(what, "major compaction, %zu thread%s", threads, (threads != 1) ? "s" : "");
+  report("major", what, jpt_gettime() - start, MAJOR_ROWS * MAJOR_COLUMNS);
+
+  jpt_close(db);
+  remove_table();
+}
+
+/*****************************************************************************/
+
+static const struct benchmark benchmarks[] =
+{
+  { "async", "cold lookups in many disktables, with and without asynchronous reads",
+    benchmark_async },
+  { "cache", "look up keys in an unmapped table, with and without a block cache",
+    benchmark_cache },
+  { "cold", "point lookups and a scan in a table evicted from the page cache",
+    benchmark_cold },
+  { "column-scan", "scan a small column in a memtable full of another column",
+    benchmark_column_scan },
+  { "column-seek", "find columns in many disktables holding many columns",
+    benchmark_column_seek },
+  { "compact", "compact small memtables into a large mapped table, then read it",
+    benchmark_compact },
+  { "compact-bg", "look up keys in many disktables, before and after background merges",
+    benchmark_compact_bg },
+  { "append", "append tiny values to a few cells, then read and flush them",
+    benchmark_append },
+  { "flush", "flush a large memtable, reporting time and peak memory use",
+    benchmark_flush },
+  { "get-batch", "fetch many cells at once, per cell and as one batch",
+    benchmark_get_batch },
+  { "get-missing", "look up absent and present keys in several large disktables",
+    benchmark_get_missing },
+  { "get-ref", "read large values with and without copying them",
+    benchmark_get_ref },
+  { "group-commit", "insert with JPT_SYNC from 1 to 64 threads",
+    benchmark_group_commit },
+  { "log-delay", "insert with log writes delayed and not, then flush the log",
+    benchmark_log_delay },
+  { "major", "major-compact a table with many columns using one thread and all processors",
+    benchmark_major },
+  { "merge", "scan and major-compact many disktables with interleaved keys",
+    benchmark_merge },
+  { "open", "open a table of many disktables and look up one key",
+    benchmark_open },
+  { "replay", "open a table whose log holds about 1 GB of inserts",
+    benchmark_replay },
+  { "trie-build", "build a PATRICIA trie from sorted keys, one at a time and in one pass",
+    benchmark_trie_build },
+};
+
+#define BENCHMARK_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static void
+help(const char* argv0)
+{
+  size_t i;
+
+  printf("Usage: %s [OPTION]... [BENCHMARK]...\n"
+         "jpt micro-benchmarks\n"
+         "\n"
+         "Runs the given benchmarks, or all of them if none are given.\n"
+         "\n"
+         "Benchmarks:\n", argv0);
+
+  for(i = 0; i < BENCHMARK_COUNT; ++i)
+    printf("     %-22s %s\n", benchmarks[i].name, benchmarks[i].description);
+
+  printf("\n"
+         "Options:\n"
+         " -s, --skiplist             use a skiplist memtable\n"
+         " -t, --table=FILE           table file to use (default `benchmark.tab')\n"
+         "     --help     display this help and exit\n"
+         "\n"
+         "Report bugs to <morten@rashbox.org>.\n");
+}
+
+int
+main(int argc, char** argv)
+{
+  size_t i;
+  int j;
+
+  for(;;)
+  {
+    int optindex = 0;
+    int c;
+
+    c = getopt_long(argc, argv, "st:", long_options, &optindex);
+
+    if(c == -1)
+      break;
+
+    switch(c)
+    {
+    case 's':
+
+      table_flags |= JPT_SKIPLIST;
+
+      break;
+
+    case 't':
+
+      table_name = optarg;
+
+      break;
+
+    case 'h':
+
+      help(argv[0]);
+
+      return EXIT_SUCCESS;
+
+    case '?':
+
+      fprintf(stderr, "Try `%s --help' for more information.\n", argv[0]);
+
+      return EXIT_FAILURE;
+    }
+  }
+
+  if(optind == argc)
+  {
+    for(i = 0; i < BENCHMARK_COUNT; ++i)
+      benchmarks[i].run();
+
+    return EXIT_SUCCESS;
+  }
+
+  for(j = optind; j < argc; ++j)
+  {
+    for(i = 0; i < BENCHMARK_COUNT; ++i)
+    {
+      if(!strcmp(argv[j], benchmarks[i].name))
+        break;
+    }
+
+    if(i == BENCHMARK_COUNT)
+    {
+      fprintf(stderr, "%s: unknown benchmark `%s'\n", argv[0], argv[j]);
+      fprintf(stderr, "Try `%s --help' for more information.\n", argv[0]);
+
+      return EXIT_FAILURE;
+    }
+
+    benchmarks[i].run();
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -723,6 +723,153 @@ djpt_get_fixed(struct DJPT_info* info, const char* row, const char* column,
   return value_size;
 }
 
+int
+djpt_get_batch(struct DJPT_info* info, struct DJPT_batch_cell* cells,
+               size_t count, void** buffer)
+{
+  struct DJPT_request_get_multi* get;
+  struct DJPT_request* response;
+  const char* in;
+  const char* end;
+  char* out;
+  size_t i, size, length, buffer_size;
+  uint32_t value_size;
+  int found = 0;
+
+  TRACE((stderr, "djpt_get_batch(%p, %p, %zu, %p)", info, cells, count, buffer));
+
+  DJPT_clear_error();
+
+  *buffer = 0;
+
+  size = sizeof(struct DJPT_request_get_multi);
+
+  for(i = 0; i < count; ++i)
+  {
+    cells[i].value = 0;
+    cells[i].value_size = 0;
+
+    size += strlen(cells[i].row) + 1 + strlen(cells[i].column) + 1;
+  }
+
+  if(size > DJPT_MAX_REQUEST_SIZE)
+  {
+    errno = E2BIG;
+
+    TRACE((stderr, " = -1 (request too large)\n"));
+
+    return -1;
+  }
+
+  get = malloc(size);
+  get->command = DJPT_REQ_GET_MULTI;
+  get->size = htonl(size);
+  get->count = htonl(count);
+
+  out = get->data;
+
+  for(i = 0; i < count; ++i)
+  {
+    length = strlen(cells[i].row) + 1;
+    memcpy(out, cells[i].row, length);
+    out += length;
+
+    length = strlen(cells[i].column) + 1;
+    memcpy(out, cells[i].column, length);
+    out += length;
+  }
+
+  if(-1 == DJPT_write_all(info->peer, get, size))
+  {
+    TRACE((stderr, " = -1 (%s)\n", djpt_last_error()));
+
+    free(get);
+
+    return -1;
+  }
+
+  free(get);
+
+  response = DJPT_read_request(info->peer);
+
+  if(!response || response->command != DJPT_REQ_VALUE)
+  {
+    if(response)
+      DJPT_set_invalid_response();
+
+    free(response);
+
+    TRACE((stderr, " = -1\n"));
+
+    return -1;
+  }
+
+  /* Every value gains a NUL terminator in place of its 4 byte size, so the
+   * response is always large enough to hold the result */
+  in = ((struct DJPT_request_value*) response)->value;
+  end = (const char*) response + response->size;
+  buffer_size = end - in;
+
+  if(!(*buffer = malloc(buffer_size + 1)))
+  {
+    free(response);
+
+    return -1;
+  }
+
+  out = *buffer;
+
+  for(i = 0; i < count; ++i)
+  {
+    if(end - in < sizeof(value_size))
+      break;
+
+    memcpy(&value_size, in, sizeof(value_size));
+    value_size = ntohl(value_size);
+    in += sizeof(value_size);
+
+    if(value_size == DJPT_MISSING_CELL)
+      continue;
+
+    if(value_size > end - in)
+      break;
+
+    memcpy(out, in, value_size);
+    out[value_size] = 0;
+
+    cells[i].value = out;
+    cells[i].value_size = value_size;
+
+    in += value_size;
+    out += value_size + 1;
+    ++found;
+  }
+
+  free(response);
+
+  if(i != count || in != end)
+  {
+    for(i = 0; i < count; ++i)
+    {
+      cells[i].value = 0;
+      cells[i].value_size = 0;
+    }
+
+    free(*buffer);
+    *buffer = 0;
+
+    DJPT_set_invalid_response();
+
+    TRACE((stderr, " = -1\n"));
+
+    return -1;
+  }
+
+  TRACE((stderr, " = %d\n", found));
+
+  return found;
+}
+
 int
 djpt_scan(struct DJPT_info* info, djpt_cell_callback callback, void* arg)
 {
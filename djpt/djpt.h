@@ -76,6 +76,19 @@ int
 djpt_get_fixed(struct DJPT_info* info, const char* row, const char* column,
                void* value, size_t value_size);
 
+struct DJPT_batch_cell
+{
+  const char* row;
+  const char* column;
+
+  const void* value;
+  size_t value_size;
+};
+
+int
+djpt_get_batch(struct DJPT_info* info, struct DJPT_batch_cell* cells,
+               size_t count, void** buffer);
+
 int
 djpt_scan(struct DJPT_info* info, djpt_cell_callback callback, void* arg);
 
@@ -591,6 +591,108 @@ DJPT_peer_loop(struct DJPT_peer* peer, int flags)
 
       break;
 
+    case DJPT_REQ_GET_MULTI:
+
+      {
+        struct DJPT_request_get_multi* get_multi = (void*) request;
+        struct DJPT_request response;
+        struct JPT_batch_cell* cells;
+        const char* data = get_multi->data;
+        const char* end = (const char*) request + request->size;
+        void* values;
+        uint32_t count, value_size;
+        size_t response_size;
+
+        count = (request->size >= sizeof(*get_multi)) ? ntohl(get_multi->count) : 0;
+
+        /* Each cell takes at least two bytes of the request */
+        if(request->size < sizeof(*get_multi) || count > (end - data) / 2)
+          goto done;
+
+        cells = malloc(count * sizeof(struct JPT_batch_cell) + 1);
+
+        if(!cells)
+          goto done;
+
+        for(i = 0; i < count; ++i)
+        {
+          cells[i].row = data;
+
+          if(!(data = memchr(data, 0, end - data)))
+            break;
+
+          cells[i].column = ++data;
+
+          if(!(data = memchr(data, 0, end - data)))
+            break;
+
+          ++data;
+        }
+
+        if(i != count)
+        {
+          free(cells);
+
+          goto done;
+        }
+
+        if(-1 == jpt_get_batch(peer->db, cells, count, &values))
+        {
+          free(cells);
+
+          if(-1 == DJPT_write_error(peer))
+            goto done;
+
+          break;
+        }
+
+        response_size = sizeof(response);
+
+        for(i = 0; i < count; ++i)
+          response_size += sizeof(uint32_t) + cells[i].value_size;
+
+        if(response_size > DJPT_MAX_REQUEST_SIZE)
+        {
+          free(values);
+          free(cells);
+
+          errno = E2BIG;
+
+          if(-1 == DJPT_write_error(peer))
+            goto done;
+
+          break;
+        }
+
+        response.command = DJPT_REQ_VALUE;
+        response.size = htonl(response_size);
+
+        if(-1 == DJPT_write_buffered(peer, &response, sizeof(response)))
+        {
+          free(values);
+          free(cells);
+
+          goto done;
+        }
+
+        for(i = 0; i < count; ++i)
+        {
+          value_size = htonl(cells[i].value ? cells[i].value_size : DJPT_MISSING_CELL);
+
+          if(-1 == DJPT_write_buffered(peer, &value_size, sizeof(value_size))
+          || -1 == DJPT_write_buffered(peer, cells[i].value, cells[i].value_size))
+            break;
+        }
+
+        free(values);
+        free(cells);
+
+        if(i != count)
+          goto done;
+      }
+
+      break;
+
     case DJPT_REQ_COLUMN_SCAN:
 
       {
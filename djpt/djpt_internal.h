@@ -86,6 +86,7 @@ struct DJPT_jpt_handle
 #define DJPT_REQ_EVAL_STRING    15
 #define DJPT_REQ_COMPACT        16
 #define DJPT_REQ_MAJOR_COMPACT  17
+#define DJPT_REQ_GET_MULTI      18
 
 struct DJPT_request
 {
@@ -178,6 +179,20 @@ struct DJPT_request_get
   char data[0];
 } PACKED;
 
+/* `data' holds `count' pairs of NUL terminated row and column names.  The
+ * response is a single DJPT_REQ_VALUE, holding for each cell a 32 bit value
+ * size, or DJPT_MISSING_CELL if the cell does not exist, followed by the
+ * value.  */
+struct DJPT_request_get_multi
+{
+  uint32_t size;
+  uint8_t command;
+  uint32_t count;
+  char data[0];
+} PACKED;
+
+#define DJPT_MISSING_CELL 0xffffffff
+
 struct DJPT_request_column_scan
 {
   uint32_t size;
@@ -0,0 +1,466 @@
+/*  Asynchronous reads for jpt tables that are not memory mapped.
+    Copyright (C) 2007, 2008, 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+#include "jpt_internal.h"
+
+/* Rings are shared by reading threads, each ring used by one batch at a
+ * time */
+#define JPT_AIO_RINGS   4
+#define JPT_AIO_DEPTH   64
+
+/* Worker threads used when io_uring is unavailable */
+#define JPT_AIO_THREADS 8
+
+#ifdef __NR_io_uring_setup
+
+struct JPT_uring
+{
+  pthread_mutex_t mutex;
+  int fd;
+  unsigned int entries;
+
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+
+  unsigned int* sq_head;
+  unsigned int* sq_tail;
+  unsigned int* sq_mask;
+  unsigned int* sq_array;
+  unsigned int* cq_head;
+  unsigned int* cq_tail;
+  unsigned int* cq_mask;
+  struct io_uring_cqe* cqes;
+};
+
+#endif
+
+/* A batch of requests waiting for the worker threads */
+struct JPT_aio_batch
+{
+  struct JPT_aio_request* requests;
+  size_t count;
+  size_t next; /* Next request to be picked up */
+  size_t pending; /* Requests not yet completed */
+
+  pthread_cond_t done;
+  struct JPT_aio_batch* next_batch;
+};
+
+struct JPT_aio
+{
+#ifdef __NR_io_uring_setup
+  struct JPT_uring rings[JPT_AIO_RINGS];
+#endif
+  size_t ring_count; /* 0 if the worker threads are used instead */
+  size_t next_ring;
+
+  pthread_t threads[JPT_AIO_THREADS];
+  size_t thread_count;
+
+  /* Protects the batch queue and the worker threads */
+  pthread_mutex_t mutex;
+  pthread_cond_t work;
+  struct JPT_aio_batch* first_batch;
+  struct JPT_aio_batch* last_batch;
+  int stop;
+};
+
+#ifdef __NR_io_uring_setup
+
+static int
+JPT_uring_init(struct JPT_uring* ring)
+{
+  struct io_uring_params params;
+
+  memset(&params, 0, sizeof(params));
+
+  ring->fd = syscall(__NR_io_uring_setup, JPT_AIO_DEPTH, &params);
+
+  if(ring->fd < 0)
+    return -1;
+
+  ring->entries = params.sq_entries;
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQ_RING);
+
+  if(ring->sq_ring == MAP_FAILED)
+    goto fail;
+
+  ring->cq_ring = mmap(0, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_CQ_RING);
+
+  if(ring->cq_ring == MAP_FAILED)
+  {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+
+    goto fail;
+  }
+
+  ring->sqes = mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+
+  if(ring->sqes == MAP_FAILED)
+  {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+
+    goto fail;
+  }
+
+  ring->sq_head = (unsigned int*) ((char*) ring->sq_ring + params.sq_off.head);
+  ring->sq_tail = (unsigned int*) ((char*) ring->sq_ring + params.sq_off.tail);
+  ring->sq_mask = (unsigned int*) ((char*) ring->sq_ring + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned int*) ((char*) ring->sq_ring + params.sq_off.array);
+  ring->cq_head = (unsigned int*) ((char*) ring->cq_ring + params.cq_off.head);
+  ring->cq_tail = (unsigned int*) ((char*) ring->cq_ring + params.cq_off.tail);
+  ring->cq_mask = (unsigned int*) ((char*) ring->cq_ring + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*) ((char*) ring->cq_ring + params.cq_off.cqes);
+
+  pthread_mutex_init(&ring->mutex, 0);
+
+  return 0;
+
+fail:
+
+  close(ring->fd);
+
+  return -1;
+}
+
+static void
+JPT_uring_free(struct JPT_uring* ring)
+{
+  munmap(ring->sqes, ring->sqes_size);
+  munmap(ring->cq_ring, ring->cq_ring_size);
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+  pthread_mutex_destroy(&ring->mutex);
+}
+
+/* Submits all requests to `ring', at most `entries' at a time, and waits for
+ * them to complete */
+static int
+JPT_uring_read(struct JPT_uring* ring, struct JPT_aio_request* requests,
+               size_t count)
+{
+  struct io_uring_sqe* sqe;
+  struct io_uring_cqe* cqe;
+  size_t submitted = 0, completed = 0;
+  unsigned int tail, head, to_submit;
+  int res;
+
+  while(completed < count)
+  {
+    tail = *ring->sq_tail;
+
+    while(submitted < count && submitted - completed < ring->entries)
+    {
+      struct JPT_aio_request* request = &requests[submitted];
+      unsigned int idx = tail & *ring->sq_mask;
+
+      request->iov.iov_base = request->target;
+      request->iov.iov_len = request->size;
+
+      sqe = &ring->sqes[idx];
+      memset(sqe, 0, sizeof(struct io_uring_sqe));
+      sqe->opcode = IORING_OP_READV;
+      sqe->fd = request->fd;
+      sqe->off = request->offset;
+      sqe->addr = (uintptr_t) &request->iov;
+      sqe->len = 1;
+      sqe->user_data = submitted;
+
+      ring->sq_array[idx] = idx;
+
+      ++tail;
+      ++submitted;
+    }
+
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    /* Entries left over by an interrupted call are submitted again */
+    to_submit = tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    res = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, 0, 0);
+
+    if(res < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      return -1;
+
+    head = *ring->cq_head;
+
+    while(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+      cqe = &ring->cqes[head & *ring->cq_mask];
+      requests[cqe->user_data].result = cqe->res;
+
+      ++head;
+      ++completed;
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  return 0;
+}
+
+#endif
+
+/* Takes the next request of the first queued batch.  Called with the queue
+ * locked. */
+static struct JPT_aio_request*
+JPT_aio_take(struct JPT_aio* aio, struct JPT_aio_batch** batch)
+{
+  struct JPT_aio_request* request;
+
+  *batch = aio->first_batch;
+  request = &(*batch)->requests[(*batch)->next++];
+
+  if((*batch)->next == (*batch)->count)
+  {
+    aio->first_batch = (*batch)->next_batch;
+
+    if(!aio->first_batch)
+      aio->last_batch = 0;
+  }
+
+  return request;
+}
+
+static void
+JPT_aio_complete(struct JPT_aio_request* request)
+{
+  request->result = pread64(request->fd, request->target, request->size, request->offset);
+
+  if(request->result < 0)
+    request->result = -errno;
+}
+
+static void*
+JPT_aio_worker(void* arg)
+{
+  struct JPT_aio* aio = arg;
+  struct JPT_aio_batch* batch;
+  struct JPT_aio_request* request;
+
+  pthread_mutex_lock(&aio->mutex);
+
+  for(;;)
+  {
+    while(!aio->first_batch && !aio->stop)
+      pthread_cond_wait(&aio->work, &aio->mutex);
+
+    if(aio->stop)
+      break;
+
+    request = JPT_aio_take(aio, &batch);
+
+    pthread_mutex_unlock(&aio->mutex);
+
+    JPT_aio_complete(request);
+
+    pthread_mutex_lock(&aio->mutex);
+
+    if(!--batch->pending)
+      pthread_cond_signal(&batch->done);
+  }
+
+  pthread_mutex_unlock(&aio->mutex);
+
+  return 0;
+}
+
+/* Hands the requests to the worker threads, and helps with them while
+ * waiting */
+static int
+JPT_aio_thread_read(struct JPT_aio* aio, struct JPT_aio_request* requests,
+                    size_t count)
+{
+  struct JPT_aio_batch batch;
+  struct JPT_aio_batch* taken;
+  struct JPT_aio_request* request;
+
+  batch.requests = requests;
+  batch.count = count;
+  batch.next = 0;
+  batch.pending = count;
+  batch.next_batch = 0;
+  pthread_cond_init(&batch.done, 0);
+
+  pthread_mutex_lock(&aio->mutex);
+
+  if(aio->last_batch)
+    aio->last_batch->next_batch = &batch;
+  else
+    aio->first_batch = &batch;
+
+  aio->last_batch = &batch;
+
+  pthread_cond_broadcast(&aio->work);
+
+  while(batch.next < batch.count)
+  {
+    /* Other batches may be ahead of this one */
+    request = JPT_aio_take(aio, &taken);
+
+    pthread_mutex_unlock(&aio->mutex);
+
+    JPT_aio_complete(request);
+
+    pthread_mutex_lock(&aio->mutex);
+
+    if(!--taken->pending && taken != &batch)
+      pthread_cond_signal(&taken->done);
+  }
+
+  while(batch.pending)
+    pthread_cond_wait(&batch.done, &aio->mutex);
+
+  pthread_mutex_unlock(&aio->mutex);
+
+  pthread_cond_destroy(&batch.done);
+
+  return 0;
+}
+
+struct JPT_aio*
+JPT_aio_create()
+{
+  struct JPT_aio* aio;
+
+  if(!(aio = calloc(1, sizeof(struct JPT_aio))))
+    return 0;
+
+  pthread_mutex_init(&aio->mutex, 0);
+  pthread_cond_init(&aio->work, 0);
+
+#ifdef __NR_io_uring_setup
+  while(aio->ring_count < JPT_AIO_RINGS && 0 == JPT_uring_init(&aio->rings[aio->ring_count]))
+    ++aio->ring_count;
+
+  if(aio->ring_count)
+    return aio;
+#endif
+
+  while(aio->thread_count < JPT_AIO_THREADS
+     && 0 == pthread_create(&aio->threads[aio->thread_count], 0, JPT_aio_worker, aio))
+    ++aio->thread_count;
+
+  return aio;
+}
+
+void
+JPT_aio_destroy(struct JPT_aio* aio)
+{
+  size_t i;
+
+  if(!aio)
+    return;
+
+#ifdef __NR_io_uring_setup
+  for(i = 0; i < aio->ring_count; ++i)
+    JPT_uring_free(&aio->rings[i]);
+#endif
+
+  pthread_mutex_lock(&aio->mutex);
+  aio->stop = 1;
+  pthread_cond_broadcast(&aio->work);
+  pthread_mutex_unlock(&aio->mutex);
+
+  for(i = 0; i < aio->thread_count; ++i)
+    pthread_join(aio->threads[i], 0);
+
+  pthread_cond_destroy(&aio->work);
+  pthread_mutex_destroy(&aio->mutex);
+
+  free(aio);
+}
+
+int
+JPT_aio_read(struct JPT_aio* aio, struct JPT_aio_request* requests,
+             size_t count)
+{
+  size_t i;
+
+  if(!count)
+    return 0;
+
+  if(count == 1 || (!aio->ring_count && !aio->thread_count))
+  {
+    for(i = 0; i < count; ++i)
+    {
+      requests[i].result = pread64(requests[i].fd, requests[i].target, requests[i].size, requests[i].offset);
+
+      if(requests[i].result < 0)
+        requests[i].result = -errno;
+    }
+
+    return 0;
+  }
+
+#ifdef __NR_io_uring_setup
+  if(aio->ring_count)
+  {
+    struct JPT_uring* ring;
+    int res;
+
+    /* Prefer an idle ring, but wait for one rather than read synchronously */
+    size_t first = __atomic_fetch_add(&aio->next_ring, 1, __ATOMIC_RELAXED);
+
+    for(i = 0; i < aio->ring_count; ++i)
+    {
+      ring = &aio->rings[(first + i) % aio->ring_count];
+
+      if(0 == pthread_mutex_trylock(&ring->mutex))
+        break;
+    }
+
+    if(i == aio->ring_count)
+    {
+      ring = &aio->rings[first % aio->ring_count];
+      pthread_mutex_lock(&ring->mutex);
+    }
+
+    res = JPT_uring_read(ring, requests, count);
+
+    pthread_mutex_unlock(&ring->mutex);
+
+    return res;
+  }
+#endif
+
+  return JPT_aio_thread_read(aio, requests, count);
+}
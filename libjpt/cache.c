@@ -0,0 +1,481 @@
+/*  Block cache for reading jpt tables without a memory map.
+    Copyright (C) 2007, 2008, 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jpt_internal.h"
+
+#define JPT_CACHE_BLOCK_SIZE 4096
+#define JPT_CACHE_SHARDS     16
+
+/* Reads larger than this bypass the cache, so that large values do not evict
+ * the key infos and keys that make up most of the reads */
+#define JPT_CACHE_MAX_READ   (4 * JPT_CACHE_BLOCK_SIZE)
+
+struct JPT_cache_block
+{
+  off_t offset;
+  size_t size; /* Bytes of the block known to be in the file */
+  int next; /* Next block in the same hash bucket, or -1 */
+  int referenced;
+};
+
+/* Blocks are assigned to shards by their offset, and each shard is protected
+ * by its own mutex.  Blocks are replaced using the CLOCK algorithm.  The
+ * arrays are allocated when the shard is first used, since tables that are
+ * memory mapped never use the cache.
+ *
+ * A block is read from the file without the mutex held.  `generation' is
+ * bumped whenever the file changes under a block of the shard, and a block
+ * read while it changed is not cached, since it may hold the old data.  */
+struct JPT_cache_shard
+{
+  pthread_mutex_t mutex;
+
+  uint64_t generation;
+
+  struct JPT_cache_block* blocks;
+  char* data;
+  size_t block_count;
+  size_t used;
+  size_t hand;
+
+  int* buckets;
+  size_t bucket_mask;
+
+  uint64_t hits;
+  uint64_t misses;
+} __attribute__((aligned(64)));
+
+struct JPT_cache
+{
+  struct JPT_cache_shard shards[JPT_CACHE_SHARDS];
+};
+
+static inline uint64_t
+JPT_cache_hash(off_t offset)
+{
+  return (uint64_t) (offset / JPT_CACHE_BLOCK_SIZE) * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline struct JPT_cache_shard*
+JPT_cache_shard(struct JPT_cache* cache, off_t offset)
+{
+  return &cache->shards[JPT_cache_hash(offset) >> 60];
+}
+
+static inline int*
+JPT_cache_bucket(struct JPT_cache_shard* shard, off_t offset)
+{
+  return &shard->buckets[(JPT_cache_hash(offset) >> 20) & shard->bucket_mask];
+}
+
+struct JPT_cache*
+JPT_cache_create(size_t size)
+{
+  struct JPT_cache* cache;
+  size_t i, block_count;
+
+  block_count = size / JPT_CACHE_BLOCK_SIZE / JPT_CACHE_SHARDS;
+
+  if(!block_count)
+    block_count = 1;
+
+  if(posix_memalign((void**) &cache, 64, sizeof(struct JPT_cache)))
+    return 0;
+
+  memset(cache, 0, sizeof(struct JPT_cache));
+
+  for(i = 0; i < JPT_CACHE_SHARDS; ++i)
+  {
+    pthread_mutex_init(&cache->shards[i].mutex, 0);
+    cache->shards[i].block_count = block_count;
+  }
+
+  return cache;
+}
+
+void
+JPT_cache_destroy(struct JPT_cache* cache)
+{
+  size_t i;
+
+  if(!cache)
+    return;
+
+  for(i = 0; i < JPT_CACHE_SHARDS; ++i)
+  {
+    free(cache->shards[i].blocks);
+    free(cache->shards[i].data);
+    free(cache->shards[i].buckets);
+    pthread_mutex_destroy(&cache->shards[i].mutex);
+  }
+
+  free(cache);
+}
+
+static int
+JPT_cache_shard_init(struct JPT_cache_shard* shard)
+{
+  size_t i, bucket_count = 1;
+
+  while(bucket_count < shard->block_count)
+    bucket_count <<= 1;
+
+  shard->blocks = malloc(shard->block_count * sizeof(struct JPT_cache_block));
+  shard->data = malloc(shard->block_count * JPT_CACHE_BLOCK_SIZE);
+  shard->buckets = malloc(bucket_count * sizeof(int));
+
+  if(!shard->blocks || !shard->data || !shard->buckets)
+  {
+    free(shard->blocks);
+    free(shard->data);
+    free(shard->buckets);
+    shard->blocks = 0;
+    shard->data = 0;
+    shard->buckets = 0;
+
+    return -1;
+  }
+
+  for(i = 0; i < bucket_count; ++i)
+    shard->buckets[i] = -1;
+
+  shard->bucket_mask = bucket_count - 1;
+  shard->used = 0;
+  shard->hand = 0;
+
+  return 0;
+}
+
+static struct JPT_cache_block*
+JPT_cache_find(struct JPT_cache_shard* shard, off_t offset)
+{
+  int idx;
+
+  if(!shard->blocks)
+    return 0;
+
+  for(idx = *JPT_cache_bucket(shard, offset); idx != -1; idx = shard->blocks[idx].next)
+  {
+    if(shard->blocks[idx].offset == offset)
+      return &shard->blocks[idx];
+  }
+
+  return 0;
+}
+
+/* Picks a block to hold `offset', evicting another if the shard is full */
+static struct JPT_cache_block*
+JPT_cache_insert(struct JPT_cache_shard* shard, off_t offset)
+{
+  struct JPT_cache_block* block;
+  int* bucket;
+  int idx;
+
+  if(!shard->blocks && -1 == JPT_cache_shard_init(shard))
+    return 0;
+
+  if(shard->used < shard->block_count)
+    idx = shard->used++;
+  else
+  {
+    for(;;)
+    {
+      block = &shard->blocks[shard->hand];
+
+      if(!block->referenced)
+        break;
+
+      block->referenced = 0;
+
+      if(++shard->hand == shard->block_count)
+        shard->hand = 0;
+    }
+
+    idx = shard->hand;
+
+    if(++shard->hand == shard->block_count)
+      shard->hand = 0;
+
+    bucket = JPT_cache_bucket(shard, block->offset);
+
+    while(*bucket != idx)
+      bucket = &shard->blocks[*bucket].next;
+
+    *bucket = block->next;
+  }
+
+  block = &shard->blocks[idx];
+  bucket = JPT_cache_bucket(shard, offset);
+
+  block->offset = offset;
+  block->size = 0;
+  block->referenced = 1;
+  block->next = *bucket;
+  *bucket = idx;
+
+  return block;
+}
+
+/* Reads `size' bytes at `offset' through the cache.  Only the first `limit'
+ * bytes of the file are cached; anything beyond may still be being written.
+ * Returns the number of bytes read, like pread.  Offsets are in the table's
+ * address range, which `fd' holds from `base' on.
+ */
+ssize_t
+JPT_cache_pread(struct JPT_cache* cache, int fd, off_t base, void* target,
+                size_t size, off_t offset, off_t limit)
+{
+  struct JPT_cache_shard* shard;
+  struct JPT_cache_block* block;
+  char buffer[JPT_CACHE_BLOCK_SIZE];
+  char* out = target;
+  size_t amount, done = 0;
+  off_t block_offset;
+  uint64_t generation;
+  ssize_t res;
+
+  if(size > JPT_CACHE_MAX_READ || offset + size > limit)
+    return pread64(fd, target, size, offset - base);
+
+  while(done < size)
+  {
+    block_offset = (offset + done) & ~(off_t) (JPT_CACHE_BLOCK_SIZE - 1);
+    amount = block_offset + JPT_CACHE_BLOCK_SIZE - (offset + done);
+
+    if(amount > size - done)
+      amount = size - done;
+
+    shard = JPT_cache_shard(cache, block_offset);
+
+    pthread_mutex_lock(&shard->mutex);
+
+    block = JPT_cache_find(shard, block_offset);
+
+    if(block && block->size >= offset + done + amount - block_offset)
+    {
+      memcpy(out + done, shard->data + (block - shard->blocks) * JPT_CACHE_BLOCK_SIZE
+                         + (offset + done - block_offset), amount);
+      block->referenced = 1;
+      ++shard->hits;
+
+      pthread_mutex_unlock(&shard->mutex);
+
+      done += amount;
+
+      continue;
+    }
+
+    ++shard->misses;
+    generation = shard->generation;
+
+    pthread_mutex_unlock(&shard->mutex);
+
+    res = pread64(fd, buffer, JPT_CACHE_BLOCK_SIZE, block_offset - base);
+
+    if(res < 0)
+      return done ? done : -1;
+
+    if(res > limit - block_offset)
+      res = limit - block_offset;
+
+    if(res < offset + done + amount - block_offset)
+    {
+      if(res > offset + done - block_offset)
+      {
+        memcpy(out + done, buffer + (offset + done - block_offset), res - (offset + done - block_offset));
+        done += res - (offset + done - block_offset);
+      }
+
+      return done;
+    }
+
+    memcpy(out + done, buffer + (offset + done - block_offset), amount);
+    done += amount;
+
+    pthread_mutex_lock(&shard->mutex);
+
+    /* Bytes already cached are kept; they are at least as new as ours */
+    if(generation == shard->generation
+    && ((block = JPT_cache_find(shard, block_offset)) || (block = JPT_cache_insert(shard, block_offset)))
+    && block->size < res)
+    {
+      memcpy(shard->data + (block - shard->blocks) * JPT_CACHE_BLOCK_SIZE + block->size,
+             buffer + block->size, res - block->size);
+      block->size = res;
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+  }
+
+  return done;
+}
+
+/* Copies data written to the file at `offset' into the cached blocks it
+ * overlaps */
+void
+JPT_cache_update(struct JPT_cache* cache, const void* source, size_t size, off_t offset)
+{
+  struct JPT_cache_shard* shard;
+  struct JPT_cache_block* block;
+  const char* in = source;
+  size_t amount, done = 0, start;
+  off_t block_offset;
+
+  while(done < size)
+  {
+    block_offset = (offset + done) & ~(off_t) (JPT_CACHE_BLOCK_SIZE - 1);
+    start = offset + done - block_offset;
+    amount = JPT_CACHE_BLOCK_SIZE - start;
+
+    if(amount > size - done)
+      amount = size - done;
+
+    shard = JPT_cache_shard(cache, block_offset);
+
+    pthread_mutex_lock(&shard->mutex);
+
+    ++shard->generation;
+
+    if((block = JPT_cache_find(shard, block_offset)) && block->size > start)
+    {
+      memcpy(shard->data + (block - shard->blocks) * JPT_CACHE_BLOCK_SIZE + start, in + done,
+             (block->size - start < amount) ? block->size - start : amount);
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+
+    done += amount;
+  }
+}
+
+/* Forgets the cached blocks overlapping `size' bytes at `offset', for data
+ * written to the file without going through JPT_pwrite */
+void
+JPT_cache_invalidate(struct JPT_cache* cache, off_t offset, size_t size)
+{
+  struct JPT_cache_shard* shard;
+  struct JPT_cache_block* block;
+  off_t block_offset;
+
+  for(block_offset = offset & ~(off_t) (JPT_CACHE_BLOCK_SIZE - 1); block_offset < offset + (off_t) size;
+      block_offset += JPT_CACHE_BLOCK_SIZE)
+  {
+    shard = JPT_cache_shard(cache, block_offset);
+
+    pthread_mutex_lock(&shard->mutex);
+
+    ++shard->generation;
+
+    if((block = JPT_cache_find(shard, block_offset)))
+      block->size = 0;
+
+    pthread_mutex_unlock(&shard->mutex);
+  }
+}
+
+/* Forgets all cached blocks, for when the table file is replaced */
+void
+JPT_cache_clear(struct JPT_cache* cache)
+{
+  struct JPT_cache_shard* shard;
+  size_t i, j;
+
+  for(i = 0; i < JPT_CACHE_SHARDS; ++i)
+  {
+    shard = &cache->shards[i];
+
+    pthread_mutex_lock(&shard->mutex);
+
+    ++shard->generation;
+
+    if(shard->blocks)
+    {
+      for(j = 0; j <= shard->bucket_mask; ++j)
+        shard->buckets[j] = -1;
+
+      shard->used = 0;
+      shard->hand = 0;
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+  }
+}
+
+void
+JPT_cache_stats(struct JPT_cache* cache, uint64_t* hits, uint64_t* misses)
+{
+  size_t i;
+
+  *hits = 0;
+  *misses = 0;
+
+  for(i = 0; i < JPT_CACHE_SHARDS; ++i)
+  {
+    pthread_mutex_lock(&cache->shards[i].mutex);
+
+    *hits += cache->shards[i].hits;
+    *misses += cache->shards[i].misses;
+
+    pthread_mutex_unlock(&cache->shards[i].mutex);
+  }
+}
+
+ssize_t
+JPT_pread(struct JPT_disktable* disktable, void* target, size_t size, off_t offset)
+{
+  struct JPT_info* info = disktable->info;
+  struct JPT_segment* segment = disktable->segment;
+  off_t base = 0, limit;
+  int fd = info->fd;
+
+  limit = disktable->snapshot ? disktable->snapshot->file_size : info->file_size;
+
+  if(segment)
+  {
+    fd = segment->fd;
+    base = segment->base;
+    limit = base + segment->size;
+  }
+
+  if(!info->cache || disktable->uncached)
+    return pread64(fd, target, size, offset - base);
+
+  return JPT_cache_pread(info->cache, fd, base, target, size, offset, limit);
+}
+
+ssize_t
+JPT_pwrite(struct JPT_disktable* disktable, const void* source, size_t size, off_t offset)
+{
+  struct JPT_info* info = disktable->info;
+  off_t file_offset = offset;
+  ssize_t res;
+  int fd;
+
+  fd = JPT_disktable_fd(disktable, &file_offset);
+
+  res = pwrite64(fd, source, size, file_offset);
+
+  if(res > 0 && info->cache)
+    JPT_cache_update(info->cache, source, res, offset);
+
+  return res;
+}
@@ -18,8 +18,10 @@
 #include <alloca.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
 
 #include "patricia.h"
 
@@ -37,8 +39,8 @@ JPT_disktable_read_keyinfo(struct JPT_disktable* disktable, struct JPT_key_info*
     return 0;
   }
 
-  res = pread64(disktable->info->fd, target, sizeof(struct JPT_key_info),
-                disktable->key_info_offset + keyidx * sizeof(struct JPT_key_info));
+  res = JPT_pread(disktable, target, sizeof(struct JPT_key_info),
+                  disktable->key_info_offset + keyidx * sizeof(struct JPT_key_info));
 
   if(res == -1)
     return -1;
@@ -65,8 +67,8 @@ JPT_disktable_write_keyinfo(struct JPT_disktable* disktable, const struct JPT_ke
     return 0;
   }
 
-  res = pwrite64(disktable->info->fd, source, sizeof(struct JPT_key_info),
-                 disktable->key_info_offset + keyidx * sizeof(struct JPT_key_info));
+  res = JPT_pwrite(disktable, source, sizeof(struct JPT_key_info),
+                   disktable->key_info_offset + keyidx * sizeof(struct JPT_key_info));
 
   if(res == -1)
     return -1;
@@ -82,20 +84,43 @@ JPT_disktable_write_keyinfo(struct JPT_disktable* disktable, const struct JPT_ke
 }
 
 
+/* Returns the mapping `disktable' is read through, and sets `*map_size' to
+ * its size, which is zero if the table is not mapped */
+static char*
+JPT_disktable_map(const struct JPT_disktable* disktable, off_t* map_size)
+{
+  const struct JPT_map_snapshot* snapshot = disktable->snapshot;
+
+  if(snapshot)
+  {
+    *map_size = snapshot->map_size;
+
+    return snapshot->map;
+  }
+
+  *map_size = disktable->info->map_size;
+
+  return disktable->info->map;
+}
+
 int
 JPT_disktable_read(struct JPT_disktable* disktable, void* target, size_t size, size_t offset)
 {
   size_t fdoffset = offset + disktable->offset;
+  off_t map_size;
+  char* map;
   int res;
 
-  if(disktable->info->map_size)
+  map = JPT_disktable_map(disktable, &map_size);
+
+  if(map_size)
   {
-    memcpy(target, disktable->info->map + fdoffset, 4);
+    memcpy(target, map + fdoffset, 4);
 
     return 0;
   }
 
-  res = pread64(disktable->info->fd, target, size, fdoffset);
+  res = JPT_pread(disktable, target, size, fdoffset);
 
   if(res != size)
     return -1;
@@ -103,9 +128,118 @@ JPT_disktable_read(struct JPT_disktable* disktable, void* target, size_t size, s
   return 0;
 }
 
+/* Returns the file holding `disktable', and turns `*offset' from an offset in
+ * the table's address range into an offset in that file.
+ */
+int
+JPT_disktable_fd(const struct JPT_disktable* disktable, off_t* offset)
+{
+  if(!disktable->segment)
+    return disktable->info->fd;
+
+  *offset -= disktable->segment->base;
+
+  return disktable->segment->fd;
+}
+
+/* Finds the keys of column `columnidx' in `disktable'.
+ *
+ * On success, the keys of the column have indexes in [`*first', `*end'), which
+ * is empty when the disktable has no keys in the column.  The range may
+ * include removed keys.
+ *
+ * Disktables older than version 12 have no column directory.  For those, the
+ * first key of the column is found by binary search over the column prefixes
+ * of the data, and `*end' is the key count.
+ */
+int
+JPT_disktable_column_range(struct JPT_disktable* disktable, uint32_t columnidx,
+                           size_t* first, size_t* end)
+{
+  struct JPT_key_info key_info;
+  size_t len, half, middle;
+  unsigned char cellmeta[4];
+
+  if(-1 == JPT_DISKTABLE_LOAD(disktable, JPT_LAZY_COLUMNS))
+    return -1;
+
+  if(disktable->columns)
+  {
+    const struct JPT_disktable_column* column;
+
+    *first = 0;
+    len = disktable->column_count;
+
+    while(len > 0)
+    {
+      half = len >> 1;
+      middle = *first + half;
+
+      if(disktable->columns[middle].columnidx < columnidx)
+      {
+        *first = middle + 1;
+        len -= half + 1;
+      }
+      else
+        len = half;
+    }
+
+    column = disktable->columns + *first;
+
+    if(*first == disktable->column_count || column->columnidx != columnidx)
+    {
+      *first = *end = disktable->key_info_count;
+
+      return 0;
+    }
+
+    *first = column->first;
+    *end = column->first + column->count;
+
+    return 0;
+  }
+
+  *first = 0;
+  *end = disktable->key_info_count;
+  len = *end;
+
+  while(len > 0)
+  {
+    half = len >> 1;
+    middle = *first + half;
+
+    if(-1 == JPT_DISKTABLE_READ_KEYINFO(disktable, &key_info, middle))
+      return -1;
+
+    if(-1 == JPT_disktable_read(disktable, cellmeta, 4, key_info.offset))
+      return -1;
+
+    if(CELLMETA_TO_COLUMN(cellmeta) < columnidx)
+    {
+      *first = middle + 1;
+      len -= half + 1;
+    }
+    else
+      len = half;
+  }
+
+  return 0;
+}
+
+/* Returns zero if the key of `key_info' cannot be the key whose hash is
+ * `hash'.  Always non-zero for disktables without key fingerprints.
+ */
+static inline int
+JPT_disktable_fingerprint_match(const struct JPT_disktable* disktable,
+                                const struct JPT_key_info* key_info, uint64_t hash)
+{
+  return !disktable->key_fingerprints
+      || (key_info->flags & JPT_KEY_FINGERPRINT_MASK) == JPT_KEY_FINGERPRINT(hash);
+}
+
 int
 JPT_disktable_has_key(struct JPT_disktable* disktable,
-                      const char* row, uint32_t columnidx)
+                      const char* row, uint32_t columnidx, uint64_t hash)
 {
   struct JPT_key_info key_info;
   char* key_buf;
@@ -117,6 +251,9 @@ JPT_disktable_has_key(struct JPT_disktable* disktable,
 
   JPT_generate_key(key_buf, row, columnidx);
 
+  if(-1 == JPT_DISKTABLE_LOAD(disktable, JPT_LAZY_TRIE))
+    return -1;
+
   idx = patricia_lookup(disktable->pat, key_buf);
 
   if(idx >= disktable->key_info_count)
@@ -125,7 +262,8 @@ JPT_disktable_has_key(struct JPT_disktable* disktable,
   if(-1 == JPT_DISKTABLE_READ_KEYINFO(disktable, &key_info, idx))
     return -1;
 
-  if(key_info.size < key_size || (key_info.flags & JPT_KEY_REMOVED))
+  if(key_info.size < key_size || (key_info.flags & JPT_KEY_REMOVED)
+  || !JPT_disktable_fingerprint_match(disktable, &key_info, hash))
     return -1;
 
   if(disktable->info->map_size)
@@ -140,7 +278,7 @@ JPT_disktable_has_key(struct JPT_disktable* disktable,
     char* cmp_buf;
     cmp_buf = alloca(key_size);
 
-    if(key_size != pread64(disktable->info->fd, cmp_buf, key_size, disktable->offset + key_info.offset))
+    if(key_size != JPT_pread(disktable, cmp_buf, key_size, disktable->offset + key_info.offset))
       return -1;
 
     if(!memcmp(cmp_buf, key_buf, key_size))
@@ -152,7 +290,7 @@ JPT_disktable_has_key(struct JPT_disktable* disktable,
 
 int
 JPT_disktable_remove(struct JPT_disktable* disktable,
-                     const char* row, uint32_t columnidx)
+                     const char* row, uint32_t columnidx, uint64_t hash)
 {
   struct JPT_key_info key_info;
   struct JPT_info* info = disktable->info;
@@ -167,6 +305,9 @@ JPT_disktable_remove(struct JPT_disktable* disktable,
 
   JPT_generate_key(key_buf, row, columnidx);
 
+  if(-1 == JPT_DISKTABLE_LOAD(disktable, JPT_LAZY_TRIE))
+    return -1;
+
   idx = patricia_lookup(disktable->pat, key_buf);
 
   if(idx >= disktable->key_info_count)
@@ -180,7 +321,8 @@ JPT_disktable_remove(struct JPT_disktable* disktable,
     return -1;
 
   if((key_info.flags & JPT_KEY_REMOVED)
-  || key_info.size < key_size)
+  || key_info.size < key_size
+  || !JPT_disktable_fingerprint_match(disktable, &key_info, hash))
   {
     errno = ENOENT;
 
@@ -198,7 +340,7 @@ JPT_disktable_remove(struct JPT_disktable* disktable,
   }
   else
   {
-    if(key_size != pread64(info->fd, cmp_buf, key_size, disktable->offset + key_info.offset))
+    if(key_size != JPT_pread(disktable, cmp_buf, key_size, disktable->offset + key_info.offset))
       return -1;
 
     if(memcmp(cmp_buf, key_buf, key_size))
@@ -214,12 +356,17 @@ JPT_disktable_remove(struct JPT_disktable* disktable,
   if(-1 == JPT_DISKTABLE_WRITE_KEYINFO(disktable, &key_info, idx))
     return -1;
 
+  ++disktable->removed_count;
+
+  if(disktable->merging)
+    JPT_compaction_touch(info, row, columnidx, hash);
+
   return 0;
 }
 
 ssize_t
 JPT_disktable_overwrite(struct JPT_disktable* disktable,
-                        const char* row, uint32_t columnidx,
+                        const char* row, uint32_t columnidx, uint64_t hash,
                         const void* value, size_t amount)
 {
   struct JPT_key_info key_info;
@@ -237,6 +384,9 @@ JPT_disktable_overwrite(struct JPT_disktable* disktable,
 
   JPT_generate_key(key_buf, row, columnidx);
 
+  if(-1 == JPT_DISKTABLE_LOAD(disktable, JPT_LAZY_TRIE))
+    return -1;
+
   idx = patricia_lookup(disktable->pat, key_buf);
 
   if(idx >= disktable->key_info_count)
@@ -252,7 +402,8 @@ JPT_disktable_overwrite(struct JPT_disktable* disktable,
   size = key_info.size;
   offset = key_info.offset;
 
-  if(size < key_size)
+  if(size < key_size
+  || !JPT_disktable_fingerprint_match(disktable, &key_info, hash))
   {
     errno = ENOENT;
 
@@ -282,7 +433,7 @@ JPT_disktable_overwrite(struct JPT_disktable* disktable,
   }
   else
   {
-    if(key_size != pread64(info->fd, cmp_buf, key_size, disktable->offset + offset))
+    if(key_size != JPT_pread(disktable, cmp_buf, key_size, disktable->offset + offset))
       return -1;
 
     if(memcmp(cmp_buf, key_buf, key_size))
@@ -298,7 +449,7 @@ JPT_disktable_overwrite(struct JPT_disktable* disktable,
       key_info.size = key_size + size;
     }
 
-    if(-1 == pwrite64(info->fd, value, size, disktable->offset + offset + key_size))
+    if(-1 == JPT_pwrite(disktable, value, size, disktable->offset + offset + key_size))
       return -1;
   }
 
@@ -307,22 +458,21 @@ JPT_disktable_overwrite(struct JPT_disktable* disktable,
   if(-1 == JPT_DISKTABLE_WRITE_KEYINFO(disktable, &key_info, idx))
       return -1;
 
+  if(disktable->merging)
+    JPT_compaction_touch(info, row, columnidx, hash);
+
   return size;
 }
 
 int
 JPT_disktable_get(struct JPT_disktable* disktable,
-                  const char* row, uint32_t columnidx,
+                  const char* row, uint32_t columnidx, uint64_t hash,
                   void** value, size_t* value_size,
                   size_t* skip, size_t* max_read,
                   uint64_t* timestamp)
 {
-  struct JPT_key_info key_info;
-  struct JPT_info* info = disktable->info;
   char* key_buf;
-  char* cmp_buf;
   size_t key_size;
-  size_t size;
   unsigned int idx;
 
   key_size = strlen(row) + COLUMN_PREFIX_SIZE + 1;
@@ -330,8 +480,31 @@ JPT_disktable_get(struct JPT_disktable* disktable,
 
   JPT_generate_key(key_buf, row, columnidx);
 
+  if(-1 == JPT_DISKTABLE_LOAD(disktable, JPT_LAZY_TRIE))
+    return -1;
+
   idx = patricia_lookup(disktable->pat, key_buf);
 
+  return JPT_disktable_get_at(disktable, idx, key_buf, key_size, hash,
+                              value, value_size, skip, max_read, timestamp);
+}
+
+/* The part of JPT_disktable_get that follows the trie lookup.  `idx' is the
+ * index returned by patricia_lookup for `key', which is `key_size' bytes
+ * including its NUL terminator.
+ */
+int
+JPT_disktable_get_at(struct JPT_disktable* disktable, unsigned int idx,
+                     const char* key, size_t key_size, uint64_t hash,
+                     void** value, size_t* value_size,
+                     size_t* skip, size_t* max_read,
+                     uint64_t* timestamp)
+{
+  struct JPT_key_info key_info;
+  struct JPT_info* info = disktable->info;
+  char* cmp_buf;
+  size_t size;
+
   if(idx >= disktable->key_info_count)
     return -1;
 
@@ -340,7 +513,8 @@ JPT_disktable_get(struct JPT_disktable* disktable,
 
   size = key_info.size;
 
-  if(size < key_size || (key_info.flags & JPT_KEY_REMOVED))
+  if(size < key_size || (key_info.flags & JPT_KEY_REMOVED)
+  || !JPT_disktable_fingerprint_match(disktable, &key_info, hash))
   {
     errno = ENOENT;
 
@@ -355,11 +529,11 @@ JPT_disktable_get(struct JPT_disktable* disktable,
   {
     cmp_buf = alloca(key_size);
 
-    if(key_size != pread64(info->fd, cmp_buf, key_size, disktable->offset + key_info.offset))
+    if(key_size != JPT_pread(disktable, cmp_buf, key_size, disktable->offset + key_info.offset))
       return -1;
   }
 
-  if(!memcmp(cmp_buf, key_buf, key_size))
+  if(!memcmp(cmp_buf, key, key_size))
   {
     size_t old_size = *value_size;
     size -= key_size;
@@ -370,6 +544,8 @@ JPT_disktable_get(struct JPT_disktable* disktable,
     {
       if(*value_size > *max_read)
         *value_size = *max_read;
+
+      size = *value_size - old_size;
     }
     else
       *value = realloc(*value, *value_size + 1);
@@ -380,7 +556,7 @@ JPT_disktable_get(struct JPT_disktable* disktable,
     }
     else
     {
-      if(size != pread64(info->fd, *value + old_size, size, disktable->offset + key_info.offset + key_size))
+      if(size != JPT_pread(disktable, *value + old_size, size, disktable->offset + key_info.offset + key_size))
       {
         *value_size = old_size;
 
@@ -399,6 +575,260 @@ JPT_disktable_get(struct JPT_disktable* disktable,
   return -1;
 }
 
+/* Looks up a key in `count' disktables of a table that is not mapped, like
+ * calling JPT_disktable_get_at for each of them in order, but with the reads
+ * for all disktables issued at once through the read engine.  `idx' holds
+ * the result of patricia_lookup in each disktable.  Returns 0 if any of the
+ * disktables has the key.
+ */
+int
+JPT_disktable_get_async(struct JPT_info* info, struct JPT_disktable** disktables,
+                        const unsigned int* idx, size_t count,
+                        const char* key, size_t key_size, uint64_t hash,
+                        void** value, size_t* value_size, size_t* max_read,
+                        uint64_t* timestamp)
+{
+  struct JPT_aio_request* requests;
+  struct JPT_key_info* key_infos;
+  struct JPT_disktable* disktable;
+  size_t* slots;
+  char* cells;
+  size_t i, n = 0, cells_size = 0, size, old_size;
+  int result = -1;
+
+  requests = alloca(count * sizeof(struct JPT_aio_request));
+  key_infos = alloca(count * sizeof(struct JPT_key_info));
+  slots = alloca(count * sizeof(size_t));
+
+  for(i = 0; i < count; ++i)
+  {
+    if(idx[i] >= disktables[i]->key_info_count)
+      continue;
+
+    requests[n].target = &key_infos[i];
+    requests[n].size = sizeof(struct JPT_key_info);
+    requests[n].offset = disktables[i]->key_info_offset + (off_t) idx[i] * sizeof(struct JPT_key_info);
+    requests[n].fd = JPT_disktable_fd(disktables[i], &requests[n].offset);
+    slots[n++] = i;
+  }
+
+  if(-1 == JPT_aio_read(info->aio, requests, n))
+    return -1;
+
+  /* Keep the key infos that may match, and read their cells */
+  count = 0;
+
+  for(i = 0; i < n; ++i)
+  {
+    struct JPT_key_info* key_info = &key_infos[slots[i]];
+
+    disktable = disktables[slots[i]];
+
+    if(requests[i].result != sizeof(struct JPT_key_info)
+    || key_info->size < key_size || (key_info->flags & JPT_KEY_REMOVED)
+    || !JPT_disktable_fingerprint_match(disktable, key_info, hash))
+      continue;
+
+    size = key_info->size;
+
+    if(max_read && size > key_size + *max_read)
+      size = key_size + *max_read;
+
+    requests[count].size = size;
+    requests[count].offset = disktable->offset + key_info->offset;
+    requests[count].fd = JPT_disktable_fd(disktable, &requests[count].offset);
+    slots[count++] = slots[i];
+    cells_size += size;
+  }
+
+  if(!count)
+  {
+    errno = ENOENT;
+
+    return -1;
+  }
+
+  if(!(cells = malloc(cells_size)))
+    return -1;
+
+  for(i = 0, cells_size = 0; i < count; ++i)
+  {
+    requests[i].target = cells + cells_size;
+    cells_size += requests[i].size;
+  }
+
+  if(-1 == JPT_aio_read(info->aio, requests, count))
+  {
+    free(cells);
+
+    return -1;
+  }
+
+  for(i = 0; i < count; ++i)
+  {
+    struct JPT_key_info* key_info = &key_infos[slots[i]];
+
+    if(requests[i].result != requests[i].size
+    || memcmp(requests[i].target, key, key_size))
+      continue;
+
+    old_size = *value_size;
+    size = key_info->size - key_size;
+
+    *value_size += size;
+
+    if(max_read)
+    {
+      if(*value_size > *max_read)
+        *value_size = *max_read;
+
+      size = *value_size - old_size;
+    }
+    else
+      *value = realloc(*value, *value_size + 1);
+
+    memcpy(*value + old_size, (char*) requests[i].target + key_size, size);
+
+    if(timestamp)
+      *timestamp = key_info->timestamp;
+
+    result = 0;
+  }
+
+  free(cells);
+
+  if(result == -1)
+    errno = ENOENT;
+
+  return result;
+}
+
+/* Finds the value of a cell in the mapping of the table file, without copying
+ * it.  Fails with ENOENT if the cell is absent, and with EINVAL if the table
+ * is not mapped.
+ */
+int
+JPT_disktable_get_mapped(struct JPT_disktable* disktable,
+                         const char* row, uint32_t columnidx, uint64_t hash,
+                         const char** value, size_t* value_size)
+{
+  struct JPT_key_info key_info;
+  struct JPT_info* info = disktable->info;
+  char* key_buf;
+  size_t key_size;
+  unsigned int idx;
+
+  if(!info->map_size)
+  {
+    errno = EINVAL;
+
+    return -1;
+  }
+
+  key_size = strlen(row) + COLUMN_PREFIX_SIZE + 1;
+  key_buf = alloca(key_size);
+
+  JPT_generate_key(key_buf, row, columnidx);
+
+  if(-1 == JPT_DISKTABLE_LOAD(disktable, JPT_LAZY_TRIE))
+    return -1;
+
+  idx = patricia_lookup(disktable->pat, key_buf);
+
+  if(idx >= disktable->key_info_count)
+  {
+    errno = ENOENT;
+
+    return -1;
+  }
+
+  if(-1 == JPT_DISKTABLE_READ_KEYINFO(disktable, &key_info, idx))
+    return -1;
+
+  if(key_info.size < key_size || (key_info.flags & JPT_KEY_REMOVED)
+  || !JPT_disktable_fingerprint_match(disktable, &key_info, hash)
+  || memcmp(info->map + disktable->offset + key_info.offset, key_buf, key_size))
+  {
+    errno = ENOENT;
+
+    return -1;
+  }
+
+  *value = info->map + disktable->offset + key_info.offset + key_size;
+  *value_size = key_info.size - key_size;
+
+  return 0;
+}
+
+/* Keys per scan readahead window, and the most data bytes requested per
+ * window */
+#define JPT_READAHEAD_KEYS 1024
+#define JPT_READAHEAD_DATA (1024 * 1024)
+
+/* Asks the kernel to read in the key infos and data of the next two windows
+ * of keys, so that a scan does not fault them in one page at a time.  When
+ * the table is not mapped, the reads are started with posix_fadvise, and
+ * stay in flight while the scan works through the current window.
+ */
+static void
+JPT_disktable_cursor_readahead(struct JPT_info* info,
+                               struct JPT_disktable_cursor* cursor)
+{
+  struct JPT_disktable* disktable = cursor->disktable;
+  struct JPT_key_info first, last;
+  size_t end, data_size;
+  off_t offset, map_size;
+  char* map;
+  int fd;
+
+  map = JPT_disktable_map(disktable, &map_size);
+
+  cursor->readahead_start = cursor->offset;
+  cursor->readahead_end = cursor->offset + JPT_READAHEAD_KEYS;
+
+  end = cursor->offset + 2 * JPT_READAHEAD_KEYS;
+
+  if(end > disktable->key_info_count)
+    end = disktable->key_info_count;
+
+  if(!map_size)
+  {
+    if(-1 == JPT_DISKTABLE_READ_KEYINFO(disktable, &first, cursor->offset)
+    || -1 == JPT_DISKTABLE_READ_KEYINFO(disktable, &last, end - 1))
+      return;
+
+    offset = disktable->key_info_offset + cursor->offset * sizeof(struct JPT_key_info);
+    fd = JPT_disktable_fd(disktable, &offset);
+
+    posix_fadvise(fd, offset, (end - cursor->offset) * sizeof(struct JPT_key_info), POSIX_FADV_WILLNEED);
+  }
+  else if(disktable->key_infos_mapped)
+  {
+    first = disktable->key_infos[cursor->offset];
+    last = disktable->key_infos[end - 1];
+
+    JPT_madvise(disktable->key_infos + cursor->offset,
+                (end - cursor->offset) * sizeof(struct JPT_key_info), MADV_WILLNEED);
+  }
+  else
+    return;
+
+  data_size = last.offset + last.size - first.offset;
+
+  if(data_size > JPT_READAHEAD_DATA)
+    data_size = JPT_READAHEAD_DATA;
+
+  if(map_size)
+    JPT_madvise(map + disktable->offset + first.offset, data_size, MADV_WILLNEED);
+  else
+  {
+    offset = disktable->offset + first.offset;
+    fd = JPT_disktable_fd(disktable, &offset);
+
+    posix_fadvise(fd, offset, data_size, POSIX_FADV_WILLNEED);
+  }
+}
+
 int
 JPT_disktable_cursor_advance(struct JPT_info* info,
                              struct JPT_disktable_cursor* cursor,
@@ -406,6 +836,10 @@ JPT_disktable_cursor_advance(struct JPT_info* info,
 {
   struct JPT_key_info key_info;
   unsigned char* cellmeta;
+  off_t map_size;
+  char* map;
+
+  map = JPT_disktable_map(cursor->disktable, &map_size);
 
   do
   {
@@ -418,6 +852,9 @@ repeat:
       return 0;
     }
 
+    if(cursor->offset >= cursor->readahead_end || cursor->offset < cursor->readahead_start)
+      JPT_disktable_cursor_readahead(info, cursor);
+
     if(-1 == JPT_DISKTABLE_READ_KEYINFO(cursor->disktable, &key_info, cursor->offset++))
       return -1;
 
@@ -427,21 +864,25 @@ repeat:
     cursor->data_offset = key_info.offset + cursor->disktable->offset;
     cursor->data_size = key_info.size;
 
-    if(info->map_size)
+    if(map_size && !cursor->disktable->uncached)
     {
-      cursor->data = info->map + cursor->data_offset;
+      cursor->data = map + cursor->data_offset;
     }
     else
     {
       if(cursor->data_alloc < key_info.size)
       {
         cursor->data_alloc = (key_info.size + 1023) & ~1023;
-        cursor->buffer = realloc(cursor->data, cursor->data_alloc);
+        cursor->buffer = realloc(cursor->buffer, cursor->data_alloc);
       }
 
       cursor->data = cursor->buffer;
 
-      if(key_info.size != pread64(info->fd, cursor->data, key_info.size, cursor->data_offset))
+      /* JPT_remove_column hides keys in place, so a merge must look at a
+       * key it has copied, or the key may change after it was checked */
+      if(map_size)
+        memcpy(cursor->data, map + cursor->data_offset, key_info.size);
+      else if(key_info.size != JPT_pread(cursor->disktable, cursor->data, key_info.size, cursor->data_offset))
         return -1;
     }
 
@@ -470,3 +911,110 @@ repeat:
 
   return 0;
 }
+
+/* Returns non-zero if the cursor at heap position `a' comes before the one at
+ * `b'.  Equal keys are ordered by cursor index, so that values spread over
+ * several disktables come out oldest first.
+ */
+static int
+JPT_cursor_heap_less(const struct JPT_cursor_heap* heap, size_t a, size_t b)
+{
+  size_t i = heap->heap[a], j = heap->heap[b];
+  int cmp;
+
+  cmp = strcmp(heap->cursors[i].data, heap->cursors[j].data);
+
+  return cmp ? (cmp < 0) : (i < j);
+}
+
+static void
+JPT_cursor_heap_sift_down(struct JPT_cursor_heap* heap, size_t i)
+{
+  size_t child, tmp;
+
+  while((child = 2 * i + 1) < heap->count)
+  {
+    if(child + 1 < heap->count && JPT_cursor_heap_less(heap, child + 1, child))
+      ++child;
+
+    if(!JPT_cursor_heap_less(heap, child, i))
+      break;
+
+    tmp = heap->heap[i];
+    heap->heap[i] = heap->heap[child];
+    heap->heap[child] = tmp;
+
+    i = child;
+  }
+}
+
+/* Advances the cursors that have no key yet, and builds a heap of those that
+ * have one.  Cursors are advanced within `columnidx', or through all columns
+ * if it is JPT_INVALID_COLUMN.
+ */
+int
+JPT_cursor_heap_init(struct JPT_info* info, struct JPT_cursor_heap* heap,
+                     struct JPT_disktable_cursor* cursors, size_t count,
+                     uint32_t columnidx)
+{
+  size_t i;
+
+  heap->cursors = cursors;
+  heap->count = 0;
+  heap->columnidx = columnidx;
+
+  if(!(heap->heap = malloc((count ? count : 1) * sizeof(size_t))))
+  {
+    asprintf(&JPT_last_error, "malloc failed while creating cursor heap: %s", strerror(errno));
+
+    return -1;
+  }
+
+  for(i = 0; i < count; ++i)
+  {
+    if(!cursors[i].data_size && cursors[i].offset < cursors[i].disktable->key_info_count)
+    {
+      if(-1 == JPT_disktable_cursor_advance(info, &cursors[i], columnidx))
+        return -1;
+    }
+
+    if(cursors[i].data_size)
+      heap->heap[heap->count++] = i;
+  }
+
+  for(i = heap->count / 2; i-- > 0; )
+    JPT_cursor_heap_sift_down(heap, i);
+
+  return 0;
+}
+
+/* Consumes the key of the first cursor, and advances it to its next key.
+ */
+int
+JPT_cursor_heap_next(struct JPT_info* info, struct JPT_cursor_heap* heap)
+{
+  struct JPT_disktable_cursor* cursor = &heap->cursors[heap->heap[0]];
+
+  cursor->data_size = 0;
+
+  if(cursor->offset < cursor->disktable->key_info_count)
+  {
+    if(-1 == JPT_disktable_cursor_advance(info, cursor, heap->columnidx))
+      return -1;
+  }
+
+  if(!cursor->data_size)
+    heap->heap[0] = heap->heap[--heap->count];
+
+  if(heap->count > 1)
+    JPT_cursor_heap_sift_down(heap, 0);
+
+  return 0;
+}
+
+void
+JPT_cursor_heap_free(struct JPT_cursor_heap* heap)
+{
+  free(heap->heap);
+  heap->heap = 0;
+}
@@ -17,9 +17,11 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/mman.h>
 
 #include "jpt_internal.h"
 
@@ -128,6 +130,34 @@ JPT_read_all(int fd, void* target, size_t size)
   return size;
 }
 
+ssize_t
+JPT_pread_all(int fd, void* target, size_t size, off_t offset)
+{
+  size_t remaining = size;
+  char* o = target;
+
+  while(remaining)
+  {
+    ssize_t res = pread64(fd, o, remaining, offset);
+
+    if(res <= 0)
+    {
+      if(!res)
+        asprintf(&JPT_last_error, "Tried to read %zu bytes, got %zu", size, size - remaining);
+      else
+        asprintf(&JPT_last_error, "Read failed: %s", strerror(errno));
+
+      return -1;
+    }
+
+    o += res;
+    offset += res;
+    remaining -= res;
+  }
+
+  return size;
+}
+
 ssize_t
 JPT_write_all(int fd, const void* target, size_t size)
 {
@@ -157,6 +187,76 @@ JPT_write_all(int fd, const void* target, size_t size)
   return size;
 }
 
+ssize_t
+JPT_pwrite_all(int fd, const void* source, size_t size, off_t offset)
+{
+  size_t remaining = size;
+  const char* o = source;
+
+  while(remaining)
+  {
+    ssize_t res;
+
+    res = pwrite64(fd, o, remaining, offset);
+
+    if(res <= 0)
+    {
+      if(!res)
+        asprintf(&JPT_last_error, "Tried to write %zu bytes, terminated after %zu", size, size - remaining);
+      else
+        asprintf(&JPT_last_error, "Write failed: %s", strerror(errno));
+
+      return -1;
+    }
+
+    o += res;
+    offset += res;
+    remaining -= res;
+  }
+
+  return size;
+}
+
+int
+JPT_write_buffer_flush(struct JPT_write_buffer* buffer)
+{
+  if(!buffer->fill)
+    return 0;
+
+  if(-1 == JPT_pwrite_all(buffer->fd, buffer->data, buffer->fill, buffer->offset))
+    return -1;
+
+  buffer->offset += buffer->fill;
+  buffer->fill = 0;
+
+  return 0;
+}
+
+int
+JPT_write_buffer_append(struct JPT_write_buffer* buffer, const void* data, size_t size)
+{
+  if(buffer->fill + size > sizeof(buffer->data))
+  {
+    if(-1 == JPT_write_buffer_flush(buffer))
+      return -1;
+
+    if(size >= sizeof(buffer->data))
+    {
+      if(-1 == JPT_pwrite_all(buffer->fd, data, size, buffer->offset))
+        return -1;
+
+      buffer->offset += size;
+
+      return 0;
+    }
+  }
+
+  memcpy(buffer->data + buffer->fill, data, size);
+  buffer->fill += size;
+
+  return 0;
+}
+
 off_t
 JPT_lseek(int fd, off_t offset, int whence, off_t filesize)
 {
@@ -172,6 +272,29 @@ JPT_lseek(int fd, off_t offset, int whence, off_t filesize)
   return new_pos;
 }
 
+static pthread_once_t JPT_page_size_once = PTHREAD_ONCE_INIT;
+static size_t JPT_page_size;
+
+static void
+JPT_page_size_init(void)
+{
+  JPT_page_size = sysconf(_SC_PAGESIZE);
+}
+
+/* madvise for a range that need not start on a page boundary.  Compaction
+ * threads call this concurrently.  */
+int
+JPT_madvise(void* addr, size_t size, int advice)
+{
+  uintptr_t start;
+
+  pthread_once(&JPT_page_size_once, JPT_page_size_init);
+
+  start = (uintptr_t) addr & ~(uintptr_t) (JPT_page_size - 1);
+
+  return madvise((void*) start, (uintptr_t) addr + size - start, advice);
+}
+
 ssize_t
 JPT_writev(int fd, const struct iovec *iov, int iovcnt)
 {
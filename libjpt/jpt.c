@@ -16,10 +16,13 @@
 */
 
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <setjmp.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -38,7 +41,51 @@
 
 #define JPT_PARTIAL_WRITE "LBA_"
 #define JPT_SIGNATURE     "LBAT"
-#define JPT_VERSION       9
+#define JPT_VERSION       13
+
+/* Signatures of the regions merged disktables are written to; see
+ * JPT_merge_begin */
+#define JPT_SKIP_SIGNATURE  "LBAS"
+#define JPT_MERGE_SIGNATURE "LBAM"
+
+/* Signature of the manifest of a table with the segmented layout; see
+ * JPT_manifest_commit */
+#define JPT_MANIFEST_SIGNATURE "LBAL"
+#define JPT_MANIFEST_VERSION   1
+
+/* Signature of the index jpt_close appends to the table file; see
+ * JPT_index_write */
+#define JPT_INDEX_SIGNATURE "LBAI"
+#define JPT_INDEX_VERSION   1
+
+#define JPT_BLOOM_DEFAULT_BITS 10
+#define JPT_CACHE_DEFAULT_SIZE (16 * 1024 * 1024)
+#define JPT_BLOOM_MAX_SIZE     0x20000000
+
+/* Address space reserved for mapping the table file: 64 GiB, or 256 MiB when
+ * pointers are 32 bits wide */
+#define JPT_MAP_RESERVE ((size_t) 256 << (sizeof(void*) < 8 ? 20 : 28))
+
+/* Disktables are copied between table files in pieces of this size */
+#define JPT_COPY_BUFFER_SIZE (1024 * 1024)
+
+/* jpt_major_compact gives each of its threads at least this many keys */
+#define JPT_MAJOR_PART_KEYS 65536
+
+/* The compaction thread checks its triggers at least this often, in seconds */
+#define JPT_COMPACTION_INTERVAL 1
+
+/* Defaults of jpt_set_log_delay, also used by JPT_DELAY_LOG */
+#define JPT_LOG_DELAY_MSEC  100
+#define JPT_LOG_DELAY_BYTES (1024 * 1024)
+
+/* One in this many lookups is counted for the read amplification trigger, and
+ * the trigger waits for this many counted lookups */
+#define JPT_LOOKUP_SAMPLE      16
+#define JPT_LOOKUP_MIN_SAMPLES 256
+
+/* Log header value for a log started while a memtable was being flushed */
+#define JPT_LOG_UNKNOWN_SIZE ((uint64_t) ~0ULL)
 
 #define GLOBAL_LOCKS 0
 
@@ -54,14 +101,36 @@ static int
 JPT_log_reset(struct JPT_info* info);
 
 static int
-JPT_log_truncate_table(struct JPT_info* info);
+JPT_log_truncate_table(struct JPT_info* info, int fd);
 
 static int
-JPT_log_replay(struct JPT_info* info);
+JPT_log_replay(struct JPT_info* info, int fd);
 
 static int
 JPT_log_begin(struct JPT_info* info);
 
+static int
+JPT_log_write_header(struct JPT_info* info, off_t size);
+
+static int
+JPT_log_append(struct JPT_info* info, const struct iovec* iov, size_t iovn,
+               uint64_t* lsn);
+
+static int
+JPT_log_commit(struct JPT_info* info, uint64_t lsn);
+
+static int
+JPT_log_thread_stop(struct JPT_info* info);
+
+static int
+JPT_log_rotate(struct JPT_info* info);
+
+static int
+JPT_log_open_frozen(struct JPT_info* info);
+
+static int
+JPT_log_replay_frozen(struct JPT_info* info);
+
 static int
 JPT_get(struct JPT_info* info, const char* row, const char* column,
         void** value, size_t* value_size, size_t* skip, size_t* max_read,
@@ -76,6 +145,22 @@ JPT_insert(struct JPT_info* info,
 static int
 JPT_remove_column(struct JPT_info* info, const char* column, int flags);
 
+static void
+JPT_disktables_replace(struct JPT_info* info, size_t first, size_t count,
+                       struct JPT_disktable* disktable);
+
+static void
+JPT_compaction_notify(struct JPT_info* info);
+
+static int
+JPT_compaction_start(struct JPT_info* info);
+
+static void
+JPT_compaction_stop(struct JPT_info* info);
+
+static void
+JPT_compaction_clear_touched(struct JPT_info* info);
+
 uint64_t
 jpt_gettime()
 {
@@ -92,6 +177,34 @@ jpt_gettime()
 __thread int JPT_errno = 0;
 __thread char* JPT_last_error = 0;
 
+static __thread unsigned int JPT_lookup_sample;
+
+static const struct JPT_compaction_policy JPT_default_compaction_policy =
+{
+  4,   /* min_merge */
+  16,  /* max_merge */
+  2.0, /* size_ratio */
+  32,  /* max_disktables */
+  4.0, /* max_read_amp */
+  0.5  /* max_removed_ratio */
+};
+
+/* Header of a region of the table file reserved for a merged disktable.
+ * The merged disktable is written inside the region, at `table_offset'.
+ * Until the merge is complete, the region has JPT_SKIP_SIGNATURE and is
+ * skipped by jpt_init.  Once it has JPT_MERGE_SIGNATURE, the merged
+ * disktable replaces the `count' disktables starting with the `first'th
+ * that precede it in the file.  */
+struct JPT_merge_header
+{
+  char signature[4];
+  uint32_t first;
+  uint32_t count;
+  uint32_t reserved;
+  uint64_t size;
+  uint64_t table_offset;
+} __attribute__((packed));
+
 #if GLOBAL_LOCKS
 static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
 #endif
@@ -116,6 +229,9 @@ JPT_reader_leave(struct JPT_info* info)
 #endif
 }
 
+static int
+JPT_flush_busy(struct JPT_info* info);
+
 static void
 JPT_writer_enter(struct JPT_info* info)
 {
@@ -124,6 +240,15 @@ JPT_writer_enter(struct JPT_info* info)
 #else
   pthread_rwlock_wrlock(&info->rw_lock);
 #endif
+
+  /* Attach the result of a finished background flush as early as possible, so
+   * that readers have one less memtable to search.  Errors are reported by
+   * whoever has to wait for the flush.  */
+  if(info->frozen && !JPT_flush_busy(info))
+  {
+    if(-1 == JPT_flush_wait(info))
+      JPT_clear_error();
+  }
 }
 
 static void
@@ -200,8 +325,11 @@ JPT_log_append_uint64(struct JPT_info* info, uint64_t value)
   info->logbuf_fill += 8;
 }
 
+/* Returns the bloom filter indices of `key' in disktables older than version
+ * 10, whose filters have four fixed 64 kbit parts.
+ */
 static void
-JPT_bloom_filter_indices(int indices[4], const char* key)
+JPT_bloom_filter_legacy_indices(int indices[4], const char* key)
 {
   uint32_t hash_a, hash_b;
 
@@ -222,27 +350,345 @@ JPT_bloom_filter_indices(int indices[4], const char* key)
   indices[3] = hash_b >> 16;
 }
 
-void
-JPT_bloom_filter_add(unsigned char filter[][8192], const char* key)
+#define JPT_BLOOM_FILTER_LEGACY_TEST(filter, indices) \
+    ((filter[0][indices[0] >> 3] & (1 << (indices[0] & 7))) \
+  && (filter[1][indices[1] >> 3] & (1 << (indices[1] & 7))) \
+  && (filter[2][indices[2] >> 3] & (1 << (indices[2] & 7))) \
+  && (filter[3][indices[3] >> 3] & (1 << (indices[3] & 7))))
+
+/* Returns the 64 bit hash of `key', used by the bloom filters and for key
+ * fingerprints.
+ */
+uint64_t
+JPT_key_hash(const char* key)
 {
-  int indices[4];
+  uint64_t hash = 0xcbf29ce484222325ULL;
 
-  if(!*key)
-    return;
+  while(*key)
+  {
+    hash ^= (unsigned char) *key++;
+    hash *= 0x100000001b3ULL;
+  }
 
-  JPT_bloom_filter_indices(indices, key);
+  /* FNV-1a leaves the high bits poorly mixed; finish like MurmurHash3 */
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
 
-  filter[0][indices[0] >> 3] |= (1 << (indices[0] & 7));
-  filter[1][indices[1] >> 3] |= (1 << (indices[1] & 7));
-  filter[2][indices[2] >> 3] |= (1 << (indices[2] & 7));
-  filter[3][indices[3] >> 3] |= (1 << (indices[3] & 7));
+  return hash;
 }
 
-#define JPT_BLOOM_FILTER_TEST(filter, indices) \
-    ((filter[0][indices[0] >> 3] & (1 << (indices[0] & 7))) \
-  && (filter[1][indices[1] >> 3] & (1 << (indices[1] & 7))) \
-  && (filter[2][indices[2] >> 3] & (1 << (indices[2] & 7))) \
-  && (filter[3][indices[3] >> 3] & (1 << (indices[3] & 7))))
+/* Bit `i' of a version 10 filter of `bits' bits.  The probes are generated
+ * from the two halves of the hash by double hashing, and scaled to the
+ * filter size by multiplication.
+ */
+#define JPT_BLOOM_BIT(hash, i, bits) \
+  ((((uint32_t) (hash) + (i) * (uint32_t) ((hash) >> 32)) * (uint64_t) (bits)) >> 32)
+
+/* Version 11 filters are split into blocks of one cache line.  The upper
+ * half of the hash picks a block, and the lower half sets one bit in each
+ * 64 bit word of the block, so a key touches one cache line per disktable,
+ * and its bits within a block are the same in every disktable.
+ */
+#define JPT_BLOOM_BLOCK_WORDS 8
+#define JPT_BLOOM_BLOCK_SIZE  (JPT_BLOOM_BLOCK_WORDS * sizeof(uint64_t))
+
+#define JPT_BLOOM_BLOCK(hash, block_count) \
+  (((hash) >> 32) * (uint64_t) (block_count) >> 32)
+
+static const uint32_t JPT_bloom_salts[JPT_BLOOM_BLOCK_WORDS] =
+{
+  0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+  0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+/* Number of filter blocks prefetched before any of them are tested */
+#define JPT_BLOOM_PREFETCH 16
+
+/* A key prepared for testing against the bloom filters of many disktables.
+ * The legacy indices are only computed if an old disktable is met.
+ */
+struct JPT_bloom_key
+{
+  const char* key;
+  uint64_t hash;
+  uint64_t masks[JPT_BLOOM_BLOCK_WORDS];
+  int legacy_indices[4];
+  int has_legacy_indices;
+};
+
+static void
+JPT_bloom_masks(uint64_t masks[JPT_BLOOM_BLOCK_WORDS], uint64_t hash)
+{
+  int i;
+
+  for(i = 0; i < JPT_BLOOM_BLOCK_WORDS; ++i)
+    masks[i] = (uint64_t) 1 << (((uint32_t) hash * JPT_bloom_salts[i]) >> 26);
+}
+
+static void
+JPT_bloom_key_init(struct JPT_bloom_key* bloom_key, const char* key)
+{
+  bloom_key->key = key;
+  bloom_key->hash = JPT_key_hash(key);
+  bloom_key->has_legacy_indices = 0;
+
+  JPT_bloom_masks(bloom_key->masks, bloom_key->hash);
+}
+
+/* Allocates an empty bloom filter for a disktable with `key_count' keys.
+ *
+ * The filter gets `bits_per_key' bits per key, rounded up to whole blocks.
+ */
+static int
+JPT_bloom_filter_create(struct JPT_disktable* disktable, size_t key_count,
+                        unsigned int bits_per_key)
+{
+  uint64_t bits;
+  void* filter;
+
+  bits = (uint64_t) key_count * bits_per_key;
+  bits = (bits + JPT_BLOOM_BLOCK_SIZE * 8 - 1) & ~(uint64_t) (JPT_BLOOM_BLOCK_SIZE * 8 - 1);
+
+  if(!bits)
+    bits = JPT_BLOOM_BLOCK_SIZE * 8;
+
+  if(bits > (uint64_t) JPT_BLOOM_MAX_SIZE * 8)
+    bits = (uint64_t) JPT_BLOOM_MAX_SIZE * 8;
+
+  disktable->bloom_size = bits / 8;
+  disktable->bloom_hashes = JPT_BLOOM_BLOCK_WORDS;
+  disktable->bloom_blocked = 1;
+
+  if(0 != (errno = posix_memalign(&filter, JPT_BLOOM_BLOCK_SIZE, disktable->bloom_size)))
+  {
+    asprintf(&JPT_last_error, "posix_memalign failed while allocating %zu byte bloom filter: %s",
+             (size_t) disktable->bloom_size, strerror(errno));
+
+    disktable->bloom_filter = 0;
+
+    return -1;
+  }
+
+  memset(filter, 0, disktable->bloom_size);
+  disktable->bloom_filter = filter;
+
+  return 0;
+}
+
+/* Adds the key whose hash is `hash' to the bloom filter of `disktable'.
+ */
+static void
+JPT_bloom_filter_add(struct JPT_disktable* disktable, uint64_t hash)
+{
+  uint64_t masks[JPT_BLOOM_BLOCK_WORDS];
+  uint64_t block_count;
+  uint64_t* block;
+  int i;
+
+  assert(disktable->bloom_blocked);
+
+  block_count = disktable->bloom_size / JPT_BLOOM_BLOCK_SIZE;
+  block = (uint64_t*) disktable->bloom_filter + JPT_BLOOM_BLOCK(hash, block_count) * JPT_BLOOM_BLOCK_WORDS;
+
+  JPT_bloom_masks(masks, hash);
+
+  for(i = 0; i < JPT_BLOOM_BLOCK_WORDS; ++i)
+    block[i] |= masks[i];
+}
+
+/* Returns non-zero if all bits of `masks' are set in `block'.
+ */
+static inline int
+JPT_bloom_block_test(const uint64_t* block, const uint64_t* masks)
+{
+  uint64_t missing = 0;
+  int i;
+
+  for(i = 0; i < JPT_BLOOM_BLOCK_WORDS; ++i)
+    missing |= ~block[i] & masks[i];
+
+  return !missing;
+}
+
+/* Returns non-zero if `key' may be present in `disktable', whose filter is
+ * older than version 11.
+ */
+static int
+JPT_bloom_filter_test(const struct JPT_disktable* disktable,
+                      struct JPT_bloom_key* key)
+{
+  uint64_t hash, bits, bit;
+  uint32_t i;
+
+  assert(!disktable->bloom_blocked);
+
+  if(!disktable->bloom_hashes)
+  {
+    uint8_t (*filter)[8192] = (uint8_t (*)[8192]) disktable->bloom_filter;
+
+    if(!key->has_legacy_indices)
+    {
+      JPT_bloom_filter_legacy_indices(key->legacy_indices, key->key);
+      key->has_legacy_indices = 1;
+    }
+
+    return JPT_BLOOM_FILTER_LEGACY_TEST(filter, key->legacy_indices);
+  }
+
+  hash = key->hash;
+  bits = (uint64_t) disktable->bloom_size * 8;
+
+  for(i = 0; i < disktable->bloom_hashes; ++i)
+  {
+    bit = JPT_BLOOM_BIT(hash, i, bits);
+
+    if(!(disktable->bloom_filter[bit >> 3] & (1 << (bit & 7))))
+      return 0;
+  }
+
+  return 1;
+}
+
+/* Makes room for the bloom filters of `count' disktables in the array
+ * probed by JPT_bloom_probe.  Called before a disktable is added, so that
+ * adding it cannot fail.
+ */
+static int
+JPT_bloom_refs_reserve(struct JPT_info* info, size_t count)
+{
+  struct JPT_bloom_ref* new_refs;
+  size_t new_alloc;
+
+  if(count <= info->bloom_ref_alloc)
+    return 0;
+
+  new_alloc = count * 2;
+
+  if(!(new_refs = realloc(info->bloom_refs, new_alloc * sizeof(struct JPT_bloom_ref))))
+  {
+    asprintf(&JPT_last_error, "realloc failed while allocating bloom filter index: %s", strerror(errno));
+
+    return -1;
+  }
+
+  info->bloom_refs = new_refs;
+  info->bloom_ref_alloc = new_alloc;
+
+  return 0;
+}
+
+/* Rebuilds the array of bloom filters probed by JPT_bloom_probe.  Must be
+ * called whenever disktables are added or removed.
+ */
+static void
+JPT_bloom_refs_update(struct JPT_info* info)
+{
+  struct JPT_disktable* disktable;
+  struct JPT_bloom_ref* ref;
+
+  assert(info->disktable_count <= info->bloom_ref_alloc);
+
+  for(disktable = info->first_disktable, ref = info->bloom_refs; disktable;
+      disktable = disktable->next, ++ref)
+  {
+    ref->disktable = disktable;
+
+    if(disktable->bloom_blocked)
+    {
+      ref->blocks = (const uint64_t*) disktable->bloom_filter;
+      ref->block_count = disktable->bloom_size / JPT_BLOOM_BLOCK_SIZE;
+    }
+    else
+    {
+      ref->blocks = 0;
+      ref->block_count = 0;
+    }
+  }
+
+  assert(ref == info->bloom_refs + info->disktable_count);
+}
+
+/* Reads the bloom filters not read since the table was opened.  Returns -1
+ * if any of them could not be read.
+ */
+static int
+JPT_bloom_load(struct JPT_info* info)
+{
+  struct JPT_disktable* disktable;
+  off_t offset;
+  int fd, result = 0;
+
+  /* Starts all reads first, so that the disk can serve them in any order */
+  for(disktable = info->first_disktable; disktable; disktable = disktable->next)
+  {
+    if(!(__atomic_load_n(&disktable->lazy, __ATOMIC_ACQUIRE) & JPT_LAZY_BLOOM))
+      continue;
+
+    offset = disktable->pat_offset - disktable->bloom_size;
+    fd = JPT_disktable_fd(disktable, &offset);
+
+    posix_fadvise(fd, offset, disktable->bloom_size, POSIX_FADV_WILLNEED);
+  }
+
+  for(disktable = info->first_disktable; disktable; disktable = disktable->next)
+  {
+    if(-1 == JPT_DISKTABLE_LOAD(disktable, JPT_LAZY_BLOOM))
+      result = -1;
+  }
+
+  return result;
+}
+
+/* Tests `key' against the bloom filters of all disktables.  `maybe[i]' is
+ * set to non-zero if the i'th disktable may contain the key.
+ *
+ * The filter block of each disktable is prefetched a batch at a time before
+ * any of them are tested, so the cache misses of a batch overlap instead of
+ * being taken one disktable at a time.
+ *
+ * Filters not read yet are read first; disktables whose filter cannot be
+ * read may contain any key.
+ */
+static void
+JPT_bloom_probe(struct JPT_info* info, struct JPT_bloom_key* key,
+                unsigned char* maybe)
+{
+  const uint64_t* blocks[JPT_BLOOM_PREFETCH];
+  const struct JPT_bloom_ref* refs = info->bloom_refs;
+  size_t i, j, batch;
+  int unread = 0;
+
+  if(__atomic_load_n(&info->lazy_bloom_count, __ATOMIC_ACQUIRE))
+    unread = (-1 == JPT_bloom_load(info));
+
+  for(i = 0; i < info->disktable_count; i += batch)
+  {
+    batch = info->disktable_count - i;
+
+    if(batch > JPT_BLOOM_PREFETCH)
+      batch = JPT_BLOOM_PREFETCH;
+
+    for(j = 0; j < batch; ++j)
+    {
+      blocks[j] = refs[i + j].blocks + JPT_BLOOM_BLOCK(key->hash, refs[i + j].block_count) * JPT_BLOOM_BLOCK_WORDS;
+
+      __builtin_prefetch(blocks[j]);
+    }
+
+    for(j = 0; j < batch; ++j)
+    {
+      if(unread && (__atomic_load_n(&refs[i + j].disktable->lazy, __ATOMIC_ACQUIRE) & JPT_LAZY_BLOOM))
+        maybe[i + j] = 1;
+      else if(refs[i + j].blocks)
+        maybe[i + j] = JPT_bloom_block_test(blocks[j], key->masks);
+      else
+        maybe[i + j] = JPT_bloom_filter_test(refs[i + j].disktable, key);
+    }
+  }
+}
 
 void
 JPT_clear_error()
@@ -329,6 +775,10 @@ JPT_get_column_idx(struct JPT_info* info, const char* column, int flags)
   {
     if(errno == ENOENT && (flags & JPT_COL_CREATE))
     {
+      if(!info->next_column
+      && sizeof(uint32_t) != JPT_get_fixed(info, "next-column", "__META__", &info->next_column, sizeof(uint32_t)))
+        info->next_column = 100;
+
       if(info->next_column == 0xffffffff)
       {
         errno = ENOSPC;
@@ -391,970 +841,5384 @@ JPT_generate_key(char* target, const char* row, uint32_t columnidx)
   strcpy(target + COLUMN_PREFIX_SIZE, row);
 }
 
-static const char*
-JPT_node_key_callback(unsigned int idx, void* arg)
+/* Applies the access hints requested by the flags given to jpt_init to a
+ * disktable.  Must be repeated whenever the table is mapped anew.  Failures
+ * are ignored, since the hints do not affect correctness.
+ */
+static void
+JPT_disktable_advise(struct JPT_info* info, struct JPT_disktable* disktable)
 {
-  struct JPT_node** nodes = arg;
-
-  /* XXX: Need to free key_buf on thread exit */
-  static __thread size_t key_buf_size = 0;
-  static __thread char* key_buf = 0;
+  if(info->flags & JPT_LOCK_INDEX)
+    mlock(disktable->bloom_filter, disktable->bloom_size);
 
-  if(strlen(nodes[idx]->row) + COLUMN_PREFIX_SIZE + 1 > key_buf_size)
-  {
-    key_buf_size = strlen(nodes[idx]->row) + 32;
-    free(key_buf);
-    key_buf = malloc(key_buf_size);
-  }
+  if(!info->map_size)
+    return;
 
-  JPT_generate_key(key_buf, nodes[idx]->row, nodes[idx]->columnidx);
+  if((info->flags & JPT_RANDOM_ACCESS) && disktable->data_size)
+    JPT_madvise(info->map + disktable->offset, disktable->data_size, MADV_RANDOM);
 
-  return key_buf;
+  /* The trie is followed directly by the key infos */
+  if(info->flags & JPT_LOCK_INDEX)
+    mlock(info->map + disktable->pat_offset, disktable->offset - disktable->pat_offset);
 }
 
-void
-JPT_update_map(struct JPT_info* info)
+/* Notes that no segment is mapped any more */
+static void
+JPT_segments_unmapped(struct JPT_info* info)
 {
   struct JPT_disktable* disktable;
-  void* old_map = 0;
 
-  info->file_size = lseek64(info->fd, 0, SEEK_END);
-
-  if(!info->file_size)
-    return;
+  for(disktable = info->first_disktable; disktable; disktable = disktable->next)
+  {
+    if(disktable->segment)
+      disktable->segment->mapped = 0;
+  }
+}
 
-  if(info->file_size > (size_t) -1)
-    return;
+/* Gives up the current mapping of the table file, along with the address
+ * range reserved for it.  If values returned by jpt_get_ref still point into
+ * it, it is unmapped when the last of them is released instead.
+ */
+static void
+JPT_unmap(struct JPT_info* info)
+{
+  struct JPT_ref* ref;
 
-  if(info->map_size)
-  {
-    void* new_map;
+  pthread_mutex_lock(&info->map_ref_mutex);
 
-    old_map = info->map;
-    new_map = mremap(info->map, info->map_size, info->file_size, MREMAP_MAYMOVE);
+  ref = info->map_ref;
+  info->map_ref = 0;
 
-    if(new_map != MAP_FAILED)
-    {
-      info->map = new_map;
-      info->map_size = info->file_size;
-    }
-    else
-    {
-      munmap(info->map, info->map_size);
-      info->map_size = 0;
-    }
+  if(ref && ref->refcount)
+  {
+    ref->next = info->retired_maps;
+    info->retired_maps = ref;
   }
   else
   {
-    info->map = mmap(0, info->file_size, PROT_READ | PROT_WRITE, MAP_SHARED, info->fd, 0);
-
-    if(info->map != MAP_FAILED)
-      info->map_size = info->file_size;
+    munmap(info->map, info->map_reserved);
+    free(ref);
   }
 
-  if(info->map_size)
-  {
-    if(old_map != info->map)
-    {
-      disktable = info->first_disktable;
+  pthread_mutex_unlock(&info->map_ref_mutex);
 
-      while(disktable)
-      {
-        patricia_remap(disktable->pat, info->map + disktable->pat_offset);
-        disktable->pat_mapped = 1;
+  info->map_size = 0;
+  info->map_reserved = 0;
 
-        disktable->key_infos = (struct JPT_key_info*) (info->map + disktable->key_info_offset);
-        disktable->key_infos_mapped = 1;
+  JPT_segments_unmapped(info);
 
-        disktable = disktable->next;
-      }
-    }
-  }
-  else
-  {
-    disktable = info->first_disktable;
+  /* Writes made through the mapping bypassed the block cache */
+  if(info->cache)
+    JPT_cache_clear(info->cache);
+}
 
-    while(disktable)
-    {
-      if(disktable->pat_mapped)
-      {
-        lseek64(info->fd, disktable->pat_offset, SEEK_SET);
-        patricia_read(disktable->pat, info->fd);
-        disktable->pat_mapped = 0;
-      }
+/* Returns a reference to the current mapping, which keeps it mapped until
+ * the reference is released with jpt_release_ref.  Returns 0 if out of
+ * memory.
+ */
+static struct JPT_ref*
+JPT_map_pin(struct JPT_info* info)
+{
+  struct JPT_ref* ref;
 
-      disktable->key_infos = 0;
-      disktable->key_infos_mapped = 0;
+  pthread_mutex_lock(&info->map_ref_mutex);
 
-      disktable = disktable->next;
+  if(!info->map_ref)
+  {
+    if(!(info->map_ref = calloc(1, sizeof(struct JPT_ref))))
+    {
+      pthread_mutex_unlock(&info->map_ref_mutex);
+
+      return 0;
     }
+
+    info->map_ref->map = info->map;
+    info->map_ref->map_size = info->map_reserved;
   }
+
+  ++info->map_ref->refcount;
+  ref = info->map_ref;
+
+  pthread_mutex_unlock(&info->map_ref_mutex);
+
+  return ref;
 }
 
-struct JPT_info*
-jpt_init(const char* filename, size_t buffer_size, int flags)
+static size_t
+JPT_page_round(size_t size)
 {
-  jmp_buf io_error;
-  struct JPT_info* info = 0;
-  struct JPT_disktable* disktable;
-  char signature[4];
-  uint32_t version;
-  uint32_t row_count;
-  uint32_t data_size;
-  int res;
-  off_t offset;
-  char* logname;
+  size_t page_size = sysconf(_SC_PAGESIZE);
 
-  assert(sizeof(off_t) == 8);
+  return (size + page_size - 1) & ~(page_size - 1);
+}
 
-  TRACE((stderr, "jpt_init(%s, %zu)", filename, buffer_size));
+/* Returns non-zero if values returned by jpt_get_ref may point into the
+ * current mapping */
+static int
+JPT_map_pinned(struct JPT_info* info)
+{
+  int pinned;
 
-  JPT_clear_error();
+  pthread_mutex_lock(&info->map_ref_mutex);
+  pinned = info->map_ref && info->map_ref->refcount;
+  pthread_mutex_unlock(&info->map_ref_mutex);
 
-  info = malloc(sizeof(struct JPT_info));
+  return pinned;
+}
 
-  if(!info)
-    goto fail;
+/* Maps the segments of a segmented table that are not mapped yet at their
+ * bases in the reserved address range */
+static int
+JPT_map_segments(struct JPT_info* info)
+{
+  struct JPT_disktable* disktable;
+  struct JPT_segment* segment;
 
-  memset(info, 0, sizeof(struct JPT_info));
+  if(JPT_page_round(info->file_size) > info->map_reserved)
+    return -1;
 
-  info->flags = flags;
-  info->fd = open(filename, O_RDWR | O_CREAT, 0600);
+  for(disktable = info->first_disktable; disktable; disktable = disktable->next)
+  {
+    if(!(segment = disktable->segment) || segment->mapped)
+      continue;
 
-  if(-1 == lockf(info->fd, F_TLOCK, INT_MAX))
-    goto fail;
+    if(MAP_FAILED == mmap(info->map + segment->base, segment->size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_FIXED, segment->fd, 0))
+      return -1;
 
-  if(info->fd == -1)
-    goto fail;
+    segment->mapped = 1;
+  }
 
-  if(-1 == asprintf(&logname, "%s.log", filename))
-    goto fail;
+  info->map_size = info->file_size;
 
-  info->logfd = open(logname, O_RDWR | O_CREAT, 0600);
+  return 0;
+}
 
-  if(info->logfd == -1)
-    goto fail;
+/* Reserves a new address range for the table file and maps the file at its
+ * start.  The range is made large enough for the file to double in size,
+ * so that compactions can usually extend the mapping without moving it.
+ */
+static int
+JPT_map_create(struct JPT_info* info)
+{
+  char* base;
+  size_t reserve = JPT_MAP_RESERVE;
 
-  if(-1 == lockf(info->logfd, F_TLOCK, INT_MAX))
-    goto fail;
+  while(reserve / 2 < info->file_size && reserve * 2 > reserve)
+    reserve *= 2;
 
-  info->logbuf_fill = 0;
+  base = mmap(0, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
 
-  free(logname);
+  if(base == MAP_FAILED)
+  {
+    /* Address space is scarce; settle for the file itself */
+    reserve = JPT_page_round(info->file_size);
 
-  JPT_update_map(info);
+    base = mmap(0, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
 
-  if(-1 == JPT_log_truncate_table(info))
-    goto fail;
+    if(base == MAP_FAILED)
+      return -1;
+  }
 
-  pthread_rwlock_init(&info->rw_lock, 0);
-  pthread_rwlock_init(&info->splay_lock, 0);
-  pthread_mutex_init(&info->column_hash_mutex, 0);
+  if(info->segmented)
+  {
+    info->map = base;
+    info->map_reserved = reserve;
 
-  JPT_writer_enter(info);
+    JPT_segments_unmapped(info);
+
+    if(-1 == JPT_map_segments(info))
+    {
+      munmap(base, reserve);
+
+      info->map_size = 0;
+      info->map_reserved = 0;
 
-  lseek64(info->fd, 0, SEEK_SET);
+      JPT_segments_unmapped(info);
 
-  for(;;)
+      return -1;
+    }
+
+    return 0;
+  }
+
+  if(MAP_FAILED == mmap(base, info->file_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, info->fd, 0))
   {
-    offset = lseek64(info->fd, 0, SEEK_CUR);
+    munmap(base, reserve);
 
-    if(setjmp(io_error))
-    {
-      if(flags & JPT_RECOVER)
-      {
-        if(-1 == JPT_lseek(info->fd, offset, SEEK_SET, info->file_size))
-          goto fail;
+    return -1;
+  }
 
-        if(-1 == ftruncate(info->fd, offset))
-          goto fail;
+  info->map = base;
+  info->map_size = info->file_size;
+  info->map_reserved = reserve;
 
-        break;
-      }
+  return 0;
+}
 
-      char* prev_error = strdupa(jpt_last_error());
-      free(JPT_last_error);
-      asprintf(&JPT_last_error, "%s.  Run `jpt-control %s recover' to truncate offending data", prev_error, filename);
+/* Maps the part of the table file beyond the current mapping into the
+ * reserved address range, so that pointers into the mapping stay valid.
+ * Fails if the file no longer fits in the range.
+ */
+static int
+JPT_map_extend(struct JPT_info* info)
+{
+  size_t old_end, new_end;
 
-      free(info);
+  if(info->segmented)
+    return JPT_map_segments(info);
 
-      goto fail;
-    }
+  if(info->file_size < info->map_size)
+    return -1;
 
-    version = 0;
+  old_end = JPT_page_round(info->map_size);
+  new_end = JPT_page_round(info->file_size);
 
-    res = read(info->fd, signature, 4);
+  if(new_end > info->map_reserved)
+    return -1;
 
-    if(res < sizeof(uint32_t))
-    {
-      if(res == -1)
-        longjmp(io_error, 1);
+  if(new_end > old_end
+  && MAP_FAILED == mmap(info->map + old_end, new_end - old_end, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_FIXED, info->fd, old_end))
+    return -1;
 
-      break;
-    }
+  info->map_size = info->file_size;
 
-    if(!memcmp(signature, JPT_PARTIAL_WRITE, 4))
-    {
-      flags |= JPT_RECOVER;
+  return 0;
+}
 
-      longjmp(io_error, 1);
-    }
+/* Drops the mapping of a table file that is being replaced, keeping the
+ * reserved address range for the new file unless values returned by
+ * jpt_get_ref still point into it.
+ */
+static void
+JPT_map_reset(struct JPT_info* info)
+{
+  if(!info->map_reserved)
+    return;
 
-    if(memcmp(signature, JPT_SIGNATURE, 4))
+  if(JPT_map_pinned(info)
+  || MAP_FAILED == mmap(info->map, JPT_page_round(info->map_size), PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0))
+  {
+    JPT_unmap(info);
+
+    return;
+  }
+
+  info->map_size = 0;
+
+  JPT_segments_unmapped(info);
+}
+
+void
+JPT_update_map(struct JPT_info* info)
+{
+  struct JPT_disktable* disktable;
+  void* old_map = 0;
+
+  if(!info->segmented)
+    info->file_size = lseek64(info->fd, 0, SEEK_END);
+
+  if(!info->file_size)
+    return;
+
+  if(info->file_size > (size_t) -1)
+    return;
+
+  if(info->flags & (JPT_NO_MMAP | JPT_ASYNC_READ))
+    return;
+
+  if(info->map_size)
+    old_map = info->map;
+
+  /* The range outgrown by the file is given up as a whole; references into
+   * it keep it alive */
+  if(info->map_reserved && -1 == JPT_map_extend(info))
+    JPT_unmap(info);
+
+  if(!info->map_reserved)
+    JPT_map_create(info);
+
+  /* jpt_init maps segments before reading their disktables, which have no
+   * trie until then.  Tries not read yet are mapped when they are.  */
+  if(info->map_size)
+  {
+    if(old_map != info->map)
     {
-      if(flags & JPT_RECOVER)
-        longjmp(io_error, 1);
-      else
+      for(disktable = info->first_disktable; disktable; disktable = disktable->next)
       {
-        asprintf(&JPT_last_error, "Database corrupt at offset 0x%llx (found %.*s, expected %s).  Run `jpt-control %s recover'", (long long) offset, 4, signature, JPT_SIGNATURE, filename);
+        if(!disktable->pat)
+          continue;
 
-        goto fail;
+        if(!(disktable->lazy & JPT_LAZY_TRIE))
+        {
+          patricia_remap(disktable->pat, info->map + disktable->pat_offset);
+          disktable->pat_mapped = 1;
+        }
+
+        disktable->key_infos = (struct JPT_key_info*) (info->map + disktable->key_info_offset);
+        disktable->key_infos_mapped = 1;
+
+        JPT_disktable_advise(info, disktable);
       }
     }
+  }
+  else
+  {
+    for(disktable = info->first_disktable; disktable; disktable = disktable->next)
+    {
+      if(!disktable->pat)
+        continue;
 
-    if(sizeof(uint32_t) != JPT_read_all(info->fd, &version, sizeof(uint32_t)))
-      longjmp(io_error, 1);
+      if(disktable->pat_mapped)
+      {
+        off_t offset = disktable->pat_offset;
+        int fd = JPT_disktable_fd(disktable, &offset);
 
-    if(version > JPT_VERSION)
-    {
-      JPT_errno = JPT_EVERSION;
-      asprintf(&JPT_last_error, "Table version %u is not supported (maximum is %u)", version, JPT_VERSION);
+        lseek64(fd, offset, SEEK_SET);
+        patricia_read(disktable->pat, fd);
+        disktable->pat_mapped = 0;
+      }
 
-      goto fail;
+      disktable->key_infos = 0;
+      disktable->key_infos_mapped = 0;
     }
+  }
+}
 
-    if(-1 == JPT_read_all(info->fd, &row_count, sizeof(uint32_t)))
-      longjmp(io_error, 1);
-
-    if(-1 == JPT_read_all(info->fd, &data_size, sizeof(uint32_t)))
-      longjmp(io_error, 1);
+/* Reads the column directory of a disktable from `offset' in `fd', and
+ * checks that it describes increasing columns with key ranges inside the
+ * disktable.
+ */
+static int
+JPT_disktable_read_columns(struct JPT_disktable* disktable, int fd, off_t offset)
+{
+  struct JPT_disktable_column* columns;
+  size_t i, size, end = 0;
 
-    if(version < 8)
-    {
-      JPT_errno = JPT_EVERSION;
-      asprintf(&JPT_last_error, "Table version %u is too old.  Use jpt-control backup/restore", version);
+  size = disktable->column_count * sizeof(struct JPT_disktable_column);
 
-      goto fail;
-    }
+  if(!(columns = malloc(size ? size : 1)))
+  {
+    asprintf(&JPT_last_error, "malloc failed while allocating %zu byte column directory: %s", size, strerror(errno));
 
-    disktable = malloc(sizeof(struct JPT_disktable));
+    return -1;
+  }
 
-    if(-1 == JPT_read_all(info->fd, disktable->bloom_filter, sizeof(disktable->bloom_filter)))
-      longjmp(io_error, 1);
+  if(-1 == JPT_pread_all(fd, columns, size, offset))
+  {
+    free(columns);
 
-    disktable->pat = patricia_create(0, 0);
+    return -1;
+  }
 
-    disktable->pat_offset = lseek64(info->fd, 0, SEEK_CUR);
+  for(i = 0; i < disktable->column_count; ++i)
+  {
+    const struct JPT_disktable_column* column = &columns[i];
 
-    if(!info->map_size)
+    if(column->first != end
+    || !column->count || column->count > disktable->key_info_count - end
+    || (i && column->columnidx <= column[-1].columnidx))
     {
-      patricia_read(disktable->pat, info->fd);
+      asprintf(&JPT_last_error, "Invalid column directory entry %zu", i);
+      free(columns);
+
+      return -1;
     }
-    else
-    {
-      size_t pat_size;
 
-      pat_size = patricia_remap(disktable->pat, info->map + disktable->pat_offset);
+    end += column->count;
+  }
 
-      if(-1 == JPT_lseek(info->fd, pat_size, SEEK_CUR, info->file_size))
-        longjmp(io_error, 1);
-    }
+  if(end != disktable->key_info_count)
+  {
+    asprintf(&JPT_last_error, "Column directory covers %zu of %zu keys", end, disktable->key_info_count);
+    free(columns);
 
-    disktable->key_info_offset = lseek64(info->fd, 0, SEEK_CUR);
-    disktable->key_info_count = row_count;
+    return -1;
+  }
 
-    if(!info->map_size)
-      disktable->key_infos_mapped = 0;
-    else
-    {
-      disktable->key_infos = (struct JPT_key_info*) (info->map + disktable->key_info_offset);
-      disktable->key_infos_mapped = 1;
-    }
+  disktable->columns = columns;
 
-    if(-1 == JPT_lseek(info->fd, row_count * sizeof(struct JPT_key_info), SEEK_CUR, info->file_size))
-      longjmp(io_error, 1);
+  return 0;
+}
 
-    disktable->offset = lseek64(info->fd, 0, SEEK_CUR);
+/* The manifest of a table with the segmented layout: this header, followed
+ * by an entry for the segment of each disktable, oldest first.  The
+ * manifest is only ever replaced as a whole, by renaming a new one over it.
+ */
+struct JPT_manifest_header
+{
+  char signature[4];
+  uint32_t version;
+  uint32_t count;
+  uint32_t reserved;
+  uint64_t flush_count;
+  uint64_t next_segment_id;
+};
 
-    if(-1 == JPT_lseek(info->fd, disktable->offset + data_size, SEEK_SET, info->file_size))
-      longjmp(io_error, 1);
+struct JPT_manifest_entry
+{
+  uint64_t id;
+  uint64_t start;
+};
 
-    disktable->info = info;
-    disktable->next = 0;
+/* Returns the name of the file of segment `id', to be freed by the caller */
+static char*
+JPT_segment_name(struct JPT_info* info, uint64_t id)
+{
+  char* name;
 
-    if(!info->first_disktable)
-    {
-      info->first_disktable = disktable;
-      info->last_disktable = disktable;
-    }
-    else
-    {
-      info->last_disktable->next = disktable;
-      info->last_disktable = disktable;
-    }
+  if(-1 == asprintf(&name, "%s.%06llu", info->filename, (unsigned long long) id))
+  {
+    asprintf(&JPT_last_error, "asprintf failed while naming segment: %s", strerror(errno));
 
-    ++info->disktable_count;
+    return 0;
   }
 
-  info->buffer_size = buffer_size;
-  info->buffer = 0;
-  info->filename = strdup(filename);
+  return name;
+}
 
-  info->column_count = 128;
-  info->columns = malloc(info->column_count * sizeof(struct JPT_column));
-  memset(info->columns, 0, info->column_count * sizeof(struct JPT_column));
+/* Creates the file of a new segment.  Numbers are taken atomically, since
+ * the threads of a major compaction create segments without holding the
+ * writer lock.
+ */
+static struct JPT_segment*
+JPT_segment_create(struct JPT_info* info)
+{
+  struct JPT_segment* segment;
+  char* name;
 
-  if(sizeof(uint32_t) != JPT_get_fixed(info, "next-column", "__META__", &info->next_column, sizeof(uint32_t)))
-    info->next_column = 100;
+  if(!(segment = malloc(sizeof(struct JPT_segment))))
+  {
+    asprintf(&JPT_last_error, "malloc failed while creating segment: %s", strerror(errno));
 
-  if(-1 == JPT_log_replay(info))
-    goto fail;
+    return 0;
+  }
 
-  JPT_writer_leave(info);
+  memset(segment, 0, sizeof(struct JPT_segment));
 
-  TRACE((stderr, " = %p\n", info));
+  segment->id = __atomic_fetch_add(&info->next_segment_id, 1, __ATOMIC_RELAXED);
 
-  return info;
+  if(!(name = JPT_segment_name(info, segment->id)))
+  {
+    free(segment);
 
-fail:
+    return 0;
+  }
 
-  if(info->logfd != -1)
-    close(info->logfd);
+  if(-1 == (segment->fd = open(name, O_RDWR | O_CREAT | O_EXCL, 0600)))
+  {
+    asprintf(&JPT_last_error, "Failed to create `%s': %s", name, strerror(errno));
 
-  if(info->fd != -1)
-    close(info->fd);
+    free(name);
+    free(segment);
 
-  free(info);
+    return 0;
+  }
 
-  TRACE((stderr, " = 0 (%s)\n", jpt_last_error()));
+  free(name);
 
-  return 0;
+  return segment;
 }
 
 static void
-JPT_free_disktables(struct JPT_info* info)
+JPT_segment_unlink(struct JPT_info* info, const struct JPT_segment* segment)
 {
-  struct JPT_disktable* dt;
+  char* name;
 
-  dt = info->first_disktable;
+  if((name = JPT_segment_name(info, segment->id)))
+  {
+    unlink(name);
+    free(name);
+  }
+}
+
+/* Deletes a segment that never made it into the manifest */
+static void
+JPT_segment_discard(struct JPT_info* info, struct JPT_segment* segment)
+{
+  close(segment->fd);
+  JPT_segment_unlink(info, segment);
+  free(segment);
+}
+
+/* Closes the file of a segment no longer in use, and gives its part of the
+ * address range back, unless values returned by jpt_get_ref may point into
+ * it.  The range is not handed out again until the whole range is reset.
+ */
+static void
+JPT_segment_close(struct JPT_info* info, struct JPT_segment* segment)
+{
+  if(segment->mapped && info->map_reserved && !JPT_map_pinned(info))
+    mmap(info->map + segment->base, JPT_page_round(segment->size), PROT_NONE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+
+  close(segment->fd);
+  free(segment);
+}
+
+/* Gives the disktable in `segment' a part of the address range after all
+ * others.  Its offsets, which are relative to the segment's old base (0 for
+ * a new segment), are moved along.  The segment is mapped by the next
+ * JPT_update_map.
+ */
+static void
+JPT_segment_place(struct JPT_info* info, struct JPT_disktable* disktable,
+                  struct JPT_segment* segment)
+{
+  off_t delta = info->file_size - segment->base;
+
+  segment->size = lseek64(segment->fd, 0, SEEK_END);
+  segment->base = info->file_size;
+  segment->mapped = 0;
+
+  disktable->pat_offset += delta;
+  disktable->key_info_offset += delta;
+  disktable->offset += delta;
+  disktable->segment = segment;
+
+  info->file_size = JPT_page_round(segment->base + segment->size);
+}
+
+/* Replaces the manifest by one listing the segments of all disktables, but
+ * with the `count' disktables starting at the `first'th replaced by the
+ * `insert_count' segments in `insert', whose files are synced first.  The
+ * list of disktables is not changed.  Must be called with the writer lock
+ * held.
+ */
+static int
+JPT_manifest_commit(struct JPT_info* info, size_t first, size_t count,
+                    struct JPT_segment** insert, size_t insert_count,
+                    uint64_t flush_count)
+{
+  struct JPT_manifest_header header;
+  struct JPT_manifest_entry* entries;
+  struct JPT_disktable* disktable;
+  size_t i, j, n = 0;
+  char* newname;
+  int fd;
+
+  for(i = 0; i < insert_count; ++i)
+  {
+    if(-1 == fdatasync(insert[i]->fd))
+    {
+      asprintf(&JPT_last_error, "fdatasync failed on segment %llu: %s",
+               (unsigned long long) insert[i]->id, strerror(errno));
+
+      return -1;
+    }
+  }
+
+  if(!(entries = malloc((info->disktable_count + insert_count + 1) * sizeof(struct JPT_manifest_entry))))
+  {
+    asprintf(&JPT_last_error, "malloc failed while writing manifest: %s", strerror(errno));
+
+    return -1;
+  }
+
+  disktable = info->first_disktable;
+
+  for(i = 0; i <= info->disktable_count; ++i)
+  {
+    if(i == first)
+    {
+      for(j = 0; j < insert_count; ++j, ++n)
+      {
+        entries[n].id = insert[j]->id;
+        entries[n].start = insert[j]->start;
+      }
+    }
+
+    if(i == info->disktable_count)
+      break;
+
+    if(i < first || i >= first + count)
+    {
+      entries[n].id = disktable->segment->id;
+      entries[n].start = disktable->segment->start;
+      ++n;
+    }
+
+    disktable = disktable->next;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.signature, JPT_MANIFEST_SIGNATURE, 4);
+  header.version = JPT_MANIFEST_VERSION;
+  header.count = n;
+  header.flush_count = flush_count;
+  header.next_segment_id = __atomic_load_n(&info->next_segment_id, __ATOMIC_RELAXED);
+
+  newname = alloca(strlen(info->filename) + 5);
+  strcpy(newname, info->filename);
+  strcat(newname, ".new");
+
+  if(-1 == (fd = open(newname, O_RDWR | O_CREAT | O_TRUNC, 0600)))
+  {
+    asprintf(&JPT_last_error, "Failed to create `%s': %s", newname, strerror(errno));
+    free(entries);
+
+    return -1;
+  }
+
+  if(-1 == JPT_write_all(fd, &header, sizeof(header))
+  || -1 == JPT_write_all(fd, entries, n * sizeof(struct JPT_manifest_entry)))
+    goto fail;
+
+  if(-1 == fsync(fd))
+  {
+    asprintf(&JPT_last_error, "fsync failed on `%s': %s", newname, strerror(errno));
+
+    goto fail;
+  }
+
+  if(-1 == rename(newname, info->filename))
+  {
+    asprintf(&JPT_last_error, "Failed to rename `%s' to `%s': %s", newname, info->filename, strerror(errno));
+
+    goto fail;
+  }
+
+  free(entries);
+
+  /* The lock moves along with the name */
+  lseek64(fd, 0, SEEK_SET);
+  lockf(fd, F_TLOCK, INT_MAX);
+
+  close(info->fd);
+  info->fd = fd;
+
+  return 0;
+
+fail:
+
+  close(fd);
+  unlink(newname);
+  free(entries);
+
+  return -1;
+}
+
+/* Reads the manifest from `info->fd' if the table has the segmented layout.
+ * A new table is given an empty manifest if `flags' contains JPT_SEGMENTED.
+ * The entries are returned in `*entries', to be freed by the caller.
+ */
+static int
+JPT_manifest_read(struct JPT_info* info, int flags,
+                  struct JPT_manifest_entry** entries, size_t* count)
+{
+  struct JPT_manifest_header header;
+  off_t size;
+
+  if(-1 == (size = lseek64(info->fd, 0, SEEK_END)))
+  {
+    asprintf(&JPT_last_error, "lseek failed on `%s': %s", info->filename, strerror(errno));
+
+    return -1;
+  }
+
+  if(!size)
+  {
+    if(!(flags & JPT_SEGMENTED))
+      return 0;
+
+    info->segmented = 1;
+    info->next_segment_id = 1;
+
+    return JPT_manifest_commit(info, 0, 0, 0, 0, 0);
+  }
+
+  if(size < sizeof(header)
+  || sizeof(header) != pread64(info->fd, &header, sizeof(header), 0)
+  || memcmp(header.signature, JPT_MANIFEST_SIGNATURE, 4))
+    return 0;
+
+  if(header.version > JPT_MANIFEST_VERSION)
+  {
+    JPT_errno = JPT_EVERSION;
+    asprintf(&JPT_last_error, "Manifest version %u is not supported (maximum is %u)",
+             header.version, JPT_MANIFEST_VERSION);
+
+    return -1;
+  }
+
+  if(size != sizeof(header) + (off_t) header.count * sizeof(struct JPT_manifest_entry))
+  {
+    asprintf(&JPT_last_error, "Manifest `%s' has %llu bytes, expected %llu for %u segments",
+             info->filename, (unsigned long long) size,
+             (unsigned long long) (sizeof(header) + (off_t) header.count * sizeof(struct JPT_manifest_entry)),
+             header.count);
+    errno = EINVAL;
+
+    return -1;
+  }
+
+  if(!(*entries = malloc((header.count + 1) * sizeof(struct JPT_manifest_entry))))
+  {
+    asprintf(&JPT_last_error, "malloc failed while reading manifest: %s", strerror(errno));
+
+    return -1;
+  }
+
+  *count = header.count;
+
+  if(-1 == lseek64(info->fd, sizeof(header), SEEK_SET)
+  || -1 == JPT_read_all(info->fd, *entries, header.count * sizeof(struct JPT_manifest_entry)))
+    return -1;
+
+  info->segmented = 1;
+  info->flush_count = header.flush_count;
+  info->next_segment_id = header.next_segment_id;
+
+  return 0;
+}
+
+/* The header of a disktable, which follows its signature.  Disktables
+ * older than version 10 lack the bloom filter parameters, and those older
+ * than version 12 the column count.  The index of the table file holds one
+ * of these for each disktable, with `offset' set to that of its
+ * signature.
+ */
+struct JPT_disktable_header
+{
+  uint64_t offset;
+  uint32_t version;
+  uint32_t row_count;
+  uint32_t data_size;
+  uint32_t bloom_size;
+  uint32_t bloom_hashes;
+  uint32_t column_count;
+};
+
+/* Returns the size of the header of a disktable of format `version',
+ * including the signature.
+ */
+static off_t
+JPT_disktable_header_size(uint32_t version)
+{
+  return 4 + 3 * sizeof(uint32_t)
+       + ((version >= 10) ? 2 * sizeof(uint32_t) : 0)
+       + ((version >= 12) ? sizeof(uint32_t) : 0);
+}
+
+/* Sets up `disktable' from its header, for a file `size' bytes long that
+ * holds the table's address range from `base' on.  Nothing is read; see
+ * JPT_disktable_prepare.  Returns -1 if the header does not describe a
+ * disktable inside the file.
+ */
+static int
+JPT_disktable_init(struct JPT_info* info, struct JPT_disktable* disktable,
+                   const struct JPT_disktable_header* header, off_t base, off_t size)
+{
+  uint64_t end;
+
+  disktable->version = header->version;
+  disktable->key_fingerprints = (header->version >= 13);
+  disktable->key_info_count = header->row_count;
+  disktable->data_size = header->data_size;
+  disktable->removed_count = 0;
+  disktable->merging = 0;
+
+  if(header->version >= 10)
+  {
+    disktable->bloom_size = header->bloom_size;
+    disktable->bloom_hashes = header->bloom_hashes;
+    disktable->bloom_blocked = (header->version >= 11);
+
+    if(!disktable->bloom_hashes || disktable->bloom_size > JPT_BLOOM_MAX_SIZE
+    || disktable->bloom_size > size
+    || (disktable->bloom_blocked
+        && (disktable->bloom_hashes != JPT_BLOOM_BLOCK_WORDS
+            || !disktable->bloom_size || disktable->bloom_size % JPT_BLOOM_BLOCK_SIZE)))
+    {
+      asprintf(&JPT_last_error, "Invalid bloom filter parameters at offset 0x%llx", (long long) header->offset);
+
+      return -1;
+    }
+  }
+  else
+  {
+    disktable->bloom_size = 4 * 8192;
+    disktable->bloom_hashes = 0;
+    disktable->bloom_blocked = 0;
+  }
+
+  disktable->columns = 0;
+  disktable->column_count = (header->version >= 12) ? header->column_count : 0;
+
+  if(disktable->column_count > header->row_count)
+  {
+    asprintf(&JPT_last_error, "Invalid column count %u at offset 0x%llx", disktable->column_count, (long long) header->offset);
+
+    return -1;
+  }
+
+  /* The trie has a node for each key, and is followed by the key infos */
+  disktable->pat_offset = header->offset + JPT_disktable_header_size(header->version)
+                        + disktable->bloom_size;
+  disktable->key_info_offset = disktable->pat_offset + patricia_size(header->row_count);
+  disktable->offset = disktable->key_info_offset + (off_t) header->row_count * sizeof(struct JPT_key_info);
+
+  end = disktable->offset + disktable->data_size
+      + (uint64_t) disktable->column_count * sizeof(struct JPT_disktable_column);
+
+  if(header->offset < base || end > (uint64_t) base + size)
+  {
+    asprintf(&JPT_last_error, "Disktable at offset 0x%llx ends past the end of its file", (long long) header->offset);
+
+    return -1;
+  }
+
+  if(!info->map_size)
+    disktable->key_infos_mapped = 0;
+  else
+  {
+    disktable->key_infos = (struct JPT_key_info*) (info->map + disktable->key_info_offset);
+    disktable->key_infos_mapped = 1;
+  }
+
+  disktable->info = info;
+
+  return 0;
+}
+
+/* Allocates the bloom filter and trie of a disktable set up by
+ * JPT_disktable_init, and leaves them and the column directory to be read
+ * by JPT_disktable_load_lazy.  The bloom filter is allocated here, so that
+ * the array probed by JPT_bloom_probe can point to it.
+ */
+static int
+JPT_disktable_prepare(struct JPT_info* info, struct JPT_disktable* disktable)
+{
+  if(0 != (errno = posix_memalign((void**) &disktable->bloom_filter, JPT_BLOOM_BLOCK_SIZE, disktable->bloom_size)))
+  {
+    asprintf(&JPT_last_error, "posix_memalign failed while allocating %zu byte bloom filter: %s",
+             (size_t) disktable->bloom_size, strerror(errno));
+    disktable->bloom_filter = 0;
+
+    return -1;
+  }
+
+  if(!(disktable->pat = patricia_create(0, 0)))
+  {
+    asprintf(&JPT_last_error, "malloc failed while allocating trie: %s", strerror(errno));
+
+    return -1;
+  }
+
+  disktable->pat_mapped = 0;
+  disktable->lazy = JPT_LAZY_BLOOM | JPT_LAZY_TRIE;
+
+  if(disktable->version >= 12)
+    disktable->lazy |= JPT_LAZY_COLUMNS;
+
+  ++info->lazy_bloom_count;
+
+  JPT_disktable_advise(info, disktable);
+
+  return 0;
+}
+
+/* Reads the parts of a disktable given by `parts' that have not been read
+ * yet.  Readers may call this concurrently; each part is read once, and
+ * used only after its flag in `lazy' has been cleared.
+ */
+int
+JPT_disktable_load_lazy(struct JPT_disktable* disktable, int parts)
+{
+  struct JPT_info* info = disktable->info;
+  off_t offset;
+  ssize_t pat_size;
+  int fd, loaded = 0, result = -1;
+
+  pthread_mutex_lock(&info->lazy_mutex);
+
+  parts &= disktable->lazy;
+
+  if(parts & JPT_LAZY_BLOOM)
+  {
+    offset = disktable->pat_offset - disktable->bloom_size;
+    fd = JPT_disktable_fd(disktable, &offset);
+
+    if(-1 == JPT_pread_all(fd, disktable->bloom_filter, disktable->bloom_size, offset))
+      goto done;
+
+    loaded |= JPT_LAZY_BLOOM;
+  }
+
+  if(parts & JPT_LAZY_TRIE)
+  {
+    if(info->map_size)
+    {
+      pat_size = patricia_remap(disktable->pat, info->map + disktable->pat_offset);
+      disktable->pat_mapped = 1;
+    }
+    else
+    {
+      offset = disktable->pat_offset;
+      fd = JPT_disktable_fd(disktable, &offset);
+
+      if(-1 == (pat_size = patricia_pread(disktable->pat, fd, offset)))
+      {
+        asprintf(&JPT_last_error, "Failed to read PATRICIA trie at offset 0x%llx", (long long) disktable->pat_offset);
+
+        goto done;
+      }
+    }
+
+    if(pat_size != disktable->key_info_offset - disktable->pat_offset)
+    {
+      asprintf(&JPT_last_error, "Invalid PATRICIA trie at offset 0x%llx", (long long) disktable->pat_offset);
+
+      goto done;
+    }
+
+    loaded |= JPT_LAZY_TRIE;
+  }
+
+  if(parts & JPT_LAZY_COLUMNS)
+  {
+    offset = disktable->offset + disktable->data_size;
+    fd = JPT_disktable_fd(disktable, &offset);
+
+    if(-1 == JPT_disktable_read_columns(disktable, fd, offset))
+      goto done;
+
+    loaded |= JPT_LAZY_COLUMNS;
+  }
+
+  result = 0;
+
+done:
+
+  __atomic_and_fetch(&disktable->lazy, ~loaded, __ATOMIC_RELEASE);
+
+  if(loaded & JPT_LAZY_BLOOM)
+    __atomic_sub_fetch(&info->lazy_bloom_count, 1, __ATOMIC_RELEASE);
+
+  pthread_mutex_unlock(&info->lazy_mutex);
+
+  return result;
+}
+
+/* Reads the header of the disktable whose signature was just read from
+ * `fd' into `disktable', and leaves `fd' at the end of the disktable.  `fd'
+ * holds the table's address range from `base' on, and is `size' bytes long.
+ * The rest of the disktable is read when first needed, or right away if
+ * jpt_init was given JPT_RECOVER or JPT_LOCK_INDEX.  Damaged data and I/O
+ * errors jump to `io_error', so that jpt_init can offer recovery; other
+ * errors return -1.
+ */
+static int
+JPT_disktable_load(struct JPT_info* info, struct JPT_disktable* disktable,
+                   int fd, off_t base, off_t size, jmp_buf io_error)
+{
+  struct JPT_disktable_header header;
+  off_t end;
+
+  memset(&header, 0, sizeof(header));
+
+  header.offset = base + lseek64(fd, 0, SEEK_CUR) - 4;
+
+  if(sizeof(uint32_t) != JPT_read_all(fd, &header.version, sizeof(uint32_t)))
+    longjmp(io_error, 1);
+
+  if(header.version > JPT_VERSION)
+  {
+    JPT_errno = JPT_EVERSION;
+    asprintf(&JPT_last_error, "Table version %u is not supported (maximum is %u)", header.version, JPT_VERSION);
+
+    return -1;
+  }
+
+  if(-1 == JPT_read_all(fd, &header.row_count, sizeof(uint32_t))
+  || -1 == JPT_read_all(fd, &header.data_size, sizeof(uint32_t)))
+    longjmp(io_error, 1);
+
+  if(header.version < 8)
+  {
+    JPT_errno = JPT_EVERSION;
+    asprintf(&JPT_last_error, "Table version %u is too old.  Use jpt-control backup/restore", header.version);
+
+    return -1;
+  }
+
+  if(header.version >= 10
+  && (-1 == JPT_read_all(fd, &header.bloom_size, sizeof(uint32_t))
+      || -1 == JPT_read_all(fd, &header.bloom_hashes, sizeof(uint32_t))))
+    longjmp(io_error, 1);
+
+  if(header.version >= 12
+  && -1 == JPT_read_all(fd, &header.column_count, sizeof(uint32_t)))
+    longjmp(io_error, 1);
+
+  if(-1 == JPT_disktable_init(info, disktable, &header, base, size))
+    longjmp(io_error, 1);
+
+  if(-1 == JPT_disktable_prepare(info, disktable))
+    return -1;
+
+  if((info->flags & (JPT_RECOVER | JPT_LOCK_INDEX))
+  && -1 == JPT_disktable_load_lazy(disktable, JPT_LAZY_ALL))
+  {
+    if(disktable->lazy & JPT_LAZY_BLOOM)
+      --info->lazy_bloom_count;
+
+    longjmp(io_error, 1);
+  }
+
+  end = disktable->offset + disktable->data_size
+      + (off_t) disktable->column_count * sizeof(struct JPT_disktable_column);
+
+  if(-1 == JPT_lseek(fd, end - base, SEEK_SET, size))
+    longjmp(io_error, 1);
+
+  return 0;
+}
+
+/* Opens the segments listed in the manifest and reads their disktables.
+ * Every segment is mapped before any disktable is read, so that the tries
+ * are used in place.
+ */
+static int
+JPT_segments_load(struct JPT_info* info, const struct JPT_manifest_entry* entries,
+                  size_t count, jmp_buf io_error)
+{
+  struct JPT_disktable* disktable;
+  struct JPT_segment* segment;
+  char signature[4];
+  char* name;
+  size_t i;
+
+  for(i = 0; i < count; ++i)
+  {
+    disktable = malloc(sizeof(struct JPT_disktable));
+    segment = malloc(sizeof(struct JPT_segment));
+
+    if(!disktable || !segment)
+    {
+      asprintf(&JPT_last_error, "malloc failed while opening segments: %s", strerror(errno));
+      free(segment);
+      free(disktable);
+
+      return -1;
+    }
+
+    memset(disktable, 0, sizeof(struct JPT_disktable));
+    memset(segment, 0, sizeof(struct JPT_segment));
+
+    segment->id = entries[i].id;
+    segment->start = entries[i].start;
+
+    if(!(name = JPT_segment_name(info, segment->id)))
+    {
+      free(segment);
+      free(disktable);
+
+      return -1;
+    }
+
+    if(-1 == (segment->fd = open(name, O_RDWR)))
+    {
+      asprintf(&JPT_last_error, "Failed to open `%s': %s", name, strerror(errno));
+      free(name);
+      free(segment);
+      free(disktable);
+
+      return -1;
+    }
+
+    free(name);
+
+    segment->size = lseek64(segment->fd, 0, SEEK_END);
+
+    if(segment->start >= segment->size)
+    {
+      asprintf(&JPT_last_error, "Segment %llu is truncated", (unsigned long long) segment->id);
+      close(segment->fd);
+      free(segment);
+      free(disktable);
+      errno = EINVAL;
+
+      return -1;
+    }
+
+    segment->base = info->file_size;
+    info->file_size = JPT_page_round(segment->base + segment->size);
+
+    disktable->segment = segment;
+    disktable->info = info;
+
+    if(!info->first_disktable)
+      info->first_disktable = disktable;
+    else
+      info->last_disktable->next = disktable;
+
+    info->last_disktable = disktable;
+    ++info->disktable_count;
+  }
+
+  JPT_update_map(info);
+
+  for(disktable = info->first_disktable; disktable; disktable = disktable->next)
+  {
+    segment = disktable->segment;
+
+    if(-1 == lseek64(segment->fd, segment->start, SEEK_SET)
+    || -1 == JPT_read_all(segment->fd, signature, 4))
+      longjmp(io_error, 1);
+
+    if(memcmp(signature, JPT_SIGNATURE, 4))
+    {
+      asprintf(&JPT_last_error, "Segment %llu is corrupt (found %.*s, expected %s)",
+               (unsigned long long) segment->id, 4, signature, JPT_SIGNATURE);
+
+      return -1;
+    }
+
+    if(-1 == JPT_disktable_load(info, disktable, segment->fd, segment->base, segment->size, io_error))
+      return -1;
+  }
+
+  return 0;
+}
+
+/* Deletes the segment files the manifest does not list.  These are left
+ * behind by a crash between writing a segment and listing it, or between
+ * dropping a segment from the manifest and deleting its file.
+ */
+static void
+JPT_segments_clean(struct JPT_info* info)
+{
+  struct JPT_disktable* disktable;
+  struct dirent* entry;
+  const char* base;
+  char* dirname;
+  char* end;
+  size_t base_length;
+  uint64_t id;
+  DIR* dir;
+
+  if((base = strrchr(info->filename, '/')))
+  {
+    dirname = strndupa(info->filename, base - info->filename + 1);
+    ++base;
+  }
+  else
+  {
+    dirname = ".";
+    base = info->filename;
+  }
+
+  base_length = strlen(base);
+
+  if(!(dir = opendir(dirname)))
+    return;
+
+  while((entry = readdir(dir)))
+  {
+    if(strncmp(entry->d_name, base, base_length)
+    || entry->d_name[base_length] != '.'
+    || !isdigit((unsigned char) entry->d_name[base_length + 1]))
+      continue;
+
+    id = strtoull(entry->d_name + base_length + 1, &end, 10);
+
+    if(*end)
+      continue;
+
+    for(disktable = info->first_disktable; disktable; disktable = disktable->next)
+    {
+      if(disktable->segment->id == id)
+        break;
+    }
+
+    if(!disktable)
+      unlinkat(dirfd(dir), entry->d_name, 0);
+  }
+
+  closedir(dir);
+}
+
+/* The index of the disktables of a table file with the monolithic layout.
+ * It is a region with JPT_SKIP_SIGNATURE, so that jpt_init skips it when it
+ * reads the file from the start, holding this header and a
+ * JPT_disktable_header for each disktable, in order.  The region ends with a
+ * JPT_index_trailer, which jpt_init looks for at the end of the file.  An
+ * index is current only while the file ends with it.
+ */
+struct JPT_index_header
+{
+  char signature[4];
+  uint32_t version;
+  uint32_t count;
+  uint32_t reserved;
+};
+
+struct JPT_index_trailer
+{
+  uint64_t start; /* Offset of the region */
+  char signature[4];
+  uint32_t count;
+};
+
+/* Sets up the disktables from the index at the end of the table file, if
+ * there is one, reading nothing else.  Returns 1 if the index was used, 0
+ * if the file has no usable index, and -1 on error.
+ */
+static int
+JPT_index_read(struct JPT_info* info)
+{
+  struct JPT_index_trailer trailer;
+  struct JPT_merge_header* region;
+  struct JPT_index_header* header;
+  struct JPT_disktable_header* entries;
+  struct JPT_disktable* disktable;
+  struct JPT_disktable tmp;
+  size_t i, size;
+  char* buffer;
+
+  if(info->file_size < (off_t) sizeof(trailer)
+  || sizeof(trailer) != pread64(info->fd, &trailer, sizeof(trailer), info->file_size - sizeof(trailer))
+  || memcmp(trailer.signature, JPT_INDEX_SIGNATURE, 4))
+    return 0;
+
+  size = sizeof(struct JPT_merge_header) + sizeof(struct JPT_index_header)
+       + (size_t) trailer.count * sizeof(struct JPT_disktable_header) + sizeof(trailer);
+
+  if(trailer.start != info->file_size - size)
+    return 0;
+
+  if(!(buffer = malloc(size)))
+  {
+    asprintf(&JPT_last_error, "malloc failed while reading %zu byte index: %s", size, strerror(errno));
+
+    return -1;
+  }
+
+  region = (struct JPT_merge_header*) buffer;
+  header = (struct JPT_index_header*) (region + 1);
+  entries = (struct JPT_disktable_header*) (header + 1);
+
+  if(size != pread64(info->fd, buffer, size, trailer.start)
+  || memcmp(region->signature, JPT_SKIP_SIGNATURE, 4) || region->size != size
+  || memcmp(header->signature, JPT_INDEX_SIGNATURE, 4) || header->version != JPT_INDEX_VERSION
+  || header->count != trailer.count)
+  {
+    free(buffer);
+
+    return 0;
+  }
+
+  /* A damaged index is ignored, and the file read from the start instead */
+  for(i = 0; i < header->count; ++i)
+  {
+    memset(&tmp, 0, sizeof(tmp));
+
+    if(entries[i].version < 8 || entries[i].version > JPT_VERSION
+    || -1 == JPT_disktable_init(info, &tmp, &entries[i], 0, trailer.start))
+    {
+      free(buffer);
+
+      return 0;
+    }
+  }
+
+  for(i = 0; i < header->count; ++i)
+  {
+    if(!(disktable = malloc(sizeof(struct JPT_disktable))))
+    {
+      asprintf(&JPT_last_error, "malloc failed while reading index: %s", strerror(errno));
+      free(buffer);
+
+      return -1;
+    }
+
+    memset(disktable, 0, sizeof(struct JPT_disktable));
+
+    JPT_disktable_init(info, disktable, &entries[i], 0, trailer.start);
+
+    if(-1 == JPT_disktable_prepare(info, disktable))
+    {
+      free(disktable->bloom_filter);
+      free(disktable);
+      free(buffer);
+
+      return -1;
+    }
+
+    if(!info->first_disktable)
+      info->first_disktable = disktable;
+    else
+      info->last_disktable->next = disktable;
+
+    info->last_disktable = disktable;
+    ++info->disktable_count;
+
+    if((info->flags & JPT_LOCK_INDEX) && -1 == JPT_disktable_load_lazy(disktable, JPT_LAZY_ALL))
+    {
+      free(buffer);
+
+      return -1;
+    }
+  }
+
+  free(buffer);
+
+  info->index_end = info->file_size;
+
+  return 1;
+}
+
+/* Appends an index of the disktables to the table file, so that the next
+ * jpt_init need not read their headers, unless the file already ends with a
+ * current index.  Anything appended later hides the index, which is then
+ * skipped like any other region with JPT_SKIP_SIGNATURE.  Failures are
+ * ignored, since jpt_init can do without the index.  Must be called with
+ * the writer lock held, with no memtable being flushed.
+ */
+static void
+JPT_index_write(struct JPT_info* info)
+{
+  struct JPT_merge_header* region;
+  struct JPT_index_header* header;
+  struct JPT_disktable_header* entry;
+  struct JPT_index_trailer* trailer;
+  struct JPT_disktable* disktable;
+  off_t end;
+  size_t size;
+  char* buffer;
+
+  if(info->segmented || !info->disktable_count)
+    return;
+
+  if(-1 == (end = lseek64(info->fd, 0, SEEK_END)) || end == info->index_end)
+    return;
+
+  size = sizeof(struct JPT_merge_header) + sizeof(struct JPT_index_header)
+       + info->disktable_count * sizeof(struct JPT_disktable_header) + sizeof(struct JPT_index_trailer);
+
+  if(!(buffer = malloc(size)))
+    return;
+
+  memset(buffer, 0, size);
+
+  region = (struct JPT_merge_header*) buffer;
+  header = (struct JPT_index_header*) (region + 1);
+  entry = (struct JPT_disktable_header*) (header + 1);
+  trailer = (struct JPT_index_trailer*) (entry + info->disktable_count);
+
+  memcpy(region->signature, JPT_SKIP_SIGNATURE, 4);
+  region->size = size;
+
+  memcpy(header->signature, JPT_INDEX_SIGNATURE, 4);
+  header->version = JPT_INDEX_VERSION;
+  header->count = info->disktable_count;
+
+  for(disktable = info->first_disktable; disktable; disktable = disktable->next, ++entry)
+  {
+    entry->offset = disktable->pat_offset - disktable->bloom_size
+                  - JPT_disktable_header_size(disktable->version);
+    entry->version = disktable->version;
+    entry->row_count = disktable->key_info_count;
+    entry->data_size = disktable->data_size;
+    entry->bloom_size = disktable->bloom_size;
+    entry->bloom_hashes = disktable->bloom_hashes;
+    entry->column_count = disktable->column_count;
+  }
+
+  trailer->start = end;
+  memcpy(trailer->signature, JPT_INDEX_SIGNATURE, 4);
+  trailer->count = info->disktable_count;
+
+  if(-1 == JPT_pwrite_all(info->fd, buffer, size, end)
+  || ((info->flags & JPT_SYNC) && -1 == fdatasync(info->fd)))
+  {
+    ftruncate(info->fd, end);
+    free(buffer);
+
+    return;
+  }
+
+  free(buffer);
+
+  /* The log would have the index truncated away as part of an unfinished
+   * flush */
+  if(!info->logfile_empty && -1 == JPT_log_write_header(info, end + size))
+    return;
+
+  info->index_end = end + size;
+}
+
+struct JPT_info*
+jpt_init(const char* filename, size_t buffer_size, int flags)
+{
+  return jpt_init_cache(filename, buffer_size, JPT_CACHE_DEFAULT_SIZE, flags);
+}
+
+struct JPT_info*
+jpt_init_cache(const char* filename, size_t buffer_size, size_t cache_size,
+               int flags)
+{
+  jmp_buf io_error;
+  struct JPT_info* info = 0;
+  struct JPT_disktable* disktable;
+  struct JPT_merge_header merge_header;
+  uint32_t merge_first = 0, merge_count = 0;
+  off_t merge_end = 0;
+  struct JPT_manifest_entry* entries = 0;
+  size_t entry_count = 0;
+  char signature[4];
+  int res;
+  off_t offset;
+  /* Set before longjmp(io_error), so it must not be kept in a register */
+  volatile int recover = flags & JPT_RECOVER;
+
+  assert(sizeof(off_t) == 8);
+
+  TRACE((stderr, "jpt_init(%s, %zu)", filename, buffer_size));
+
+  JPT_clear_error();
+
+  info = malloc(sizeof(struct JPT_info));
+
+  if(!info)
+    goto fail;
+
+  memset(info, 0, sizeof(struct JPT_info));
+
+  info->flags = flags;
+  info->bloom_bits = JPT_BLOOM_DEFAULT_BITS;
+  info->compaction_policy = JPT_default_compaction_policy;
+  info->logfd = -1;
+  info->frozen_logfd = -1;
+  pthread_mutex_init(&info->map_ref_mutex, 0);
+
+  if(1 > (long) (info->major_compact_threads = sysconf(_SC_NPROCESSORS_ONLN)))
+    info->major_compact_threads = 1;
+
+  if(cache_size && !(info->cache = JPT_cache_create(cache_size)))
+    goto fail;
+
+  if((flags & JPT_ASYNC_READ) && !(info->aio = JPT_aio_create()))
+    goto fail;
+
+  info->fd = open(filename, O_RDWR | O_CREAT, 0600);
+
+  if(-1 == lockf(info->fd, F_TLOCK, INT_MAX))
+    goto fail;
+
+  if(info->fd == -1)
+    goto fail;
+
+  if(!(info->filename = strdup(filename)))
+    goto fail;
+
+  if(-1 == JPT_manifest_read(info, flags, &entries, &entry_count))
+    goto fail;
+
+  if(-1 == asprintf(&info->logname, "%s.log", filename))
+    goto fail;
+
+  if(-1 == asprintf(&info->frozen_logname, "%s.log.frozen", filename))
+    goto fail;
+
+  info->logfd = open(info->logname, O_RDWR | O_CREAT, 0600);
+
+  if(info->logfd == -1)
+    goto fail;
+
+  if(-1 == lockf(info->logfd, F_TLOCK, INT_MAX))
+    goto fail;
+
+  info->logbuf_fill = 0;
+
+  if(-1 == JPT_log_open_frozen(info))
+    goto fail;
+
+  JPT_update_map(info);
+
+  if(-1 == JPT_log_truncate_table(info, (info->frozen_logfd != -1) ? info->frozen_logfd : info->logfd))
+    goto fail;
+
+  JPT_update_map(info);
+
+  pthread_rwlock_init(&info->rw_lock, 0);
+  pthread_rwlock_init(&info->splay_lock, 0);
+  pthread_mutex_init(&info->column_hash_mutex, 0);
+  pthread_mutex_init(&info->lazy_mutex, 0);
+  pthread_mutex_init(&info->log_mutex, 0);
+  pthread_cond_init(&info->log_cond, 0);
+  pthread_cond_init(&info->log_thread_cond, 0);
+  pthread_mutex_init(&info->flush_mutex, 0);
+  pthread_cond_init(&info->flush_cond, 0);
+  pthread_mutex_init(&info->compaction_mutex, 0);
+  pthread_cond_init(&info->compaction_cond, 0);
+  pthread_mutex_init(&info->major_compact_mutex, 0);
+
+  JPT_writer_enter(info);
+
+  if(info->segmented)
+  {
+    if(setjmp(io_error))
+      goto fail;
+
+    if(-1 == JPT_segments_load(info, entries, entry_count, io_error))
+      goto fail;
+
+    JPT_segments_clean(info);
+  }
+  else
+  {
+    /* A table being recovered is read from the start, and checked */
+    if(!(flags & JPT_RECOVER) && -1 == JPT_index_read(info))
+      goto fail;
+
+    lseek64(info->fd, 0, SEEK_SET);
+  }
+
+  while(!info->segmented && !info->index_end)
+  {
+    offset = lseek64(info->fd, 0, SEEK_CUR);
+
+    if(setjmp(io_error))
+    {
+      if(recover)
+      {
+        if(-1 == JPT_lseek(info->fd, offset, SEEK_SET, info->file_size))
+          goto fail;
+
+        if(-1 == ftruncate(info->fd, offset))
+          goto fail;
+
+        break;
+      }
+
+      char* prev_error = strdupa(jpt_last_error());
+      free(JPT_last_error);
+      asprintf(&JPT_last_error, "%s.  Run `jpt-control %s recover' to truncate offending data", prev_error, filename);
+
+      goto fail;
+    }
+
+    res = read(info->fd, signature, 4);
+
+    if(res < sizeof(uint32_t))
+    {
+      if(res == -1)
+        longjmp(io_error, 1);
+
+      break;
+    }
+
+    if(!memcmp(signature, JPT_PARTIAL_WRITE, 4))
+    {
+      recover = 1;
+
+      longjmp(io_error, 1);
+    }
+
+    if(!memcmp(signature, JPT_SKIP_SIGNATURE, 4) || !memcmp(signature, JPT_MERGE_SIGNATURE, 4))
+    {
+      memcpy(merge_header.signature, signature, 4);
+
+      if(-1 == JPT_read_all(info->fd, (char*) &merge_header + 4, sizeof(merge_header) - 4))
+        longjmp(io_error, 1);
+
+      /* The region was being reserved when the table was last used */
+      if(merge_header.size < sizeof(merge_header) || merge_header.size > info->file_size - offset)
+      {
+        asprintf(&JPT_last_error, "Merge region at offset 0x%llx is incomplete", (long long) offset);
+        recover = 1;
+
+        longjmp(io_error, 1);
+      }
+
+      if(!memcmp(signature, JPT_SKIP_SIGNATURE, 4))
+      {
+        if(-1 == JPT_lseek(info->fd, offset + merge_header.size, SEEK_SET, info->file_size))
+          longjmp(io_error, 1);
+
+        continue;
+      }
+
+      if(!merge_header.count || merge_header.first > info->disktable_count
+      || merge_header.count > info->disktable_count - merge_header.first
+      || merge_header.table_offset < offset + sizeof(merge_header)
+      || merge_header.table_offset >= offset + merge_header.size)
+      {
+        asprintf(&JPT_last_error, "Invalid merge region at offset 0x%llx", (long long) offset);
+
+        longjmp(io_error, 1);
+      }
+
+      /* The merged disktable replaces its sources once it has been read */
+      merge_first = merge_header.first;
+      merge_count = merge_header.count;
+      merge_end = offset + merge_header.size;
+
+      if(-1 == JPT_lseek(info->fd, merge_header.table_offset, SEEK_SET, info->file_size))
+        longjmp(io_error, 1);
+
+      continue;
+    }
+
+    if(memcmp(signature, JPT_SIGNATURE, 4))
+    {
+      if(recover)
+        longjmp(io_error, 1);
+      else
+      {
+        asprintf(&JPT_last_error, "Database corrupt at offset 0x%llx (found %.*s, expected %s).  Run `jpt-control %s recover'", (long long) offset, 4, signature, JPT_SIGNATURE, filename);
+
+        goto fail;
+      }
+    }
+
+    if(!(disktable = malloc(sizeof(struct JPT_disktable))))
+    {
+      asprintf(&JPT_last_error, "malloc failed while reading disktable: %s", strerror(errno));
+
+      goto fail;
+    }
+
+    memset(disktable, 0, sizeof(struct JPT_disktable));
+
+    if(-1 == JPT_disktable_load(info, disktable, info->fd, 0, info->file_size, io_error))
+      goto fail;
+
+    if(merge_count)
+    {
+      JPT_disktables_replace(info, merge_first, merge_count, disktable);
+      merge_count = 0;
+
+      if(-1 == JPT_lseek(info->fd, merge_end, SEEK_SET, info->file_size))
+        longjmp(io_error, 1);
+
+      continue;
+    }
+
+    if(!info->first_disktable)
+    {
+      info->first_disktable = disktable;
+      info->last_disktable = disktable;
+    }
+    else
+    {
+      info->last_disktable->next = disktable;
+      info->last_disktable = disktable;
+    }
+
+    ++info->disktable_count;
+  }
+
+  if(-1 == JPT_bloom_refs_reserve(info, info->disktable_count))
+    goto fail;
+
+  JPT_bloom_refs_update(info);
+
+  info->buffer_size = buffer_size;
+
+  if(!(info->memtable = JPT_memtable_create(info)))
+    goto fail;
+
+  info->column_count = 128;
+  info->columns = malloc(info->column_count * sizeof(struct JPT_column));
+  memset(info->columns, 0, info->column_count * sizeof(struct JPT_column));
+
+  /* `next_column' is read when the first column is created, so that opening
+   * the table does not read the bloom filter of every disktable */
+  info->next_column = 0;
+
+  if(info->frozen_logfd != -1 && -1 == JPT_log_replay_frozen(info))
+    goto fail;
+
+  if(-1 == JPT_log_replay(info, info->logfd))
+    goto fail;
+
+  if(info->manifest_stale && -1 == JPT_compact(info))
+    goto fail;
+
+  free(entries);
+  entries = 0;
+
+  if((flags & JPT_DELAY_LOG) && -1 == jpt_set_log_delay(info, JPT_LOG_DELAY_MSEC, JPT_LOG_DELAY_BYTES))
+    goto fail;
+
+  if((flags & JPT_AUTO_COMPACT) && -1 == JPT_compaction_start(info))
+    goto fail;
+
+  JPT_writer_leave(info);
+
+  TRACE((stderr, " = %p\n", info));
+
+  return info;
+
+fail:
+
+  JPT_log_thread_stop(info);
+
+  if(info->frozen_logfd != -1)
+    close(info->frozen_logfd);
+
+  if(info->logfd != -1)
+    close(info->logfd);
+
+  if(info->fd != -1)
+    close(info->fd);
+
+  JPT_memtable_destroy(info->memtable);
+  JPT_cache_destroy(info->cache);
+  JPT_aio_destroy(info->aio);
+  free(info->bloom_refs);
+  free(info->log_group);
+  free(info->log_spare);
+  free(info->frozen_logname);
+  free(info->logname);
+  free(info->filename);
+  free(info);
+  free(entries);
+
+  TRACE((stderr, " = 0 (%s)\n", jpt_last_error()));
+
+  return 0;
+}
+
+static void
+JPT_free_disktables(struct JPT_info* info)
+{
+  struct JPT_disktable* dt;
+
+  dt = info->first_disktable;
+
+  while(dt)
+  {
+    struct JPT_disktable* tmp = dt;
+    dt = dt->next;
+
+    patricia_destroy(tmp->pat);
+
+    if(info->flags & JPT_LOCK_INDEX)
+      munlock(tmp->bloom_filter, tmp->bloom_size);
+
+    if(tmp->segment)
+    {
+      close(tmp->segment->fd);
+      free(tmp->segment);
+    }
+
+    free(tmp->columns);
+    free(tmp->bloom_filter);
+    free(tmp);
+  }
+
+  info->first_disktable = 0;
+  info->last_disktable = 0;
+}
+
+static void
+JPT_disktable_free(struct JPT_disktable* disktable)
+{
+  if(disktable->lazy & JPT_LAZY_BLOOM)
+    __atomic_sub_fetch(&disktable->info->lazy_bloom_count, 1, __ATOMIC_RELEASE);
+
+  patricia_destroy(disktable->pat);
+
+  if(disktable->info->flags & JPT_LOCK_INDEX)
+    munlock(disktable->bloom_filter, disktable->bloom_size);
+
+  if(disktable->segment)
+    JPT_segment_close(disktable->info, disktable->segment);
+
+  free(disktable->columns);
+  free(disktable->bloom_filter);
+  free(disktable);
+}
+
+/* Replaces the `count' disktables starting with the `first'th by `disktable',
+ * which must not be in the list.  The bloom filter index must be updated
+ * afterwards.
+ */
+static void
+JPT_disktables_replace(struct JPT_info* info, size_t first, size_t count,
+                       struct JPT_disktable* disktable)
+{
+  struct JPT_disktable** prev = &info->first_disktable;
+  struct JPT_disktable* old;
+  size_t i;
+
+  assert(count && first + count <= info->disktable_count);
+
+  for(i = 0; i < first; ++i)
+    prev = &(*prev)->next;
+
+  for(i = 0; i < count; ++i)
+  {
+    old = *prev;
+    *prev = old->next;
+
+    JPT_disktable_free(old);
+  }
+
+  disktable->next = *prev;
+  *prev = disktable;
+
+  if(!disktable->next)
+    info->last_disktable = disktable;
+
+  info->disktable_count -= count - 1;
+}
+
+/* Appends an empty entry for column `columnidx', starting at key `first', to
+ * the column directory of a disktable being written.  `*alloc' is the number
+ * of entries allocated.
+ */
+static int
+JPT_disktable_column_begin(struct JPT_disktable* disktable, size_t* alloc,
+                           uint32_t columnidx, uint32_t first)
+{
+  struct JPT_disktable_column* column;
+
+  if(disktable->column_count == *alloc)
+  {
+    size_t new_alloc = *alloc ? *alloc * 2 : 16;
+    struct JPT_disktable_column* new_columns;
+
+    if(!(new_columns = realloc(disktable->columns, new_alloc * sizeof(struct JPT_disktable_column))))
+    {
+      asprintf(&JPT_last_error, "realloc failed while growing column directory to %zu entries: %s",
+               new_alloc, strerror(errno));
+
+      return -1;
+    }
+
+    disktable->columns = new_columns;
+    *alloc = new_alloc;
+  }
+
+  column = &disktable->columns[disktable->column_count++];
+  column->columnidx = columnidx;
+  column->first = first;
+  column->count = 0;
+
+  return 0;
+}
+
+/* Writes the contents of `memtable' as a new disktable starting at `old_eof'
+ * in `fd', which is either the table file or a new segment.
+ *
+ * Only positional writes are used, and neither the file position nor the
+ * memory map is touched, so this may run in the flush thread while other
+ * threads use the table.  The new disktable is returned in `result', but is
+ * not attached to the table.
+ *
+ * The size of every part of the disktable is known in advance, so the memtable
+ * is written in a single in-order pass: each key is generated once, and its
+ * key info and data are streamed to their final positions through separate
+ * write buffers.  The keys arrive in order, so the PATRICIA trie is built in
+ * the same pass without looking up earlier keys.  The column directory is
+ * collected in the same pass.  The directory, the header, the bloom filter
+ * and the trie are written when the pass is complete.
+ */
+static int
+JPT_disktable_write(struct JPT_info* info, struct JPT_memtable* memtable,
+                    int fd, off_t old_eof, struct JPT_disktable** result)
+{
+  struct JPT_write_buffer* key_info_output = 0;
+  struct JPT_write_buffer* data_output = 0;
+  struct JPT_disktable* disktable;
+  struct JPT_key_info key_info;
+  struct JPT_node* n;
+  struct patricia* pat = 0;
+  char* key_buf;
+  size_t key_buf_size = 256;
+  size_t i, key_size;
+  uint64_t hash;
+  off_t offset = 0;
+  uint32_t row_count = 0;
+  uint32_t header[6];
+  uint32_t data_size;
+  size_t column_alloc = 0;
+  int pat_size;
+
+  if((disktable = malloc(sizeof(struct JPT_disktable))))
+  {
+    disktable->bloom_filter = 0;
+    disktable->columns = 0;
+    disktable->column_count = 0;
+    disktable->version = JPT_VERSION;
+    disktable->lazy = 0;
+    disktable->key_fingerprints = 1;
+    disktable->removed_count = 0;
+    disktable->merging = 0;
+    disktable->uncached = 0;
+    disktable->snapshot = 0;
+    disktable->segment = 0;
+  }
+
+  key_info_output = malloc(sizeof(struct JPT_write_buffer));
+  data_output = malloc(sizeof(struct JPT_write_buffer));
+  key_buf = malloc(key_buf_size);
+
+  if(!disktable || !key_info_output || !data_output || !key_buf)
+  {
+    asprintf(&JPT_last_error, "malloc failed while writing disktable: %s", strerror(errno));
+
+    goto fail;
+  }
+
+  if(-1 == JPT_bloom_filter_create(disktable, memtable->key_count, info->bloom_bits))
+    goto fail;
+
+  data_size = memtable->key_size + memtable->key_count * COLUMN_PREFIX_SIZE + memtable->value_size;
+
+  if(-1 == JPT_pwrite_all(fd, JPT_PARTIAL_WRITE, 4, old_eof))
+    goto fail;
+
+  disktable->pat_offset = old_eof + 4 + sizeof(header) + disktable->bloom_size;
+  disktable->key_info_offset = disktable->pat_offset + patricia_size(memtable->key_count);
+  disktable->offset = disktable->key_info_offset + memtable->key_count * sizeof(struct JPT_key_info);
+  disktable->data_size = data_size;
+
+  key_info_output->fd = fd;
+  key_info_output->offset = disktable->key_info_offset;
+  key_info_output->fill = 0;
+
+  data_output->fd = fd;
+  data_output->offset = disktable->offset;
+  data_output->fill = 0;
+
+  pat = patricia_create(0, 0);
+
+  for(n = JPT_memtable_first(memtable); n; n = JPT_memtable_next(memtable, n))
+  {
+    key_size = strlen(n->row) + COLUMN_PREFIX_SIZE + 1;
+
+    if(key_size > key_buf_size)
+    {
+      key_buf_size = key_size + 32;
+      free(key_buf);
+
+      if(!(key_buf = malloc(key_buf_size)))
+      {
+        asprintf(&JPT_last_error, "malloc failed while writing disktable: %s", strerror(errno));
+
+        goto fail;
+      }
+    }
+
+    JPT_generate_key(key_buf, n->row, n->columnidx);
+
+    assert(row_count < memtable->key_count);
+
+    i = patricia_define_sorted(pat, key_buf);
+
+    assert(i == row_count);
+
+    hash = JPT_key_hash(key_buf);
+
+    JPT_bloom_filter_add(disktable, hash);
+
+    key_info.timestamp = n->timestamp;
+    key_info.offset = offset;
+    key_info.size = key_size + n->value_size;
+    key_info.flags = JPT_KEY_FINGERPRINT(hash);
+
+    if(!disktable->column_count
+    || n->columnidx != disktable->columns[disktable->column_count - 1].columnidx)
+    {
+      key_info.flags |= JPT_KEY_NEW_COLUMN;
+
+      if(-1 == JPT_disktable_column_begin(disktable, &column_alloc, n->columnidx, row_count))
+        goto fail;
+    }
+
+    ++disktable->columns[disktable->column_count - 1].count;
+
+    if(-1 == JPT_write_buffer_append(key_info_output, &key_info, sizeof(key_info))
+    || -1 == JPT_write_buffer_append(data_output, key_buf, key_size)
+    || -1 == JPT_write_buffer_append(data_output, n->value, n->value_size))
+      goto fail;
+
+    offset += key_info.size;
+    ++row_count;
+  }
+
+  assert(offset == data_size);
+  assert(row_count == memtable->key_count);
+
+  if(-1 == JPT_write_buffer_flush(key_info_output)
+  || -1 == JPT_write_buffer_flush(data_output))
+    goto fail;
+
+  assert(key_info_output->offset == disktable->offset);
+  assert(data_output->offset == disktable->offset + data_size);
+
+  header[0] = JPT_VERSION;
+  header[1] = memtable->key_count;
+  header[2] = data_size;
+  header[3] = disktable->bloom_size;
+  header[4] = disktable->bloom_hashes;
+  header[5] = disktable->column_count;
+
+  if(-1 == JPT_pwrite_all(fd, disktable->columns,
+                          disktable->column_count * sizeof(struct JPT_disktable_column),
+                          disktable->offset + data_size)
+  || -1 == JPT_pwrite_all(fd, header, sizeof(header), old_eof + 4))
+    goto fail;
+
+  if(-1 == JPT_pwrite_all(fd, disktable->bloom_filter, disktable->bloom_size, old_eof + 4 + sizeof(header)))
+    goto fail;
+
+  if(-1 == (pat_size = patricia_pwrite(pat, fd, disktable->pat_offset)))
+  {
+    asprintf(&JPT_last_error, "Failed to write PATRICIA trie: %s", strerror(errno));
+
+    goto fail;
+  }
+
+  assert(disktable->pat_offset + pat_size == disktable->key_info_offset);
+
+  if(-1 == JPT_pwrite_all(fd, JPT_SIGNATURE, 4, old_eof))
+    goto fail;
+
+  if(info->flags & JPT_SYNC)
+  {
+    if(-1 == fdatasync(fd))
+      goto fail;
+  }
+
+  free(key_buf);
+  free(data_output);
+  free(key_info_output);
+
+  disktable->pat = pat;
+  disktable->pat_mapped = 0;
+  disktable->key_infos = 0;
+  disktable->key_info_count = row_count;
+  disktable->key_infos_mapped = 0;
+  disktable->info = info;
+  disktable->next = 0;
+
+  *result = disktable;
+
+  return 0;
+
+fail:
+
+  ftruncate(fd, old_eof);
+
+  if(pat)
+    patricia_destroy(pat);
+
+  free(key_buf);
+  free(data_output);
+  free(key_info_output);
+
+  if(disktable)
+  {
+    free(disktable->columns);
+    free(disktable->bloom_filter);
+  }
+
+  free(disktable);
+
+  return -1;
+}
+
+/* Appends a disktable written by JPT_disktable_write to the table.  Room for
+ * its bloom filter must have been reserved with JPT_bloom_refs_reserve.
+ */
+static void
+JPT_disktable_attach(struct JPT_info* info, struct JPT_disktable* disktable)
+{
+  if(!info->first_disktable)
+  {
+    info->first_disktable = disktable;
+    info->last_disktable = disktable;
+  }
+  else
+  {
+    info->last_disktable->next = disktable;
+    info->last_disktable = disktable;
+  }
+
+  ++info->disktable_count;
+
+  JPT_bloom_refs_update(info);
+  JPT_update_map(info);
+
+  if(info->map_size && !disktable->pat_mapped)
+  {
+    patricia_remap(disktable->pat, info->map + disktable->pat_offset);
+    disktable->pat_mapped = 1;
+
+    disktable->key_infos = (struct JPT_key_info*) (info->map + disktable->key_info_offset);
+    disktable->key_infos_mapped = 1;
+  }
+
+  JPT_disktable_advise(info, disktable);
+
+  JPT_compaction_notify(info);
+}
+
+/* JPT_compact for the segmented layout.  The manifest lists the new segment
+ * before the log is reset, unless a log is being replayed; see
+ * `manifest_stale'.
+ */
+static int
+JPT_compact_segment(struct JPT_info* info)
+{
+  struct JPT_disktable* disktable;
+  struct JPT_segment* segment;
+
+  if(!(segment = JPT_segment_create(info)))
+    return -1;
+
+  if(-1 == JPT_disktable_write(info, info->memtable, segment->fd, 0, &disktable))
+  {
+    JPT_segment_discard(info, segment);
+
+    return -1;
+  }
+
+  if(info->replaying)
+    info->manifest_stale = 1;
+  else
+  {
+    if(-1 == JPT_manifest_commit(info, info->disktable_count, 0, &segment, 1, info->flush_count + 1))
+    {
+      JPT_disktable_free(disktable);
+      JPT_segment_discard(info, segment);
+
+      return -1;
+    }
+
+    ++info->flush_count;
+
+    if(-1 == JPT_log_reset(info))
+    {
+      /* Both the log and the new segment would be replayed */
+      if(-1 == JPT_manifest_commit(info, info->disktable_count, 0, 0, 0, info->flush_count - 1))
+        return -1;
+
+      --info->flush_count;
+
+      JPT_disktable_free(disktable);
+      JPT_segment_discard(info, segment);
+
+      return -1;
+    }
+
+    info->manifest_stale = 0;
+  }
+
+  JPT_segment_place(info, disktable, segment);
+
+  JPT_memtable_clear(info->memtable);
+  JPT_disktable_attach(info, disktable);
+
+  return 0;
+}
+
+int
+JPT_compact(struct JPT_info* info)
+{
+  struct JPT_disktable* disktable;
+  off_t old_eof;
+
+  if(-1 == JPT_flush_wait(info))
+    return -1;
+
+  if(!info->memtable->key_count)
+  {
+    JPT_memtable_clear(info->memtable);
+    ++info->memtable_generation;
+
+    if(info->manifest_stale && !info->replaying)
+    {
+      if(-1 == JPT_manifest_commit(info, info->disktable_count, 0, 0, 0, info->flush_count + 1))
+        return -1;
+
+      ++info->flush_count;
+      info->manifest_stale = 0;
+    }
+
+    return JPT_log_reset(info);
+  }
+
+  if(-1 == JPT_bloom_refs_reserve(info, info->disktable_count + 1))
+    return -1;
+
+  if(info->segmented)
+    return JPT_compact_segment(info);
+
+  old_eof = lseek64(info->fd, 0, SEEK_END);
+
+  if(-1 == JPT_disktable_write(info, info->memtable, info->fd, old_eof, &disktable))
+    return -1;
+
+  if(-1 == JPT_log_reset(info))
+  {
+    ftruncate(info->fd, old_eof);
+    JPT_disktable_free(disktable);
+
+    return -1;
+  }
+
+  JPT_memtable_clear(info->memtable);
+  JPT_disktable_attach(info, disktable);
+
+  return 0;
+}
+
+/* The file a frozen memtable is written to */
+static int
+JPT_flush_fd(struct JPT_info* info)
+{
+  return info->flush_segment ? info->flush_segment->fd : info->fd;
+}
+
+static void*
+JPT_flush_thread(void* arg)
+{
+  struct JPT_info* info = arg;
+  struct JPT_disktable* disktable;
+
+  pthread_mutex_lock(&info->flush_mutex);
+
+  for(;;)
+  {
+    while(!info->flush_pending && !info->flush_stop)
+      pthread_cond_wait(&info->flush_cond, &info->flush_mutex);
+
+    if(!info->flush_pending)
+      break;
+
+    pthread_mutex_unlock(&info->flush_mutex);
+
+    /* On failure, JPT_flush_wait retries in the writer's thread, so that the
+     * error can be reported to the caller.  */
+    if(-1 == JPT_disktable_write(info, info->frozen, JPT_flush_fd(info), info->flush_offset, &disktable))
+    {
+      disktable = 0;
+
+      JPT_clear_error();
+    }
+
+    pthread_mutex_lock(&info->flush_mutex);
+
+    info->flush_result = disktable;
+    info->flush_pending = 0;
+
+    pthread_cond_broadcast(&info->flush_cond);
+  }
+
+  pthread_mutex_unlock(&info->flush_mutex);
+
+  return 0;
+}
+
+static int
+JPT_flush_busy(struct JPT_info* info)
+{
+  int result;
+
+  pthread_mutex_lock(&info->flush_mutex);
+  result = info->flush_pending;
+  pthread_mutex_unlock(&info->flush_mutex);
+
+  return result;
+}
+
+/* Makes a finished flush visible: the active log is told the new table size,
+ * the disktable is attached, and the frozen memtable and its log are
+ * discarded.  The order matters for crash recovery; see JPT_log_open_frozen.
+ *
+ * With the segmented layout, the manifest lists the new segment first.  A
+ * failure to update the log header after that is not reported: the header
+ * stays JPT_LOG_UNKNOWN_SIZE, and the active log alone is replayed after a
+ * crash, which is right once the frozen log is gone.
+ */
+static int
+JPT_flush_commit(struct JPT_info* info, struct JPT_disktable* disktable)
+{
+  if(-1 == JPT_bloom_refs_reserve(info, info->disktable_count + 1))
+    return -1;
+
+  if(info->segmented)
+  {
+    if(-1 == JPT_manifest_commit(info, info->disktable_count, 0, &info->flush_segment, 1, info->flush_count + 1))
+      return -1;
+
+    ++info->flush_count;
+
+    JPT_segment_place(info, disktable, info->flush_segment);
+    info->flush_segment = 0;
+
+    if(!info->logfile_empty && -1 == JPT_log_write_header(info, info->flush_count))
+      JPT_clear_error();
+  }
+  else if(!info->logfile_empty)
+  {
+    if(-1 == JPT_log_write_header(info, lseek64(info->fd, 0, SEEK_END)))
+      return -1;
+  }
+
+  JPT_disktable_attach(info, disktable);
+
+  if(info->frozen_logfd != -1)
+  {
+    close(info->frozen_logfd);
+    info->frozen_logfd = -1;
+
+    unlink(info->frozen_logname);
+  }
+
+  JPT_memtable_destroy(info->frozen);
+  info->frozen = 0;
+
+  return 0;
+}
+
+/* Waits for the frozen memtable, if any, to be written to disk, and attaches
+ * the resulting disktable.  Must be called with the writer lock held.
+ */
+int
+JPT_flush_wait(struct JPT_info* info)
+{
+  struct JPT_disktable* disktable;
+
+  if(!info->frozen)
+    return 0;
+
+  pthread_mutex_lock(&info->flush_mutex);
+
+  while(info->flush_pending)
+    pthread_cond_wait(&info->flush_cond, &info->flush_mutex);
+
+  disktable = info->flush_result;
+  info->flush_result = 0;
+
+  pthread_mutex_unlock(&info->flush_mutex);
+
+  if(!disktable
+  && -1 == JPT_disktable_write(info, info->frozen, JPT_flush_fd(info), info->flush_offset, &disktable))
+    return -1;
+
+  if(-1 == JPT_flush_commit(info, disktable))
+  {
+    info->flush_result = disktable;
+
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Replaces the active memtable with an empty one, and has the flush thread
+ * write the old one to disk.  Only one memtable can be flushed at a time, so
+ * if the previous flush has not finished yet, we wait for it.
+ */
+int
+JPT_freeze_memtable(struct JPT_info* info)
+{
+  struct JPT_memtable* memtable;
+
+  if(info->replaying || !info->memtable->key_count)
+    return JPT_compact(info);
+
+  if(-1 == JPT_flush_wait(info))
+    return -1;
+
+  if(!(memtable = JPT_memtable_create(info)))
+    return -1;
+
+  if(info->segmented && !(info->flush_segment = JPT_segment_create(info)))
+  {
+    JPT_memtable_destroy(memtable);
+
+    return -1;
+  }
+
+  if(-1 == JPT_log_rotate(info))
+  {
+    if(info->flush_segment)
+    {
+      JPT_segment_discard(info, info->flush_segment);
+      info->flush_segment = 0;
+    }
+
+    JPT_memtable_destroy(memtable);
+
+    return -1;
+  }
+
+  info->flush_offset = info->segmented ? 0 : lseek64(info->fd, 0, SEEK_END);
+  info->frozen = info->memtable;
+  info->frozen->frozen = 1;
+  info->memtable = memtable;
+
+  if(!info->flush_thread_started)
+  {
+    if(0 != pthread_create(&info->flush_thread, 0, JPT_flush_thread, info))
+      return JPT_flush_wait(info);
+
+    info->flush_thread_started = 1;
+  }
+
+  pthread_mutex_lock(&info->flush_mutex);
+  info->flush_pending = 1;
+  pthread_cond_broadcast(&info->flush_cond);
+  pthread_mutex_unlock(&info->flush_mutex);
+
+  return 0;
+}
+
+/* Background compaction.
+ *
+ * A merge takes three steps.  JPT_merge_begin chooses a run of neighbouring
+ * disktables under the writer lock, and reserves a region at the end of the
+ * table file that is large enough for the merged disktable however many keys
+ * turn out to be duplicates.  JPT_merge_write then merges the run into the
+ * region without holding any lock, reading through private copies of the
+ * disktables and a pinned mapping, so that neither changes under it.  Since
+ * the number of keys is not known until the end, the data is written forward
+ * from a fixed offset, and the header, bloom filter, trie and key infos are
+ * placed right before it afterwards.  Finally JPT_merge_finish takes the
+ * writer lock again, gives cells changed during the merge their current
+ * values, and marks the region as complete before replacing the run by the
+ * merged disktable.
+ *
+ * With the segmented layout, the merged disktable is written to a new
+ * segment instead of a region, and is made complete by listing it in the
+ * manifest in place of the run, whose files are then deleted.
+ */
+
+struct JPT_merge
+{
+  struct JPT_disktable** sources;
+  struct JPT_disktable* copies;
+  size_t first;
+  size_t count;
+
+  /* First key of each copy to merge, or null to merge them all */
+  size_t* starts;
+
+  struct JPT_disktable* result;
+  struct JPT_key_info* key_infos;
+  uint32_t max_rows;
+
+  off_t region;
+  off_t region_size;
+  off_t data_offset;
+
+  /* The file of the merged disktable, with the segmented layout */
+  struct JPT_segment* segment;
+
+  struct JPT_ref* pin;
+
+  /* The mapping when the merge began, which `pin' keeps mapped */
+  struct JPT_map_snapshot snapshot;
+};
+
+/* Wakes the compaction thread to check its triggers */
+static void
+JPT_compaction_notify(struct JPT_info* info)
+{
+  if(!__atomic_load_n(&info->compaction_thread_started, __ATOMIC_ACQUIRE))
+    return;
+
+  pthread_mutex_lock(&info->compaction_mutex);
+  info->compaction_wake = 1;
+  pthread_cond_broadcast(&info->compaction_cond);
+  pthread_mutex_unlock(&info->compaction_mutex);
+}
+
+/* Makes a merge in progress discard its result */
+static void
+JPT_merge_abort(struct JPT_info* info)
+{
+  if(!__atomic_load_n(&info->compaction_thread_started, __ATOMIC_ACQUIRE))
+    return;
+
+  pthread_mutex_lock(&info->compaction_mutex);
+  info->compaction_abort = 1;
+  pthread_mutex_unlock(&info->compaction_mutex);
+}
+
+/* Like JPT_merge_abort, but also waits until the merge no longer uses the
+ * table file.  Must be called with the writer lock held.
+ */
+static void
+JPT_merge_cancel(struct JPT_info* info)
+{
+  if(!__atomic_load_n(&info->compaction_thread_started, __ATOMIC_ACQUIRE))
+    return;
+
+  pthread_mutex_lock(&info->compaction_mutex);
+
+  info->compaction_abort = 1;
+
+  while(info->compaction_merging)
+    pthread_cond_wait(&info->compaction_cond, &info->compaction_mutex);
+
+  pthread_mutex_unlock(&info->compaction_mutex);
+}
+
+static int
+JPT_merge_aborted(struct JPT_info* info)
+{
+  int result;
+
+  pthread_mutex_lock(&info->compaction_mutex);
+  result = info->compaction_abort;
+  pthread_mutex_unlock(&info->compaction_mutex);
+
+  return result;
+}
+
+/* Records that a cell of a disktable being merged has changed.  Called with
+ * the writer lock held.
+ */
+void
+JPT_compaction_touch(struct JPT_info* info, const char* row, uint32_t columnidx,
+                     uint64_t hash)
+{
+  struct JPT_compaction_touch* touch;
+
+  if(info->touched_count == info->touched_alloc)
+  {
+    size_t new_alloc = info->touched_alloc ? info->touched_alloc * 2 : 64;
+    struct JPT_compaction_touch* new_touched;
+
+    if(!(new_touched = realloc(info->touched, new_alloc * sizeof(struct JPT_compaction_touch))))
+    {
+      info->touch_failed = 1;
+      JPT_merge_abort(info);
+
+      return;
+    }
+
+    info->touched = new_touched;
+    info->touched_alloc = new_alloc;
+  }
+
+  touch = &info->touched[info->touched_count];
+
+  if(!(touch->row = strdup(row)))
+  {
+    info->touch_failed = 1;
+    JPT_merge_abort(info);
+
+    return;
+  }
+
+  touch->columnidx = columnidx;
+  touch->hash = hash;
+
+  ++info->touched_count;
+}
+
+static void
+JPT_compaction_clear_touched(struct JPT_info* info)
+{
+  size_t i;
+
+  for(i = 0; i < info->touched_count; ++i)
+    free(info->touched[i].row);
+
+  info->touched_count = 0;
+  info->touch_failed = 0;
+}
+
+/* Counts the disktables a lookup searches beyond their bloom filters */
+static void
+JPT_lookup_account(struct JPT_info* info, const unsigned char* maybe)
+{
+  uint64_t searches = 0;
+  size_t i;
+
+  for(i = 0; i < info->disktable_count; ++i)
+    searches += (maybe[i] != 0);
+
+  __atomic_fetch_add(&info->lookup_count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&info->lookup_searches, searches, __ATOMIC_RELAXED);
+}
+
+static uint64_t
+JPT_disktable_size(const struct JPT_disktable* disktable)
+{
+  return disktable->data_size + (uint64_t) disktable->key_info_count * sizeof(struct JPT_key_info);
+}
+
+/* Returns the first of the run of `length' neighbours with the smallest
+ * total size, given the sizes of all `count' disktables.
+ */
+static size_t
+JPT_compaction_cheapest(const uint64_t* sizes, size_t count, size_t length)
+{
+  uint64_t total = 0, best_total = 0;
+  size_t i, best = 0;
+
+  for(i = 0; i < count; ++i)
+  {
+    total += sizes[i];
+
+    if(i >= length)
+      total -= sizes[i - length];
+
+    if(i + 1 == length || (i + 1 > length && total < best_total))
+    {
+      best = i + 1 - length;
+      best_total = total;
+    }
+  }
+
+  return best;
+}
+
+/* Chooses the run of disktables to merge next, as described for struct
+ * JPT_compaction_policy.  Returns 0 if nothing needs merging.  Must be called
+ * with the writer lock held.
+ */
+static int
+JPT_compaction_pick(struct JPT_info* info, size_t* first, size_t* count)
+{
+  const struct JPT_compaction_policy* policy = &info->compaction_policy;
+  struct JPT_disktable* disktable;
+  uint64_t* sizes;
+  uint64_t min_size, max_size, total, best_total = 0;
+  uint64_t lookups, searches;
+  size_t i, j, length = 0, n = info->disktable_count;
+
+  if(!n)
+    return 0;
+
+  sizes = alloca(n * sizeof(uint64_t));
+
+  for(disktable = info->first_disktable, i = 0; disktable; disktable = disktable->next, ++i)
+  {
+    sizes[i] = JPT_disktable_size(disktable);
+
+    if(policy->max_removed_ratio > 0 && disktable->removed_count
+    && disktable->removed_count > policy->max_removed_ratio * disktable->key_info_count)
+    {
+      *first = i;
+      *count = 1;
+
+      return 1;
+    }
+  }
+
+  /* Size-tiered: of the runs of similar sizes, merge the one with the
+   * smallest average size, which usually holds the newest data */
+  *count = 0;
+
+  for(i = 0; i + policy->min_merge <= n; ++i)
+  {
+    min_size = max_size = total = sizes[i];
+
+    for(j = i + 1; j < n && j - i < policy->max_merge; ++j)
+    {
+      if(sizes[j] < min_size)
+        min_size = sizes[j];
+
+      if(sizes[j] > max_size)
+        max_size = sizes[j];
+
+      if(max_size > policy->size_ratio * (min_size ? min_size : 1))
+        break;
+
+      total += sizes[j];
+    }
+
+    if(j - i >= policy->min_merge
+    && (!*count || total / (j - i) < best_total / *count))
+    {
+      *first = i;
+      *count = j - i;
+      best_total = total;
+    }
+  }
+
+  if(*count)
+    return 1;
+
+  if(n < 2)
+    return 0;
+
+  if(policy->max_disktables && n > policy->max_disktables)
+    length = n - policy->max_disktables + 1;
+
+  lookups = __atomic_load_n(&info->lookup_count, __ATOMIC_RELAXED);
+  searches = __atomic_load_n(&info->lookup_searches, __ATOMIC_RELAXED);
+
+  if(policy->max_read_amp > 0 && lookups >= JPT_LOOKUP_MIN_SAMPLES
+  && searches > policy->max_read_amp * lookups && length < policy->min_merge)
+    length = policy->min_merge;
+
+  if(!length)
+    return 0;
+
+  if(length < policy->min_merge)
+    length = policy->min_merge;
+
+  if(length > policy->max_merge)
+    length = policy->max_merge;
+
+  if(length > n)
+    length = n;
+
+  *first = JPT_compaction_cheapest(sizes, n, length);
+  *count = length;
+
+  return 1;
+}
+
+static void
+JPT_merge_free(struct JPT_merge* merge)
+{
+  if(merge->result)
+  {
+    if(merge->result->pat)
+      patricia_destroy(merge->result->pat);
+
+    free(merge->result->columns);
+    free(merge->result->bloom_filter);
+    free(merge->result);
+  }
+
+  free(merge->key_infos);
+  free(merge->starts);
+  free(merge->copies);
+  free(merge->sources);
+}
+
+/* Chooses disktables to merge and reserves a region for the result.  Returns
+ * 1 if a merge was started, and 0 if there is nothing to merge.
+ */
+static int
+JPT_merge_begin(struct JPT_info* info, struct JPT_merge* merge)
+{
+  struct JPT_merge_header header;
+  struct JPT_disktable* disktable;
+  uint64_t rows = 0, data_size = 0, columns = 0;
+  size_t i;
+
+  JPT_writer_enter(info);
+
+  /* A memtable being flushed is written at what is now the end of the
+   * file.  Its disktable wakes us up when attached.  A major compaction
+   * wakes us up when done.  */
+  if(info->frozen || info->major_compacting
+  || !JPT_compaction_pick(info, &merge->first, &merge->count))
+  {
+    JPT_writer_leave(info);
+
+    return 0;
+  }
+
+  merge->sources = malloc(merge->count * sizeof(struct JPT_disktable*));
+  merge->copies = malloc(merge->count * sizeof(struct JPT_disktable));
+
+  if((merge->result = malloc(sizeof(struct JPT_disktable))))
+    memset(merge->result, 0, sizeof(struct JPT_disktable));
+
+  if(!merge->sources || !merge->copies || !merge->result)
+  {
+    asprintf(&JPT_last_error, "malloc failed while starting merge: %s", strerror(errno));
+
+    goto fail;
+  }
+
+  for(disktable = info->first_disktable, i = 0; i < merge->first; ++i)
+    disktable = disktable->next;
+
+  for(i = 0; i < merge->count; ++i, disktable = disktable->next)
+  {
+    /* The merge reads the sources without the writer lock */
+    if(-1 == JPT_DISKTABLE_LOAD(disktable, JPT_LAZY_TRIE | JPT_LAZY_COLUMNS))
+      goto fail;
+
+    merge->sources[i] = disktable;
+
+    rows += disktable->key_info_count;
+    data_size += disktable->data_size;
+    columns += disktable->columns ? disktable->column_count : disktable->key_info_count;
+  }
+
+  if(rows >= UINT_MAX || data_size > UINT32_MAX)
+  {
+    asprintf(&JPT_last_error, "Merging %zu disktables would give %llu keys and %llu bytes of data",
+             merge->count, (unsigned long long) rows, (unsigned long long) data_size);
+    errno = EFBIG;
+
+    goto fail;
+  }
+
+  merge->max_rows = rows;
+
+  /* Sized for the total key count, as duplicates are not yet known */
+  if(-1 == JPT_bloom_filter_create(merge->result, rows, info->bloom_bits))
+    goto fail;
+
+  if(info->segmented)
+  {
+    if(!(merge->segment = JPT_segment_create(info)))
+      goto fail;
+
+    merge->data_offset = JPT_disktable_header_size(JPT_VERSION) + merge->result->bloom_size
+                       + patricia_size(rows) + rows * sizeof(struct JPT_key_info);
+  }
+  else
+  {
+    merge->region = lseek64(info->fd, 0, SEEK_END);
+    merge->data_offset = merge->region + sizeof(header) + JPT_disktable_header_size(JPT_VERSION)
+                       + merge->result->bloom_size + patricia_size(rows)
+                       + rows * sizeof(struct JPT_key_info);
+    merge->region_size = merge->data_offset - merge->region + data_size
+                       + columns * sizeof(struct JPT_disktable_column);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.signature, JPT_SKIP_SIGNATURE, 4);
+    header.first = merge->first;
+    header.count = merge->count;
+    header.size = merge->region_size;
+
+    if(-1 == JPT_pwrite_all(info->fd, &header, sizeof(header), merge->region))
+      goto fail;
+
+    if(-1 == ftruncate(info->fd, merge->region + merge->region_size))
+    {
+      asprintf(&JPT_last_error, "ftruncate failed while reserving %llu bytes for merge: %s",
+               (unsigned long long) merge->region_size, strerror(errno));
+
+      ftruncate(info->fd, merge->region);
+
+      goto fail;
+    }
+
+    JPT_update_map(info);
+  }
+
+  /* From here on, a failed merge leaves the region to be skipped */
+  if(info->map_size && !(merge->pin = JPT_map_pin(info)))
+  {
+    asprintf(&JPT_last_error, "calloc failed while starting merge: %s", strerror(errno));
+
+    goto fail;
+  }
+
+  merge->snapshot.map = info->map;
+  merge->snapshot.map_size = info->map_size;
+  merge->snapshot.file_size = info->file_size;
+
+  for(i = 0; i < merge->count; ++i)
+  {
+    merge->copies[i] = *merge->sources[i];
+    merge->copies[i].uncached = 1;
+    merge->copies[i].snapshot = &merge->snapshot;
+    merge->sources[i]->merging = 1;
+  }
+
+  JPT_compaction_clear_touched(info);
+
+  pthread_mutex_lock(&info->compaction_mutex);
+  info->compaction_abort = 0;
+  info->compaction_merging = 1;
+  pthread_mutex_unlock(&info->compaction_mutex);
+
+  JPT_writer_leave(info);
+
+  return 1;
+
+fail:
+
+  JPT_writer_leave(info);
+
+  if(merge->segment)
+    JPT_segment_discard(info, merge->segment);
+
+  JPT_merge_free(merge);
+
+  return -1;
+}
+
+/* Merges the copies in `merge' into a disktable written to `fd'.  The data
+ * is written as it is merged, starting at `merge->data_offset', and the
+ * header, bloom filter, trie and key infos are then placed just before it.
+ * `*start' is set to the offset of the disktable's signature.  If
+ * `abortable' is set, JPT_merge_abort makes this fail.  Called without any
+ * lock held.
+ */
+static int
+JPT_merge_table(struct JPT_info* info, struct JPT_merge* merge, int fd,
+                int abortable, off_t* start)
+{
+  struct JPT_disktable* disktable = merge->result;
+  struct JPT_disktable_cursor* cursors;
+  struct JPT_disktable_cursor* cursor;
+  struct JPT_cursor_heap heap;
+  struct JPT_write_buffer* output;
+  struct JPT_key_info* key_infos;
+  uint32_t header[6];
+  size_t i, j, amount, steps = 0, column_alloc = 0;
+  uint32_t row_count = 0;
+  off_t offset = 0;
+  int pat_size, result = -1;
+
+  memset(&heap, 0, sizeof(heap));
+
+  cursors = calloc(merge->count, sizeof(struct JPT_disktable_cursor));
+  output = malloc(sizeof(struct JPT_write_buffer));
+  key_infos = merge->key_infos = malloc((merge->max_rows ? merge->max_rows : 1) * sizeof(struct JPT_key_info));
+  disktable->pat = patricia_create(0, 0);
+
+  if(!cursors || !output || !key_infos || !disktable->pat)
+  {
+    asprintf(&JPT_last_error, "malloc failed while merging disktables: %s", strerror(errno));
+
+    goto done;
+  }
+
+  for(i = 0; i < merge->count; ++i)
+  {
+    cursors[i].disktable = &merge->copies[i];
+
+    if(merge->starts)
+      cursors[i].offset = merge->starts[i];
+  }
+
+  output->fd = fd;
+  output->offset = merge->data_offset;
+  output->fill = 0;
+
+  if(-1 == JPT_cursor_heap_init(info, &heap, cursors, merge->count, JPT_INVALID_COLUMN))
+    goto done;
+
+  while((cursor = JPT_CURSOR_HEAP_TOP(&heap)))
+  {
+    if(abortable && !(++steps & 1023) && JPT_merge_aborted(info))
+    {
+      asprintf(&JPT_last_error, "Merge aborted");
+      errno = ECANCELED;
+
+      goto done;
+    }
+
+    const char* min = cursor->data;
+
+    j = patricia_define_sorted(disktable->pat, min);
+
+    if(j == row_count)
+    {
+      uint32_t columnidx = CELLMETA_TO_COLUMN(min);
+      uint64_t hash = JPT_key_hash(min);
+
+      assert(row_count < merge->max_rows);
+
+      JPT_bloom_filter_add(disktable, hash);
+
+      key_infos[j].timestamp = cursor->timestamp;
+      key_infos[j].offset = offset;
+      key_infos[j].size = cursor->data_size;
+      key_infos[j].flags = JPT_KEY_FINGERPRINT(hash);
+
+      if(!disktable->column_count
+      || columnidx != disktable->columns[disktable->column_count - 1].columnidx)
+      {
+        key_infos[j].flags |= JPT_KEY_NEW_COLUMN;
+
+        if(-1 == JPT_disktable_column_begin(disktable, &column_alloc, columnidx, j))
+          goto done;
+      }
+
+      ++disktable->columns[disktable->column_count - 1].count;
+
+      if(-1 == JPT_write_buffer_append(output, cursor->data, cursor->data_size))
+        goto done;
+
+      offset += cursor->data_size;
+
+      ++row_count;
+    }
+    else
+    {
+      assert(j == row_count - 1);
+
+      amount = cursor->data_size - cursor->keylen;
+
+      if(-1 == JPT_write_buffer_append(output, cursor->data + cursor->keylen, amount))
+        goto done;
+
+      key_infos[j].size += amount;
+      offset += amount;
+    }
+
+    if(-1 == JPT_cursor_heap_next(info, &heap))
+      goto done;
+  }
+
+  if(-1 == JPT_write_buffer_flush(output))
+    goto done;
+
+  *start = merge->data_offset - row_count * sizeof(struct JPT_key_info) - patricia_size(row_count)
+         - disktable->bloom_size - sizeof(header) - 4;
+
+  disktable->pat_offset = *start + 4 + sizeof(header) + disktable->bloom_size;
+  disktable->key_info_offset = disktable->pat_offset + patricia_size(row_count);
+  disktable->key_info_count = row_count;
+  disktable->offset = merge->data_offset;
+  disktable->data_size = offset;
+  disktable->version = JPT_VERSION;
+  disktable->key_fingerprints = 1;
+  disktable->info = info;
+
+  assert(disktable->key_info_offset + row_count * sizeof(struct JPT_key_info) == disktable->offset);
+
+  header[0] = JPT_VERSION;
+  header[1] = row_count;
+  header[2] = offset;
+  header[3] = disktable->bloom_size;
+  header[4] = disktable->bloom_hashes;
+  header[5] = disktable->column_count;
+
+  if(-1 == JPT_pwrite_all(fd, disktable->columns,
+                          disktable->column_count * sizeof(struct JPT_disktable_column),
+                          disktable->offset + offset)
+  || -1 == JPT_pwrite_all(fd, key_infos, row_count * sizeof(struct JPT_key_info),
+                          disktable->key_info_offset)
+  || -1 == JPT_pwrite_all(fd, header, sizeof(header), *start + 4)
+  || -1 == JPT_pwrite_all(fd, disktable->bloom_filter, disktable->bloom_size,
+                          *start + 4 + sizeof(header)))
+    goto done;
+
+  if(-1 == (pat_size = patricia_pwrite(disktable->pat, fd, disktable->pat_offset)))
+  {
+    asprintf(&JPT_last_error, "Failed to write PATRICIA trie: %s", strerror(errno));
+
+    goto done;
+  }
+
+  assert(disktable->pat_offset + pat_size == disktable->key_info_offset);
+
+  if(-1 == JPT_pwrite_all(fd, JPT_SIGNATURE, 4, *start))
+    goto done;
+
+  result = 0;
+
+done:
+
+  if(cursors)
+  {
+    for(i = 0; i < merge->count; ++i)
+      free(cursors[i].buffer);
+  }
+
+  JPT_cursor_heap_free(&heap);
+  free(cursors);
+  free(output);
+
+  return result;
+}
+
+/* Writes the merged disktable into the region or segment reserved by
+ * JPT_merge_begin.  Called without any lock held.
+ */
+static int
+JPT_merge_write(struct JPT_info* info, struct JPT_merge* merge)
+{
+  uint64_t table_offset;
+  off_t start;
+
+  if(merge->segment)
+  {
+    if(-1 == JPT_merge_table(info, merge, merge->segment->fd, 1, &start))
+      return -1;
+
+    merge->segment->start = start;
+
+    return 0;
+  }
+
+  if(-1 == JPT_merge_table(info, merge, info->fd, 1, &start))
+    return -1;
+
+  table_offset = start;
+
+  if(-1 == JPT_pwrite_all(info->fd, &table_offset, sizeof(table_offset),
+                          merge->region + offsetof(struct JPT_merge_header, table_offset)))
+    return -1;
+
+  /* The region must be complete on disk before it is marked as such */
+  if(-1 == fdatasync(info->fd))
+  {
+    asprintf(&JPT_last_error, "fdatasync failed: %s", strerror(errno));
+
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Gives the cell of `touch' in the merged disktable, written to `fd', the
+ * value it has now in the disktables being merged.  The key infos are
+ * updated both in `merge->key_infos' and in the file.  Changes only ever
+ * shrink cells, except when JPT_REPLACE brings back a removed one, in which
+ * case this fails.
+ */
+static int
+JPT_merge_resync(struct JPT_info* info, struct JPT_merge* merge, int fd,
+                 const struct JPT_compaction_touch* touch)
+{
+  struct JPT_disktable* disktable = merge->result;
+  struct JPT_disktable source;
+  struct JPT_key_info* key_info = 0;
+  void* value = 0;
+  size_t i, value_size = 0, key_size;
+  unsigned int idx;
+  char* key;
+  char* cmp;
+  int found = 0, result = -1;
+
+  for(i = 0; i < merge->count; ++i)
+  {
+    /* The cell is read from the file itself, not from blocks that readers
+     * cached while it changed */
+    source = *merge->sources[i];
+    source.uncached = 1;
+
+    errno = 0;
+
+    if(0 == JPT_disktable_get(&source, touch->row, touch->columnidx, touch->hash,
+                              &value, &value_size, 0, 0, 0))
+      found = 1;
+    else if(errno && errno != ENOENT)
+      goto done;
+  }
+
+  key_size = strlen(touch->row) + COLUMN_PREFIX_SIZE + 1;
+  key = alloca(key_size);
+  cmp = alloca(key_size);
+
+  JPT_generate_key(key, touch->row, touch->columnidx);
+
+  idx = patricia_lookup(disktable->pat, key);
+
+  if(idx < disktable->key_info_count)
+  {
+    key_info = &merge->key_infos[idx];
+
+    if(key_info->size < key_size || (key_info->flags & JPT_KEY_REMOVED))
+      key_info = 0;
+    else if(key_size != pread64(fd, cmp, key_size, disktable->offset + key_info->offset))
+    {
+      asprintf(&JPT_last_error, "Failed to read merged disktable: %s", strerror(errno));
+
+      goto done;
+    }
+    else if(memcmp(cmp, key, key_size))
+      key_info = 0;
+  }
+
+  if(!key_info)
+  {
+    if(found)
+    {
+      asprintf(&JPT_last_error, "Key \"%s\" was restored during merge", touch->row);
+
+      goto done;
+    }
+
+    result = 0;
+
+    goto done;
+  }
+
+  if(!found)
+  {
+    key_info->flags |= JPT_KEY_REMOVED;
+    ++disktable->removed_count;
+  }
+  else
+  {
+    if(value_size > key_info->size - key_size)
+    {
+      asprintf(&JPT_last_error, "Key \"%s\" grew during merge", touch->row);
+
+      goto done;
+    }
+
+    if(-1 == JPT_pwrite_all(fd, value, value_size, disktable->offset + key_info->offset + key_size))
+      goto done;
+
+    key_info->size = key_size + value_size;
+  }
+
+  if(-1 == JPT_pwrite_all(fd, key_info, sizeof(struct JPT_key_info),
+                          disktable->key_info_offset + idx * sizeof(struct JPT_key_info)))
+    goto done;
+
+  result = 0;
+
+done:
+
+  free(value);
+
+  return result;
+}
+
+/* Lists the merged disktable in the manifest in place of the merged run,
+ * deletes the files of the run and replaces it by the merged disktable.
+ * JPT_merge_finish for the segmented layout.
+ */
+static int
+JPT_merge_finish_segment(struct JPT_info* info, struct JPT_merge* merge)
+{
+  struct JPT_disktable* disktable = merge->result;
+  size_t i;
+
+  /* The merged disktable is still addressed relative to its file */
+  for(i = 0; i < info->touched_count; ++i)
+  {
+    if(-1 == JPT_merge_resync(info, merge, merge->segment->fd, &info->touched[i]))
+      return -1;
+  }
+
+  if(-1 == JPT_manifest_commit(info, merge->first, merge->count, &merge->segment, 1, info->flush_count))
+    return -1;
+
+  for(i = 0; i < merge->count; ++i)
+    JPT_segment_unlink(info, merge->sources[i]->segment);
+
+  JPT_segment_place(info, disktable, merge->segment);
+  merge->segment = 0;
+
+  JPT_disktables_replace(info, merge->first, merge->count, disktable);
+
+  JPT_update_map(info);
+
+  if(info->map_size && !disktable->pat_mapped)
+  {
+    patricia_remap(disktable->pat, info->map + disktable->pat_offset);
+    disktable->pat_mapped = 1;
+
+    disktable->key_infos = (struct JPT_key_info*) (info->map + disktable->key_info_offset);
+    disktable->key_infos_mapped = 1;
+  }
+
+  return 0;
+}
+
+/* Replaces the merged disktables by the result of JPT_merge_write, if it
+ * succeeded and the merge was not aborted.  Returns 1 if compaction should
+ * continue, and -1 on error.
+ */
+static int
+JPT_merge_finish(struct JPT_info* info, struct JPT_merge* merge, int result)
+{
+  struct JPT_disktable* disktable = merge->result;
+  size_t i;
+
+  JPT_writer_enter(info);
+
+  if(result == -1)
+    goto discard;
+
+  /* A major compaction may already have freed the merged disktables */
+  if(JPT_merge_aborted(info))
+    goto discard;
+
+  if(merge->segment)
+  {
+    if(-1 == JPT_merge_finish_segment(info, merge))
+    {
+      result = -1;
+
+      goto discard;
+    }
+  }
+  else
+  {
+    if(info->map_size)
+    {
+      patricia_remap(disktable->pat, info->map + disktable->pat_offset);
+      disktable->pat_mapped = 1;
+
+      disktable->key_infos = (struct JPT_key_info*) (info->map + disktable->key_info_offset);
+      disktable->key_infos_mapped = 1;
+    }
+
+    for(i = 0; i < info->touched_count; ++i)
+    {
+      if(-1 == JPT_merge_resync(info, merge, info->fd, &info->touched[i]))
+      {
+        result = -1;
+
+        goto discard;
+      }
+    }
+
+    /* Readers may have cached parts of the region before it was written */
+    if(info->cache)
+      JPT_cache_invalidate(info->cache, merge->region, merge->region_size);
+
+    if(info->touched_count && -1 == fdatasync(info->fd))
+    {
+      asprintf(&JPT_last_error, "fdatasync failed: %s", strerror(errno));
+      result = -1;
+
+      goto discard;
+    }
+
+    if(-1 == JPT_pwrite_all(info->fd, JPT_MERGE_SIGNATURE, 4, merge->region))
+    {
+      result = -1;
+
+      goto discard;
+    }
+
+    if(info->flags & JPT_SYNC)
+      fdatasync(info->fd);
+
+    JPT_disktables_replace(info, merge->first, merge->count, disktable);
+  }
+
+  merge->result = 0;
+
+  JPT_bloom_refs_update(info);
+  JPT_disktable_advise(info, disktable);
+
+  ++info->disktable_generation;
+
+  __atomic_store_n(&info->lookup_count, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&info->lookup_searches, 0, __ATOMIC_RELAXED);
+
+  result = 1;
+
+discard:
+
+  if(merge->segment)
+  {
+    JPT_segment_discard(info, merge->segment);
+    merge->segment = 0;
+  }
+
+  /* No other merge can be running, but a major compaction that aborted this
+   * one may be */
+  if(!info->major_compacting)
+  {
+    for(disktable = info->first_disktable; disktable; disktable = disktable->next)
+      disktable->merging = 0;
+
+    JPT_compaction_clear_touched(info);
+  }
+
+  JPT_writer_leave(info);
+
+  JPT_merge_free(merge);
+
+  return (result == -1) ? -1 : 1;
+}
+
+/* Performs one merge, if one is needed.  Returns 1 if there may be more to
+ * do, 0 if not, and -1 on error.
+ */
+static int
+JPT_compaction_step(struct JPT_info* info)
+{
+  struct JPT_merge merge;
+  int result;
+
+  memset(&merge, 0, sizeof(merge));
+
+  if(1 != (result = JPT_merge_begin(info, &merge)))
+    return result;
+
+  result = JPT_merge_write(info, &merge);
+
+  if(merge.pin)
+    jpt_release_ref(info, merge.pin);
+
+  pthread_mutex_lock(&info->compaction_mutex);
+  info->compaction_merging = 0;
+  pthread_cond_broadcast(&info->compaction_cond);
+  pthread_mutex_unlock(&info->compaction_mutex);
+
+  return JPT_merge_finish(info, &merge, result);
+}
+
+static void*
+JPT_compaction_thread(void* arg)
+{
+  struct JPT_info* info = arg;
+  struct timespec deadline;
+  int result;
+
+  pthread_mutex_lock(&info->compaction_mutex);
+
+  while(!info->compaction_stop)
+  {
+    if(!info->compaction_wake)
+    {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += JPT_COMPACTION_INTERVAL;
+
+      if(ETIMEDOUT == pthread_cond_timedwait(&info->compaction_cond, &info->compaction_mutex, &deadline))
+        info->compaction_wake = 1;
+
+      continue;
+    }
+
+    info->compaction_wake = 0;
+    info->compaction_busy = 1;
+
+    pthread_mutex_unlock(&info->compaction_mutex);
+
+    /* Errors are retried when the thread next wakes up */
+    if(-1 == (result = JPT_compaction_step(info)))
+      JPT_clear_error();
+
+    pthread_mutex_lock(&info->compaction_mutex);
+
+    if(result == 1)
+      info->compaction_wake = 1;
+
+    info->compaction_busy = 0;
+
+    pthread_cond_broadcast(&info->compaction_cond);
+  }
+
+  pthread_mutex_unlock(&info->compaction_mutex);
+
+  return 0;
+}
+
+static int
+JPT_compaction_start(struct JPT_info* info)
+{
+  if(__atomic_load_n(&info->compaction_thread_started, __ATOMIC_ACQUIRE))
+  {
+    JPT_compaction_notify(info);
+
+    return 0;
+  }
+
+  info->compaction_stop = 0;
+  info->compaction_wake = 1;
+
+  if(0 != (errno = pthread_create(&info->compaction_thread, 0, JPT_compaction_thread, info)))
+  {
+    asprintf(&JPT_last_error, "pthread_create failed while starting compaction thread: %s", strerror(errno));
+
+    return -1;
+  }
+
+  __atomic_store_n(&info->compaction_thread_started, 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+/* Stops the compaction thread, discarding any merge in progress.  Must not
+ * be called with the writer lock held.
+ */
+static void
+JPT_compaction_stop(struct JPT_info* info)
+{
+  if(!__atomic_load_n(&info->compaction_thread_started, __ATOMIC_ACQUIRE))
+    return;
+
+  pthread_mutex_lock(&info->compaction_mutex);
+  info->compaction_stop = 1;
+  info->compaction_abort = 1;
+  pthread_cond_broadcast(&info->compaction_cond);
+  pthread_mutex_unlock(&info->compaction_mutex);
+
+  pthread_join(info->compaction_thread, 0);
+
+  __atomic_store_n(&info->compaction_thread_started, 0, __ATOMIC_RELEASE);
+}
+
+int
+jpt_set_compaction_policy(struct JPT_info* info,
+                          const struct JPT_compaction_policy* policy)
+{
+  int result;
+
+  JPT_clear_error();
+
+  if(!policy)
+  {
+    JPT_compaction_stop(info);
+
+    return 0;
+  }
+
+  if(policy->min_merge < 2 || policy->max_merge < policy->min_merge || !(policy->size_ratio >= 1))
+  {
+    asprintf(&JPT_last_error, "Invalid compaction policy (merge %u to %u disktables within a factor of %g)",
+             policy->min_merge, policy->max_merge, policy->size_ratio);
+    errno = EINVAL;
+
+    return -1;
+  }
+
+  JPT_writer_enter(info);
+
+  info->compaction_policy = *policy;
+
+  result = JPT_compaction_start(info);
+
+  JPT_writer_leave(info);
+
+  return result;
+}
+
+void
+jpt_get_compaction_policy(struct JPT_info* info,
+                          struct JPT_compaction_policy* policy)
+{
+  JPT_reader_enter(info);
+
+  *policy = info->compaction_policy;
+
+  JPT_reader_leave(info);
+}
+
+void
+jpt_compaction_wait(struct JPT_info* info)
+{
+  if(!__atomic_load_n(&info->compaction_thread_started, __ATOMIC_ACQUIRE))
+    return;
+
+  pthread_mutex_lock(&info->compaction_mutex);
+
+  info->compaction_wake = 1;
+  pthread_cond_broadcast(&info->compaction_cond);
+
+  while((info->compaction_wake || info->compaction_busy) && !info->compaction_stop)
+    pthread_cond_wait(&info->compaction_cond, &info->compaction_mutex);
+
+  pthread_mutex_unlock(&info->compaction_mutex);
+}
+
+int
+jpt_compact(struct JPT_info* info)
+{
+  int result;
+
+  TRACE((stderr, "jpt_compact(%p)", info));
+
+  JPT_clear_error();
+
+  JPT_writer_enter(info);
+
+  result = JPT_compact(info);
+
+  JPT_writer_leave(info);
+
+  TRACE((stderr, " = %d\n", result));
+
+  return result;
+}
+
+/* A disktable appended to the old table file during a major compaction, and
+ * copied to the new one at `new_start' */
+struct JPT_major_copy
+{
+  struct JPT_disktable* disktable;
+  off_t start;
+  off_t end;
+  off_t new_start;
+};
+
+/* Finds the part of the table file holding `disktable', from its signature to
+ * the end of its column directory */
+static void
+JPT_disktable_extent(const struct JPT_disktable* disktable, off_t* start, off_t* end)
+{
+  *start = disktable->pat_offset - disktable->bloom_size
+         - JPT_disktable_header_size(disktable->version);
+  *end = disktable->offset + disktable->data_size
+       + (off_t) disktable->column_count * sizeof(struct JPT_disktable_column);
+}
+
+/* Copies `size' bytes of the table file at `from' to `outfd' at `to' */
+static int
+JPT_copy_range(struct JPT_info* info, int outfd, off_t from, off_t to, off_t size)
+{
+  char* buffer;
+  size_t buffer_size;
+  ssize_t res;
+  int result = -1;
+
+  buffer_size = (size < JPT_COPY_BUFFER_SIZE) ? size : JPT_COPY_BUFFER_SIZE;
+
+  if(!(buffer = malloc(buffer_size ? buffer_size : 1)))
+  {
+    asprintf(&JPT_last_error, "malloc failed while copying disktable: %s", strerror(errno));
+
+    return -1;
+  }
+
+  while(size)
+  {
+    res = pread64(info->fd, buffer, (size < buffer_size) ? size : buffer_size, from);
+
+    if(res <= 0)
+    {
+      if(!res)
+        asprintf(&JPT_last_error, "Unexpected end of table file while copying disktable");
+      else
+        asprintf(&JPT_last_error, "Read failed while copying disktable: %s", strerror(errno));
+
+      goto done;
+    }
+
+    if(-1 == JPT_pwrite_all(outfd, buffer, res, to))
+      goto done;
+
+    from += res;
+    to += res;
+    size -= res;
+  }
+
+  result = 0;
+
+done:
+
+  free(buffer);
+
+  return result;
+}
+
+/* Lists the disktables attached after the last one in `copies', or after the
+ * disktables being merged if there are none, placing them after `*end' in the
+ * new file.  Changes to them are recorded from now on.  Must be called with
+ * the writer lock held.
+ */
+static int
+JPT_major_list_new(struct JPT_info* info, struct JPT_merge* merge,
+                   struct JPT_major_copy** copies, size_t* copy_count,
+                   off_t* end)
+{
+  struct JPT_major_copy* new_copies;
+  struct JPT_disktable* disktable;
+  size_t count = *copy_count;
+
+  disktable = count ? (*copies)[count - 1].disktable : merge->sources[merge->count - 1];
+
+  for(disktable = disktable->next; disktable; disktable = disktable->next)
+    ++count;
+
+  if(count == *copy_count)
+    return 0;
+
+  if(!(new_copies = realloc(*copies, count * sizeof(struct JPT_major_copy))))
+  {
+    asprintf(&JPT_last_error, "realloc failed while listing new disktables: %s", strerror(errno));
+
+    return -1;
+  }
+
+  *copies = new_copies;
+
+  disktable = *copy_count ? new_copies[*copy_count - 1].disktable : merge->sources[merge->count - 1];
+
+  for(disktable = disktable->next; disktable; disktable = disktable->next)
+  {
+    struct JPT_major_copy* copy = &new_copies[(*copy_count)++];
+
+    copy->disktable = disktable;
+    JPT_disktable_extent(disktable, &copy->start, &copy->end);
+    copy->new_start = *end;
+    *end += copy->end - copy->start;
+
+    disktable->merging = 1;
+  }
+
+  return 0;
+}
+
+/* Brings a cell changed in a copied disktable up to date in the new file.
+ * The cell is found by its trie position alone; if that is another key,
+ * copying it does no harm.
+ */
+static int
+JPT_major_resync_copy(struct JPT_info* info, int outfd, const struct JPT_major_copy* copy,
+                      const struct JPT_compaction_touch* touch)
+{
+  struct JPT_disktable disktable_copy = *copy->disktable;
+  struct JPT_disktable* disktable = &disktable_copy;
+  struct JPT_key_info key_info;
+  off_t delta = copy->new_start - copy->start;
+  size_t key_size;
+  unsigned int idx;
+  char* key;
+
+  key_size = strlen(touch->row) + COLUMN_PREFIX_SIZE + 1;
+  key = alloca(key_size);
+
+  JPT_generate_key(key, touch->row, touch->columnidx);
+
+  idx = patricia_lookup(disktable->pat, key);
+
+  if(idx >= disktable->key_info_count)
+    return 0;
+
+  /* Like JPT_copy_range, read the file rather than the block cache */
+  disktable->uncached = 1;
+
+  if(-1 == JPT_DISKTABLE_READ_KEYINFO(disktable, &key_info, idx))
+    return -1;
+
+  if(-1 == JPT_pwrite_all(outfd, &key_info, sizeof(key_info),
+                          disktable->key_info_offset + delta + idx * sizeof(key_info)))
+    return -1;
+
+  return JPT_copy_range(info, outfd, disktable->offset + key_info.offset,
+                        disktable->offset + key_info.offset + delta, key_info.size);
+}
+
+/* Hides the keys of a column removed during the merge from the merged
+ * disktable, as JPT_remove_column does */
+static int
+JPT_major_hide_column(struct JPT_merge* merge, int outfd, uint32_t columnidx)
+{
+  struct JPT_disktable* disktable = merge->result;
+  size_t first, end;
+  char zero = 0;
+
+  if(-1 == JPT_disktable_column_range(disktable, columnidx, &first, &end))
+    return -1;
+
+  for(; first < end; ++first)
+  {
+    if(-1 == JPT_pwrite_all(outfd, &zero, 1, disktable->offset + merge->key_infos[first].offset
+                                             + COLUMN_PREFIX_SIZE))
+      return -1;
+  }
+
+  return 0;
+}
+
+/* Records that a column was removed while a major compaction merges, so that
+ * it can be removed from the result.  Called with the writer lock held.
+ */
+static void
+JPT_major_remove_column(struct JPT_info* info, uint32_t columnidx)
+{
+  uint32_t* new_columns;
+  size_t new_alloc;
+
+  if(!info->major_compacting)
+    return;
+
+  if(info->removed_column_count == info->removed_column_alloc)
+  {
+    new_alloc = info->removed_column_alloc ? info->removed_column_alloc * 2 : 16;
+
+    if(!(new_columns = realloc(info->removed_columns, new_alloc * sizeof(uint32_t))))
+    {
+      info->touch_failed = 1;
+
+      return;
+    }
+
+    info->removed_columns = new_columns;
+    info->removed_column_alloc = new_alloc;
+  }
+
+  info->removed_columns[info->removed_column_count++] = columnidx;
+}
+
+/* Takes a snapshot of the disktables for jpt_major_compact to merge, and
+ * starts recording changes to them.  Must be called with the writer lock
+ * held.
+ */
+static int
+JPT_major_begin(struct JPT_info* info, struct JPT_merge* merge)
+{
+  struct JPT_disktable* disktable;
+  size_t i;
+
+  merge->count = info->disktable_count;
+  merge->sources = malloc(merge->count * sizeof(struct JPT_disktable*));
+  merge->copies = malloc(merge->count * sizeof(struct JPT_disktable));
+
+  if(!merge->sources || !merge->copies)
+  {
+    asprintf(&JPT_last_error, "malloc failed while starting major compaction: %s", strerror(errno));
+
+    return -1;
+  }
+
+  for(disktable = info->first_disktable, i = 0; disktable; disktable = disktable->next, ++i)
+  {
+    if(-1 == JPT_DISKTABLE_LOAD(disktable, JPT_LAZY_TRIE | JPT_LAZY_COLUMNS))
+      return -1;
+
+    merge->sources[i] = disktable;
+  }
+
+  if(info->map_size && !(merge->pin = JPT_map_pin(info)))
+  {
+    asprintf(&JPT_last_error, "calloc failed while starting major compaction: %s", strerror(errno));
+
+    return -1;
+  }
+
+  merge->snapshot.map = info->map;
+  merge->snapshot.map_size = info->map_size;
+  merge->snapshot.file_size = info->file_size;
+
+  for(i = 0; i < merge->count; ++i)
+  {
+    merge->copies[i] = *merge->sources[i];
+    merge->copies[i].uncached = 1;
+    merge->copies[i].snapshot = &merge->snapshot;
+    merge->sources[i]->merging = 1;
+  }
+
+  JPT_compaction_clear_touched(info);
+  info->removed_column_count = 0;
+  info->major_compacting = 1;
+
+  return 0;
+}
+
+/* A range of columns that one thread of jpt_major_compact merges into a
+ * disktable of its own.  The disktable is written inside a region of the new
+ * file that is large enough whatever the number of duplicates; the space
+ * left over before and after it is covered by regions with
+ * JPT_SKIP_SIGNATURE.  With the segmented layout, each part is written to a
+ * segment of its own instead.
+ */
+struct JPT_major_part
+{
+  struct JPT_info* info;
+  struct JPT_merge merge;
+  struct JPT_segment* segment;
+  int fd;
+
+  /* The range starts with this column, and ends where the next part starts */
+  uint32_t first_column;
+
+  /* The end of the merged disktable, when written */
+  off_t end;
+
+  int last;
+  int result;
+  char* error;
+  int error_errno;
+
+  pthread_t thread;
+};
+
+struct JPT_major_column
+{
+  uint32_t columnidx;
+  uint64_t count;
+};
+
+static int
+JPT_major_column_cmp(const void* lhs, const void* rhs)
+{
+  const struct JPT_major_column* a = lhs;
+  const struct JPT_major_column* b = rhs;
+
+  return (a->columnidx > b->columnidx) - (a->columnidx < b->columnidx);
+}
+
+/* Returns the index of the first key of `disktable' in a column not before
+ * `columnidx' */
+static size_t
+JPT_major_column_key(const struct JPT_disktable* disktable, uint32_t columnidx)
+{
+  size_t first = 0, len = disktable->column_count, half;
+
+  while(len > 0)
+  {
+    half = len >> 1;
+
+    if(disktable->columns[first + half].columnidx < columnidx)
+    {
+      first += half + 1;
+      len -= half + 1;
+    }
+    else
+      len = half;
+  }
+
+  return (first == disktable->column_count) ? disktable->key_info_count
+                                            : disktable->columns[first].first;
+}
+
+/* Sets up a part merging the keys of `merge' from the `first' key of each
+ * copy up to the `end' key, and reserves its region from `*offset' on.  If
+ * `first' is null, all keys are merged.
+ */
+static int
+JPT_major_part_init(struct JPT_info* info, struct JPT_merge* merge,
+                    struct JPT_major_part* part, const size_t* first,
+                    const size_t* end, size_t columns, int fd, off_t* offset)
+{
+  struct JPT_key_info key_info;
+  uint64_t rows = 0, data_size = 0;
+  off_t segment_offset = 0;
+  size_t i;
+
+  part->info = info;
+  part->fd = fd;
+
+  if(info->segmented)
+  {
+    if(!(part->segment = JPT_segment_create(info)))
+      return -1;
+
+    part->fd = part->segment->fd;
+    offset = &segment_offset;
+  }
+  part->merge.count = merge->count;
+  part->merge.sources = merge->sources;
+  part->merge.copies = malloc(merge->count * sizeof(struct JPT_disktable));
+  part->merge.starts = malloc(merge->count * sizeof(size_t));
+
+  if((part->merge.result = malloc(sizeof(struct JPT_disktable))))
+    memset(part->merge.result, 0, sizeof(struct JPT_disktable));
+
+  if(!part->merge.copies || !part->merge.starts || !part->merge.result)
+  {
+    asprintf(&JPT_last_error, "malloc failed while starting major compaction: %s", strerror(errno));
+
+    return -1;
+  }
+
+  for(i = 0; i < merge->count; ++i)
+  {
+    struct JPT_disktable* copy = &part->merge.copies[i];
+
+    *copy = merge->copies[i];
+
+    if(!first)
+    {
+      part->merge.starts[i] = 0;
+      rows += copy->key_info_count;
+      data_size += copy->data_size;
+
+      continue;
+    }
+
+    /* Keys are stored in order, and so is their data */
+    part->merge.starts[i] = first[i];
+    copy->key_info_count = end[i];
+
+    if(first[i] == end[i])
+      continue;
+
+    rows += end[i] - first[i];
+
+    if(-1 == JPT_DISKTABLE_READ_KEYINFO(copy, &key_info, end[i] - 1))
+      return -1;
+
+    data_size += key_info.offset + key_info.size;
+
+    if(-1 == JPT_DISKTABLE_READ_KEYINFO(copy, &key_info, first[i]))
+      return -1;
+
+    data_size -= key_info.offset;
+  }
+
+  if(rows >= UINT_MAX || data_size > UINT32_MAX)
+  {
+    asprintf(&JPT_last_error, "Major compaction would give a disktable with %llu keys and %llu bytes of data",
+             (unsigned long long) rows, (unsigned long long) data_size);
+    errno = EFBIG;
+
+    return -1;
+  }
+
+  part->merge.max_rows = rows;
+
+  /* Sized for the total key count, as duplicates are not yet known */
+  if(-1 == JPT_bloom_filter_create(part->merge.result, rows, info->bloom_bits))
+    return -1;
+
+  if(!first)
+    columns = rows;
+
+  part->merge.region = *offset;
+  part->merge.data_offset = *offset + sizeof(struct JPT_merge_header) + JPT_disktable_header_size(JPT_VERSION)
+                          + part->merge.result->bloom_size + patricia_size(rows)
+                          + rows * sizeof(struct JPT_key_info);
+  part->merge.region_size = part->merge.data_offset - *offset + data_size
+                          + columns * sizeof(struct JPT_disktable_column)
+                          + sizeof(struct JPT_merge_header);
+
+  *offset += part->merge.region_size;
+
+  return 0;
+}
+
+/* Divides the keys of `merge' into ranges of columns of similar size, one for
+ * each thread, and sets up a part for each.  If a disktable has no column
+ * directory, there is only one part.
+ */
+static int
+JPT_major_split(struct JPT_info* info, struct JPT_merge* merge, int fd,
+                struct JPT_major_part** parts, size_t* part_count)
+{
+  struct JPT_major_column* columns = 0;
+  size_t* bounds = 0;
+  size_t i, j, k, column_count = 0, count, first_col;
+  uint64_t total = 0, sum;
+  off_t offset = 0;
+  int result = -1;
+
+  for(i = 0; i < merge->count; ++i)
+  {
+    if(!merge->copies[i].columns && merge->copies[i].key_info_count)
+      break;
+
+    column_count += merge->copies[i].column_count;
+  }
+
+  count = 1;
+
+  if(i == merge->count && column_count)
+  {
+    if(!(columns = malloc(column_count * sizeof(struct JPT_major_column))))
+    {
+      asprintf(&JPT_last_error, "malloc failed while dividing major compaction: %s", strerror(errno));
+
+      return -1;
+    }
+
+    for(i = 0, k = 0; i < merge->count; ++i)
+    {
+      for(j = 0; j < merge->copies[i].column_count; ++j, ++k)
+      {
+        columns[k].columnidx = merge->copies[i].columns[j].columnidx;
+        columns[k].count = merge->copies[i].columns[j].count;
+        total += columns[k].count;
+      }
+    }
+
+    qsort(columns, column_count, sizeof(struct JPT_major_column), JPT_major_column_cmp);
+
+    for(i = 1, k = 0; i < column_count; ++i)
+    {
+      if(columns[i].columnidx == columns[k].columnidx)
+        columns[k].count += columns[i].count;
+      else
+        columns[++k] = columns[i];
+    }
+
+    column_count = k + 1;
+
+    count = info->major_compact_threads;
+
+    if(count > total / JPT_MAJOR_PART_KEYS)
+      count = total / JPT_MAJOR_PART_KEYS;
+
+    if(count > column_count)
+      count = column_count;
+
+    if(!count)
+      count = 1;
+  }
+
+  if(!(*parts = calloc(count, sizeof(struct JPT_major_part))))
+  {
+    asprintf(&JPT_last_error, "calloc failed while dividing major compaction: %s", strerror(errno));
+
+    goto done;
+  }
+
+  *part_count = 0;
+
+  if(count == 1)
+  {
+    (*parts)[0].last = 1;
+    *part_count = 1;
+
+    result = JPT_major_part_init(info, merge, &(*parts)[0], 0, 0, 0, fd, &offset);
+
+    goto done;
+  }
+
+  if(!(bounds = malloc(2 * merge->count * sizeof(size_t))))
+  {
+    asprintf(&JPT_last_error, "malloc failed while dividing major compaction: %s", strerror(errno));
+
+    goto done;
+  }
+
+  for(i = 0; i < merge->count; ++i)
+    bounds[i] = 0;
+
+  /* Each part but the last ends once it has its share of the keys */
+  for(i = 0, first_col = 0, sum = 0; i < column_count; ++i)
+  {
+    struct JPT_major_part* part = &(*parts)[*part_count];
+
+    sum += columns[i].count;
+
+    if(i + 1 < column_count && sum < total * (*part_count + 1) / count)
+      continue;
+
+    part->first_column = *part_count ? columns[first_col].columnidx : 0;
+    part->last = (i + 1 == column_count);
+
+    for(j = 0; j < merge->count; ++j)
+    {
+      bounds[merge->count + j] = part->last ? merge->copies[j].key_info_count
+                                            : JPT_major_column_key(&merge->copies[j], columns[i + 1].columnidx);
+    }
+
+    ++*part_count;
+
+    if(-1 == JPT_major_part_init(info, merge, part, bounds, bounds + merge->count,
+                                 i + 1 - first_col, fd, &offset))
+      goto done;
+
+    memcpy(bounds, bounds + merge->count, merge->count * sizeof(size_t));
+    first_col = i + 1;
+  }
+
+  result = 0;
+
+done:
+
+  free(bounds);
+  free(columns);
+
+  return result;
+}
+
+/* Merges one part into the new file, and covers the space it does not use
+ * with skipped regions */
+static int
+JPT_major_part_write(struct JPT_major_part* part)
+{
+  struct JPT_merge_header header;
+  struct JPT_disktable* disktable = part->merge.result;
+  off_t start;
+
+  if(-1 == JPT_merge_table(part->info, &part->merge, part->fd, 0, &start))
+    return -1;
+
+  part->end = disktable->offset + disktable->data_size
+            + (off_t) disktable->column_count * sizeof(struct JPT_disktable_column);
+
+  if(part->segment)
+  {
+    part->segment->start = start;
+
+    return 0;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.signature, JPT_SKIP_SIGNATURE, 4);
+  header.size = start - part->merge.region;
+
+  if(-1 == JPT_pwrite_all(part->fd, &header, sizeof(header), part->merge.region))
+    return -1;
+
+  /* Disktables copied from the old file follow the last part directly */
+  if(part->last)
+    return 0;
+
+  header.size = part->merge.region + part->merge.region_size - part->end;
+
+  if(-1 == JPT_pwrite_all(part->fd, &header, sizeof(header), part->end))
+    return -1;
+
+  return 0;
+}
+
+static void*
+JPT_major_part_thread(void* arg)
+{
+  struct JPT_major_part* part = arg;
+
+  if(-1 == (part->result = JPT_major_part_write(part)))
+  {
+    part->error = JPT_last_error;
+    part->error_errno = errno;
+    JPT_last_error = 0;
+  }
+
+  return 0;
+}
+
+/* Merges all parts, each in a thread of its own but the first, which is
+ * merged by the calling thread.  Called without any lock held.
+ */
+static int
+JPT_major_write(struct JPT_major_part* parts, size_t part_count, off_t* end)
+{
+  size_t i;
+  int result = 0;
+
+  for(i = 1; i < part_count; ++i)
+  {
+    if(0 != pthread_create(&parts[i].thread, 0, JPT_major_part_thread, &parts[i]))
+    {
+      parts[i].thread = pthread_self();
+      JPT_major_part_thread(&parts[i]);
+    }
+  }
+
+  JPT_major_part_thread(&parts[0]);
+
+  for(i = 1; i < part_count; ++i)
+  {
+    if(!pthread_equal(parts[i].thread, pthread_self()))
+      pthread_join(parts[i].thread, 0);
+  }
+
+  for(i = 0; i < part_count; ++i)
+  {
+    if(parts[i].result == -1 && !result)
+    {
+      free(JPT_last_error);
+      JPT_last_error = parts[i].error;
+      errno = parts[i].error_errno;
+      parts[i].error = 0;
+
+      result = -1;
+    }
+
+    free(parts[i].error);
+  }
+
+  *end = parts[part_count - 1].end;
+
+  return result;
+}
+
+/* Returns the part holding the keys of column `columnidx' */
+static struct JPT_major_part*
+JPT_major_part_of(struct JPT_major_part* parts, size_t part_count, uint32_t columnidx)
+{
+  while(part_count > 1 && parts[part_count - 1].first_column > columnidx)
+    --part_count;
+
+  return &parts[part_count - 1];
+}
+
+static void
+JPT_major_parts_free(struct JPT_major_part* parts, size_t part_count)
+{
+  size_t i;
+
+  if(!parts)
+    return;
+
+  for(i = 0; i < part_count; ++i)
+  {
+    /* Shared with the snapshot */
+    parts[i].merge.sources = 0;
+
+    JPT_merge_free(&parts[i].merge);
+
+    if(parts[i].segment)
+      JPT_segment_discard(parts[i].info, parts[i].segment);
+  }
+
+  free(parts);
+}
+
+/* Copies the disktables attached during the merge to the new file, brings
+ * changes made meanwhile over, and puts the new file in place of the old
+ * one.  Must be called with the writer lock held.
+ */
+static int
+JPT_major_finish(struct JPT_info* info, struct JPT_merge* merge,
+                 struct JPT_major_part* parts, size_t part_count, int outfd,
+                 const char* newname, struct JPT_major_copy** copies,
+                 size_t* copy_count, size_t removed_columns_seen, off_t end)
+{
+  struct JPT_disktable* disktable;
+  struct JPT_compaction_touch* touch;
+  size_t i, j, copied = *copy_count;
+  off_t delta;
+
+  /* The disktable of a memtable being flushed would be written to the old
+   * file */
+  if(-1 == JPT_flush_wait(info))
+    return -1;
+
+  if(-1 == JPT_major_list_new(info, merge, copies, copy_count, &end))
+    return -1;
+
+  if(-1 == JPT_bloom_refs_reserve(info, part_count + *copy_count))
+    return -1;
+
+  for(i = copied; i < *copy_count; ++i)
+  {
+    if(-1 == JPT_copy_range(info, outfd, (*copies)[i].start, (*copies)[i].new_start,
+                            (*copies)[i].end - (*copies)[i].start))
+      return -1;
+  }
+
+  if(info->touch_failed)
+  {
+    asprintf(&JPT_last_error, "Out of memory while recording changes during major compaction");
+    errno = ENOMEM;
+
+    return -1;
+  }
+
+  /* Whole disktables are copied again if a column was removed after they
+   * were first copied */
+  if(info->removed_column_count > removed_columns_seen)
+  {
+    for(i = 0; i < copied; ++i)
+    {
+      if(-1 == JPT_copy_range(info, outfd, (*copies)[i].start, (*copies)[i].new_start,
+                              (*copies)[i].end - (*copies)[i].start))
+        return -1;
+    }
+
+    copied = 0;
+  }
+
+  for(i = 0; i < info->touched_count; ++i)
+  {
+    touch = &info->touched[i];
+
+    if(-1 == JPT_merge_resync(info, &JPT_major_part_of(parts, part_count, touch->columnidx)->merge,
+                              outfd, touch))
+      return -1;
+
+    for(j = 0; j < copied; ++j)
+    {
+      if(-1 == JPT_major_resync_copy(info, outfd, &(*copies)[j], touch))
+        return -1;
+    }
+  }
+
+  for(i = 0; i < info->removed_column_count; ++i)
+  {
+    if(-1 == JPT_major_hide_column(&JPT_major_part_of(parts, part_count, info->removed_columns[i])->merge,
+                                   outfd, info->removed_columns[i]))
+      return -1;
+  }
+
+  if(-1 == fsync(outfd))
+  {
+    asprintf(&JPT_last_error, "fsync failed during major compaction: %s", strerror(errno));
+
+    return -1;
+  }
+
+  /* Until the log's record of the table size is updated below, it would be
+   * wrong for one of the two files */
+  if(!info->logfile_empty && -1 == JPT_log_write_header(info, JPT_LOG_UNKNOWN_SIZE))
+    return -1;
+
+  if(-1 == rename(newname, info->filename))
+  {
+    asprintf(&JPT_last_error, "Failed to rename `%s' to `%s': %s", newname, info->filename, strerror(errno));
+
+    return -1;
+  }
+
+  /* Let the old mapping go, unless values returned by jpt_get_ref use it */
+  if(merge->pin)
+  {
+    jpt_release_ref(info, merge->pin);
+    merge->pin = 0;
+  }
+
+  info->first_disktable = 0;
+  info->disktable_count = 0;
+  disktable = 0;
+
+  for(i = 0; i < merge->count; ++i)
+    JPT_disktable_free(merge->sources[i]);
+
+  close(info->fd);
+  info->fd = outfd;
+  info->index_end = 0;
+
+  JPT_map_reset(info);
+
+  if(info->cache)
+    JPT_cache_clear(info->cache);
+
+  for(i = 0; i < part_count; ++i)
+  {
+    struct JPT_disktable* result = parts[i].merge.result;
+
+    parts[i].merge.result = 0;
+
+    result->info = info;
+    result->next = 0;
+
+    if(disktable)
+      disktable->next = result;
+    else
+      info->first_disktable = result;
+
+    disktable = result;
+
+    ++info->disktable_count;
+  }
+
+  for(i = 0; i < *copy_count; ++i)
+  {
+    delta = (*copies)[i].new_start - (*copies)[i].start;
+
+    disktable->next = (*copies)[i].disktable;
+    disktable = disktable->next;
+
+    disktable->pat_offset += delta;
+    disktable->key_info_offset += delta;
+    disktable->offset += delta;
+
+    ++info->disktable_count;
+  }
+
+  info->last_disktable = disktable;
+
+  JPT_bloom_refs_update(info);
+  JPT_update_map(info);
+
+  ++info->disktable_generation;
+
+  if(!info->logfile_empty && -1 == JPT_log_write_header(info, info->file_size))
+    return -1;
+
+  return 0;
+}
+
+/* Lists the merged disktables in the manifest in place of the disktables
+ * they were merged from, and deletes the files of those.  Disktables flushed
+ * during the merge stay in their files, but all disktables get new parts of
+ * the address range, so that it does not grow for good.  JPT_major_finish for
+ * the segmented layout.  Must be called with the writer lock held.
+ */
+static int
+JPT_major_finish_segments(struct JPT_info* info, struct JPT_merge* merge,
+                          struct JPT_major_part* parts, size_t part_count)
+{
+  struct JPT_segment** segments;
+  struct JPT_disktable* disktable;
+  struct JPT_disktable* rest;
+  struct JPT_major_part* part;
+  size_t i, rest_count = 0;
+
+  if(info->touch_failed)
+  {
+    asprintf(&JPT_last_error, "Out of memory while recording changes during major compaction");
+    errno = ENOMEM;
+
+    return -1;
+  }
+
+  rest = merge->sources[merge->count - 1]->next;
+
+  for(disktable = rest; disktable; disktable = disktable->next)
+    ++rest_count;
+
+  if(-1 == JPT_bloom_refs_reserve(info, part_count + rest_count))
+    return -1;
+
+  /* The merged disktables are still addressed relative to their files */
+  for(i = 0; i < info->touched_count; ++i)
+  {
+    part = JPT_major_part_of(parts, part_count, info->touched[i].columnidx);
+
+    if(-1 == JPT_merge_resync(info, &part->merge, part->fd, &info->touched[i]))
+      return -1;
+  }
+
+  for(i = 0; i < info->removed_column_count; ++i)
+  {
+    part = JPT_major_part_of(parts, part_count, info->removed_columns[i]);
+
+    if(-1 == JPT_major_hide_column(&part->merge, part->fd, info->removed_columns[i]))
+      return -1;
+  }
+
+  segments = alloca(part_count * sizeof(struct JPT_segment*));
+
+  for(i = 0; i < part_count; ++i)
+    segments[i] = parts[i].segment;
+
+  if(-1 == JPT_manifest_commit(info, 0, merge->count, segments, part_count, info->flush_count))
+    return -1;
+
+  if(merge->pin)
+  {
+    jpt_release_ref(info, merge->pin);
+    merge->pin = 0;
+  }
+
+  info->first_disktable = 0;
+  info->disktable_count = 0;
+  disktable = 0;
+
+  for(i = 0; i < merge->count; ++i)
+  {
+    JPT_segment_unlink(info, merge->sources[i]->segment);
+    JPT_disktable_free(merge->sources[i]);
+  }
+
+  for(i = 0; i < part_count; ++i)
+  {
+    struct JPT_disktable* result = parts[i].merge.result;
+
+    parts[i].merge.result = 0;
+
+    result->info = info;
+    result->next = 0;
+
+    if(disktable)
+      disktable->next = result;
+    else
+      info->first_disktable = result;
+
+    disktable = result;
+
+    ++info->disktable_count;
+  }
+
+  disktable->next = rest;
+  info->disktable_count += rest_count;
+
+  JPT_map_reset(info);
+
+  if(info->cache)
+    JPT_cache_clear(info->cache);
+
+  info->file_size = 0;
+
+  for(disktable = info->first_disktable, i = 0; disktable; disktable = disktable->next, ++i)
+  {
+    if(i < part_count)
+    {
+      JPT_segment_place(info, disktable, parts[i].segment);
+      parts[i].segment = 0;
+    }
+    else
+      JPT_segment_place(info, disktable, disktable->segment);
+
+    info->last_disktable = disktable;
+  }
+
+  JPT_bloom_refs_update(info);
+  JPT_update_map(info);
+
+  ++info->disktable_generation;
+
+  return 0;
+}
+
+int
+jpt_major_compact(struct JPT_info* info)
+{
+  struct JPT_merge merge;
+  struct JPT_major_part* parts = 0;
+  struct JPT_major_copy* copies = 0;
+  struct JPT_disktable* disktable;
+  size_t i, part_count = 0, copy_count = 0, removed_columns_seen;
+  char* newname;
+  off_t end;
+  int outfd = -1;
+  int result = -1;
+
+  TRACE((stderr, "jpt_major_compact(%p)\n", info));
+
+  JPT_clear_error();
+
+  memset(&merge, 0, sizeof(merge));
+
+  newname = alloca(strlen(info->filename) + 8);
+  strcpy(newname, info->filename);
+  strcat(newname, ".XXXXXX");
+
+  pthread_mutex_lock(&info->major_compact_mutex);
+
+  JPT_writer_enter(info);
+
+  /* The table file is about to be replaced */
+  JPT_merge_cancel(info);
+
+  if(-1 == JPT_compact(info))
+    goto done;
+
+  if(info->disktable_count < 2)
+  {
+    result = 0;
+
+    goto done;
+  }
+
+  if(!info->segmented && -1 == (outfd = mkstemp(newname)))
+  {
+    asprintf(&JPT_last_error, "Failed to create `%s': %s", newname, strerror(errno));
+
+    goto done;
+  }
+
+  if(-1 == JPT_major_begin(info, &merge))
+    goto done;
+
+  JPT_writer_leave(info);
+
+  /* Readers and writers carry on using the old disktables while they are
+   * merged.  New memtables are flushed to the old file as usual.  */
+  if(-1 == JPT_major_split(info, &merge, outfd, &parts, &part_count)
+  || -1 == JPT_major_write(parts, part_count, &end))
+  {
+    JPT_writer_enter(info);
+
+    goto done;
+  }
+
+  if(info->segmented)
+  {
+    JPT_writer_enter(info);
+
+    result = JPT_major_finish_segments(info, &merge, parts, part_count);
+
+    goto done;
+  }
+
+  /* Copy what was flushed meanwhile before taking the lock for good */
+  JPT_writer_enter(info);
+
+  if(-1 == JPT_major_list_new(info, &merge, &copies, &copy_count, &end))
+    goto done;
+
+  removed_columns_seen = info->removed_column_count;
+
+  JPT_writer_leave(info);
+
+  for(i = 0; i < copy_count; ++i)
+  {
+    if(-1 == JPT_copy_range(info, outfd, copies[i].start, copies[i].new_start,
+                            copies[i].end - copies[i].start))
+    {
+      JPT_writer_enter(info);
+
+      goto done;
+    }
+  }
+
+  JPT_writer_enter(info);
+
+  result = JPT_major_finish(info, &merge, parts, part_count, outfd, newname,
+                            &copies, &copy_count, removed_columns_seen, end);
+
+  /* The new file may be in place even if something failed afterwards */
+  if(info->fd == outfd)
+    outfd = -1;
+
+done:
+
+  if(info->major_compacting)
+  {
+    for(disktable = info->first_disktable; disktable; disktable = disktable->next)
+      disktable->merging = 0;
+
+    JPT_compaction_clear_touched(info);
+    info->removed_column_count = 0;
+    info->major_compacting = 0;
+  }
+
+  ++info->major_compact_count;
+
+  JPT_writer_leave(info);
+
+  pthread_mutex_unlock(&info->major_compact_mutex);
+
+  if(merge.pin)
+    jpt_release_ref(info, merge.pin);
+
+  JPT_major_parts_free(parts, part_count);
+  JPT_merge_free(&merge);
+  free(copies);
+
+  if(outfd != -1)
+  {
+    close(outfd);
+    unlink(newname);
+  }
+
+  JPT_compaction_notify(info);
+
+  return result;
+}
+
+int
+jpt_set_bloom_bits(struct JPT_info* info, unsigned int bits_per_key)
+{
+  JPT_clear_error();
+
+  if(!bits_per_key || bits_per_key > 64)
+  {
+    asprintf(&JPT_last_error, "Bloom filter bits per key must be between 1 and 64 (got %u)", bits_per_key);
+    errno = EINVAL;
+
+    return -1;
+  }
+
+  JPT_writer_enter(info);
+
+  info->bloom_bits = bits_per_key;
+
+  JPT_writer_leave(info);
+
+  return 0;
+}
+
+static int
+JPT_insert(struct JPT_info* info,
+           const char* row, const char* column,
+           const void* value, size_t value_size,
+           uint64_t* timestamp, int flags)
+{
+  struct JPT_bloom_key bloom_key;
+  unsigned char* maybe = 0;
+  uint32_t columnidx;
+  size_t row_size = strlen(row) + 1;
+  char* key = alloca(strlen(row) + COLUMN_PREFIX_SIZE + 1);
+  size_t i = 0;
+  int written = 0;
+
+  if(!row[0])
+  {
+    asprintf(&JPT_last_error, "Empty row name");
+    errno = EINVAL;
+
+    return -1;
+  }
+
+  if(row_size + COLUMN_PREFIX_SIZE - 1 > PATRICIA_MAX_KEYLENGTH)
+  {
+    asprintf(&JPT_last_error, "Row name too long (%zu, maximum is %zu)",
+             row_size - 1,
+             (size_t) (PATRICIA_MAX_KEYLENGTH - COLUMN_PREFIX_SIZE));
+    errno = EINVAL;
+
+    return -1;
+  }
+
+  columnidx = JPT_get_column_idx(info, column, JPT_COL_CREATE);
+
+  if(columnidx == JPT_INVALID_COLUMN)
+    return -1;
+
+  JPT_generate_key(key, row, columnidx);
+  JPT_bloom_key_init(&bloom_key, key);
+
+  if(info->frozen && 0 == JPT_memtable_has_key(info->frozen, row, columnidx))
+  {
+    if(!(flags & (JPT_APPEND | JPT_REPLACE)))
+    {
+      errno = EEXIST;
+
+      return -1;
+    }
+
+    /* The frozen memtable cannot be modified, so the old value must reach a
+     * disktable before it can be replaced.  */
+    if((flags & JPT_REPLACE) && -1 == JPT_flush_wait(info))
+      return -1;
+  }
+
+  if((flags & JPT_REPLACE) || !(flags & JPT_APPEND))
+  {
+    maybe = alloca(info->disktable_count + 1);
+    JPT_bloom_probe(info, &bloom_key, maybe);
+  }
+
+  if(flags & JPT_REPLACE)
+  {
+    struct JPT_disktable* d = info->first_disktable;
+
+    while(d)
+    {
+      if(maybe[i++])
+      {
+        if(value_size)
+        {
+          ssize_t result;
+
+          result = JPT_disktable_overwrite(d, row, columnidx, bloom_key.hash, value, value_size);
+
+          if(result == -1 && errno != ENOENT)
+            return -1;
+
+          if(result > 0)
+          {
+            value = (char*) value + result;
+            value_size -= result;
+            written = 1;
+          }
+        }
+        else
+        {
+          if(-1 == JPT_disktable_remove(d, row, columnidx, bloom_key.hash) && errno != ENOENT)
+            return -1;
+        }
+      }
+
+      d = d->next;
+    }
+  }
+  else if(!(flags & JPT_APPEND))
+  {
+    struct JPT_disktable* d = info->first_disktable;
+
+    while(d)
+    {
+      if(maybe[i++] && 0 == JPT_disktable_has_key(d, row, columnidx, bloom_key.hash))
+      {
+        errno = EEXIST;
+
+        return -1;
+      }
+
+      d = d->next;
+    }
+  }
 
-  while(dt)
+  if(written && (flags & JPT_REPLACE) && !value_size)
   {
-    struct JPT_disktable* tmp = dt;
-    dt = dt->next;
-
-    patricia_destroy(tmp->pat);
+    JPT_memtable_remove(info->memtable, row, columnidx);
 
-    free(tmp);
+    return 0;
   }
+
+  return JPT_memtable_insert(info->memtable, row, columnidx, value, value_size, timestamp, flags);
 }
 
 int
-JPT_compact(struct JPT_info* info)
+jpt_insert_timestamp(struct JPT_info* info,
+           const char* row, const char* column,
+           const void* value, size_t value_size,
+           uint64_t* timestamp, int flags)
 {
-  struct JPT_node** nodes;
-  struct JPT_node** iterator;
-  struct patricia* pat;
-  size_t i, j, amount;
-
-  off_t offset = 0;
-  off_t data_start = 0;
-  uint32_t row_count = 0;
-  struct JPT_key_info* key_infos;
-
-  jmp_buf io_error;
-  off_t old_eof;
-
-  if(!info->memtable_key_count)
-    return JPT_log_reset(info);
-
-  key_infos = malloc(sizeof(struct JPT_key_info) * info->memtable_key_count);
-  nodes = malloc(sizeof(struct JPT_node*) * info->node_count);
-  iterator = nodes;
-
-  JPT_memtable_list_all(info, &iterator);
-
-  pat = patricia_create(JPT_node_key_callback, nodes);
+  uint64_t lsn = 0;
+  int res;
 
-  size_t key_buf_size = 256;
-  char* key_buf = malloc(key_buf_size);
+  TRACE((stderr, "jpt_insert_timestamp(%p, \"%s\", \"%s\", \"%.*s\", %zu, 0x%04x)", info, row, column, (int) value_size, (const char*) value, value_size, flags));
 
-  size_t sum_key_size = 0;
-  size_t sum_value_size = 0;
-  size_t sum_key_count = 0;
+  JPT_clear_error();
 
-  struct JPT_disktable* disktable = malloc(sizeof(struct JPT_disktable));
+  JPT_writer_enter(info);
 
-  memset(disktable->bloom_filter, 0, sizeof(disktable->bloom_filter));
-  disktable->key_infos_mapped = 0;
+  res = JPT_insert(info, row, column, value, value_size, timestamp, flags);
 
-  uint32_t prev_column = (uint32_t) -1;
+  TRACE((stderr, " = %d\n", res));
 
-  for(i = 0; i < info->node_count; ++i)
+  /* if res == -1, we had an error.  if res == 1, data is already commited */
+  if(res == 0 && !info->replaying)
   {
-    if(strlen(nodes[i]->row) + 3 > key_buf_size)
-    {
-      key_buf_size = strlen(nodes[i]->row) + 32;
-      free(key_buf);
-      key_buf = malloc(key_buf_size);
-    }
+    struct iovec iov[4];
+    size_t iovn = 0;
+    int rowlen = strlen(row);
+    int collen = strlen(column);
 
-    sum_key_size += strlen(nodes[i]->row) + 1;
-    sum_value_size += nodes[i]->data.value_size;
-    ++sum_key_count;
+    if(-1 == JPT_log_begin(info))
+    {
+      JPT_writer_leave(info);
 
-    JPT_generate_key(key_buf, nodes[i]->row, nodes[i]->columnidx);
+      return -1;
+    }
 
-    j = patricia_define(pat, key_buf);
+    JPT_log_append_uint(info, JPT_OPERATOR_INSERT);
+    JPT_log_append_uint(info, flags);
+    JPT_log_append_uint(info, rowlen);
+    JPT_log_append_uint(info, collen);
+    JPT_log_append_uint(info, value_size);
+    JPT_log_append_uint64(info, *timestamp);
 
-    assert(j == row_count);
+    IOV_SET(iov, iovn++, info->logbuf, info->logbuf_fill);
+    IOV_SET(iov, iovn++, row, rowlen);
+    IOV_SET(iov, iovn++, column, collen);
 
-    JPT_bloom_filter_add(disktable->bloom_filter, key_buf);
+    if(value_size)
+      IOV_SET(iov, iovn++, value, value_size);
 
-    key_infos[row_count].timestamp = nodes[i]->timestamp;
-    key_infos[row_count].offset = offset;
-    key_infos[row_count].size = strlen(key_buf) + 1 + nodes[i]->data.value_size;
-    key_infos[row_count].flags = 0;
+    info->logbuf_fill = 0;
 
-    if(nodes[i]->columnidx != prev_column)
+    if(-1 == JPT_log_append(info, iov, iovn, &lsn))
     {
-      key_infos[row_count].flags |= JPT_KEY_NEW_COLUMN;
-
-      prev_column = nodes[i]->columnidx;
-    }
-
-    struct JPT_node_data* d = nodes[i]->data.next;
+      JPT_writer_leave(info);
 
-    while(d)
-    {
-      key_infos[row_count].size += d->value_size;
-      sum_value_size += d->value_size;
-      d = d->next;
+      return -1;
     }
-
-    offset += key_infos[row_count].size;
-    ++row_count;
   }
+  else if(res == 1)
+    res = 0;
 
-  assert(offset == info->memtable_key_size + info->memtable_key_count * COLUMN_PREFIX_SIZE + info->memtable_value_size);
-  assert(row_count == info->memtable_key_count);
-
-  old_eof = lseek64(info->fd, 0, SEEK_END);
-
-  if(setjmp(io_error))
-  {
-    ftruncate(info->fd, old_eof);
-    free(key_buf);
-    free(key_infos);
-    free(nodes);
-    free(disktable);
+  JPT_writer_leave(info);
 
+  if(lsn && -1 == JPT_log_commit(info, lsn))
     return -1;
-  }
-
-#if IOV_MAX < 16
-#  define IOV_SIZE IOV_MAX
-#else
-#  define IOV_SIZE 16
-#endif
 
-  struct iovec iov[IOV_SIZE];
-  size_t iovn = 0;
-
-  uint32_t version = JPT_VERSION;
-  uint32_t data_size = key_infos[row_count - 1].offset + key_infos[row_count - 1].size;
+  return res;
+}
 
-  IOV_SET(iov, iovn++, JPT_PARTIAL_WRITE, 4);
-  IOV_SET(iov, iovn++, &version, sizeof(uint32_t));
-  IOV_SET(iov, iovn++, &row_count, sizeof(uint32_t));
-  IOV_SET(iov, iovn++, &data_size, sizeof(uint32_t));
-  IOV_SET(iov, iovn++, disktable->bloom_filter, sizeof(disktable->bloom_filter));
+int
+jpt_insert(struct JPT_info* info,
+           const char* row, const char* column,
+           const void* value, size_t value_size, int flags)
+{
+  uint64_t timestamp = jpt_gettime();
 
-  if(-1 == JPT_writev(info->fd, iov, iovn))
-    longjmp(io_error, 1);
+  return jpt_insert_timestamp(info, row, column, value, value_size, &timestamp, flags);
+}
 
-  iovn = 0;
+static int
+JPT_remove(struct JPT_info* info, const char* row, const char* column)
+{
+  struct JPT_bloom_key bloom_key;
+  struct JPT_disktable* disktable;
+  char* key = alloca(strlen(row) + COLUMN_PREFIX_SIZE + 1);
+  unsigned char* maybe;
+  uint32_t columnidx;
+  size_t i = 0;
+  int found = 0;
 
-  disktable->pat_offset = lseek64(info->fd, 0, SEEK_CUR);
+  columnidx = JPT_get_column_idx(info, column, 0);
 
-  if(-1 == patricia_write(pat, info->fd))
+  if(columnidx == JPT_INVALID_COLUMN)
   {
-    asprintf(&JPT_last_error, "Failed to write PATRICIA trie: %s", strerror(errno));
+    asprintf(&JPT_last_error, "Column \"%s\" does not exist", column);
+    errno = ENOENT;
 
-    longjmp(io_error, 1);
+    return -1;
   }
 
-  amount = row_count * sizeof(struct JPT_key_info);
-
-  disktable->key_info_offset = lseek64(info->fd, 0, SEEK_CUR);
-
-  if(amount != JPT_write_all(info->fd, key_infos, amount))
-    longjmp(io_error, 1);
-
-  data_start = lseek64(info->fd, 0, SEEK_CUR);
-  offset = data_start;
+  JPT_generate_key(key, row, columnidx);
+  JPT_bloom_key_init(&bloom_key, key);
 
-  if(-1 == ftruncate(info->fd, data_start + data_size))
+  if(info->frozen && 0 == JPT_memtable_has_key(info->frozen, row, columnidx))
   {
-    asprintf(&JPT_last_error, "Failed to resize file to %llu bytes: %s", (long long) (data_start + data_size), strerror(errno));
-
-    longjmp(io_error, 1);
+    if(-1 == JPT_flush_wait(info))
+      return -1;
   }
 
-  JPT_update_map(info);
+  maybe = alloca(info->disktable_count + 1);
+  JPT_bloom_probe(info, &bloom_key, maybe);
 
-  lseek64(info->fd, data_start, SEEK_SET);
+  disktable = info->first_disktable;
 
-  for(i = 0; i < info->node_count; ++i)
+  while(disktable)
   {
-    struct JPT_node_data* d = &nodes[i]->data;
-    size_t keylen;
-
-    JPT_generate_key(key_buf, nodes[i]->row, nodes[i]->columnidx);
-
-    keylen = strlen(key_buf) + 1;
-
-    if(info->map_size)
+    if(maybe[i++])
     {
-      memcpy(info->map + offset, key_buf, keylen);
-      offset += keylen;
-
-      do
-      {
-        memcpy(info->map + offset, d->value, d->value_size);
-        offset += d->value_size;
-        d = d->next;
-      }
-      while(d);
+      if(0 == JPT_disktable_remove(disktable, row, columnidx, bloom_key.hash))
+        found = 1;
     }
-    else
-    {
-      if(-1 == JPT_write_all(info->fd, key_buf, keylen))
-        longjmp(io_error, 1);
-
-      do
-      {
-        if(-1 == JPT_write_all(info->fd, d->value, d->value_size))
-          longjmp(io_error, 1);
 
-        d = d->next;
-      }
-      while(d);
-    }
+    disktable = disktable->next;
   }
 
-  if(-1 == lseek64(info->fd, old_eof, SEEK_SET))
-    longjmp(io_error, 1);
-
-  if(-1 == JPT_write_all(info->fd, JPT_SIGNATURE, 4))
-    longjmp(io_error, 1);
+  if(0 == JPT_memtable_remove(info->memtable, row, columnidx))
+    found = 1;
 
-  if(info->flags & JPT_SYNC)
+  if(!found)
   {
-    if(-1 == fdatasync(info->fd))
-      longjmp(io_error, 1);
-  }
-
-  if(-1 == JPT_log_reset(info))
-    longjmp(io_error, 1);
-
-  free(key_buf);
-  free(nodes);
-  free(key_infos);
-
-  free(info->buffer);
-  info->buffer = 0;
-  info->buffer_util = 0;
-  info->root = 0;
-  info->node_count = 0;
-  info->memtable_key_count = 0;
-  info->memtable_key_size = 0;
-  info->memtable_value_size = 0;
-
-  disktable->pat = pat;
-  disktable->key_infos = 0;
-  disktable->key_info_count = row_count;
-  disktable->info = info;
-  disktable->offset = data_start;
-  disktable->next = 0;
+    asprintf(&JPT_last_error, "Key \"%s\", \"%s\" does not exist", row, column);
+    errno = ENOENT;
 
-  if(!info->first_disktable)
-  {
-    info->first_disktable = disktable;
-    info->last_disktable = disktable;
-  }
-  else
-  {
-    info->last_disktable->next = disktable;
-    info->last_disktable = disktable;
+    return -1;
   }
 
-  JPT_update_map(info);
-
-  ++info->disktable_count;
-
   return 0;
 }
 
-int
-jpt_compact(struct JPT_info* info)
+/* Reads the table size recorded at the start of a log file.  Returns -1 if
+ * the log is too short to have a header.
+ */
+static int
+JPT_log_read_header(int fd, uint64_t* size)
 {
-  int result;
-
-  TRACE((stderr, "jpt_compact(%p)", info));
-
-  JPT_clear_error();
-
-  JPT_writer_enter(info);
+  unsigned char buf[8];
+  int i;
 
-  result = JPT_compact(info);
+  if(sizeof(buf) != pread64(fd, buf, sizeof(buf), 0))
+    return -1;
 
-  JPT_writer_leave(info);
+  *size = 0;
 
-  TRACE((stderr, " = %d\n", result));
+  for(i = 0; i < 8; ++i)
+    *size = (*size << 8) | buf[i];
 
-  return result;
+  return 0;
 }
 
-const char*
-JPT_key_info_callback(unsigned int idx, void* arg)
+static int
+JPT_log_write_header(struct JPT_info* info, off_t size)
 {
-  struct JPT_key_info_callback_args* args = arg;
+  unsigned char buf[8];
+  int i;
 
-  static __thread size_t key_buf_size = 0;
-  static __thread char* key_buf = 0;
+  for(i = 0; i < 8; ++i)
+    buf[i] = (uint64_t) size >> ((7 - i) * 8);
 
-  if(args->row_names[idx].size + 1 > key_buf_size)
-  {
-    key_buf_size = args->row_names[idx].size + 32;
-    free(key_buf);
-    key_buf = malloc(key_buf_size);
-  }
+  if(-1 == JPT_pwrite_all(info->logfd, buf, sizeof(buf), 0))
+    return -1;
 
-  if(args->info->map_size)
-  {
-    memcpy(key_buf, args->info->map + args->row_names[idx].offset,
-           args->row_names[idx].size);
-  }
-  else
+  if(info->flags & JPT_SYNC)
   {
-    pread64(args->info->fd, key_buf, args->row_names[idx].size,
-            args->row_names[idx].offset);
+    if(-1 == fdatasync(info->logfd))
+      return -1;
   }
 
-  key_buf[args->row_names[idx].size] = 0;
-
-  return key_buf;
+  return 0;
 }
 
-int
-jpt_major_compact(struct JPT_info* info)
+/* Appends a log record, given as `iovn' pieces, to the group to be written
+ * next.  `lsn' is set to the position JPT_log_commit must wait for.  Must be
+ * called with the writer lock held, and followed by JPT_log_commit once the
+ * lock is released.
+ */
+static int
+JPT_log_append(struct JPT_info* info, const struct iovec* iov, size_t iovn,
+               uint64_t* lsn)
 {
-  char* newname;
-  struct JPT_disktable* dt;
-  struct JPT_disktable_cursor* cursors;
-  struct patricia* pat;
-  size_t i, j;
-  int outfd;
-  int ok = 0;
-
-  uint32_t row_count = 0;
-  off_t offset = 0;
-  struct JPT_key_info* row_names;
-  struct JPT_key_info* key_infos;
-  struct JPT_key_info_callback_args callback_args;
-
-  TRACE((stderr, "jpt_major_compact(%p)\n", info));
+  unsigned char* group;
+  size_t i, size = 0, alloc;
 
-  JPT_clear_error();
-
-  JPT_writer_enter(info);
-
-  if(-1 == JPT_compact(info))
-  {
-    JPT_writer_leave(info);
+  for(i = 0; i < iovn; ++i)
+    size += iov[i].iov_len;
 
-    return -1;
-  }
+  pthread_mutex_lock(&info->log_mutex);
 
-  if(info->disktable_count < 2)
+  if(info->log_group_fill + size > info->log_group_alloc)
   {
-    JPT_writer_leave(info);
-
-    return 0;
-  }
-
-  newname = alloca(strlen(info->filename) + 8);
-  strcpy(newname, info->filename);
-  strcat(newname, ".XXXXXX");
-  outfd = mkstemp(newname);
-
-  struct JPT_disktable* disktable = malloc(sizeof(struct JPT_disktable));
-
-  memset(disktable->bloom_filter, 0, sizeof(disktable->bloom_filter));
-  disktable->key_infos_mapped = 0;
+    alloc = info->log_group_alloc ? info->log_group_alloc : 65536;
 
-  cursors = calloc(info->disktable_count, sizeof(struct JPT_disktable_cursor));
+    while(alloc < info->log_group_fill + size)
+      alloc *= 2;
 
-  dt = info->first_disktable;
-  i = 0;
+    if(!(group = realloc(info->log_group, alloc)))
+    {
+      asprintf(&JPT_last_error, "realloc failed while growing log buffer to %zu bytes: %s", alloc, strerror(errno));
+      pthread_mutex_unlock(&info->log_mutex);
 
-  while(dt)
-  {
-    cursors[i++].disktable = dt;
-    row_count += dt->key_info_count;
+      return -1;
+    }
 
-    dt = dt->next;
+    info->log_group = group;
+    info->log_group_alloc = alloc;
   }
 
-  row_names = malloc(sizeof(struct JPT_key_info) * row_count);
-
-  if(!row_names)
+  for(i = 0; i < iovn; ++i)
   {
-    asprintf(&JPT_last_error, "malloc failed while allocating %zu bytes", sizeof(struct JPT_key_info) * row_count);
-
-    JPT_writer_leave(info);
-
-    return -1;
+    memcpy(info->log_group + info->log_group_fill, iov[i].iov_base, iov[i].iov_len);
+    info->log_group_fill += iov[i].iov_len;
   }
 
-  key_infos = malloc(sizeof(struct JPT_key_info) * row_count);
+  info->log_appended += size;
+  *lsn = info->log_appended;
+  ++info->log_committers;
 
-  if(!key_infos)
-  {
-    asprintf(&JPT_last_error, "malloc failed while allocating %zu bytes", sizeof(struct JPT_key_info) * row_count);
+  pthread_mutex_unlock(&info->log_mutex);
 
-    free(row_names);
+  return 0;
+}
 
-    JPT_writer_leave(info);
+/* Writes every log record appended so far, followed by fdatasync if `sync'
+ * is set.  Must be called with `log_mutex' held and no write in progress;
+ * the mutex is released while writing.  Returns 0, or the errno of a
+ * failed write, which is also kept in `log_error'.
+ */
+static int
+JPT_log_write_group(struct JPT_info* info, int sync)
+{
+  unsigned char* group;
+  size_t size, alloc;
+  uint64_t end;
+  int fd, err = 0;
+
+  group = info->log_group;
+  size = info->log_group_fill;
+  alloc = info->log_group_alloc;
+  end = info->log_appended;
+  fd = info->logfd;
+
+  info->log_group = info->log_spare;
+  info->log_group_alloc = info->log_spare_alloc;
+  info->log_group_fill = 0;
+  info->log_spare = 0;
+  info->log_spare_alloc = 0;
+  info->log_writing = 1;
+
+  pthread_mutex_unlock(&info->log_mutex);
+
+  if((size && -1 == JPT_write_all(fd, group, size))
+  || (sync && -1 == fdatasync(fd)))
+    err = errno;
+
+  pthread_mutex_lock(&info->log_mutex);
+
+  info->log_spare = group;
+  info->log_spare_alloc = alloc;
+  info->log_writing = 0;
+
+  if(err)
+    info->log_error = err;
+  else
+  {
+    info->log_written = end;
 
-    return -1;
+    if(sync)
+      info->log_synced = end;
   }
 
-  callback_args.row_names = row_names;
-  callback_args.info = info;
+  pthread_cond_broadcast(&info->log_cond);
 
-  pat = patricia_create(JPT_key_info_callback, &callback_args);
+  return err;
+}
 
-  uint32_t prev_column = (uint32_t) -1;
+/* Returns once the log records appended up to `lsn' have been written.  If
+ * no write is in progress, the caller writes every record appended so far,
+ * for all writers; otherwise it waits for the current write, which may be
+ * followed by one of its own.  Called without the writer lock, so that
+ * neither readers nor writers wait for fdatasync.
+ *
+ * While log writes are delayed, the records are left to JPT_log_thread,
+ * which is woken early once `log_delay_bytes' are waiting.
+ */
+static int
+JPT_log_commit(struct JPT_info* info, uint64_t lsn)
+{
+  int err = 0;
 
-  row_count = 0;
+  pthread_mutex_lock(&info->log_mutex);
 
-  for(;;)
+  if(info->log_delay_msec)
+  {
+    if(!(err = info->log_error) && info->log_group_fill >= info->log_delay_bytes)
+      pthread_cond_signal(&info->log_thread_cond);
+  }
+  else
   {
-    for(i = 0; i < info->disktable_count; ++i)
+    while(info->log_written < lsn && !(err = info->log_error))
     {
-      if(!cursors[i].data_size && cursors[i].offset < cursors[i].disktable->key_info_count)
-      {
-        if(-1 == JPT_disktable_cursor_advance(info, &cursors[i], JPT_INVALID_COLUMN))
-          goto fail;
-      }
+      if(info->log_writing)
+        pthread_cond_wait(&info->log_cond, &info->log_mutex);
+      else
+        JPT_log_write_group(info, info->flags & JPT_SYNC);
     }
+  }
 
-    const char* min = 0;
-    size_t minidx = 0;
+  if(!--info->log_committers)
+    pthread_cond_broadcast(&info->log_cond);
 
-    for(i = 0; i < info->disktable_count; ++i)
-    {
-      if(!cursors[i].data_size)
-        continue;
+  pthread_mutex_unlock(&info->log_mutex);
 
-      if(!min || strcmp(cursors[i].data, min) < 0)
-      {
-        min = cursors[i].data;
-        minidx = i;
-      }
-    }
+  if(err)
+  {
+    free(JPT_last_error);
+    asprintf(&JPT_last_error, "Failed to write log: %s", strerror(err));
+    errno = err;
 
-    if(!min)
-      break;
+    return -1;
+  }
 
-    j = patricia_define(pat, min);
+  return 0;
+}
 
-    if(j == row_count)
-    {
-      uint32_t columnidx = CELLMETA_TO_COLUMN(min);
+/* Writes the records of all writers before the log file is moved aside or
+ * truncated, and returns with `log_mutex' held, so that no write starts
+ * until the caller has done so.  Must be called with the writer lock held,
+ * so that no records are appended meanwhile.  Records not written because
+ * of an error are dropped, and the error forgotten, as the damaged log is
+ * not appended to again.
+ */
+static void
+JPT_log_drain(struct JPT_info* info)
+{
+  pthread_mutex_lock(&info->log_mutex);
 
-      JPT_bloom_filter_add(disktable->bloom_filter, min);
+  while(info->log_committers || info->log_writing)
+    pthread_cond_wait(&info->log_cond, &info->log_mutex);
 
-      row_names[j].offset = cursors[minidx].data_offset;
-      row_names[j].size = strlen(cursors[minidx].data);
+  if(info->log_group_fill && !info->log_error)
+    JPT_log_write_group(info, info->flags & JPT_SYNC);
 
-      key_infos[j].timestamp = cursors[minidx].timestamp;
-      key_infos[j].offset = offset;
-      key_infos[j].size = cursors[minidx].data_size;
-      key_infos[j].flags = 0;
+  info->log_group_fill = 0;
+  info->log_written = info->log_appended;
+  info->log_error = 0;
 
-      if(columnidx != prev_column)
-      {
-        key_infos[j].flags |= JPT_KEY_NEW_COLUMN;
+  if(info->flags & JPT_SYNC)
+    info->log_synced = info->log_appended;
+}
 
-        prev_column = columnidx;
-      }
+/* Writes delayed log records every `log_delay_msec' milliseconds, or when
+ * JPT_log_commit finds `log_delay_bytes' of them waiting.  Errors are
+ * reported by the next JPT_log_commit or jpt_flush_log.
+ */
+static void*
+JPT_log_thread(void* arg)
+{
+  struct JPT_info* info = arg;
+  struct timespec deadline;
 
-      offset += cursors[minidx].data_size;
+  pthread_mutex_lock(&info->log_mutex);
 
-      ++row_count;
+  while(!info->log_stop)
+  {
+    /* Records appended while the mutex was released to write the last group
+     * may have passed the threshold without anyone waiting for the signal.  */
+    if(info->log_group_fill < info->log_delay_bytes || info->log_error)
+    {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += info->log_delay_msec / 1000;
+      deadline.tv_nsec += (info->log_delay_msec % 1000) * 1000000L;
+
+      if(deadline.tv_nsec >= 1000000000L)
+      {
+        ++deadline.tv_sec;
+        deadline.tv_nsec -= 1000000000L;
+      }
+
+      /* Also woken when the interval changes */
+      if(ETIMEDOUT != pthread_cond_timedwait(&info->log_thread_cond, &info->log_mutex, &deadline)
+      && info->log_group_fill < info->log_delay_bytes)
+        continue;
     }
-    else
+
+    if(info->log_writing)
     {
-      assert(j == row_count - 1);
+      pthread_cond_wait(&info->log_cond, &info->log_mutex);
 
-      key_infos[j].size += cursors[minidx].data_size - cursors[minidx].keylen;
-      offset += cursors[minidx].data_size - cursors[minidx].keylen;
+      continue;
     }
 
-    cursors[minidx].data_size = 0;
+    if(info->log_group_fill && !info->log_error)
+      JPT_log_write_group(info, info->flags & JPT_SYNC);
   }
 
-  uint32_t version = JPT_VERSION;
-  off_t data_size = offset;
+  pthread_mutex_unlock(&info->log_mutex);
 
-  if(-1 == JPT_write_all(outfd, JPT_PARTIAL_WRITE, 4))
-    goto fail;
+  return 0;
+}
 
-  if(-1 == JPT_write_all(outfd, &version, sizeof(uint32_t)))
-    goto fail;
+/* Stops the thread writing delayed log records, and writes what is left of
+ * them.
+ */
+static int
+JPT_log_thread_stop(struct JPT_info* info)
+{
+  int err;
 
-  if(-1 == JPT_write_all(outfd, &row_count, sizeof(uint32_t)))
-    goto fail;
+  if(!info->log_thread_started)
+    return 0;
 
-  if(-1 == JPT_write_all(outfd, &data_size, sizeof(uint32_t)))
-    goto fail;
+  pthread_mutex_lock(&info->log_mutex);
+  info->log_stop = 1;
+  info->log_delay_msec = 0;
+  pthread_cond_signal(&info->log_thread_cond);
+  pthread_mutex_unlock(&info->log_mutex);
 
-  if(-1 == JPT_write_all(outfd, disktable->bloom_filter, sizeof(disktable->bloom_filter)))
-    goto fail;
+  pthread_join(info->log_thread, 0);
 
-  disktable->pat_offset = lseek64(outfd, 0, SEEK_CUR);
-  if(-1 == patricia_write(pat, outfd))
-    goto fail;
+  info->log_thread_started = 0;
 
-  disktable->key_info_offset = lseek64(outfd, 0, SEEK_CUR);
-  if(-1 == JPT_write_all(outfd, key_infos, row_count * sizeof(struct JPT_key_info)))
-    goto fail;
+  pthread_mutex_lock(&info->log_mutex);
 
-  offset = lseek64(outfd, 0, SEEK_CUR);
+  while(info->log_writing)
+    pthread_cond_wait(&info->log_cond, &info->log_mutex);
 
-  row_count = 0;
+  if(!(err = info->log_error) && info->log_group_fill)
+    err = JPT_log_write_group(info, info->flags & JPT_SYNC);
 
-  for(i = 0; i < info->disktable_count; ++i)
-  {
-    assert(!cursors[i].data_size);
-    cursors[i].offset = 0;
-  }
+  pthread_mutex_unlock(&info->log_mutex);
 
-  for(;;)
+  if(err)
   {
-    for(i = 0; i < info->disktable_count; ++i)
-    {
-      if(!cursors[i].data_size && cursors[i].offset < cursors[i].disktable->key_info_count)
-      {
-        if(-1 == JPT_disktable_cursor_advance(info, &cursors[i], JPT_INVALID_COLUMN))
-          goto fail;
-      }
-    }
-
-    const char* min = 0;
-    size_t minidx = 0;
-
-    for(i = 0; i < info->disktable_count; ++i)
-    {
-      if(!cursors[i].data_size)
-        continue;
-
-      if(!min || strcmp(cursors[i].data, min) < 0)
-      {
-        min = cursors[i].data;
-        minidx = i;
-      }
-    }
+    asprintf(&JPT_last_error, "Failed to write log: %s", strerror(err));
+    errno = err;
 
-    if(!min)
-      break;
+    return -1;
+  }
 
-    j = patricia_lookup(pat, min);
+  return 0;
+}
 
-    if(j == row_count)
-    {
-      if(cursors[minidx].data_size != JPT_write_all(outfd, cursors[minidx].data, cursors[minidx].data_size))
-        goto fail;
+int
+jpt_set_log_delay(struct JPT_info* info, unsigned int interval_msec,
+                  size_t max_bytes)
+{
+  JPT_clear_error();
 
-      ++row_count;
-    }
-    else
-    {
-      size_t amount;
+  if(!interval_msec)
+    return JPT_log_thread_stop(info);
 
-      assert(j == row_count - 1);
+  pthread_mutex_lock(&info->log_mutex);
 
-      amount = cursors[minidx].data_size - cursors[minidx].keylen;
+  info->log_delay_bytes = max_bytes ? max_bytes : JPT_LOG_DELAY_BYTES;
 
-      if(amount != JPT_write_all(outfd, cursors[minidx].data + cursors[minidx].keylen, amount))
-        goto fail;
-    }
+  if(info->log_thread_started)
+  {
+    info->log_delay_msec = interval_msec;
+    pthread_cond_signal(&info->log_thread_cond);
+    pthread_mutex_unlock(&info->log_mutex);
 
-    cursors[minidx].data_size = 0;
+    return 0;
   }
 
-  if(-1 == lseek64(outfd, 0, SEEK_SET))
-    goto fail;
-
-  if(-1 == JPT_write_all(outfd, JPT_SIGNATURE, 4))
-    goto fail;
+  info->log_delay_msec = interval_msec;
+  info->log_stop = 0;
 
-  if(info->map_size)
+  if(0 != (errno = pthread_create(&info->log_thread, 0, JPT_log_thread, info)))
   {
-    munmap(info->map, info->map_size);
-    info->map_size = 0;
-  }
+    info->log_delay_msec = 0;
+    pthread_mutex_unlock(&info->log_mutex);
 
-  if(-1 == fsync(outfd))
-    goto fail;
+    asprintf(&JPT_last_error, "pthread_create failed while starting log thread: %s", strerror(errno));
 
-  if(-1 == rename(newname, info->filename))
-    goto fail;
+    return -1;
+  }
 
-  JPT_free_disktables(info);
+  info->log_thread_started = 1;
 
-  close(info->fd);
-  info->fd = outfd;
+  pthread_mutex_unlock(&info->log_mutex);
 
-  disktable->pat = pat;
-  disktable->key_infos = 0;
-  disktable->key_info_count = row_count;
-  disktable->info = info;
-  disktable->offset = offset;
-  disktable->next = 0;
+  return 0;
+}
 
-  info->first_disktable = disktable;
-  info->last_disktable = disktable;
-  info->disktable_count = 1;
+int
+jpt_flush_log(struct JPT_info* info)
+{
+  uint64_t end;
+  int err = 0;
 
-  JPT_update_map(info);
+  JPT_clear_error();
 
-  ok = 1;
+  pthread_mutex_lock(&info->log_mutex);
 
-fail:
+  end = info->log_appended;
 
-  if(!info->map_size)
+  while(info->log_synced < end && !(err = info->log_error))
   {
-    for(i = 0; i < info->disktable_count; ++i)
-      free(cursors[i].buffer);
+    if(info->log_writing)
+      pthread_cond_wait(&info->log_cond, &info->log_mutex);
+    else
+      JPT_log_write_group(info, 1);
   }
 
-  free(cursors);
-  free(row_names);
-  free(key_infos);
-
-  ++info->major_compact_count;
-
-  JPT_writer_leave(info);
+  pthread_mutex_unlock(&info->log_mutex);
 
-  if(!ok)
+  if(err)
   {
-    free(disktable);
-    close(outfd);
-    unlink(newname);
+    asprintf(&JPT_last_error, "Failed to flush log: %s", strerror(err));
+    errno = err;
 
     return -1;
   }
@@ -1363,221 +6227,166 @@ fail:
 }
 
 static int
-JPT_insert(struct JPT_info* info,
-           const char* row, const char* column,
-           const void* value, size_t value_size,
-           uint64_t* timestamp, int flags)
+JPT_log_truncate_table(struct JPT_info* info, int fd)
 {
-  int bloom_indices[4];
-  uint32_t columnidx;
-  size_t row_size = strlen(row) + 1;
-  char* key = alloca(strlen(row) + COLUMN_PREFIX_SIZE + 1);
-  int written = 0;
+  off_t size;
+  uint64_t old_size;
 
-  if(!row[0])
-  {
-    asprintf(&JPT_last_error, "Empty row name");
-    errno = EINVAL;
+  size = lseek(fd, 0, SEEK_END);
 
+  if(size == -1)
     return -1;
-  }
 
-  if(row_size + COLUMN_PREFIX_SIZE - 1 > PATRICIA_MAX_KEYLENGTH)
+  if(size < sizeof(uint64_t))
   {
-    asprintf(&JPT_last_error, "Row name too long (%zu, maximum is %zu)",
-             row_size - 1,
-             (size_t) (PATRICIA_MAX_KEYLENGTH - COLUMN_PREFIX_SIZE));
-    errno = EINVAL;
+    if(size && -1 == ftruncate(fd, 0))
+      return -1;
 
-    return -1;
-  }
+    if(fd == info->logfd)
+      info->logfile_empty = 1;
 
-  columnidx = JPT_get_column_idx(info, column, JPT_COL_CREATE);
+    return 0;
+  }
 
-  if(columnidx == JPT_INVALID_COLUMN)
+  if(-1 == JPT_log_read_header(fd, &old_size))
     return -1;
 
-  JPT_generate_key(key, row, columnidx);
-  JPT_bloom_filter_indices(bloom_indices, key);
+  if(old_size == JPT_LOG_UNKNOWN_SIZE)
+    return 0;
 
-  if(flags & JPT_REPLACE)
+  /* Segments are never truncated.  If one was listed after the log began,
+   * it holds the whole log.  */
+  if(info->segmented)
   {
-    struct JPT_disktable* d = info->first_disktable;
-
-    while(d)
+    if(info->flush_count < old_size)
     {
-      if(JPT_BLOOM_FILTER_TEST(d->bloom_filter, bloom_indices))
-      {
-        if(value_size)
-        {
-          ssize_t result;
-
-          result = JPT_disktable_overwrite(d, row, columnidx, value, value_size);
-
-          if(result == -1 && errno != ENOENT)
-            return -1;
-
-          if(result > 0)
-          {
-            value = (char*) value + result;
-            value_size -= result;
-            written = 1;
-          }
-        }
-        else
-        {
-          if(-1 == JPT_disktable_remove(d, row, columnidx) && errno != ENOENT)
-            return -1;
-        }
-      }
+      asprintf(&JPT_last_error, "log file's record of flush count (%llu) is larger than the manifest's (%llu)",
+               (unsigned long long) old_size, (unsigned long long) info->flush_count);
+      errno = EINVAL;
 
-      d = d->next;
+      return -1;
     }
-  }
-  else if(!(flags & JPT_APPEND))
-  {
-    struct JPT_disktable* d = info->first_disktable;
 
-    while(d)
+    if(info->flush_count > old_size)
     {
-      if(0 == JPT_disktable_has_key(d, row, columnidx))
-      {
-        errno = EEXIST;
-
+      if(-1 == ftruncate(fd, 0))
         return -1;
-      }
 
-      d = d->next;
+      if(fd == info->logfd)
+        info->logfile_empty = 1;
     }
-  }
-
-  if(written && (flags & JPT_REPLACE) && !value_size)
-  {
-    JPT_memtable_remove(info, row, columnidx);
 
     return 0;
   }
 
-  return JPT_memtable_insert(info, row, columnidx, value, value_size, timestamp, flags);
-}
-
-int
-jpt_insert_timestamp(struct JPT_info* info,
-           const char* row, const char* column,
-           const void* value, size_t value_size,
-           uint64_t* timestamp, int flags)
-{
-  int res;
-
-  TRACE((stderr, "jpt_insert_timestamp(%p, \"%s\", \"%s\", \"%.*s\", %zu, 0x%04x)", info, row, column, (int) value_size, (const char*) value, value_size, flags));
-
-  JPT_clear_error();
-
-  JPT_writer_enter(info);
+  if(info->file_size < old_size)
+  {
+    asprintf(&JPT_last_error, "log file's record of database size (%llu) is larger than actual size (%llu)",
+             (unsigned long long) old_size, (unsigned long long) info->file_size);
+    errno = EINVAL;
 
-  res = JPT_insert(info, row, column, value, value_size, timestamp, flags);
+    return -1;
+  }
 
-  TRACE((stderr, " = %d\n", res));
+  if(size == sizeof(uint64_t))
+    return 0;
 
-  /* if res == -1, we had an error.  if res == 1, data is already commited */
-  if(res == 0 && !info->replaying)
+  if(info->file_size != old_size)
   {
-    struct iovec iov[4];
-    size_t iovn = 0;
-    int rowlen = strlen(row);
-    int collen = strlen(column);
-
-    if(-1 == JPT_log_begin(info))
+    if(-1 == ftruncate(info->fd, old_size))
     {
-      JPT_writer_leave(info);
+      asprintf(&JPT_last_error, "ftruncate(fd, %llu) failed during log replay: %s", (unsigned long long) old_size, strerror(errno));
 
       return -1;
     }
+  }
+
+  return 0;
+}
+
+/* A memtable's log is renamed to `<table>.log.frozen' when the memtable is
+ * frozen, and deleted once the memtable has been written to disk.  Before it
+ * is deleted, the size of the table including the new disktable is written to
+ * the header of the active log; until then, the active log's header is either
+ * missing or JPT_LOG_UNKNOWN_SIZE.  So if the frozen log exists, and the
+ * active log's header holds a real size, the flush completed and the frozen
+ * log is stale.
+ */
+static int
+JPT_log_open_frozen(struct JPT_info* info)
+{
+  uint64_t size;
 
-    JPT_log_append_uint(info, JPT_OPERATOR_INSERT);
-    JPT_log_append_uint(info, flags);
-    JPT_log_append_uint(info, rowlen);
-    JPT_log_append_uint(info, collen);
-    JPT_log_append_uint(info, value_size);
-    JPT_log_append_uint64(info, *timestamp);
+  info->frozen_logfd = open(info->frozen_logname, O_RDWR);
 
-    IOV_SET(iov, iovn++, info->logbuf, info->logbuf_fill);
-    IOV_SET(iov, iovn++, row, rowlen);
-    IOV_SET(iov, iovn++, column, collen);
+  if(info->frozen_logfd == -1)
+  {
+    if(errno == ENOENT)
+      return 0;
 
-    if(value_size)
-      IOV_SET(iov, iovn++, value, value_size);
+    asprintf(&JPT_last_error, "Failed to open `%s': %s", info->frozen_logname, strerror(errno));
 
-    info->logbuf_fill = 0;
+    return -1;
+  }
 
-    if(-1 == JPT_writev(info->logfd, iov, iovn))
+  if(0 == JPT_log_read_header(info->logfd, &size)
+  && size != JPT_LOG_UNKNOWN_SIZE)
+  {
+    close(info->frozen_logfd);
+    info->frozen_logfd = -1;
+
+    if(-1 == unlink(info->frozen_logname))
     {
-      JPT_writer_leave(info);
+      asprintf(&JPT_last_error, "Failed to remove `%s': %s", info->frozen_logname, strerror(errno));
 
       return -1;
     }
-
-    if(info->flags & JPT_SYNC)
-      fdatasync(info->logfd);
   }
-  else if(res == 1)
-    res = 0;
-
-  JPT_writer_leave(info);
 
-  return res;
+  return 0;
 }
 
-int
-jpt_insert(struct JPT_info* info,
-           const char* row, const char* column,
-           const void* value, size_t value_size, int flags)
+/* Replays the log of a memtable whose flush was interrupted, writes the result
+ * to a disktable, and retires the log the same way JPT_flush_commit does.
+ * This must happen before the active log is replayed.
+ */
+static int
+JPT_log_replay_frozen(struct JPT_info* info)
 {
-  uint64_t timestamp = jpt_gettime();
+  int result;
 
-  return jpt_insert_timestamp(info, row, column, value, value_size, &timestamp, flags);
-}
+  if(-1 == JPT_log_replay(info, info->frozen_logfd))
+    return -1;
 
-static int
-JPT_remove(struct JPT_info* info, const char* row, const char* column)
-{
-  int bloom_indices[4];
-  struct JPT_disktable* disktable = info->first_disktable;
-  char* key = alloca(strlen(row) + COLUMN_PREFIX_SIZE + 1);
-  uint32_t columnidx;
-  int found = 0;
+  /* The active log holds newer data, and must not be reset */
+  info->replaying = 1;
+  result = JPT_compact(info);
+  info->replaying = 0;
 
-  columnidx = JPT_get_column_idx(info, column, 0);
+  if(result == -1)
+    return -1;
 
-  if(columnidx == JPT_INVALID_COLUMN)
+  if(info->segmented)
   {
-    asprintf(&JPT_last_error, "Column \"%s\" does not exist", column);
-    errno = ENOENT;
+    if(-1 == JPT_manifest_commit(info, info->disktable_count, 0, 0, 0, info->flush_count + 1))
+      return -1;
 
-    return -1;
+    ++info->flush_count;
+    info->manifest_stale = 0;
   }
 
-  JPT_generate_key(key, row, columnidx);
-  JPT_bloom_filter_indices(bloom_indices, key);
-
-  while(disktable)
+  if(lseek(info->logfd, 0, SEEK_END) >= sizeof(uint64_t))
   {
-    if(JPT_BLOOM_FILTER_TEST(disktable->bloom_filter, bloom_indices))
-    {
-      if(0 == JPT_disktable_remove(disktable, row, columnidx))
-        found = 1;
-    }
-
-    disktable = disktable->next;
+    if(-1 == JPT_log_write_header(info, info->segmented ? info->flush_count : lseek64(info->fd, 0, SEEK_END)))
+      return -1;
   }
 
-  if(0 == JPT_memtable_remove(info, row, columnidx))
-    found = 1;
+  close(info->frozen_logfd);
+  info->frozen_logfd = -1;
 
-  if(!found)
+  if(-1 == unlink(info->frozen_logname))
   {
-    asprintf(&JPT_last_error, "Key \"%s\", \"%s\" does not exist", row, column);
-    errno = ENOENT;
+    asprintf(&JPT_last_error, "Failed to remove `%s': %s", info->frozen_logname, strerror(errno));
 
     return -1;
   }
@@ -1585,214 +6394,330 @@ JPT_remove(struct JPT_info* info, const char* row, const char* column)
   return 0;
 }
 
+/* Moves the active log aside along with the memtable being frozen, and starts
+ * an empty log for the new memtable.
+ */
 static int
-JPT_log_truncate_table(struct JPT_info* info)
+JPT_log_rotate(struct JPT_info* info)
 {
-  off_t size;
-  uint64_t old_size;
+  int fd;
 
-  size = lseek(info->logfd, 0, SEEK_END);
+  assert(info->frozen_logfd == -1);
 
-  if(size == -1)
-    return -1;
+  if(info->logfile_empty)
+    return 0;
+
+  JPT_log_drain(info);
+
+  if(-1 == rename(info->logname, info->frozen_logname))
+  {
+    asprintf(&JPT_last_error, "Failed to rename `%s' to `%s': %s", info->logname, info->frozen_logname, strerror(errno));
+    pthread_mutex_unlock(&info->log_mutex);
 
-  if(-1 == lseek(info->logfd, 0, SEEK_SET))
     return -1;
+  }
 
-  if(size < sizeof(uint64_t))
+  fd = open(info->logname, O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+  if(fd == -1)
   {
-    if(size && -1 == ftruncate(info->logfd, 0))
-      return -1;
+    asprintf(&JPT_last_error, "Failed to create `%s': %s", info->logname, strerror(errno));
 
-    info->logfile_empty = 1;
+    rename(info->frozen_logname, info->logname);
+    pthread_mutex_unlock(&info->log_mutex);
 
-    return 0;
+    return -1;
   }
 
-  if(-1 == JPT_read_all(info->logfd, &old_size, sizeof(old_size)))
-    return -1;
+  lockf(fd, F_TLOCK, INT_MAX);
 
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-  old_size = ((old_size & 0xff00000000000000ULL) >> 56)
-           | ((old_size & 0x00ff000000000000ULL) >> 40)
-           | ((old_size & 0x0000ff0000000000ULL) >> 24)
-           | ((old_size & 0x000000ff00000000ULL) >> 8)
-           | ((old_size & 0x00000000ff000000ULL) << 8)
-           | ((old_size & 0x0000000000ff0000ULL) << 24)
-           | ((old_size & 0x000000000000ff00ULL) << 40)
-           | ((old_size & 0x00000000000000ffULL) << 56);
-#endif
+  info->frozen_logfd = info->logfd;
+  info->logfd = fd;
+  info->logfile_empty = 1;
 
-  if(info->file_size < old_size)
+  pthread_mutex_unlock(&info->log_mutex);
+
+  return 0;
+}
+
+/* Reads a number written by JPT_log_append_uint from a mapped log.  Returns
+ * -1 if the log ends first.
+ */
+static int
+JPT_log_parse_uint(const unsigned char** input, const unsigned char* end,
+                   uint64_t* value)
+{
+  const unsigned char* i = *input;
+  uint64_t result = 0;
+
+  while(i != end)
   {
-    asprintf(&JPT_last_error, "log file's record of database size (%llu) is larger than actual size (%llu)",
-             (unsigned long long) old_size, (unsigned long long) info->file_size);
-    errno = EINVAL;
+    result <<= 7;
+    result |= (*i & 0x7f);
 
+    if(!(*i++ & 0x80))
+    {
+      *input = i;
+      *value = result;
+
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+static int
+JPT_log_parse_uint64(const unsigned char** input, const unsigned char* end,
+                     uint64_t* value)
+{
+  uint64_t result = 0;
+  int i;
+
+  if(end - *input < sizeof(uint64_t))
     return -1;
+
+  for(i = 0; i < 8; ++i)
+  {
+    result <<= 8;
+    result |= *(*input)++;
   }
 
-  if(size == sizeof(uint64_t))
+  *value = result;
+
+  return 0;
+}
+
+/* Returns the next `length' bytes of a mapped log and skips past them, or 0
+ * if the log ends first.
+ */
+static const unsigned char*
+JPT_log_parse_bytes(const unsigned char** input, const unsigned char* end,
+                    uint64_t length)
+{
+  const unsigned char* result = *input;
+
+  if(length > (uint64_t) (end - result))
     return 0;
 
-  if(info->file_size != old_size)
+  *input += length;
+
+  return result;
+}
+
+/* Copies a row or column name out of a mapped log, so that it can be NUL
+ * terminated.  The buffer is reused from one record to the next.
+ */
+static int
+JPT_log_copy_name(char** buffer, size_t* alloc,
+                  const unsigned char* name, size_t length)
+{
+  if(length + 1 > *alloc)
   {
-    if(-1 == ftruncate(info->fd, old_size))
+    char* tmp;
+    size_t new_alloc = (length + 1 > 2 * *alloc) ? length + 1 : 2 * *alloc;
+
+    if(!(tmp = realloc(*buffer, new_alloc)))
     {
-      asprintf(&JPT_last_error, "ftruncate(fd, %llu) failed during log replay: %s", (unsigned long long) old_size, strerror(errno));
+      asprintf(&JPT_last_error, "malloc failed during log replay: %s", strerror(errno));
 
       return -1;
     }
+
+    *buffer = tmp;
+    *alloc = new_alloc;
   }
 
+  memcpy(*buffer, name, length);
+  (*buffer)[length] = 0;
+
   return 0;
 }
 
+/* Replays a log through a read-only memory map.  Values are passed to the
+ * memtable straight from the map, and only row and column names are copied.
+ *
+ * The table has been truncated to where it was when the log was started, and
+ * each record is replayed on the same state it was first applied to.  An
+ * insert without JPT_REPLACE was therefore logged only because the cell was
+ * in no disktable, or because it was appended to, and goes directly into the
+ * memtable without any disktable lookups.  Replacements and removals change
+ * disktables in place, and take the normal path.
+ */
 static int
-JPT_log_replay(struct JPT_info* info)
+JPT_log_replay(struct JPT_info* info, int fd)
 {
   int result = -1;
+  const unsigned char* map = 0;
+  const unsigned char* input;
+  const unsigned char* end;
   char* row = 0;
   char* col = 0;
-  char* value = 0;
+  size_t row_alloc = 0, col_alloc = 0;
+  size_t last_collen = 0;
+  uint32_t last_columnidx = JPT_INVALID_COLUMN;
   off_t last_valid = 0;
-  FILE* input;
+  off_t size;
 
-  input = fdopen(dup(info->logfd), "r+");
+  size = lseek(fd, 0, SEEK_END);
 
-  info->replaying = 1;
+  if(size == -1)
+    return -1;
 
-  while(!feof(input))
+  if(size > sizeof(uint64_t))
   {
-    int command;
+    map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if(map == MAP_FAILED)
+    {
+      asprintf(&JPT_last_error, "Failed to map log file: %s", strerror(errno));
+
+      return -1;
+    }
+
+    madvise((void*) map, size, MADV_SEQUENTIAL);
+    madvise((void*) map, size, MADV_WILLNEED);
+
+    /* Skip the header */
+    input = map + sizeof(uint64_t);
+    end = map + size;
+  }
+  else
+    input = end = 0;
+
+  info->replaying = 1;
+
+  assert(!info->frozen);
 
-    command = JPT_read_uint(input);
+  /* The last record may have been cut short by a crash, in which case the
+   * loop stops at it.  */
+  while(input != end)
+  {
+    const unsigned char* rowname;
+    const unsigned char* colname;
+    const unsigned char* value;
+    uint64_t command, flags, rowlen, collen, value_size, timestamp;
 
-    if(feof(input))
+    if(-1 == JPT_log_parse_uint(&input, end, &command))
       break;
 
     if(command == JPT_OPERATOR_INSERT)
     {
-      int flags, rowlen, collen, value_size;
-      uint64_t timestamp;
+      if(-1 == JPT_log_parse_uint(&input, end, &flags)
+      || -1 == JPT_log_parse_uint(&input, end, &rowlen)
+      || -1 == JPT_log_parse_uint(&input, end, &collen)
+      || -1 == JPT_log_parse_uint(&input, end, &value_size)
+      || -1 == JPT_log_parse_uint64(&input, end, &timestamp)
+      || !(rowname = JPT_log_parse_bytes(&input, end, rowlen))
+      || !(colname = JPT_log_parse_bytes(&input, end, collen))
+      || !(value = JPT_log_parse_bytes(&input, end, value_size)))
+        break;
 
-      flags = JPT_read_uint(input);
-      rowlen = JPT_read_uint(input);
-      collen = JPT_read_uint(input);
-      value_size = JPT_read_uint(input);
-      timestamp = JPT_read_uint64(input);
-      row = malloc(rowlen + 1);
-      col = malloc(collen + 1);
-      value = malloc(value_size);
+      if(-1 == JPT_log_copy_name(&row, &row_alloc, rowname, rowlen))
+        goto fail;
 
-      if(!row || !col || !value)
+      if(!(flags & JPT_REPLACE)
+      && rowlen && rowlen + COLUMN_PREFIX_SIZE <= PATRICIA_MAX_KEYLENGTH)
       {
-        asprintf(&JPT_last_error, "malloc failed during log replay: %s", strerror(errno));
+        if(last_columnidx == JPT_INVALID_COLUMN
+        || collen != last_collen || memcmp(col, colname, collen))
+        {
+          if(-1 == JPT_log_copy_name(&col, &col_alloc, colname, collen))
+            goto fail;
 
-        goto fail;
-      }
+          last_collen = collen;
+          last_columnidx = JPT_get_column_idx(info, col, JPT_COL_CREATE);
 
-      if(rowlen != fread(row, 1, rowlen, input)
-      || collen != fread(col, 1, collen, input)
-      || value_size != fread(value, 1, value_size, input))
-        break;
+          if(last_columnidx == JPT_INVALID_COLUMN)
+            goto fail;
+        }
 
-      row[rowlen] = 0;
-      col[collen] = 0;
+        if(-1 == JPT_memtable_insert(info->memtable, row, last_columnidx, value, value_size, &timestamp, flags)
+        && errno != EEXIST)
+        {
+          asprintf(&JPT_last_error, "insert failed during log replay: %s", strerror(errno));
 
-      if(-1 == JPT_insert(info, row, col, value, value_size, &timestamp, flags) && errno != EEXIST)
+          goto fail;
+        }
+      }
+      else
       {
-        asprintf(&JPT_last_error, "insert failed during log replay: %s", strerror(errno));
+        if(-1 == JPT_log_copy_name(&col, &col_alloc, colname, collen))
+          goto fail;
 
-        goto fail;
-      }
+        last_columnidx = JPT_INVALID_COLUMN;
+
+        if(-1 == JPT_insert(info, row, col, value, value_size, &timestamp, flags) && errno != EEXIST)
+        {
+          asprintf(&JPT_last_error, "insert failed during log replay: %s", strerror(errno));
 
-      free(row); row = 0;
-      free(col); col = 0;
-      free(value); value = 0;
+          goto fail;
+        }
+      }
     }
     else if(command == JPT_OPERATOR_REMOVE)
     {
-      int rowlen, collen;
-
-      rowlen = JPT_read_uint(input);
-      collen = JPT_read_uint(input);
-      row = malloc(rowlen + 1);
-      col = malloc(collen + 1);
+      if(-1 == JPT_log_parse_uint(&input, end, &rowlen)
+      || -1 == JPT_log_parse_uint(&input, end, &collen)
+      || !(rowname = JPT_log_parse_bytes(&input, end, rowlen))
+      || !(colname = JPT_log_parse_bytes(&input, end, collen)))
+        break;
 
-      if(!row || !col)
+      if(-1 == JPT_log_copy_name(&row, &row_alloc, rowname, rowlen)
+      || -1 == JPT_log_copy_name(&col, &col_alloc, colname, collen))
         goto fail;
 
-      if(rowlen != fread(row, 1, rowlen, input)
-      || collen != fread(col, 1, collen, input))
-        break;
-
-      row[rowlen] = 0;
-      col[collen] = 0;
+      last_columnidx = JPT_INVALID_COLUMN;
 
       if(-1 == JPT_remove(info, row, col) && errno != ENOENT)
         goto fail;
-
-      free(row); row = 0;
-      free(col); col = 0;
     }
-    else if(command == JPT_OPERATOR_CREATE_COLUMN)
+    else if(command == JPT_OPERATOR_CREATE_COLUMN
+         || command == JPT_OPERATOR_REMOVE_COLUMN)
     {
-      int flags, collen;
-
-      flags = JPT_read_uint(input);
-      collen = JPT_read_uint(input);
-      col = malloc(collen + 1);
-
-      if(!col)
-        goto fail;
-
-      if(collen != fread(col, 1, collen, input))
+      if(-1 == JPT_log_parse_uint(&input, end, &flags)
+      || -1 == JPT_log_parse_uint(&input, end, &collen)
+      || !(colname = JPT_log_parse_bytes(&input, end, collen)))
         break;
 
-      col[collen] = 0;
-
-      if(JPT_get_column_idx(info, col, JPT_COL_CREATE) == JPT_INVALID_COLUMN)
-        goto fail;
-
-      free(col); col = 0;
-    }
-    else if(command == JPT_OPERATOR_REMOVE_COLUMN)
-    {
-      int flags, collen;
-
-      flags = JPT_read_uint(input);
-      collen = JPT_read_uint(input);
-      col = malloc(collen + 1);
-
-      if(!col)
+      if(-1 == JPT_log_copy_name(&col, &col_alloc, colname, collen))
         goto fail;
 
-      if(collen != fread(col, 1, collen, input))
-        break;
-
-      col[collen] = 0;
+      last_columnidx = JPT_INVALID_COLUMN;
 
-      if(-1 == JPT_remove_column(info, col, flags) && errno != ENOENT)
+      if(command == JPT_OPERATOR_CREATE_COLUMN)
+      {
+        if(JPT_get_column_idx(info, col, JPT_COL_CREATE) == JPT_INVALID_COLUMN)
+          goto fail;
+      }
+      else if(-1 == JPT_remove_column(info, col, flags) && errno != ENOENT)
         goto fail;
-
-      free(col); col = 0;
     }
     else
     {
-      asprintf(&JPT_last_error, "Unexpected command %d in log file near offset %zu", command, (size_t) ftell(input));
+      asprintf(&JPT_last_error, "Unexpected command %d in log file near offset %zu", (int) command, (size_t) (input - map));
 
       goto fail;
     }
 
-    last_valid = ftell(input);
+    last_valid = input - map;
   }
 
   assert(info->replaying);
   info->replaying = 0;
 
-  fclose(input);
-  input = 0;
+  if(map)
+  {
+    munmap((void*) map, size);
+    map = 0;
+  }
+
+  if(fd != info->logfd)
+  {
+    result = 0;
+
+    goto fail;
+  }
 
   if(-1 == lseek(info->logfd, last_valid, SEEK_SET))
     goto fail;
@@ -1811,12 +6736,11 @@ JPT_log_replay(struct JPT_info* info)
 
 fail:
 
-  if(input)
-    fclose(input);
+  if(map)
+    munmap((void*) map, size);
 
   free(row);
   free(col);
-  free(value);
 
   return result;
 }
@@ -1824,24 +6748,33 @@ fail:
 static int
 JPT_log_reset(struct JPT_info* info)
 {
+  int result = -1;
+
   if(info->replaying)
     return 0;
 
+  JPT_log_drain(info);
+
   if(-1 == lseek(info->logfd, 0, SEEK_SET))
-    return -1;
+    goto done;
 
   if(-1 == ftruncate(info->logfd, 0))
-    return -1;
+    goto done;
 
   if(info->flags & JPT_SYNC)
   {
     if(-1 == fdatasync(info->logfd))
-      return -1;
+      goto done;
   }
 
   info->logfile_empty = 1;
+  result = 0;
 
-  return 0;
+done:
+
+  pthread_mutex_unlock(&info->log_mutex);
+
+  return result;
 }
 
 static int
@@ -1859,7 +6792,8 @@ JPT_log_begin(struct JPT_info* info)
 
   assert(0 == lseek(info->logfd, 0, SEEK_CUR));
 
-  JPT_log_append_uint64(info, info->file_size);
+  JPT_log_append_uint64(info, info->frozen ? JPT_LOG_UNKNOWN_SIZE
+                            : info->segmented ? info->flush_count : info->file_size);
 
   if(-1 == JPT_write_all(info->logfd, info->logbuf, info->logbuf_fill))
   {
@@ -1881,6 +6815,7 @@ JPT_log_begin(struct JPT_info* info)
 int
 jpt_remove(struct JPT_info* info, const char* row, const char* column)
 {
+  uint64_t lsn = 0;
   int res;
 
   TRACE((stderr, "jpt_remove(%p, \"%s\", \"%s\")\n", info, row, column));
@@ -1914,19 +6849,19 @@ jpt_remove(struct JPT_info* info, const char* row, const char* column)
 
     info->logbuf_fill = 0;
 
-    if(-1 == JPT_writev(info->logfd, iov, 3))
+    if(-1 == JPT_log_append(info, iov, 3, &lsn))
     {
       JPT_writer_leave(info);
 
       return -1;
     }
-
-    if(info->flags & JPT_SYNC)
-      fdatasync(info->logfd);
   }
 
   JPT_writer_leave(info);
 
+  if(lsn && -1 == JPT_log_commit(info, lsn))
+    return -1;
+
   return res;
 }
 
@@ -1934,12 +6869,10 @@ static int
 JPT_remove_column(struct JPT_info* info, const char* column, int flags)
 {
   struct JPT_disktable_cursor cursor;
-  struct JPT_node** nodes = 0;
-  struct JPT_node** iterator = 0;
+  struct JPT_memtable* memtable;
   struct JPT_disktable* dt;
   const char* c;
   uint32_t columnidx, hash;
-  size_t i;
   char prefix[COLUMN_PREFIX_SIZE + 1];
 
   columnidx = JPT_get_column_idx(info, column, 0);
@@ -1949,44 +6882,24 @@ JPT_remove_column(struct JPT_info* info, const char* column, int flags)
 
   JPT_generate_key(prefix, "", columnidx);
 
-  if(info->root)
-  {
-    nodes = malloc(sizeof(struct JPT_node*) * info->node_count);
-    iterator = nodes;
-
-    JPT_memtable_list_column(info, &iterator, columnidx);
-
-    if(iterator != nodes)
-    {
-      if(flags & JPT_REMOVE_IF_EMPTY)
-      {
-        errno = ENOTEMPTY;
-
-        return -1;
-      }
-
-      for(i = 0; i < iterator - nodes; ++i)
-      {
-        struct JPT_node* n = nodes[i];
-        struct JPT_node_data* d = &n->data;
+  /* Keys are hidden in place, and a merge may already have copied them */
+  JPT_merge_abort(info);
 
-        while(d)
-        {
-          info->memtable_value_size -= d->value_size;
+  if(-1 == JPT_flush_wait(info))
+    return -1;
 
-          d = d->next;
-        }
+  memtable = info->memtable;
 
-        info->memtable_key_size -= strlen(n->row) + 1;
-        --info->memtable_key_count;
-        --info->node_count;
+  if(JPT_memtable_column_count(memtable, columnidx))
+  {
+    if(flags & JPT_REMOVE_IF_EMPTY)
+    {
+      errno = ENOTEMPTY;
 
-        n->data.value = (void*) -1;
-        n->data.next = 0;
-      }
+      return -1;
     }
 
-    free(nodes);
+    JPT_memtable_remove_column(memtable, columnidx);
   }
 
   dt = info->first_disktable;
@@ -1994,68 +6907,21 @@ JPT_remove_column(struct JPT_info* info, const char* column, int flags)
   memset(&cursor, 0, sizeof(cursor));
 
   while(dt)
-  {
-    struct JPT_key_info key_info;
-    size_t first, len, half, middle;
-    size_t this_columnidx;
-    unsigned char cellmeta[4];
-
-    cursor.disktable = dt;
-
-    first = patricia_lookup_prefix(dt->pat, prefix);
-    len = cursor.disktable->key_info_count - first;
-
-    if(len > 0)
-    {
-      if(-1 == JPT_DISKTABLE_READ_KEYINFO(cursor.disktable, &key_info, first))
-        return -1;
-
-      if(-1 == JPT_disktable_read(cursor.disktable, cellmeta, 4, key_info.offset))
-        return -1;
-
-      this_columnidx = CELLMETA_TO_COLUMN(cellmeta);
-
-      if(this_columnidx >= columnidx)
-        len = 0;
-
-      while(len > 0)
-      {
-        half = len >> 1;
-        middle = first + half;
-
-        if(-1 == JPT_DISKTABLE_READ_KEYINFO(cursor.disktable, &key_info, middle))
-          return -1;
-
-        if(-1 == JPT_disktable_read(cursor.disktable, cellmeta, 4, key_info.offset))
-          return -1;
-
-        this_columnidx = CELLMETA_TO_COLUMN(cellmeta);
-
-        if(this_columnidx < columnidx)
-        {
-          first = middle + 1;
-          len -= half + 1;
-        }
-        else
-          len = half;
-      }
-    }
+  {
+    size_t first, end;
+
+    if(-1 == JPT_disktable_column_range(dt, columnidx, &first, &end))
+      return -1;
 
+    cursor.disktable = dt;
     cursor.offset = first;
 
-    while(cursor.offset < cursor.disktable->key_info_count)
+    while(cursor.offset < end)
     {
-      if(-1 == JPT_disktable_cursor_advance(info, &cursor, JPT_INVALID_COLUMN))
+      if(-1 == JPT_disktable_cursor_advance(info, &cursor, columnidx))
         return -1;
 
-      if(cursor.columnidx != columnidx)
-      {
-        cursor.data_size = 0;
-
-        continue;
-      }
-
-      if(cursor.columnidx > columnidx)
+      if(!cursor.data_size)
         break;
 
       if(flags & JPT_REMOVE_IF_EMPTY)
@@ -2073,7 +6939,7 @@ JPT_remove_column(struct JPT_info* info, const char* column, int flags)
       {
         char zero = 0;
 
-        if(1 != pwrite64(info->fd, &zero, 1, cursor.data_offset + COLUMN_PREFIX_SIZE))
+        if(1 != JPT_pwrite(dt, &zero, 1, cursor.data_offset + COLUMN_PREFIX_SIZE))
           return -1;
       }
     }
@@ -2083,6 +6949,8 @@ JPT_remove_column(struct JPT_info* info, const char* column, int flags)
 
   free(cursor.buffer);
 
+  JPT_major_remove_column(info, columnidx);
+
   if(-1 == JPT_remove(info, column, "__COLUMNS__") && errno != ENOENT)
     return -1;
 
@@ -2125,6 +6993,7 @@ JPT_remove_column(struct JPT_info* info, const char* column, int flags)
 int
 jpt_remove_column(struct JPT_info* info, const char* column, int flags)
 {
+  uint64_t lsn = 0;
   int result;
 
   TRACE((stderr, "jpt_remove_column(%p, \"%s\")\n", info, column));
@@ -2156,25 +7025,27 @@ jpt_remove_column(struct JPT_info* info, const char* column, int flags)
 
     info->logbuf_fill = 0;
 
-    if(-1 == JPT_writev(info->logfd, iov, 2))
+    if(-1 == JPT_log_append(info, iov, 2, &lsn))
     {
       JPT_writer_leave(info);
 
       return -1;
     }
-
-    if(info->flags & JPT_SYNC)
-      fdatasync(info->logfd);
   }
 
   JPT_writer_leave(info);
 
+  if(lsn && -1 == JPT_log_commit(info, lsn))
+    return -1;
+
   return result;
 }
 
 int
 jpt_create_column(struct JPT_info* info, const char* column, int flags)
 {
+  uint64_t lsn = 0;
+
   JPT_writer_enter(info);
 
   if(JPT_get_column_idx(info, column, JPT_COL_CREATE) == JPT_INVALID_COLUMN)
@@ -2205,29 +7076,31 @@ jpt_create_column(struct JPT_info* info, const char* column, int flags)
 
     info->logbuf_fill = 0;
 
-    if(-1 == JPT_writev(info->logfd, iov, 2))
+    if(-1 == JPT_log_append(info, iov, 2, &lsn))
     {
       JPT_writer_leave(info);
 
       return -1;
     }
-
-    if(info->flags & JPT_SYNC)
-      fdatasync(info->logfd);
   }
 
   JPT_writer_leave(info);
 
+  if(lsn && -1 == JPT_log_commit(info, lsn))
+    return -1;
+
   return 0;
 }
 
 int
 jpt_has_key(struct JPT_info* info, const char* row, const char* column)
 {
-  int bloom_indices[4];
+  struct JPT_bloom_key bloom_key;
   struct JPT_disktable* dt;
   char* key = alloca(strlen(row) + COLUMN_PREFIX_SIZE + 1);
+  unsigned char* maybe;
   uint32_t columnidx;
+  size_t i = 0;
   int result;
 
   TRACE((stderr, "jpt_has_key(%p, \"%s\", \"%s\")\n", info, row, column));
@@ -2244,15 +7117,18 @@ jpt_has_key(struct JPT_info* info, const char* row, const char* column)
   }
 
   JPT_generate_key(key, row, columnidx);
-  JPT_bloom_filter_indices(bloom_indices, key);
+  JPT_bloom_key_init(&bloom_key, key);
+
+  maybe = alloca(info->disktable_count + 1);
+  JPT_bloom_probe(info, &bloom_key, maybe);
 
   dt = info->first_disktable;
 
   while(dt)
   {
-    if(JPT_BLOOM_FILTER_TEST(dt->bloom_filter, bloom_indices))
+    if(maybe[i++])
     {
-      if(0 == JPT_disktable_has_key(dt, row, columnidx))
+      if(0 == JPT_disktable_has_key(dt, row, columnidx, bloom_key.hash))
       {
         JPT_reader_leave(info);
 
@@ -2263,7 +7139,10 @@ jpt_has_key(struct JPT_info* info, const char* row, const char* column)
     dt = dt->next;
   }
 
-  result = JPT_memtable_has_key(info, row, columnidx);
+  if(info->frozen && 0 == JPT_memtable_has_key(info->frozen, row, columnidx))
+    result = 0;
+  else
+    result = JPT_memtable_has_key(info->memtable, row, columnidx);
 
   JPT_reader_leave(info);
 
@@ -2290,10 +7169,12 @@ JPT_get(struct JPT_info* info, const char* row, const char* column,
         void** value, size_t* value_size, size_t* skip, size_t* max_read,
         uint64_t* timestamp)
 {
-  int bloom_indices[4];
+  struct JPT_bloom_key bloom_key;
   struct JPT_disktable* d;
+  unsigned char* maybe;
   uint32_t columnidx;
   char* key;
+  size_t i = 0;
   int res = -1;
   /* XXX: Improve error handling */
 
@@ -2319,20 +7200,55 @@ JPT_get(struct JPT_info* info, const char* row, const char* column,
   *value_size = 0;
 
   JPT_generate_key(key, row, columnidx);
-  JPT_bloom_filter_indices(bloom_indices, key);
+  JPT_bloom_key_init(&bloom_key, key);
+
+  maybe = alloca(info->disktable_count + 1);
+  JPT_bloom_probe(info, &bloom_key, maybe);
+
+  if(__atomic_load_n(&info->compaction_thread_started, __ATOMIC_ACQUIRE)
+  && !(++JPT_lookup_sample % JPT_LOOKUP_SAMPLE))
+    JPT_lookup_account(info, maybe);
+
+  if(info->aio && !info->map_size)
+  {
+    struct JPT_disktable** candidates;
+    unsigned int* idx;
+    size_t count = 0;
+
+    candidates = alloca(info->disktable_count * sizeof(struct JPT_disktable*));
+    idx = alloca(info->disktable_count * sizeof(unsigned int));
+
+    for(; d; d = d->next)
+    {
+      if(maybe[i++] && 0 == JPT_DISKTABLE_LOAD(d, JPT_LAZY_TRIE))
+      {
+        candidates[count] = d;
+        idx[count++] = patricia_lookup(d->pat, key);
+      }
+    }
+
+    if(count
+    && 0 == JPT_disktable_get_async(info, candidates, idx, count, key, strlen(row) + COLUMN_PREFIX_SIZE + 1,
+                                    bloom_key.hash, value, value_size, max_read, timestamp))
+      res = 0;
+  }
 
   while(d)
   {
-    if(JPT_BLOOM_FILTER_TEST(d->bloom_filter, bloom_indices))
+    if(maybe[i++])
     {
-      if(0 == JPT_disktable_get(d, row, columnidx, value, value_size, skip, max_read, timestamp))
+      if(0 == JPT_disktable_get(d, row, columnidx, bloom_key.hash, value, value_size, skip, max_read, timestamp))
         res = 0;
     }
 
     d = d->next;
   }
 
-  if(0 == JPT_memtable_get(info, row, columnidx, value, value_size, skip, max_read, timestamp))
+  if(info->frozen
+  && 0 == JPT_memtable_get(info->frozen, row, columnidx, value, value_size, skip, max_read, timestamp))
+    res = 0;
+
+  if(0 == JPT_memtable_get(info->memtable, row, columnidx, value, value_size, skip, max_read, timestamp))
     res = 0;
 
   if(res == -1)
@@ -2341,92 +7257,468 @@ JPT_get(struct JPT_info* info, const char* row, const char* column,
     errno = ENOENT;
   }
 
-  if(!max_read && *value)
-    ((char*) *value)[*value_size] = 0;
+  if(!max_read && *value)
+    ((char*) *value)[*value_size] = 0;
+
+  return res;
+}
+
+int
+jpt_get(struct JPT_info* info,
+        const char* row, const char* column,
+        void** value, size_t* value_size)
+{
+  int res;
+
+  TRACE((stderr, "jpt_get(%p, \"%s\", \"%s\", %p, %p)", info, row, column, value, value_size));
+
+  JPT_reader_enter(info);
+
+  res = JPT_get(info, row, column, value, value_size, 0, 0, 0);
+
+  JPT_reader_leave(info);
+
+  if(res >= 0)
+  {
+    TRACE((stderr, " = \"%.*s\" (%zu bytes)\n", (int) *value_size, (const char*) *value, *value_size));
+  }
+  else
+  {
+    TRACE((stderr, " = %d (%s)\n", res, jpt_last_error()));
+  }
+
+  return res;
+}
+
+int
+jpt_get_timestamp(struct JPT_info* info,
+                  const char* row, const char* column,
+                  void** value, size_t* value_size, uint64_t* timestamp)
+{
+  int res;
+
+  JPT_reader_enter(info);
+
+  res = JPT_get(info, row, column, value, value_size, 0, 0, timestamp);
+
+  JPT_reader_leave(info);
+
+  return res;
+}
+
+int
+JPT_get_fixed(struct JPT_info* info, const char* row, const char* column,
+              void* value, size_t value_size)
+{
+  size_t size;
+  size_t max_read = value_size;
+
+  if(-1 == JPT_get(info, row, column, &value, &size, 0, &max_read, 0))
+    return -1;
+
+  return size;
+}
+
+int
+jpt_get_fixed(struct JPT_info* info, const char* row, const char* column,
+              void* value, size_t value_size)
+{
+  int result;
+
+  JPT_reader_enter(info);
+
+  result = JPT_get_fixed(info, row, column, value, value_size);
+
+  JPT_reader_leave(info);
+
+  return result;
+}
+
+/* Looks up a cell for jpt_get_ref.  Values found in exactly one disktable and
+ * in no memtable are stored contiguously in the mapping, if there is one; all
+ * others are assembled by JPT_get.
+ */
+static int
+JPT_get_ref(struct JPT_info* info, const char* row, const char* column,
+            const void** value, size_t* value_size, struct JPT_ref** ref)
+{
+  struct JPT_bloom_key bloom_key;
+  struct JPT_disktable* d;
+  unsigned char* maybe;
+  const char* found_value = 0;
+  const char* tmp_value;
+  size_t found_size = 0, tmp_size;
+  uint32_t columnidx;
+  char* key;
+  size_t i = 0;
+  int found = 0;
+  void* copy = 0;
+
+  JPT_clear_error();
+
+  columnidx = JPT_get_column_idx(info, column, 0);
+
+  if(columnidx == JPT_INVALID_COLUMN)
+  {
+    asprintf(&JPT_last_error, "Column \"%s\" does not exist", column);
+    errno = ENOENT;
+
+    return -1;
+  }
+
+  if(info->map_size
+  && (!info->frozen || -1 == JPT_memtable_has_key(info->frozen, row, columnidx))
+  && -1 == JPT_memtable_has_key(info->memtable, row, columnidx))
+  {
+    key = alloca(strlen(row) + COLUMN_PREFIX_SIZE + 1);
+
+    JPT_generate_key(key, row, columnidx);
+    JPT_bloom_key_init(&bloom_key, key);
+
+    maybe = alloca(info->disktable_count + 1);
+    JPT_bloom_probe(info, &bloom_key, maybe);
+
+    for(d = info->first_disktable; d && found < 2; d = d->next)
+    {
+      if(!maybe[i++])
+        continue;
+
+      if(0 == JPT_disktable_get_mapped(d, row, columnidx, bloom_key.hash, &tmp_value, &tmp_size))
+      {
+        found_value = tmp_value;
+        found_size = tmp_size;
+        ++found;
+      }
+    }
+
+    if(!found)
+    {
+      asprintf(&JPT_last_error, "Key \"%s\", \"%s\" does not exist", row, column);
+      errno = ENOENT;
+
+      return -1;
+    }
+
+    if(found == 1)
+    {
+      if(!(*ref = JPT_map_pin(info)))
+        return -1;
+
+      *value = found_value;
+      *value_size = found_size;
+
+      return 0;
+    }
+  }
+
+  if(-1 == JPT_get(info, row, column, &copy, value_size, 0, 0, 0))
+    return -1;
+
+  if(!(*ref = calloc(1, sizeof(struct JPT_ref))))
+  {
+    free(copy);
+
+    return -1;
+  }
+
+  (*ref)->copy = copy;
+  *value = copy;
+
+  return 0;
+}
+
+int
+jpt_get_ref(struct JPT_info* info, const char* row, const char* column,
+            const void** value, size_t* value_size, struct JPT_ref** ref)
+{
+  int res;
+
+  *value = 0;
+  *value_size = 0;
+  *ref = 0;
+
+  JPT_reader_enter(info);
+
+  res = JPT_get_ref(info, row, column, value, value_size, ref);
+
+  JPT_reader_leave(info);
+
+  return res;
+}
+
+void
+jpt_release_ref(struct JPT_info* info, struct JPT_ref* ref)
+{
+  struct JPT_ref** prev;
+
+  if(!ref)
+    return;
+
+  if(!ref->map)
+  {
+    free(ref->copy);
+    free(ref);
+
+    return;
+  }
+
+  pthread_mutex_lock(&info->map_ref_mutex);
+
+  /* The current mapping keeps its reference structure for later use */
+  if(!--ref->refcount && ref != info->map_ref)
+  {
+    prev = &info->retired_maps;
+
+    while(*prev != ref)
+      prev = &(*prev)->next;
+
+    *prev = ref->next;
+
+    munmap(ref->map, ref->map_size);
+    free(ref);
+  }
+
+  pthread_mutex_unlock(&info->map_ref_mutex);
+}
+
+/* A cell being retrieved by jpt_get_batch */
+struct JPT_batch_key
+{
+  struct JPT_bloom_key bloom;
+  size_t key_size;
+  size_t cell;
+  uint32_t columnidx;
+  unsigned int idx; /* Trie match in the disktable being searched */
+  void* value;
+  size_t value_size;
+  int found;
+};
+
+static int
+JPT_batch_key_compare(const void* lhs, const void* rhs)
+{
+  const struct JPT_batch_key* a = lhs;
+  const struct JPT_batch_key* b = rhs;
+
+  return strcmp(a->bloom.key, b->bloom.key);
+}
+
+/* Searches every disktable for the keys of a batch, in the same order as
+ * JPT_get, so that values spread over several disktables are concatenated
+ * the same way.  `maybe' holds the bloom filter results of each key, `stride'
+ * bytes apart.
+ *
+ * The keys are sorted, so each disktable is searched in key order.  All trie
+ * lookups in a disktable are done before any of its key infos are read, and
+ * the key infos are prefetched as they are found.
+ */
+static void
+JPT_batch_search_disktables(struct JPT_info* info, struct JPT_batch_key* keys,
+                            size_t key_count, const unsigned char* maybe,
+                            size_t stride)
+{
+  struct JPT_disktable* d;
+  struct JPT_batch_key* key;
+  size_t i, j;
+
+  for(d = info->first_disktable, i = 0; d; d = d->next, ++i)
+  {
+    for(j = 0; j < key_count; ++j)
+    {
+      if(!maybe[j * stride + i])
+        continue;
+
+      key = &keys[j];
+
+      /* A trie that cannot be read matches nothing */
+      if(-1 == JPT_DISKTABLE_LOAD(d, JPT_LAZY_TRIE))
+        key->idx = d->key_info_count;
+      else
+        key->idx = patricia_lookup(d->pat, key->bloom.key);
+
+      if(d->key_infos_mapped && key->idx < d->key_info_count)
+        __builtin_prefetch(d->key_infos + key->idx);
+    }
+
+    for(j = 0; j < key_count; ++j)
+    {
+      if(!maybe[j * stride + i])
+        continue;
+
+      key = &keys[j];
+
+      if(0 == JPT_disktable_get_at(d, key->idx, key->bloom.key, key->key_size, key->bloom.hash,
+                                   &key->value, &key->value_size, 0, 0, 0))
+        key->found = 1;
+    }
+  }
+}
+
+int
+jpt_get_batch(struct JPT_info* info, struct JPT_batch_cell* cells,
+              size_t count, void** buffer)
+{
+  struct JPT_batch_key* keys;
+  struct JPT_batch_key* key;
+  unsigned char* maybe = 0;
+  char* key_data;
+  char* o;
+  const char* column = 0;
+  uint32_t columnidx = JPT_INVALID_COLUMN;
+  size_t i, key_count = 0, key_data_size = 0, buffer_size = 0, stride;
+  int result = -1;
+
+  TRACE((stderr, "jpt_get_batch(%p, %p, %zu, %p)", info, cells, count, buffer));
+
+  JPT_clear_error();
+
+  *buffer = 0;
+
+  for(i = 0; i < count; ++i)
+  {
+    cells[i].value = 0;
+    cells[i].value_size = 0;
+
+    key_data_size += strlen(cells[i].row) + COLUMN_PREFIX_SIZE + 1;
+  }
+
+  keys = malloc(count * sizeof(struct JPT_batch_key) + 1);
+  key_data = malloc(key_data_size + 1);
+
+  if(!keys || !key_data)
+  {
+    asprintf(&JPT_last_error, "malloc failed while allocating keys for %zu cells: %s", count, strerror(errno));
+
+    free(key_data);
+    free(keys);
+
+    return -1;
+  }
+
+  JPT_reader_enter(info);
+
+  /* Cells are usually grouped by column, so a column is only looked up when
+   * it differs from that of the previous cell.  Cells in columns that do not
+   * exist are not found.  */
+  for(i = 0, o = key_data; i < count; ++i)
+  {
+    if(!column || strcmp(cells[i].column, column))
+    {
+      column = cells[i].column;
+      columnidx = JPT_get_column_idx(info, column, 0);
+    }
+
+    if(columnidx == JPT_INVALID_COLUMN)
+      continue;
+
+    key = &keys[key_count++];
 
-  return res;
-}
+    JPT_generate_key(o, cells[i].row, columnidx);
+    JPT_bloom_key_init(&key->bloom, o);
 
-int
-jpt_get(struct JPT_info* info,
-        const char* row, const char* column,
-        void** value, size_t* value_size)
-{
-  int res;
+    key->key_size = strlen(cells[i].row) + COLUMN_PREFIX_SIZE + 1;
+    key->cell = i;
+    key->columnidx = columnidx;
+    key->value = 0;
+    key->value_size = 0;
+    key->found = 0;
 
-  TRACE((stderr, "jpt_get(%p, \"%s\", \"%s\", %p, %p)", info, row, column, value, value_size));
+    o += key->key_size;
+  }
 
-  JPT_reader_enter(info);
+  JPT_clear_error();
 
-  res = JPT_get(info, row, column, value, value_size, 0, 0, 0);
+  qsort(keys, key_count, sizeof(struct JPT_batch_key), JPT_batch_key_compare);
 
-  JPT_reader_leave(info);
+  stride = info->disktable_count + 1;
 
-  if(res >= 0)
+  if(!(maybe = malloc(key_count * stride + 1)))
   {
-    TRACE((stderr, " = \"%.*s\" (%zu bytes)\n", (int) *value_size, (const char*) *value, *value_size));
+    asprintf(&JPT_last_error, "malloc failed while allocating bloom filter results: %s", strerror(errno));
+
+    goto fail;
   }
-  else
+
+  for(i = 0; i < key_count; ++i)
+    JPT_bloom_probe(info, &keys[i].bloom, maybe + i * stride);
+
+  JPT_batch_search_disktables(info, keys, key_count, maybe, stride);
+
+  for(i = 0; i < key_count; ++i)
   {
-    TRACE((stderr, " = %d (%s)\n", res, jpt_last_error()));
-  }
+    key = &keys[i];
 
-  return res;
-}
+    if(info->frozen
+    && 0 == JPT_memtable_get(info->frozen, cells[key->cell].row, key->columnidx,
+                             &key->value, &key->value_size, 0, 0, 0))
+      key->found = 1;
 
-int
-jpt_get_timestamp(struct JPT_info* info,
-                  const char* row, const char* column,
-                  void** value, size_t* value_size, uint64_t* timestamp)
-{
-  int res;
+    if(0 == JPT_memtable_get(info->memtable, cells[key->cell].row, key->columnidx,
+                             &key->value, &key->value_size, 0, 0, 0))
+      key->found = 1;
 
-  JPT_reader_enter(info);
+    if(key->found)
+      buffer_size += key->value_size + 1;
+  }
 
-  res = JPT_get(info, row, column, value, value_size, 0, 0, timestamp);
+  if(!(*buffer = malloc(buffer_size + 1)))
+  {
+    asprintf(&JPT_last_error, "malloc failed while allocating %zu bytes for values: %s", buffer_size, strerror(errno));
 
-  JPT_reader_leave(info);
+    goto fail;
+  }
 
-  return res;
-}
+  result = 0;
 
-int
-JPT_get_fixed(struct JPT_info* info, const char* row, const char* column,
-              void* value, size_t value_size)
-{
-  size_t size;
-  size_t max_read = value_size;
+  for(i = 0, o = *buffer; i < key_count; ++i)
+  {
+    key = &keys[i];
 
-  if(-1 == JPT_get(info, row, column, &value, &size, 0, &max_read, 0))
-    return -1;
+    if(!key->found)
+      continue;
 
-  return size;
-}
+    memcpy(o, key->value, key->value_size);
+    o[key->value_size] = 0;
 
-int
-jpt_get_fixed(struct JPT_info* info, const char* row, const char* column,
-              void* value, size_t value_size)
-{
-  int result;
+    cells[key->cell].value = o;
+    cells[key->cell].value_size = key->value_size;
 
-  JPT_reader_enter(info);
+    o += key->value_size + 1;
+    ++result;
+  }
 
-  result = JPT_get_fixed(info, row, column, value, value_size);
+fail:
 
   JPT_reader_leave(info);
 
+  for(i = 0; i < key_count; ++i)
+    free(keys[i].value);
+
+  free(maybe);
+  free(key_data);
+  free(keys);
+
+  TRACE((stderr, " = %d\n", result));
+
   return result;
 }
 
+struct JPT_memtable_iterator
+{
+  struct JPT_node** nodes;
+  struct JPT_node** current;
+  struct JPT_node** end;
+};
+
 int
 jpt_column_scan(struct JPT_info* info, const char* column,
                 jpt_cell_callback callback, void* arg)
 {
-  struct JPT_node** nodes = 0;
-  struct JPT_node** iterator = 0;
-  struct JPT_node** nodes_end = 0;
+  struct JPT_memtable_iterator memtables[2];
+  size_t memtable_count = 0;
   struct JPT_disktable* dt;
   struct JPT_disktable_cursor* cursors;
+  struct JPT_cursor_heap heap;
   char* row = 0;
   char* start_row = 0;
   char* last_row = 0;
@@ -2434,10 +7726,12 @@ jpt_column_scan(struct JPT_info* info, const char* column,
   size_t cat_buffer_size = 0;
   uint32_t columnidx;
   size_t i;
-  int ok = 0, cmp, res = 0;
+  int ok = 0, res = 0;
   size_t cursor_count = 0;
-  char prefix[COLUMN_PREFIX_SIZE + 1];
-  size_t major_compact_count, disktable_count;
+  size_t major_compact_count, disktable_count, memtable_generation;
+  size_t disktable_generation;
+
+  memset(&heap, 0, sizeof(heap));
 
   JPT_reader_enter(info);
 
@@ -2453,23 +7747,35 @@ jpt_column_scan(struct JPT_info* info, const char* column,
     return -1;
   }
 
-  JPT_generate_key(prefix, "", columnidx);
-
 restart:
 
   disktable_count = info->disktable_count;
   major_compact_count = info->major_compact_count;
+  memtable_generation = info->memtable_generation;
+  disktable_generation = info->disktable_generation;
 
-  if(info->root)
+  /* The frozen memtable holds older data than the active memtable, so it is
+   * listed first.  */
+  memtable_count = 0;
+
+  for(i = 0; i < 2; ++i)
   {
-    /* XXX: Allocates nodes for all values, not just one column */
-    nodes = malloc(sizeof(struct JPT_node*) * info->node_count);
-    iterator = nodes;
+    struct JPT_memtable* memtable = i ? info->memtable : info->frozen;
+    struct JPT_memtable_iterator* it = &memtables[memtable_count];
+    size_t node_count;
+
+    if(!memtable || !(node_count = JPT_memtable_column_count(memtable, columnidx)))
+      continue;
+
+    it->nodes = malloc(sizeof(struct JPT_node*) * node_count);
+    it->current = it->nodes;
+
+    JPT_memtable_list_column(memtable, &it->current, columnidx);
 
-    JPT_memtable_list_column(info, &iterator, columnidx);
+    it->end = it->current;
+    it->current = it->nodes;
 
-    nodes_end = iterator;
-    iterator = nodes;
+    ++memtable_count;
   }
 
   cursor_count = info->disktable_count;
@@ -2479,89 +7785,16 @@ restart:
 
   while(dt)
   {
-    struct JPT_key_info last;
-    char last_column[COLUMN_PREFIX_SIZE];
+    size_t first, end;
 
-    if(dt->key_infos_mapped)
-    {
-      last = dt->key_infos[dt->key_info_count - 1];
-    }
-    else
-    {
-      if(sizeof(struct JPT_key_info) != pread64(info->fd, &last, sizeof(struct JPT_key_info), dt->key_info_offset + (dt->key_info_count - 1) * sizeof(struct JPT_key_info)))
-        goto fail;
-    }
-
-    if(info->map_size)
-    {
-      memcpy(last_column, info->map + last.offset + dt->offset, COLUMN_PREFIX_SIZE);
-    }
-    else
-    {
-      if(COLUMN_PREFIX_SIZE != pread64(info->fd, last_column, COLUMN_PREFIX_SIZE, last.offset + dt->offset))
-        goto fail;
-    }
+    if(-1 == JPT_disktable_column_range(dt, columnidx, &first, &end))
+      goto fail;
 
-    if(memcmp(prefix, last_column, COLUMN_PREFIX_SIZE) <= 0)
+    if(first < end)
     {
-      struct JPT_key_info key_info;
-      struct JPT_disktable_cursor* cursor;
-      size_t first, len, half, middle;
-      size_t this_columnidx;
-      unsigned char cellmeta[4];
-
-      cursor = &cursors[i];
-
-      cursor->disktable = dt;
-
-      first = patricia_lookup_prefix(dt->pat, prefix);
-      len = cursor->disktable->key_info_count - first;
-
-      if(len > 0)
-      {
-        if(-1 == JPT_DISKTABLE_READ_KEYINFO(cursor->disktable, &key_info, first))
-          goto fail;
-
-        if(-1 == JPT_disktable_read(cursor->disktable, cellmeta, 4, key_info.offset))
-          goto fail;
-
-        this_columnidx = CELLMETA_TO_COLUMN(cellmeta);
-
-        if(this_columnidx >= columnidx)
-        {
-          len = 0;
-
-          if(this_columnidx > columnidx)
-            first = cursor->disktable->key_info_count;
-        }
-
-        while(len > 0)
-        {
-          half = len >> 1;
-          middle = first + half;
-
-          if(-1 == JPT_DISKTABLE_READ_KEYINFO(cursor->disktable, &key_info, middle))
-            goto fail;
-
-          if(-1 == JPT_disktable_read(cursor->disktable, cellmeta, 4, key_info.offset))
-            goto fail;
-
-          this_columnidx = CELLMETA_TO_COLUMN(cellmeta);
-
-          if(this_columnidx < columnidx)
-          {
-            first = middle + 1;
-            len -= half + 1;
-          }
-          else
-            len = half;
-        }
-      }
-
-      cursor->offset = first;
-
-      if(cursor->offset < cursor->disktable->key_info_count)
-        ++i;
+      cursors[i].disktable = dt;
+      cursors[i].offset = first;
+      ++i;
     }
 
     dt = dt->next;
@@ -2569,10 +7802,15 @@ restart:
 
   cursor_count = i;
 
+  if(-1 == JPT_cursor_heap_init(info, &heap, cursors, cursor_count, columnidx))
+    goto fail;
+
   for(;;)
   {
     if(disktable_count != info->disktable_count
-    || major_compact_count != info->major_compact_count)
+    || major_compact_count != info->major_compact_count
+    || memtable_generation != info->memtable_generation
+    || disktable_generation != info->disktable_generation)
     {
       if(!start_row)
         start_row = strdup(last_row);
@@ -2580,263 +7818,129 @@ restart:
       for(i = 0; i < cursor_count; ++i)
         free(cursors[i].buffer);
 
+      for(i = 0; i < memtable_count; ++i)
+        free(memtables[i].nodes);
+
+      JPT_cursor_heap_free(&heap);
       free(cursors);
-      free(nodes);
 
       cursors = 0;
       cursor_count = 0;
-      nodes = 0;
-      iterator = 0;
-      nodes_end = 0;
+      memtable_count = 0;
 
       goto restart;
     }
 
-    i = 0;
+    struct JPT_disktable_cursor* cursor = JPT_CURSOR_HEAP_TOP(&heap);
+    struct JPT_disktable_cursor* last;
+    const char* min = cursor ? cursor->data + COLUMN_PREFIX_SIZE : 0;
+    uint64_t timestamp = 0;
+    int have_timestamp = 0;
+    size_t keylen, size;
+    struct JPT_node* n;
 
-    while(i < cursor_count)
+    for(i = 0; i < memtable_count; ++i)
     {
-      struct JPT_disktable_cursor* cursor;
-
-      cursor = &cursors[i];
-
-      if(!cursor->data_size)
-      {
-        if(cursor->offset < cursor->disktable->key_info_count)
-        {
-          if(-1 == JPT_disktable_cursor_advance(info, cursor, columnidx))
-            goto fail;
-        }
-
-        if(!cursor->data_size && cursor->offset == cursor->disktable->key_info_count)
-        {
-          free(cursor->buffer);
-
-          memmove(cursors + i, cursors + i + 1, sizeof(struct JPT_disktable_cursor) * (cursor_count - i - 1));
-          --cursor_count;
+      if(memtables[i].current == memtables[i].end)
+        continue;
 
-          continue;
-        }
-      }
+      n = *memtables[i].current;
 
-      ++i;
+      if(!min || strcmp(n->row, min) < 0)
+        min = n->row;
     }
 
-    const char* min = 0;
-    size_t minidx = 0;
+    if(!min)
+      break;
 
     /* When the same value exists in several tables, the values are
-     * concatenated before they are returned.
+     * concatenated before they are returned.  The row goes first in the
+     * buffer, since `min' points into a cursor that is about to move.
      */
-    size_t equal_count = 1;
-    size_t equal_size = 0;
-    size_t keylen = 0;
-
-    struct JPT_node_data* d;
+    if(cursor && min == cursor->data + COLUMN_PREFIX_SIZE)
+      keylen = cursor->keylen - COLUMN_PREFIX_SIZE;
+    else
+      keylen = strlen(min) + 1;
 
-    for(i = 0; i < cursor_count; ++i)
+    if(keylen > cat_buffer_size)
     {
-      if(!min)
-      {
-        min = cursors[i].data + COLUMN_PREFIX_SIZE;
-        minidx = i;
-        equal_size = cursors[i].data_size - cursors[i].keylen;
-        keylen = cursors[i].keylen - COLUMN_PREFIX_SIZE;
-      }
-      else
-      {
-        cmp = strcmp(cursors[i].data + COLUMN_PREFIX_SIZE, min);
-
-        if(cmp < 0)
-        {
-          min = cursors[i].data + COLUMN_PREFIX_SIZE;
-          minidx = i;
-          equal_count = 1;
-          equal_size = cursors[i].data_size - cursors[i].keylen;
-          keylen = cursors[i].keylen - COLUMN_PREFIX_SIZE;
-        }
-        else if(cmp == 0)
-        {
-          ++equal_count;
-          equal_size += cursors[i].data_size - cursors[i].keylen;
-        }
-      }
+      cat_buffer_size = keylen * 2;
+      cat_buffer = realloc(cat_buffer, cat_buffer_size);
     }
 
-    if(iterator != nodes_end)
+    memcpy(cat_buffer, min, keylen);
+    size = keylen;
+
+    /* A cursor that stays on top after moving has passed the row */
+    for(last = 0;
+        (cursor = JPT_CURSOR_HEAP_TOP(&heap)) && cursor != last
+        && !strcmp(cursor->data + COLUMN_PREFIX_SIZE, cat_buffer);
+        last = cursor)
     {
-      if(!min)
-      {
-        min = (*iterator)->row;
-        minidx = (uint32_t) ~0;
-        keylen = strlen((*iterator)->row) + 1;
+      assert(cursor->data_size >= cursor->keylen);
 
-        for(d = &(*iterator)->data; d; d = d->next)
-          equal_size += d->value_size;
-      }
-      else
+      if(size + cursor->data_size - cursor->keylen > cat_buffer_size)
       {
-        cmp = strcmp((*iterator)->row, min);
-
-        if(cmp < 0)
-        {
-          min = (*iterator)->row;
-          minidx = (uint32_t) ~0;
-          equal_count = 1;
-          keylen = strlen((*iterator)->row) + 1;
-
-          equal_size = 0;
-          for(d = &(*iterator)->data; d; d = d->next)
-            equal_size += d->value_size;
-        }
-        else if(cmp == 0)
-        {
-          ++equal_count;
-          for(d = &(*iterator)->data; d; d = d->next)
-            equal_size += d->value_size;
-        }
+        cat_buffer_size = (size + cursor->data_size - cursor->keylen) * 2;
+        cat_buffer = realloc(cat_buffer, cat_buffer_size);
       }
-    }
 
-    if(!min)
-      break;
+      memcpy(cat_buffer + size, cursor->data + cursor->keylen, cursor->data_size - cursor->keylen);
+      size += cursor->data_size - cursor->keylen;
 
-    if(equal_size + keylen > cat_buffer_size)
-    {
-      cat_buffer_size = equal_size + keylen;
-      cat_buffer = realloc(cat_buffer, cat_buffer_size);
+      if(!have_timestamp)
+      {
+        timestamp = cursor->timestamp;
+        have_timestamp = 1;
+      }
+
+      if(-1 == JPT_cursor_heap_next(info, &heap))
+        goto fail;
     }
 
-    if(equal_count > 1)
+    for(i = 0; i < memtable_count; ++i)
     {
-      char* o;
-
-      o = cat_buffer;
-
-      for(i = 0; i < cursor_count && equal_count; ++i)
-      {
-        if(i == minidx || (cursors[i].data_size && !strcmp(cursors[i].data + COLUMN_PREFIX_SIZE, min)))
-        {
-          assert(cursors[i].data_size >= cursors[i].keylen);
+      if(memtables[i].current == memtables[i].end
+      || strcmp((*memtables[i].current)->row, cat_buffer))
+        continue;
 
-          memcpy(o, cursors[i].data + cursors[i].keylen, cursors[i].data_size - cursors[i].keylen);
-          o += cursors[i].data_size - cursors[i].keylen;
-          cursors[i].data_size = 0;
-          --equal_count;
-        }
-      }
+      n = *memtables[i].current++;
 
-      if(equal_count)
+      if(size + n->value_size > cat_buffer_size)
       {
-        assert(equal_count == 1);
-        assert(!strcmp((*iterator)->row, min));
-
-        for(d = &(*iterator)->data; d; d = d->next)
-        {
-          memcpy(o, d->value, d->value_size);
-          o += d->value_size;
-        }
-
-        ++iterator;
+        cat_buffer_size = (size + n->value_size) * 2;
+        cat_buffer = realloc(cat_buffer, cat_buffer_size);
       }
 
-      row = o;
-      strcpy(row, cursors[minidx].data + COLUMN_PREFIX_SIZE);
+      memcpy(cat_buffer + size, n->value, n->value_size);
+      size += n->value_size;
 
-      if(start_row)
+      if(!have_timestamp)
       {
-        if(0 > strcmp(start_row, row))
-        {
-          free(start_row);
-
-          start_row = 0;
-        }
-        else
-          continue;
+        timestamp = n->timestamp;
+        have_timestamp = 1;
       }
+    }
 
+    row = cat_buffer;
 
-      JPT_reader_leave(info);
-
-      res = callback(last_row = row, column, cat_buffer, equal_size, &cursors[minidx].timestamp, arg);
-
-      JPT_reader_enter(info);
-    }
-    else
+    if(start_row)
     {
-      if(minidx != (uint32_t) ~0)
+      if(0 > strcmp(start_row, row))
       {
-        memcpy(cat_buffer, cursors[minidx].data + cursors[minidx].keylen, equal_size);
-        row = cat_buffer + equal_size;
-        strcpy(row, cursors[minidx].data + COLUMN_PREFIX_SIZE);
-
-        if(start_row)
-        {
-          if(0 > strcmp(start_row, row))
-          {
-            free(start_row);
-
-            start_row = 0;
-          }
-          else
-          {
-            cursors[minidx].data_size = 0;
+        free(start_row);
 
-            continue;
-          }
-        }
-
-        JPT_reader_leave(info);
-
-        res = callback(last_row = row, column, cat_buffer,
-                       cursors[minidx].data_size - cursors[minidx].keylen,
-                       &cursors[minidx].timestamp, arg);
-
-        JPT_reader_enter(info);
-
-        cursors[minidx].data_size = 0;
+        start_row = 0;
       }
       else
-      {
-        uint64_t timestamp;
-        size_t size = 0;
-
-        for(d = &(*iterator)->data; d; d = d->next)
-        {
-          memcpy(cat_buffer + size, d->value, d->value_size);
-          size += d->value_size;
-        }
-
-        memcpy(cat_buffer + size, (*iterator)->row, keylen);
-        timestamp = (*iterator)->timestamp;
-
-        row = cat_buffer + size;
-
-        if(start_row)
-        {
-          if(0 > strcmp(start_row, row))
-          {
-            free(start_row);
-
-            start_row = 0;
-          }
-          else
-          {
-            ++iterator;
-
-            continue;
-          }
-        }
-
-        JPT_reader_leave(info);
+        continue;
+    }
 
-        res = callback(last_row = row, column, cat_buffer, size, &timestamp, arg);
+    JPT_reader_leave(info);
 
-        JPT_reader_enter(info);
+    res = callback(last_row = row, column, cat_buffer + keylen, size - keylen, &timestamp, arg);
 
-        ++iterator;
-      }
-    }
+    JPT_reader_enter(info);
 
     switch(res)
     {
@@ -2854,9 +7958,12 @@ fail:
   for(i = 0; i < cursor_count; ++i)
     free(cursors[i].buffer);
 
+  for(i = 0; i < memtable_count; ++i)
+    free(memtables[i].nodes);
+
+  JPT_cursor_heap_free(&heap);
   free(cursors);
   free(cat_buffer);
-  free(nodes);
   free(start_row);
 
   return ok ? 0 : -1;
@@ -2895,6 +8002,20 @@ jpt_scan(struct JPT_info* info, jpt_cell_callback callback, void* arg)
   return result;
 }
 
+void
+jpt_cache_stats(struct JPT_info* info, uint64_t* hits, uint64_t* misses)
+{
+  if(!info->cache)
+  {
+    *hits = 0;
+    *misses = 0;
+
+    return;
+  }
+
+  JPT_cache_stats(info->cache, hits, misses);
+}
+
 uint64_t
 jpt_get_counter(struct JPT_info* info, const char* name)
 {
@@ -2939,21 +8060,75 @@ jpt_close(struct JPT_info* info)
 
   JPT_clear_error();
 
+  JPT_compaction_stop(info);
+
+  /* Delayed log records are written before the log is closed */
+  if(-1 == JPT_log_thread_stop(info))
+    JPT_clear_error();
+
   JPT_writer_enter(info);
 
+  /* If this fails, the frozen memtable is recovered from its log on the next
+   * open.  */
+  JPT_flush_wait(info);
+
+  if(info->flush_thread_started)
+  {
+    pthread_mutex_lock(&info->flush_mutex);
+    info->flush_stop = 1;
+    pthread_cond_broadcast(&info->flush_cond);
+    pthread_mutex_unlock(&info->flush_mutex);
+
+    pthread_join(info->flush_thread, 0);
+  }
+
+  if(info->flush_result)
+    JPT_disktable_free(info->flush_result);
+
+  if(info->flush_segment)
+    JPT_segment_discard(info, info->flush_segment);
+
+  if(!info->frozen)
+    JPT_index_write(info);
+
   JPT_free_disktables(info);
 
   close(info->fd);
   close(info->logfd);
 
-  if(info->map_size)
-    munmap(info->map, info->map_size);
+  if(info->frozen_logfd != -1)
+    close(info->frozen_logfd);
+
+  if(info->map_reserved)
+    JPT_unmap(info);
+
+  /* References should have been released by now */
+  while(info->retired_maps)
+  {
+    struct JPT_ref* ref = info->retired_maps;
+
+    info->retired_maps = ref->next;
+    munmap(ref->map, ref->map_size);
+    free(ref);
+  }
 
   for(i = 0; i < info->column_count; ++i)
     free(info->columns[i].name);
 
+  JPT_compaction_clear_touched(info);
+
   free(info->columns);
-  free(info->buffer);
+  free(info->touched);
+  free(info->removed_columns);
+  free(info->bloom_refs);
+  JPT_cache_destroy(info->cache);
+  JPT_aio_destroy(info->aio);
+  JPT_memtable_destroy(info->memtable);
+  JPT_memtable_destroy(info->frozen);
+  free(info->log_group);
+  free(info->log_spare);
+  free(info->frozen_logname);
+  free(info->logname);
   free(info->filename);
   free(info);
 
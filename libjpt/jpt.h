@@ -26,8 +26,16 @@ extern "C" {
 #endif
 
 /* Flags for jpt_init */
-#define JPT_RECOVER 0x0001
-#define JPT_SYNC    0x0002
+#define JPT_RECOVER       0x0001
+#define JPT_SYNC          0x0002
+#define JPT_SKIPLIST      0x0004
+#define JPT_NO_MMAP       0x0008
+#define JPT_RANDOM_ACCESS 0x0010
+#define JPT_LOCK_INDEX    0x0020
+#define JPT_ASYNC_READ    0x0040
+#define JPT_AUTO_COMPACT  0x0080
+#define JPT_SEGMENTED     0x0100
+#define JPT_DELAY_LOG     0x0200
 
 /* Flags for jpt_insert */
 #define JPT_IGNORE   0x0000
@@ -50,6 +58,35 @@ extern "C" {
  * Disktables residing in memory cache have lower access times than the memtable.
  */
 struct JPT_info;
+struct JPT_ref;
+
+/**
+ * When background compaction merges disktables.
+ *
+ * Disktables are merged in runs of neighbours, so that the merged disktable
+ * can take the place of the run.  The compaction thread merges:
+ *
+ *  - a single disktable if more than `max_removed_ratio' of its keys have
+ *    been removed since the table was opened,
+ *  - at least `min_merge' and at most `max_merge' neighbours whose sizes
+ *    differ by no more than a factor of `size_ratio',
+ *  - the cheapest run of neighbours that brings the count down to
+ *    `max_disktables', when there are more than that,
+ *  - the cheapest run of `min_merge' neighbours, when lookups search more
+ *    than `max_read_amp' disktables on average beyond their bloom filters.
+ *
+ * A `max_disktables', `max_read_amp' or `max_removed_ratio' of 0 disables
+ * that trigger.
+ */
+struct JPT_compaction_policy
+{
+  unsigned int min_merge;
+  unsigned int max_merge;
+  double size_ratio;
+  unsigned int max_disktables;
+  double max_read_amp;
+  double max_removed_ratio;
+};
 
 struct JPT_value
 {
@@ -94,15 +131,77 @@ jpt_last_error();
  *
  * The `buffer_size' parameter indicates the maximum size of the memtable.
  * This is allocated in a single call to malloc.
+ *
+ * Changes are written to a log before the call making them returns.  With
+ * JPT_SYNC, they are also flushed to disk with fdatasync.  Writers calling
+ * at the same time share a single write and fdatasync, which happens after
+ * the table has been unlocked; a change may therefore be seen by readers
+ * slightly before it is durable.  JPT_DELAY_LOG lets changes return before
+ * they are written; see `jpt_set_log_delay'.
+ *
+ * If the table was not closed, the log is replayed into the memtable when
+ * the table is opened again.  This reads the log through a memory map, and
+ * takes about as long as inserting its changes into an empty memtable.
+ *
+ * If `flags' contains JPT_SKIPLIST, the memtable is stored in a skiplist
+ * instead of a splay tree.  Lookups in a skiplist never modify it, so
+ * concurrent readers do not serialize on hot keys.
+ *
+ * JPT_RANDOM_ACCESS is for tables used mostly for point lookups.  The data of
+ * every disktable is marked with MADV_RANDOM, so that the kernel does not
+ * read ahead around each value.  Scans request their own readahead either
+ * way.
+ *
+ * Opening a table reads only where each disktable lies, from the index that
+ * `jpt_close' appends to the table file, or from the disktable headers if
+ * the file was changed since.  The bloom filters are read by the first
+ * lookup, and the PATRICIA tries and column directories of each disktable
+ * by the first lookup or scan that needs them.
+ *
+ * JPT_LOCK_INDEX reads all of them when the table is opened, and locks the
+ * bloom filters, PATRICIA tries and key info arrays of all disktables into
+ * memory with mlock, so that lookups never wait for them to be paged in.
+ * This is best effort: if RLIMIT_MEMLOCK is too low, the table opens anyway.
+ *
+ * JPT_ASYNC_READ reads disktables with asynchronous I/O instead of through a
+ * memory map.  A lookup issues its reads to all disktables that may hold the
+ * key at once, so a table that is not in the page cache costs about one disk
+ * latency per lookup step rather than one per disktable.  io_uring is used
+ * where the kernel supports it, and a pool of reading threads otherwise.
+ *
+ * JPT_AUTO_COMPACT starts background compaction with the default policy; see
+ * `jpt_set_compaction_policy'.
+ *
+ * JPT_SEGMENTED creates a new table with each disktable in a file of its own,
+ * named `<filename>.<number>'.  `filename' is then a manifest listing the
+ * live files, which is replaced atomically whenever a disktable is added or
+ * merged, and the files of merged disktables are deleted right away instead
+ * of waiting for a major compaction.  Opening the table reads the manifest
+ * rather than the whole table file, and deletes files the manifest does not
+ * list.  Existing tables keep their layout whatever `flags' says.
  */
 struct JPT_info*
 jpt_init(const char* filename, size_t buffer_size, int flags);
 
+/**
+ * Opens a table like `jpt_init', with a block cache of `cache_size' bytes.
+ *
+ * Disktables are normally read through a memory map of the table file.  If
+ * the file cannot be mapped, or `flags' contains JPT_NO_MMAP, they are read
+ * with pread instead, and the block cache holds recently read parts of the
+ * file.  `jpt_init' uses a 16 MiB cache.  A `cache_size' of 0 disables the
+ * cache.
+ */
+struct JPT_info*
+jpt_init_cache(const char* filename, size_t buffer_size, size_t cache_size,
+               int flags);
+
 /**
  * Performs a compact and releases any resources held by the given table.
  *
- * This function does not write anything to disk, so if you want your program
- * to exit fast, you do not need to call this function.
+ * The only thing written to disk is the index of disktables that lets the
+ * next `jpt_init' open the table without reading them, so if you want your
+ * program to exit fast, you do not need to call this function.
  */
 void
 jpt_close(struct JPT_info* info);
@@ -142,11 +241,92 @@ jpt_compact(struct JPT_info* info);
  * elements.  It also ensures that access to any element in the table requires
  * no more than one seek per disktable.
  *
- * This function is never called implicitly.  The execution time can be long.
+ * This function is never called implicitly.  The execution time can be long,
+ * but the table remains available meanwhile: the disktables present when it
+ * starts are merged into a new file without holding up readers or writers,
+ * and memtables flushed in the meantime are copied after the merged
+ * disktable.  Only copying the last of those and bringing over changes made
+ * to the merged disktables meanwhile blocks other threads.  Calls made while
+ * a major compaction runs wait for it to finish.
+ *
+ * The merge is divided by ranges of columns among one thread per online
+ * processor, each writing a disktable of its own, so a large table with many
+ * columns ends up with one disktable per range rather than just one.
+ *
+ * With JPT_SEGMENTED, the merged disktables are written to new files and
+ * nothing is copied: disktables flushed meanwhile stay in their files.
  */
 int
 jpt_major_compact(struct JPT_info* info);
 
+/**
+ * Sets the bloom filter size of disktables written from now on.
+ *
+ * Each disktable gets a filter of `bits_per_key' bits per key.  With the
+ * default of 10 bits, about 1% of lookups for keys not in a disktable get
+ * past its filter, and each extra bit cuts that by about a third.  Returns
+ * -1 and sets errno to EINVAL unless 1 <= `bits_per_key' <= 64.
+ */
+int
+jpt_set_bloom_bits(struct JPT_info* info, unsigned int bits_per_key);
+
+/**
+ * Starts merging disktables in a background thread, or changes when they are
+ * merged.  A null `policy' stops the thread.
+ *
+ * The merges do not hold up readers or writers.  The merged disktable is
+ * written at the end of the table file, and the space of the disktables it
+ * replaces is not reclaimed until `jpt_major_compact'.  A merge is discarded
+ * if `jpt_remove_column' or `jpt_major_compact' is called while it runs.
+ *
+ * Returns -1 and sets errno to EINVAL unless 2 <= `min_merge' <=
+ * `max_merge' and `size_ratio' >= 1.
+ */
+int
+jpt_set_compaction_policy(struct JPT_info* info,
+                          const struct JPT_compaction_policy* policy);
+
+/**
+ * Retrieves the compaction policy last set, or the default one if none has
+ * been set.  The default merges 4 to 16 disktables within
+ * a factor of 2 in size, and triggers at 32 disktables, 4 disktables
+ * searched per lookup and half of the keys of a disktable removed.
+ */
+void
+jpt_get_compaction_policy(struct JPT_info* info,
+                          struct JPT_compaction_policy* policy);
+
+/**
+ * Keeps log records in memory for up to `interval_msec' milliseconds, or
+ * until `max_bytes' of them are waiting, and writes them from a background
+ * thread, so that changes return without waiting for the log.  Changes made
+ * in the last interval are lost if the process crashes, or, with JPT_SYNC,
+ * if the system does; the log is replayed up to the last record written in
+ * full.  A `max_bytes' of 0 means 1 MiB.  An `interval_msec' of 0 writes
+ * the records kept so far, and has changes wait for the log again.
+ *
+ * JPT_DELAY_LOG in `jpt_init' starts with an interval of 100 ms.  Errors
+ * writing the log are reported by the next change, or by `jpt_flush_log'.
+ */
+int
+jpt_set_log_delay(struct JPT_info* info, unsigned int interval_msec,
+                  size_t max_bytes);
+
+/**
+ * Writes all log records kept in memory, and flushes the log to disk with
+ * fdatasync.  Changes that have already moved from the log to a disktable
+ * are only flushed with JPT_SYNC.
+ */
+int
+jpt_flush_log(struct JPT_info* info);
+
+/**
+ * Waits until background compaction has no merges left to do.  Returns
+ * immediately if background compaction is not running.
+ */
+void
+jpt_compaction_wait(struct JPT_info* info);
+
 /**
  * Inserts data into a given cell.
  *
@@ -243,6 +423,60 @@ int
 jpt_get_fixed(struct JPT_info* info, const char* row, const char* column,
               void* value, size_t value_size);
 
+/**
+ * Retrieves a value from a given cell without copying it, if possible.
+ *
+ * If the value is stored contiguously in the memory mapped table, `*value'
+ * points directly into the mapping.  Otherwise, it points to a copy.  Either
+ * way, the value remains valid until `*ref' is passed to `jpt_release_ref',
+ * even if the table is compacted in the meantime.  Replacing the cell with
+ * JPT_REPLACE may however overwrite a value in place.
+ *
+ * Unlike with `jpt_get', the value is not NUL terminated.
+ */
+int
+jpt_get_ref(struct JPT_info* info, const char* row, const char* column,
+            const void** value, size_t* value_size, struct JPT_ref** ref);
+
+/**
+ * Releases a value returned by `jpt_get_ref'.  All references must be
+ * released before the table is closed.
+ */
+void
+jpt_release_ref(struct JPT_info* info, struct JPT_ref* ref);
+
+/**
+ * A cell to retrieve with `jpt_get_batch'.
+ *
+ * `row' and `column' are set by the caller.  `value' and `value_size' are set
+ * by `jpt_get_batch'; `value' is 0 if the cell does not exist.
+ */
+struct JPT_batch_cell
+{
+  const char* row;
+  const char* column;
+
+  const void* value;
+  size_t value_size;
+};
+
+/**
+ * Retrieves the values of many cells at once.
+ *
+ * This is faster than calling `jpt_get' for each cell.  The table is locked
+ * once, each column is looked up once, and the cells are sorted so that each
+ * disktable is searched in key order.
+ *
+ * All values are stored in a single buffer, which is allocated using malloc
+ * and returned in `buffer'.  It must be freed by the caller.  The `value' of
+ * each cell points into this buffer, and is followed by a NUL byte.
+ *
+ * Returns the number of cells found, or -1 on error.
+ */
+int
+jpt_get_batch(struct JPT_info* info, struct JPT_batch_cell* cells,
+              size_t count, void** buffer);
+
 /**
  * Calls a function for every cell in the table.
  *
@@ -260,6 +494,13 @@ int
 jpt_column_scan(struct JPT_info* info, const char* column,
                 jpt_cell_callback callback, void* arg);
 
+/**
+ * Returns the number of block cache hits and misses since the table was
+ * opened.  Both are 0 if the table has no cache.
+ */
+void
+jpt_cache_stats(struct JPT_info* info, uint64_t* hits, uint64_t* misses);
+
 /**
  * Retrieves and increments a 64 bit unsigned counter.
  *
@@ -19,9 +19,11 @@
 #ifndef JPT_INTERNAL_H_
 #define JPT_INTERNAL_H_ 1
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
 #include <sys/uio.h>
 
 #include "jpt.h"
@@ -45,6 +47,16 @@
   (disktable->key_infos_mapped ? (memcpy(disktable->key_infos + keyidx, source, sizeof(struct JPT_key_info)), 0) \
                                : JPT_disktable_write_keyinfo(disktable, source, keyidx))
 
+/* Parts of a disktable read on first use; see JPT_disktable_load_lazy */
+#define JPT_LAZY_BLOOM   0x0001
+#define JPT_LAZY_TRIE    0x0002
+#define JPT_LAZY_COLUMNS 0x0004
+#define JPT_LAZY_ALL     (JPT_LAZY_BLOOM | JPT_LAZY_TRIE | JPT_LAZY_COLUMNS)
+
+#define JPT_DISKTABLE_LOAD(disktable, parts) \
+  ((__atomic_load_n(&(disktable)->lazy, __ATOMIC_ACQUIRE) & (parts)) \
+   ? JPT_disktable_load_lazy(disktable, parts) : 0)
+
 #define JPT_OPERATOR_INSERT         0x0001
 #define JPT_OPERATOR_REMOVE         0x0002
 #define JPT_OPERATOR_CREATE_COLUMN  0x0003
@@ -53,18 +65,27 @@
 #define JPT_KEY_REMOVED             0x0001
 #define JPT_KEY_NEW_COLUMN          0x0002
 
+/* Since version 13, the upper 16 bits of the key info flags hold a
+ * fingerprint of the key's hash.  A PATRICIA trie lookup of an absent key
+ * usually lands on a key with a different fingerprint, which is rejected
+ * without reading the key from the data region.  */
+#define JPT_KEY_FINGERPRINT_MASK    0xffff0000U
+#define JPT_KEY_FINGERPRINT(hash) \
+  ((uint32_t) (((hash) * 0x9e3779b97f4a7c15ULL) >> 48) << 16)
+
 #define JPT_INVALID_COLUMN ((uint32_t) ~0)
 
 extern __thread int JPT_errno;
 extern __thread char* JPT_last_error;
 
-struct JPT_node_data
-{
-  struct JPT_node_data* next;
-  void* value;
-  size_t value_size;
-};
-
+/**
+ * Memtable node.
+ *
+ * The value of a cell is stored contiguously at `value', which is
+ * `(void*) -1' for removed cells.  `value_alloc' bytes are reserved there,
+ * so that appends can usually be done in place.  A `value_alloc' of zero
+ * means the value is not stored in the memtable at all.
+ */
 struct JPT_node
 {
   uint64_t timestamp;
@@ -75,9 +96,73 @@ struct JPT_node
   struct JPT_node* parent;
   struct JPT_node* left;
   struct JPT_node* right;
-  struct JPT_node_data* last;
 
-  struct JPT_node_data data;
+  void* value;
+  size_t value_size;
+  size_t value_alloc;
+};
+
+#define JPT_SKIPLIST_MAX_HEIGHT 20
+
+#define JPT_SKIPLIST_HEAD_SIZE \
+  (sizeof(struct JPT_skipnode) + JPT_SKIPLIST_MAX_HEIGHT * sizeof(struct JPT_skipnode*))
+
+/**
+ * Memtable node used when the table is opened with JPT_SKIPLIST.
+ *
+ * The node is followed by `height' forward pointers.  `node' must be the first
+ * member, so that a skiplist node can be passed anywhere a JPT_node is
+ * expected.
+ */
+struct JPT_skipnode
+{
+  struct JPT_node node;
+
+  unsigned int height;
+  struct JPT_skipnode* next[];
+};
+
+/**
+ * Column directory entry of a memtable.
+ *
+ * `first' is the first node of the column in key order, which may be a
+ * tombstone.  `node_count' is the number of cells in the column that are not
+ * tombstones.
+ */
+struct JPT_memtable_column
+{
+  struct JPT_node* first;
+  size_t node_count;
+};
+
+/**
+ * An in-memory table.
+ *
+ * New data is inserted into the active memtable.  When it fills up, it is
+ * frozen and handed to a background thread, which writes it to a disktable
+ * while a fresh memtable takes over.  A frozen memtable is never modified, and
+ * is never splayed by lookups.
+ */
+struct JPT_memtable
+{
+  struct JPT_info* info;
+
+  char* buffer;
+  size_t buffer_util;
+
+  struct JPT_node* root;
+  struct JPT_skipnode* skiplist_head;
+  unsigned int skiplist_height;
+  size_t node_count;
+  size_t key_count;
+  size_t key_size;
+  size_t value_size;
+
+  /* Indexed by column index; `column_alloc' entries are allocated */
+  struct JPT_memtable_column* columns;
+  size_t column_alloc;
+
+  int frozen;
 };
 
 struct JPT_column
@@ -94,6 +179,48 @@ struct JPT_key_info
   uint32_t flags;
 } __attribute__((packed));
 
+/* A value returned by jpt_get_ref: either a mapping of the table file that
+ * the value points into, or a private copy of a value that is not stored
+ * contiguously.  */
+struct JPT_ref
+{
+  char* map; /* 0 for copies */
+  off_t map_size; /* Size of the whole address range at `map' */
+  size_t refcount;
+  struct JPT_ref* next; /* Next retired mapping */
+
+  void* copy;
+};
+
+/* The mapping and size of the table file when a merge began.  The copies a
+ * merge reads point to one, so that the merge does not read the fields of
+ * `info' that change as the file grows.  */
+struct JPT_map_snapshot
+{
+  char* map;
+  off_t map_size;
+  off_t file_size;
+};
+
+/**
+ * The file of a disktable in a table with the segmented layout.
+ *
+ * Each segment is given a page aligned range of its own in the table's
+ * address range, starting at `base', and is mapped there if the table is
+ * mapped.  Disktable offsets are offsets in the address range, as if the
+ * segments were parts of one table file.  Bases are handed out in increasing
+ * order and not reused until the table is opened again or major compacted.
+ */
+struct JPT_segment
+{
+  uint64_t id; /* The file is named `<table>.<id>' */
+  int fd;
+  off_t start; /* Offset of the disktable in the file */
+  off_t base;
+  off_t size;
+  int mapped;
+};
+
 struct JPT_info
 {
   int flags;
@@ -101,34 +228,112 @@ struct JPT_info
   char* filename;
   int fd;
 
+  /* With the segmented layout, `fd' holds the manifest listing the segment
+   * of each disktable, and `file_size' is the end of the address range
+   * given to segments.  `flush_count' is the number of memtables flushed to
+   * the table, which log headers record in place of the table size.
+   * Disktables written while a log is replayed are listed in the manifest
+   * only once the log is reset; until then, `manifest_stale' is set.  */
+  int segmented;
+  int manifest_stale;
+  uint64_t next_segment_id;
+  uint64_t flush_count;
+
+  char* logname;
   int logfd;
   int logfile_empty;
   unsigned char logbuf[256]; /* For log entry headers */
   size_t logbuf_fill;
   int replaying; /* To avoid logging while replaying */
 
+  /* Group commit.  Writers append their log records to `log_group' under
+   * the writer lock, and JPT_log_commit writes them once the lock has been
+   * released: whoever finds no write in progress writes the records of
+   * everyone, followed by fdatasync with JPT_SYNC, while the others wait.
+   * `log_appended', `log_written' and `log_synced' count bytes appended,
+   * written, and flushed with fdatasync since the table was opened;
+   * `log_committers' is the number of writers that have appended a record
+   * and not yet returned from JPT_log_commit.  All of this is protected by
+   * `log_mutex'.  */
+  pthread_mutex_t log_mutex;
+  pthread_cond_t log_cond;
+  unsigned char* log_group;
+  size_t log_group_fill, log_group_alloc;
+  unsigned char* log_spare;
+  size_t log_spare_alloc;
+  uint64_t log_appended, log_written, log_synced;
+  size_t log_committers;
+  int log_writing;
+  int log_error; /* errno of a failed write, until the log is reset */
+
+  /* With jpt_set_log_delay, JPT_log_commit leaves the records to
+   * `log_thread', which writes them every `log_delay_msec' milliseconds, or
+   * once `log_delay_bytes' are waiting.  Protected by `log_mutex'.  */
+  unsigned int log_delay_msec;
+  size_t log_delay_bytes;
+  pthread_t log_thread;
+  int log_thread_started;
+  int log_stop;
+  pthread_cond_t log_thread_cond;
+
+  /* The table file is mapped at the start of an address range of
+   * `map_reserved' bytes, the rest of which is reserved so that the mapping
+   * can grow in place.  `map_size' may be zero while `map_reserved' is not,
+   * when no file is mapped into the range.  */
   char* map;
   off_t map_size;
+  off_t map_reserved;
   off_t file_size;
 
+  /* References into mappings, handed out by jpt_get_ref.  `map_ref' describes
+   * `map', and may be kept with a zero reference count.  Mappings replaced
+   * while referenced are kept in `retired_maps' until their last reference
+   * is released.  All three are protected by `map_ref_mutex'.  */
+  struct JPT_ref* map_ref;
+  struct JPT_ref* retired_maps;
+  pthread_mutex_t map_ref_mutex;
+
+  /* Caches reads of the table file while it is not mapped; 0 if disabled */
+  struct JPT_cache* cache;
+
+  /* Reads the table file asynchronously; only with JPT_ASYNC_READ */
+  struct JPT_aio* aio;
+
+  /* Index of the next column created; 0 until read from the table */
   uint32_t next_column;
   struct JPT_column* columns;
   size_t column_count;
 
-  char* buffer;
   size_t buffer_size;
-  size_t buffer_util;
+  uint32_t skiplist_seed;
 
-  struct JPT_node* root;
-  size_t node_count;
-  size_t memtable_key_count;
-  size_t memtable_key_size;
-  size_t memtable_value_size;
+  struct JPT_memtable* memtable;
+
+  /* Memtable being written to disk by the flush thread, and its log */
+  struct JPT_memtable* frozen;
+  char* frozen_logname;
+  int frozen_logfd;
+  off_t flush_offset;
+  struct JPT_segment* flush_segment;
+
+  pthread_t flush_thread;
+  int flush_thread_started;
+  pthread_mutex_t flush_mutex;
+  pthread_cond_t flush_cond;
+  int flush_pending; /* Protected by flush_mutex */
+  int flush_stop; /* Protected by flush_mutex */
+  struct JPT_disktable* flush_result; /* Protected by flush_mutex */
 
   struct JPT_disktable* first_disktable;
   struct JPT_disktable* last_disktable;
   size_t disktable_count;
 
+  unsigned int bloom_bits; /* Bloom filter bits per key in new disktables */
+
+  /* Bloom filters of all disktables, in order, for JPT_bloom_probe */
+  struct JPT_bloom_ref* bloom_refs;
+  size_t bloom_ref_alloc;
+
 #if GLOBAL_LOCKS
   pthread_mutex_t global_lock;
 #else
@@ -138,7 +343,63 @@ struct JPT_info
 
   pthread_mutex_t column_hash_mutex;
 
+  /* Disktables are read only as far as their headers when the table is
+   * opened; the rest is read by JPT_disktable_load_lazy, under
+   * `lazy_mutex'.  `lazy_bloom_count' is the number of disktables whose
+   * bloom filter is yet to be read, and is updated with atomic
+   * operations.  */
+  pthread_mutex_t lazy_mutex;
+  size_t lazy_bloom_count;
+
+  /* End of the index written to the table file by jpt_close, or of the one
+   * read by jpt_init; while the file ends there, the index is current.  */
+  off_t index_end;
+
+  /* Background compaction.  The thread merges runs of disktables chosen by
+   * `compaction_policy', which is protected by the writer lock.  While a
+   * merge reads and writes the table file without holding the writer lock,
+   * `compaction_merging' is set; setting `compaction_abort' makes it stop
+   * and discard its result.  */
+  struct JPT_compaction_policy compaction_policy;
+  pthread_t compaction_thread;
+  int compaction_thread_started; /* Accessed atomically */
+  pthread_mutex_t compaction_mutex;
+  pthread_cond_t compaction_cond;
+  int compaction_wake; /* Protected by compaction_mutex */
+  int compaction_busy; /* Protected by compaction_mutex */
+  int compaction_stop; /* Protected by compaction_mutex */
+  int compaction_abort; /* Protected by compaction_mutex */
+  int compaction_merging; /* Protected by compaction_mutex */
+
+  /* Cells changed in disktables being merged, protected by the writer lock.
+   * `touch_failed' is set if a change could not be recorded.  */
+  struct JPT_compaction_touch* touched;
+  size_t touched_count;
+  size_t touched_alloc;
+  int touch_failed;
+
+  /* Major compaction.  `major_compact_mutex' is held for the whole
+   * compaction, and `major_compacting' is set while it merges without the
+   * writer lock.  Columns removed meanwhile are listed in
+   * `removed_columns'.  */
+  pthread_mutex_t major_compact_mutex;
+  int major_compacting;
+  uint32_t* removed_columns;
+  size_t removed_column_count;
+  size_t removed_column_alloc;
+
+  /* Number of threads jpt_major_compact merges with; the number of online
+   * processors by default.  */
+  size_t major_compact_threads;
+
+  /* A sample of lookups, and the number of disktables they searched beyond
+   * the bloom filters.  Updated with atomic operations.  */
+  uint64_t lookup_count;
+  uint64_t lookup_searches;
+
   size_t major_compact_count;
+  size_t memtable_generation; /* Incremented when memtable memory is reused */
+  size_t disktable_generation; /* Incremented when disktables are merged */
 };
 
 struct JPT_disktable
@@ -154,12 +415,84 @@ struct JPT_disktable
 
   struct JPT_info* info;
   off_t offset;
+  size_t data_size;
+
+  uint32_t version;
+
+  /* JPT_LAZY_* flags for the parts not read yet.  Cleared with atomic
+   * operations, once the part can be used.  */
+  int lazy;
+
+  /* The file holding the disktable, or 0 if it is in the table file */
+  struct JPT_segment* segment;
 
-  uint8_t bloom_filter[4][8192];
+  /* Since version 10, disktables store the filter size in bytes and the
+   * number of hash functions in their header.  Older disktables have four
+   * 64 kbit filters with one hash function each, marked by `bloom_hashes'
+   * == 0.  */
+  uint8_t* bloom_filter;
+  uint32_t bloom_size;
+  uint32_t bloom_hashes;
+  int bloom_blocked; /* Version 11 and later: one cache line per key */
+
+  int key_fingerprints; /* Version 13 and later */
+
+  /* Since version 12, disktables end with a directory of the key range of
+   * every column they contain, in column order.  `columns' is 0 for older
+   * disktables.  */
+  struct JPT_disktable_column* columns;
+  uint32_t column_count;
+
+  /* Keys removed since the table was opened, for the compaction policy */
+  size_t removed_count;
+
+  /* Non-zero while the compaction thread merges this disktable into another.
+   * Changes made to it in the meantime are reported to JPT_compaction_touch. */
+  int merging;
+
+  /* Non-zero for the copies a merge reads while other threads may change
+   * the disktable.  Their reads bypass the block cache, which could
+   * otherwise be filled with data that a write is about to replace, and
+   * their cursors copy cells out of the memory map.  */
+  int uncached;
+
+  /* The mapping the copies a merge reads are read through, or null */
+  const struct JPT_map_snapshot* snapshot;
 
   struct JPT_disktable* next;
 };
 
+/**
+ * Column directory entry of a disktable.
+ *
+ * The keys of column `columnidx' are those with indexes `first' through
+ * `first' + `count' - 1, including removed keys.
+ */
+struct JPT_disktable_column
+{
+  uint32_t columnidx;
+  uint32_t first;
+  uint32_t count;
+} __attribute__((packed));
+
+struct JPT_bloom_ref
+{
+  const uint64_t* blocks; /* 0 for filters older than version 11 */
+  uint64_t block_count;
+  struct JPT_disktable* disktable;
+};
+
+/**
+ * A cell changed in a disktable that is being merged.  The merged disktable
+ * gets the cell's new value before it replaces the old ones.
+ */
+struct JPT_compaction_touch
+{
+  char* row;
+  uint32_t columnidx;
+  uint64_t hash;
+};
+
 struct JPT_disktable_cursor
 {
   uint64_t timestamp;
@@ -173,69 +506,178 @@ struct JPT_disktable_cursor
   off_t offset;
   uint32_t columnidx;
   uint32_t flags;
+
+  /* Keys from `readahead_start' have been passed to MADV_WILLNEED; the next
+   * window is requested when the cursor reaches `readahead_end' */
+  size_t readahead_start;
+  size_t readahead_end;
 };
 
-struct JPT_key_info_callback_args
+/**
+ * Merges disktable cursors in key order.
+ *
+ * `heap' holds the indexes of the cursors that have a key, as a binary
+ * min-heap on the keys, so that finding the next key among k cursors takes
+ * O(log k) comparisons.  The cursor with the smallest key is
+ * `cursors[heap[0]]'; of cursors with equal keys, the lowest index comes
+ * first.
+ */
+struct JPT_cursor_heap
 {
-  struct JPT_key_info* row_names;
-  struct JPT_info* info;
+  struct JPT_disktable_cursor* cursors;
+  size_t* heap;
+  size_t count;
+  uint32_t columnidx;
 };
 
+/**
+ * A read issued through JPT_aio_read.
+ *
+ * `result' receives the number of bytes read, or a negative errno value.
+ */
+struct JPT_aio_request
+{
+  int fd;
+  void* target;
+  size_t size;
+  off_t offset;
+  ssize_t result;
+
+  struct iovec iov; /* Used internally */
+};
+
+/**
+ * Output buffer for writing a large file region with positional writes.
+ *
+ * Data is written to `fd' at `offset', which is advanced as the buffer is
+ * flushed.  The file position of `fd' is never used.
+ */
+struct JPT_write_buffer
+{
+  int fd;
+  off_t offset;
+  size_t fill;
+  char data[65536];
+};
+
+struct JPT_memtable*
+JPT_memtable_create(struct JPT_info* info);
+
+void
+JPT_memtable_clear(struct JPT_memtable* memtable);
+
+void
+JPT_memtable_destroy(struct JPT_memtable* memtable);
+
 void
-JPT_memtable_splay(struct JPT_info* info, struct JPT_node* n);
+JPT_memtable_splay(struct JPT_memtable* memtable, struct JPT_node* n);
 
 int
-JPT_memtable_has_key(struct JPT_info* info, const char* row, uint32_t columnidx);
+JPT_memtable_has_key(struct JPT_memtable* memtable, const char* row, uint32_t columnidx);
 
 int
-JPT_memtable_insert(struct JPT_info* info, const char* row, uint32_t columnidx,
+JPT_memtable_insert(struct JPT_memtable* memtable, const char* row, uint32_t columnidx,
                     const void* value, size_t value_size, uint64_t* timestamp,
                     int flags);
 
 int
-JPT_memtable_get(struct JPT_info* info, const char* row, uint32_t columnidx,
+JPT_memtable_get(struct JPT_memtable* memtable, const char* row, uint32_t columnidx,
                  void** value, size_t* value_size, size_t* skip, size_t* max_read,
                  uint64_t* timestamp);
 
-void
-JPT_memtable_list_all(struct JPT_info* info, struct JPT_node*** nodes);
+struct JPT_node*
+JPT_memtable_first(struct JPT_memtable* memtable);
+
+struct JPT_node*
+JPT_memtable_next(struct JPT_memtable* memtable, struct JPT_node* n);
 
 void
-JPT_memtable_list_column(struct JPT_info* info, struct JPT_node*** nodes, uint32_t columnidx);
+JPT_memtable_list_column(struct JPT_memtable* memtable, struct JPT_node*** nodes, uint32_t columnidx);
 
 int
-JPT_memtable_remove(struct JPT_info* info, const char* row, uint32_t columnidx);
+JPT_memtable_remove(struct JPT_memtable* memtable, const char* row, uint32_t columnidx);
+
+size_t
+JPT_memtable_column_count(struct JPT_memtable* memtable, uint32_t columnidx);
+
+void
+JPT_memtable_remove_column(struct JPT_memtable* memtable, uint32_t columnidx);
 
 int
 JPT_disktable_read_keyinfo(struct JPT_disktable* disktable, struct JPT_key_info* target, size_t keyidx);
 
+int
+JPT_disktable_write_keyinfo(struct JPT_disktable* disktable, const struct JPT_key_info* source, size_t keyidx);
+
 int
 JPT_disktable_read(struct JPT_disktable* disktable, void* target, size_t size, size_t offset);
 
+int
+JPT_disktable_fd(const struct JPT_disktable* disktable, off_t* offset);
+
+int
+JPT_disktable_load_lazy(struct JPT_disktable* disktable, int parts);
+
+int
+JPT_disktable_column_range(struct JPT_disktable* disktable, uint32_t columnidx,
+                           size_t* first, size_t* end);
+
 int
 JPT_disktable_has_key(struct JPT_disktable* disktable,
-                      const char* row, uint32_t columnidx);
+                      const char* row, uint32_t columnidx, uint64_t hash);
 
 int
 JPT_disktable_remove(struct JPT_disktable* disktable,
-                     const char* row, uint32_t columnidx);
+                     const char* row, uint32_t columnidx, uint64_t hash);
 
 ssize_t
 JPT_disktable_overwrite(struct JPT_disktable* disktable,
-                        const char* row, uint32_t columnidx,
+                        const char* row, uint32_t columnidx, uint64_t hash,
                         const void* data, size_t amount);
 
 int
 JPT_disktable_get(struct JPT_disktable* disktable,
-                  const char* row, uint32_t columnidx,
+                  const char* row, uint32_t columnidx, uint64_t hash,
                   void** value, size_t* value_size, size_t* skip, size_t* max_read,
                   uint64_t* timestamp);
 
+int
+JPT_disktable_get_at(struct JPT_disktable* disktable, unsigned int idx,
+                     const char* key, size_t key_size, uint64_t hash,
+                     void** value, size_t* value_size, size_t* skip, size_t* max_read,
+                     uint64_t* timestamp);
+
+int
+JPT_disktable_get_async(struct JPT_info* info, struct JPT_disktable** disktables,
+                        const unsigned int* idx, size_t count,
+                        const char* key, size_t key_size, uint64_t hash,
+                        void** value, size_t* value_size, size_t* max_read,
+                        uint64_t* timestamp);
+
+int
+JPT_disktable_get_mapped(struct JPT_disktable* disktable,
+                         const char* row, uint32_t columnidx, uint64_t hash,
+                         const char** value, size_t* value_size);
+
 int
 JPT_disktable_cursor_advance(struct JPT_info* info,
                              struct JPT_disktable_cursor* cursor,
                              uint32_t columnidx);
 
+int
+JPT_cursor_heap_init(struct JPT_info* info, struct JPT_cursor_heap* heap,
+                     struct JPT_disktable_cursor* cursors, size_t count,
+                     uint32_t columnidx);
+
+#define JPT_CURSOR_HEAP_TOP(cursor_heap) \
+  ((cursor_heap)->count ? &(cursor_heap)->cursors[(cursor_heap)->heap[0]] : 0)
+
+int
+JPT_cursor_heap_next(struct JPT_info* info, struct JPT_cursor_heap* heap);
+
+void
+JPT_cursor_heap_free(struct JPT_cursor_heap* heap);
+
 int
 JPT_disktable_cursor_remap(struct JPT_info* info,
                            struct JPT_disktable_cursor* cursor);
@@ -243,6 +685,16 @@ JPT_disktable_cursor_remap(struct JPT_info* info,
 int
 JPT_compact(struct JPT_info* info);
 
+void
+JPT_compaction_touch(struct JPT_info* info, const char* row, uint32_t columnidx,
+                     uint64_t hash);
+
+int
+JPT_freeze_memtable(struct JPT_info* info);
+
+int
+JPT_flush_wait(struct JPT_info* info);
+
 int
 JPT_get_fixed(struct JPT_info* info, const char* row, const char* column,
               void* value, size_t value_size);
@@ -250,12 +702,27 @@ JPT_get_fixed(struct JPT_info* info, const char* row, const char* column,
 void
 JPT_generate_key(char* target, const char* row, uint32_t columnidx);
 
+uint64_t
+JPT_key_hash(const char* key);
+
 ssize_t
 JPT_read_all(int fd, void* target, size_t size);
 
+ssize_t
+JPT_pread_all(int fd, void* target, size_t size, off_t offset);
+
 ssize_t
 JPT_write_all(int fd, const void* target, size_t size);
 
+ssize_t
+JPT_pwrite_all(int fd, const void* source, size_t size, off_t offset);
+
+int
+JPT_write_buffer_append(struct JPT_write_buffer* buffer, const void* data, size_t size);
+
+int
+JPT_write_buffer_flush(struct JPT_write_buffer* buffer);
+
 void*
 JPT_fs_malloc(size_t size);
 
@@ -288,4 +755,52 @@ JPT_lseek(int fd, off_t offset, int whence, off_t filesize);
 ssize_t
 JPT_writev(int fd, const struct iovec *iov, int iovcnt);
 
+int
+JPT_madvise(void* addr, size_t size, int advice);
+
+struct JPT_cache*
+JPT_cache_create(size_t size);
+
+void
+JPT_cache_destroy(struct JPT_cache* cache);
+
+/* Reads from `fd', which holds the bytes of the table file from `base' on */
+ssize_t
+JPT_cache_pread(struct JPT_cache* cache, int fd, off_t base, void* target,
+                size_t size, off_t offset, off_t limit);
+
+void
+JPT_cache_update(struct JPT_cache* cache, const void* source, size_t size, off_t offset);
+
+void
+JPT_cache_invalidate(struct JPT_cache* cache, off_t offset, size_t size);
+
+void
+JPT_cache_clear(struct JPT_cache* cache);
+
+void
+JPT_cache_stats(struct JPT_cache* cache, uint64_t* hits, uint64_t* misses);
+
+/* pread64 and pwrite64 on the file holding `disktable', through the block
+ * cache if the table has one and `disktable' is not uncached.  `offset' is in
+ * the table's address range. */
+ssize_t
+JPT_pread(struct JPT_disktable* disktable, void* target, size_t size, off_t offset);
+
+ssize_t
+JPT_pwrite(struct JPT_disktable* disktable, const void* source, size_t size, off_t offset);
+
+/* Creates a read engine using io_uring, or worker threads where io_uring is
+ * not available */
+struct JPT_aio*
+JPT_aio_create();
+
+void
+JPT_aio_destroy(struct JPT_aio* aio);
+
+/* Issues all `count' reads at once, and waits for them to complete */
+int
+JPT_aio_read(struct JPT_aio* aio, struct JPT_aio_request* requests,
+             size_t count);
+
 #endif /* !JPT_INTERNAL_H_ */
@@ -25,135 +25,315 @@
 
   @< Functions @>
 
-@ A heavily unbalanced tree, for example a tree that only has left branches,
-can easily cause a stack overflow even if it contains just a few thousand
-elements.
+@ When the table is opened with |JPT_SKIPLIST|, the memtable is stored in a
+skiplist instead of a splay tree.  A skiplist is never reorganized by lookups,
+so any number of readers can search it at the same time without taking any
+locks at all.
 
-If we use two binary tree traversal functions, one which can step down a
-sequence of left branches without increasing the stack, the other which can
-step down step down a sequency of right branches, one would have to create a
-deep zig-zag tree to cause a stack overflow.
+Each node in the skiplist is a regular |JPT_node| followed by a tower of
+forward pointers.  Only the bottom level is required for correctness; the
+higher levels are express lanes that make searches logarithmic.  The head
+node has a tower of the maximum height, and holds no key.
 
 @< Functions @>=
 
-  static void
-  JPT_memtable_list_all_right(struct JPT_node* n, struct JPT_node*** nodes);
+  static int
+  JPT_memtable_skiplist_compare(const struct JPT_skipnode* s,
+                                const char* row, uint32_t columnidx)
+  {
+    if(s->node.columnidx != columnidx)
+      return (s->node.columnidx < columnidx) ? -1 : 1;
+
+    return strcmp(s->node.row, row);
+  }
 
-  static void
-  JPT_memtable_list_all_left(struct JPT_node* n, struct JPT_node*** nodes)
+@ |JPT_memtable_skiplist_seek| returns the first node whose key is greater than
+or equal to the search key.  If |prev| is given, it receives the last node
+before the search key at each level.
+
+Readers and the writer may execute this function concurrently.  A writer
+fully initializes a node before making it reachable, and publishes the link
+with release semantics.  Readers load links with acquire semantics, so they
+either see the node in its entirety, or not at all.  Since there are no retry
+loops, lookups are wait-free.
+
+@< Functions @>=
+
+  static struct JPT_skipnode*
+  JPT_memtable_skiplist_seek(struct JPT_memtable* memtable,
+                             const char* row, uint32_t columnidx,
+                             struct JPT_skipnode** prev)
   {
-    struct JPT_node* top = n->parent;
+    struct JPT_skipnode* s;
+    struct JPT_skipnode* next = 0;
+    int level;
 
-    while(n->left)
-      n = n->left;
+    s = memtable->skiplist_head;
+
+    if(!s)
+      return 0;
+
+    level = __atomic_load_n(&memtable->skiplist_height, __ATOMIC_ACQUIRE);
 
-    while(n != top)
+    while(level--)
     {
-      @< Add current node to result list, if not removed @>
+      for(;;)
+      {
+        next = __atomic_load_n(&s->next[level], __ATOMIC_ACQUIRE);
 
-      if(n->right)
-        JPT_memtable_list_all_right(n->right, nodes);
+        if(!next || JPT_memtable_skiplist_compare(next, row, columnidx) >= 0)
+          break;
 
-      n = n->parent;
+        s = next;
+      }
+
+      if(prev)
+        prev[level] = s;
     }
+
+    return next;
   }
 
-  static void
-  JPT_memtable_list_all_right(struct JPT_node* n, struct JPT_node*** nodes)
+  static struct JPT_node*
+  JPT_memtable_skiplist_find(struct JPT_memtable* memtable,
+                             const char* row, uint32_t columnidx)
   {
-    while(n)
-    {
-      if(n->left)
-        JPT_memtable_list_all_left(n->left, nodes);
+    struct JPT_skipnode* s;
 
-      @< Add current node to result list, if not removed @>
+    s = JPT_memtable_skiplist_seek(memtable, row, columnidx, 0);
 
-      n = n->right;
-    }
+    if(!s || JPT_memtable_skiplist_compare(s, row, columnidx))
+      return 0;
+
+    return &s->node;
   }
 
-  void
-  JPT_memtable_list_all(struct JPT_info* info, struct JPT_node*** nodes)
+@ Node heights are geometrically distributed with $p = 1/4$.  The random
+number generator is a plain xorshift generator; it is only ever used by the
+writer, so it needs no locking.
+
+@< Functions @>=
+
+  static unsigned int
+  JPT_memtable_skiplist_random_height(struct JPT_memtable* memtable)
   {
-    pthread_rwlock_rdlock(&info->splay_lock);
+    uint32_t x = memtable->info->skiplist_seed;
+    unsigned int height = 1;
+
+    if(!x)
+      x = 2463534242U;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
 
-    if(info->root)
-      JPT_memtable_list_all_left(info->root, nodes);
+    memtable->info->skiplist_seed = x;
+
+    while(height < JPT_SKIPLIST_MAX_HEIGHT && !(x & 3))
+    {
+      ++height;
+      x >>= 2;
+    }
 
-    pthread_rwlock_unlock(&info->splay_lock);
+    return height;
   }
 
-@ These functions work like the "list all" functions, except they filter for a
-given column index.
+@ The nodes of a memtable are visited in key order with |JPT_memtable_first| and
+|JPT_memtable_next|, which skip tombstones.  No memory is allocated, so a
+memtable of any size can be streamed to disk with constant overhead.
+
+In a skiplist, the next node is simply the next node on the bottom level.  In
+a splay tree, the node following |n| is the leftmost node of its right
+subtree, or, if it has no right subtree, the first ancestor of which |n| is in
+the left subtree.  Following parent links instead of recursing means even a
+degenerate tree, for example one that only has left branches, is walked
+without using any stack.  Walking $k$ consecutive nodes takes time
+proportional to $k$ plus the height of the tree.
+
+The caller must make sure the tree is not splayed during the walk, either by
+holding |splay_lock|, or by excluding all other users of the memtable, or
+because the memtable is frozen.
 
 @< Functions @>=
 
-  static void
-  JPT_memtable_list_column_right(struct JPT_node* n, struct JPT_node*** nodes,
-                                 uint32_t columnidx);
+  static struct JPT_node*
+  JPT_memtable_successor(struct JPT_memtable* memtable, struct JPT_node* n)
+  {
+    if(memtable->info->flags & JPT_SKIPLIST)
+      return (struct JPT_node*) __atomic_load_n(&((struct JPT_skipnode*) n)->next[0], __ATOMIC_ACQUIRE);
+
+    if(n->right)
+    {
+      n = n->right;
+
+      while(n->left)
+        n = n->left;
+
+      return n;
+    }
+
+    while(n->parent && n == n->parent->right)
+      n = n->parent;
 
-  static void
-  JPT_memtable_list_column_left(struct JPT_node* n, struct JPT_node*** nodes, uint32_t columnidx)
+    return n->parent;
+  }
+
+  struct JPT_node*
+  JPT_memtable_next(struct JPT_memtable* memtable, struct JPT_node* n)
   {
-    struct JPT_node* top = n->parent;
+    do
+      n = JPT_memtable_successor(memtable, n);
+    while(n && n->value == (void*) -1);
 
-    while(n->left && n->columnidx >= columnidx)
-      n = n->left;
+    return n;
+  }
 
-    while(n != top)
+  struct JPT_node*
+  JPT_memtable_first(struct JPT_memtable* memtable)
+  {
+    struct JPT_node* n;
+
+    if(memtable->info->flags & JPT_SKIPLIST)
     {
-      @< Add current node to result list, if correct column and not removed @>
+      if(!memtable->skiplist_head)
+        return 0;
 
-      if(n->right)
-        JPT_memtable_list_column_right(n->right, nodes, columnidx);
+      n = (struct JPT_node*) __atomic_load_n(&memtable->skiplist_head->next[0], __ATOMIC_ACQUIRE);
+    }
+    else
+    {
+      if(!(n = memtable->root))
+        return 0;
 
-      n = n->parent;
+      while(n->left)
+        n = n->left;
     }
+
+    if(n && n->value == (void*) -1)
+      n = JPT_memtable_next(memtable, n);
+
+    return n;
+  }
+
+@ Each memtable has a directory of the columns it holds, indexed by column
+index.  The directory remembers the first node of each column, so that the
+cells of one column can be listed without visiting the nodes of any other
+column, and it counts the cells of each column, so that callers can allocate
+exactly as much room as the listing needs.
+
+|JPT_memtable_column_count| returns the number of cells in a column, not
+counting tombstones.
+
+@< Functions @>=
+
+  size_t
+  JPT_memtable_column_count(struct JPT_memtable* memtable, uint32_t columnidx)
+  {
+    if(columnidx >= memtable->column_alloc)
+      return 0;
+
+    return memtable->columns[columnidx].node_count;
   }
 
-  static void
-  JPT_memtable_list_column_right(struct JPT_node* n, struct JPT_node*** nodes, uint32_t columnidx)
+@ The directory is grown before a node is inserted, so that running out of
+memory leaves the memtable untouched.
+
+@< Functions @>=
+
+  static int
+  JPT_memtable_reserve_column(struct JPT_memtable* memtable, uint32_t columnidx)
   {
-    while(n)
-    {
-      if(n->left)
-        JPT_memtable_list_column_left(n->left, nodes, columnidx);
+    struct JPT_memtable_column* new_columns;
+    size_t new_alloc;
 
-      @< Add current node to result list, if correct column and not removed @>
+    if(columnidx < memtable->column_alloc)
+      return 0;
 
-      if(n->columnidx > columnidx)
-        return;
+    new_alloc = memtable->column_alloc ? memtable->column_alloc : 16;
 
-      n = n->right;
+    while(new_alloc <= columnidx)
+      new_alloc *= 2;
+
+    new_columns = realloc(memtable->columns,
+                          new_alloc * sizeof(struct JPT_memtable_column));
+
+    if(!new_columns)
+    {
+      asprintf(&JPT_last_error, "Failed to allocate column directory: %s",
+               strerror(errno));
+
+      return -1;
     }
+
+    memset(new_columns + memtable->column_alloc, 0,
+           (new_alloc - memtable->column_alloc) * sizeof(struct JPT_memtable_column));
+
+    memtable->columns = new_columns;
+    memtable->column_alloc = new_alloc;
+
+    return 0;
   }
 
+@ Listing a column starts at its first node, which may be a tombstone, and
+stops at the first node in another column.
+
+@< Functions @>=
+
   void
-  JPT_memtable_list_column(struct JPT_info* info, struct JPT_node*** nodes, uint32_t columnidx)
+  JPT_memtable_list_column(struct JPT_memtable* memtable, struct JPT_node*** nodes, uint32_t columnidx)
   {
-    pthread_rwlock_rdlock(&info->splay_lock);
+    struct JPT_node* n;
 
-    if(info->root)
-      JPT_memtable_list_column_left(info->root, nodes, columnidx);
+    if(!JPT_memtable_column_count(memtable, columnidx))
+      return;
 
-    pthread_rwlock_unlock(&info->splay_lock);
+    pthread_rwlock_rdlock(&memtable->info->splay_lock);
+
+    for(n = memtable->columns[columnidx].first;
+        n && n->columnidx == columnidx;
+        n = JPT_memtable_next(memtable, n))
+    {
+      @< Add current node to result list, if not removed @>
+    }
+
+    pthread_rwlock_unlock(&memtable->info->splay_lock);
   }
 
-@ When a value is removed from the tree, its value is set to |(void*) -1|.
+@ |JPT_memtable_remove_column| places a tombstone in every cell of a column.
 
-@< Add current node to result list, if not removed @>=
+@< Functions @>=
 
-  if(n->data.value != (void*) -1)
+  void
+  JPT_memtable_remove_column(struct JPT_memtable* memtable, uint32_t columnidx)
   {
-    **nodes = n;
-    ++(*nodes);
+    struct JPT_node* n;
+    const char* row;
+
+    if(!JPT_memtable_column_count(memtable, columnidx))
+      return;
+
+    for(n = memtable->columns[columnidx].first;
+        n && n->columnidx == columnidx;
+        n = JPT_memtable_next(memtable, n))
+    {
+      if(n->value == (void*) -1)
+        continue;
+
+      row = n->row;
+
+      {
+        @< Place tombstone in current node @>
+      }
+    }
+
+    assert(!memtable->columns[columnidx].node_count);
   }
 
 @ When a value is removed from the tree, its value is set to |(void*) -1|.
 
-@< Add current node to result list, if correct column and not removed @>=
+@< Add current node to result list, if not removed @>=
 
-  if(n->columnidx == columnidx && n->data.value != (void*) -1)
+  if(n->value != (void*) -1)
   {
     **nodes = n;
     ++(*nodes);
@@ -188,19 +368,33 @@ normal binary tree.  We just start at the top, and move to the left or the
 right depending on whether the current key is greather than or less than the
 search key.
 
+A found node is splayed to the top of the tree, unless the memtable is frozen.
+A frozen memtable may be traversed by the flush thread at any time, so its
+shape must not change.
+
 |JPT_memtable_has_key| returns 0 if the key is found, -1 otherwise.
 
 @< Functions @>=
 
   int
-  JPT_memtable_has_key(struct JPT_info* info, const char* row, uint32_t columnidx)
+  JPT_memtable_has_key(struct JPT_memtable* memtable, const char* row, uint32_t columnidx)
   {
     struct JPT_node* n;
     int cmp;
 
-    pthread_rwlock_rdlock(&info->splay_lock);
+    if(memtable->info->flags & JPT_SKIPLIST)
+    {
+      n = JPT_memtable_skiplist_find(memtable, row, columnidx);
+
+      if(!n || n->value == (void*) -1)
+        return -1;
+
+      return 0;
+    }
+
+    pthread_rwlock_rdlock(&memtable->info->splay_lock);
 
-    n = info->root;
+    n = memtable->root;
 
     while(n)
     {
@@ -220,22 +414,22 @@ search key.
         continue;
       }
 
-      pthread_rwlock_unlock(&info->splay_lock);
+      pthread_rwlock_unlock(&memtable->info->splay_lock);
 
-      if(0 == pthread_rwlock_trywrlock(&info->splay_lock))
+      if(!memtable->frozen && 0 == pthread_rwlock_trywrlock(&memtable->info->splay_lock))
       {
-        JPT_memtable_splay(info, n);
+        JPT_memtable_splay(memtable, n);
 
-        pthread_rwlock_unlock(&info->splay_lock);
+        pthread_rwlock_unlock(&memtable->info->splay_lock);
       }
 
-      if(n->data.value == (void*) -1)
+      if(n->value == (void*) -1)
         break;
 
       return 0;
     }
 
-    pthread_rwlock_unlock(&info->splay_lock);
+    pthread_rwlock_unlock(&memtable->info->splay_lock);
 
     return -1;
   }
@@ -246,22 +440,32 @@ appends the associated value to the pointers passed as parameters.
 @< Functions @>=
 
   int
-  JPT_memtable_get(struct JPT_info* info, const char* row, uint32_t columnidx,
+  JPT_memtable_get(struct JPT_memtable* memtable, const char* row, uint32_t columnidx,
                    void** value, size_t* value_size, size_t* skip, size_t* max_read,
                    uint64_t* timestamp)
   {
     struct JPT_node* n;
+    size_t i;
     int cmp;
 
-    pthread_rwlock_rdlock(&info->splay_lock);
+    if(memtable->info->flags & JPT_SKIPLIST)
+    {
+      n = JPT_memtable_skiplist_find(memtable, row, columnidx);
+
+      if(!n || n->value == (void*) -1)
+        return -1;
+
+      @< Read value at current node @>
 
-    n = info->root;
+      return 0;
+    }
+
+    pthread_rwlock_rdlock(&memtable->info->splay_lock);
+
+    n = memtable->root;
 
     while(n)
     {
-      struct JPT_node_data* d;
-      size_t i;
-
       @< Determine branch of search key @>
 
       @< Left branch: @>
@@ -278,99 +482,57 @@ appends the associated value to the pointers passed as parameters.
         continue;
       }
 
+      if(n->value == (void*) -1)
+        break;
+
       @< Read value at current node @>
 
-      pthread_rwlock_unlock(&info->splay_lock);
+      pthread_rwlock_unlock(&memtable->info->splay_lock);
 
-      if(0 == pthread_rwlock_trywrlock(&info->splay_lock))
+      if(!memtable->frozen && 0 == pthread_rwlock_trywrlock(&memtable->info->splay_lock))
       {
-        JPT_memtable_splay(info, n);
+        JPT_memtable_splay(memtable, n);
 
-        pthread_rwlock_unlock(&info->splay_lock);
+        pthread_rwlock_unlock(&memtable->info->splay_lock);
       }
 
       return 0;
     }
 
-    pthread_rwlock_unlock(&info->splay_lock);
+    pthread_rwlock_unlock(&memtable->info->splay_lock);
 
     return -1;
   }
 
 @ If a node has been removed, its value will have been set to |(void*) -1|, as
-a sort of tombstone.
+a sort of tombstone.  Callers check for this before reading the value.
 
-@< Read value at current node @>=
+The value of a node is stored in one piece, so reading it is a single copy.
+The caller can choose whether or not to read a predetermined number of bytes
+(upper bound).  When doing so, the caller is responsible for making sure the
+target buffer can hold this amount of data.  Otherwise, we have to start by
+reallocing the buffer to make sure it can hold all the data we're going to put
+into it.
 
-  if(n->data.value == (void*) -1)
-    break;
+@< Read value at current node @>=
 
   i = *value_size;
-
-  @< Determine value size of current node @>
+  *value_size += n->value_size;
 
   if(max_read)
   {
-    @< Read up to |max_read| from current node @>
+    if(*value_size > *max_read)
+      *value_size = *max_read;
   }
   else
-  {
-    @< Read all data from current node @>
-  }
+    *value = realloc(*value, *value_size + 1);
+
+  if(*value_size > i)
+    memcpy(((char*) *value) + i, n->value, *value_size - i);
 
   if(timestamp)
     *timestamp = n->timestamp;
 
-@ When reading data from the memtable, the caller can choose whether or not to
-read a predetermined number of bytes (upper bound).  When doing so, the caller
-is responsible for making sure the target buffer can hold this amount of data.
-
-@< Read up to |max_read| from current node @>=
-
-  size_t amount;
-
-  if(*value_size > *max_read)
-    *value_size = *max_read;
-
-  for(d = &n->data; i < *value_size; d = d->next)
-  {
-    if(i + d->value_size <= *value_size)
-      amount = d->value_size;
-    else
-      amount = *value_size - d->value_size;
-
-    memcpy(((char*) *value) + i, d->value, d->value_size);
-    i += amount;
-  }
-
-@ When the caller has not set an upper bound on the number of bytes to read, we
-have to start by reallocing the buffer to make sure it can hold all the data
-we're going to put into it.
-
-@< Read all data from current node @>=
-
-  *value = realloc(*value, *value_size + 1);
-
-  for(d = &n->data; i < *value_size; d = d->next)
-  {
-    memcpy(((char*) *value) + i, d->value, d->value_size);
-    i += d->value_size;
-  }
-
-@ When data is appended to an existing node, a |JPT_data_node| is created and
-added to a linked list.
-
-@< Determine value size of current node @>=
-
-  d = &n->data;
-
-  do
-  {
-    *value_size += d->value_size;
-    d = d->next;
-  }
-  while(d);
-
 @ All splay work is performed by |JPT_memtable_splay|.  A call to this function
 brings the specified node to the top of the binary tree, reorganizaing the tree
 in the process.  The goal of the reorganization is to make the tree more
@@ -388,7 +550,7 @@ balanced.
   while(0)
 
   void
-  JPT_memtable_splay(struct JPT_info* info, struct JPT_node* n)
+  JPT_memtable_splay(struct JPT_memtable* memtable, struct JPT_node* n)
   {
     while(n->parent)
     {
@@ -434,14 +596,14 @@ where `p' is short for `parent'.  Three links are updated.
 
 @< Splay: Handle root node @>=
 
-  assert(parent == info->root);
+  assert(parent == memtable->root);
 
   if(is_left_child)
   {
     UPDATE_LINK(parent, left, n->right);
     UPDATE_LINK(n, right, parent);
 
-    info->root = n;
+    memtable->root = n;
     n->parent = 0;
   }
   else
@@ -449,7 +611,7 @@ where `p' is short for `parent'.  Three links are updated.
     UPDATE_LINK(parent, right, n->left);
     UPDATE_LINK(n, left, parent);
 
-    info->root = n;
+    memtable->root = n;
     n->parent = 0;
   }
 
@@ -475,7 +637,7 @@ with the current node.  The common code for those two cases are found here.
   }
   else
   {
-    info->root = n;
+    memtable->root = n;
 
     n->parent = 0;
   }
@@ -540,44 +702,103 @@ The grandparent (subtree root) node has already been replaced.
     UPDATE_LINK(n, left, gparent);
   }
 
+@ A table has one active memtable, and at most one frozen memtable.  Each is
+allocated by |JPT_memtable_create|.  |JPT_memtable_clear| discards all the
+contents of a memtable, leaving it ready for reuse.
+
+@< Functions @>=
+
+  struct JPT_memtable*
+  JPT_memtable_create(struct JPT_info* info)
+  {
+    struct JPT_memtable* result;
+
+    result = calloc(1, sizeof(struct JPT_memtable));
+
+    if(!result)
+    {
+      asprintf(&JPT_last_error, "Failed to allocate memtable: %s",
+               strerror(errno));
+
+      return 0;
+    }
+
+    result->info = info;
+
+    return result;
+  }
+
+  void
+  JPT_memtable_clear(struct JPT_memtable* memtable)
+  {
+    free(memtable->buffer);
+    memtable->buffer = 0;
+    memtable->buffer_util = 0;
+    memtable->root = 0;
+    memtable->skiplist_head = 0;
+    memtable->skiplist_height = 0;
+    memtable->node_count = 0;
+    memtable->key_count = 0;
+    memtable->key_size = 0;
+    memtable->value_size = 0;
+
+    free(memtable->columns);
+    memtable->columns = 0;
+    memtable->column_alloc = 0;
+  }
+
+  void
+  JPT_memtable_destroy(struct JPT_memtable* memtable)
+  {
+    if(!memtable)
+      return;
+
+    free(memtable->buffer);
+    free(memtable->columns);
+    free(memtable);
+  }
+
 @ The memtable's buffer is lazily allocated.  This is an attempt to avoid
 excessive memory usage when a table is opened but never written to.
 
-We round |info->buffer_util| up to a multiple of four, to make sure all
-allocations are word aligned.
+We round |buffer_util| up to a multiple of four, to make sure all
+allocations are word aligned.  Nodes are additionally aligned to the size of a
+pointer, since skiplist readers load their links atomically.
 
 @< Functions @>=
 
   static void*
-  JPT_memtable_buffer_alloc(struct JPT_info* info, size_t size)
+  JPT_memtable_buffer_alloc(struct JPT_memtable* memtable, size_t size)
   {
     void* result;
 
-    if(!info->buffer)
+    if(!memtable->buffer)
     {
-      info->buffer = malloc(info->buffer_size);
+      memtable->buffer = malloc(memtable->info->buffer_size);
 
-      if(!info->buffer)
+      if(!memtable->buffer)
       {
         asprintf(&JPT_last_error,
                  "Failed to allocate %zu bytes for memtable: %s",
-                 info->buffer_size, strerror(errno));
+                 memtable->info->buffer_size, strerror(errno));
 
         return 0;
       }
     }
 
-    result = info->buffer + info->buffer_util;
-    info->buffer_util = (info->buffer_util + size + 3) & ~3;
+    result = memtable->buffer + memtable->buffer_util;
+    memtable->buffer_util = (memtable->buffer_util + size + 3) & ~3;
 
-    assert(info->buffer_util <= info->buffer_size);
+    assert(memtable->buffer_util <= memtable->info->buffer_size);
 
     return result;
   }
 
 @ The |JPT_memtable_create_node| function is a helper function to
-|JPT_memtable_insert|.  It allocates memory for a binary tree node, and its
-associated value, and initializes all structure members.
+|JPT_memtable_insert|.  It allocates memory for a node, and its associated
+value, initializes all structure members, and adds the node to the column
+directory.  The |node_size| parameter is |sizeof(struct JPT_node)| for splay
+tree nodes, and includes the tower for skiplist nodes.
 
 The |will_compact| parameters tells whether the calling function will perform a
 compaction before it returns.  When this is the case, we do not need to make a
@@ -587,36 +808,110 @@ than our buffer size.
 @< Functions @>=
 
   static struct JPT_node*
-  JPT_memtable_create_node(struct JPT_info* info,
+  JPT_memtable_create_node(struct JPT_memtable* memtable, size_t node_size,
                            const void* row, uint32_t columnidx,
                            const void* value, size_t value_size,
                            int will_compact)
   {
+    struct JPT_memtable_column* column;
     struct JPT_node* result;
 
-    result = JPT_memtable_buffer_alloc(info, sizeof(struct JPT_node));
-    result->row = JPT_memtable_buffer_alloc(info, strlen(row) + 1);
-    result->data.value_size = value_size;
-    result->data.next = 0;
+    memtable->buffer_util = (memtable->buffer_util + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+    result = JPT_memtable_buffer_alloc(memtable, node_size);
+    result->row = JPT_memtable_buffer_alloc(memtable, strlen(row) + 1);
+    result->value_size = value_size;
     result->parent = 0;
     result->left = 0;
     result->right = 0;
-    result->last = 0;
     result->columnidx = columnidx;
 
     strcpy(result->row, row);
 
     if(will_compact)
-      result->data.value = (char*) value;
+    {
+      result->value = (char*) value;
+      result->value_alloc = 0;
+    }
     else
     {
-      result->data.value = JPT_memtable_buffer_alloc(info, value_size);
-      memcpy(result->data.value, value, value_size);
+      result->value = JPT_memtable_buffer_alloc(memtable, value_size);
+      result->value_alloc = value_size;
+      memcpy(result->value, value, value_size);
     }
 
+    column = &memtable->columns[columnidx];
+
+    if(!column->first || strcmp(row, column->first->row) < 0)
+      column->first = result;
+
+    ++column->node_count;
+
     return result;
   }
 
+@ |JPT_memtable_find| looks up a node for the writer, without splaying the
+tree.  It returns tombstones too.
+
+@< Functions @>=
+
+  static struct JPT_node*
+  JPT_memtable_find(struct JPT_memtable* memtable, const char* row, uint32_t columnidx)
+  {
+    struct JPT_node* n;
+    int cmp;
+
+    if(memtable->info->flags & JPT_SKIPLIST)
+      return JPT_memtable_skiplist_find(memtable, row, columnidx);
+
+    n = memtable->root;
+
+    while(n)
+    {
+      @< Determine branch of search key @>
+
+      @< Left branch: @>
+      {
+        n = n->left;
+
+        continue;
+      }
+
+      @< Right branch: @>
+      {
+        n = n->right;
+
+        continue;
+      }
+
+      break;
+    }
+
+    return n;
+  }
+
+@ Appended values are stored contiguously.  When an append does not fit in
+the space reserved for a value, the value moves to a new extent at least twice
+the size of the old one, so that a cell built from many small appends is
+copied a logarithmic number of times.  The old extent is not reused until the
+memtable is cleared.
+
+|JPT_memtable_append_extent| returns the size of the extent needed to append
+|value_size| bytes to |n|, or 0 if the append can be done in place.
+
+@< Functions @>=
+
+  static size_t
+  JPT_memtable_append_extent(const struct JPT_node* n, size_t value_size)
+  {
+    size_t needed = n->value_size + value_size;
+
+    if(needed <= n->value_alloc)
+      return 0;
+
+    return (needed > 2 * n->value_alloc) ? needed : 2 * n->value_alloc;
+  }
+
 @ The |JPT_memtable_insert| function is the function that will be called for
 inserting any new data.  Disktables are only written when the memtable is full,
 or when any old value is modified.
@@ -629,20 +924,40 @@ In this case, the |JPT_WRITTEN| flag is set, to help us distinguish betwee
 @< Functions @>=
 
 int
-JPT_memtable_insert(struct JPT_info* info, const char* row, uint32_t columnidx,
+JPT_memtable_insert(struct JPT_memtable* memtable, const char* row, uint32_t columnidx,
                     const void* value, size_t value_size, uint64_t* timestamp,
                     int flags)
 {
   struct JPT_node* n;
   size_t space_needed;
+  size_t value_space;
+  size_t node_size;
   size_t row_size = strlen(row) + 1;
+  unsigned int height = 0;
   int must_compact = 0;
   int cmp;
 
   @< Calculate needed space, compact or schedule compact if necessary @>
+
+  if(memtable->info->flags & JPT_SKIPLIST)
+  {
+    @< Skiplist: Find existing node, or link new node and go to |done| @>
+
+    if(n->value != (void*) -1 && !(flags & (JPT_APPEND | JPT_REPLACE)))
+    {
+      errno = EEXIST;
+
+      return -1;
+    }
+
+    @< Merge value into existing node @>
+
+    goto done;
+  }
+
   @< Handle insertion into an empty tree (creating the root node) @>
 
-  n = info->root;
+  n = memtable->root;
 
   for(;;)
   {
@@ -652,16 +967,14 @@ JPT_memtable_insert(struct JPT_info* info, const char* row, uint32_t columnidx,
     {
       if(!n->left)
       {
-        n->left = JPT_memtable_create_node(info, row, columnidx, value,
-                                           value_size, must_compact);
+        n->left = JPT_memtable_create_node(memtable, node_size, row, columnidx,
+                                           value, value_size, must_compact);
         n->left->timestamp = *timestamp;
         n->left->parent = n;
-        ++info->node_count;
-        ++info->memtable_key_count;
-        info->memtable_key_size += strlen(row) + 1;
-        info->memtable_value_size += value_size;
 
-        JPT_memtable_splay(info, n->left);
+        @< Account for new node @>
+
+        JPT_memtable_splay(memtable, n->left);
 
         break;
       }
@@ -675,16 +988,14 @@ JPT_memtable_insert(struct JPT_info* info, const char* row, uint32_t columnidx,
     {
       if(!n->right)
       {
-        n->right = JPT_memtable_create_node(info, row, columnidx, value,
-                                            value_size, must_compact);
+        n->right = JPT_memtable_create_node(memtable, node_size, row, columnidx,
+                                            value, value_size, must_compact);
         n->right->timestamp = *timestamp;
         n->right->parent = n;
-        ++info->node_count;
-        ++info->memtable_key_count;
-        info->memtable_key_size += strlen(row) + 1;
-        info->memtable_value_size += value_size;
 
-        JPT_memtable_splay(info, n->right);
+        @< Account for new node @>
+
+        JPT_memtable_splay(memtable, n->right);
 
         break;
       }
@@ -694,28 +1005,18 @@ JPT_memtable_insert(struct JPT_info* info, const char* row, uint32_t columnidx,
       continue;
     }
 
-    if(n->data.value == (void*) -1)
-    {
-      @< Reuse existing node (value was previously removed) @>
-    }
-    else if(flags & JPT_APPEND)
-    {
-      @< Append value to current node @>
-    }
-    else if(flags & JPT_REPLACE)
+    if(n->value != (void*) -1 && !(flags & (JPT_APPEND | JPT_REPLACE)))
     {
-      @< Replace value in current node @>
-    }
-    else
-    {
-      JPT_memtable_splay(info, n);
+      JPT_memtable_splay(memtable, n);
 
       errno = EEXIST;
 
       return -1;
     }
 
-    JPT_memtable_splay(info, n);
+    @< Merge value into existing node @>
+
+    JPT_memtable_splay(memtable, n);
 
     break;
   }
@@ -724,7 +1025,7 @@ done:
 
   if(must_compact)
   {
-    if(-1 == JPT_compact(info))
+    if(-1 == JPT_compact(memtable->info))
       return -1;
 
     /* We return 1 to inform the caller that logging is not required */
@@ -734,185 +1035,253 @@ done:
   return 0;
 }
 
-@ @< Calculate needed space, compact or schedule compact if necessary @>=
+@ When the key already exists, the new value is merged into the existing node
+according to |flags|.  The caller has already made sure that either the
+existing node is a tombstone, or one of |JPT_APPEND| or |JPT_REPLACE| is set.
+
+@< Merge value into existing node @>=
+
+  if(n->value == (void*) -1)
+  {
+    @< Reuse existing node (value was previously removed) @>
+  }
+  else if(flags & JPT_APPEND)
+  {
+    @< Append value to current node @>
+  }
+  else
+  {
+    @< Replace value in current node @>
+  }
+
+@ @< Account for new node @>=
+
+  ++memtable->node_count;
+  ++memtable->key_count;
+  memtable->key_size += row_size;
+  memtable->value_size += value_size;
+
+@ The size of a skiplist node depends on its height, so we pick the height
+before calculating the space needed.  The head node is allocated along with the
+first node, so we always reserve space for it, even if it might already exist.
+Nodes are pointer aligned, which may cost up to a word of padding.
+
+When appending to an existing cell, the value may have to move to a larger
+extent, which is accounted for instead of the size of the appended data.
+
+If the new node and its value do not fit, the memtable is frozen, and the
+insert proceeds in the fresh memtable that takes its place.  Writing the
+frozen memtable to disk happens in the background.  Only a value that is too
+large for even an empty memtable is written to disk synchronously.  Finally,
+the column directory of the memtable we end up inserting into is given room
+for |columnidx|.
+
+@< Calculate needed space, compact or schedule compact if necessary @>=
+
+  if(memtable->info->flags & JPT_SKIPLIST)
+  {
+    height = JPT_memtable_skiplist_random_height(memtable);
+    node_size = sizeof(struct JPT_skipnode) + height * sizeof(struct JPT_skipnode*);
+  }
+  else
+    node_size = sizeof(struct JPT_node);
 
   space_needed = ((row_size + 3) & ~3)
-               + ((sizeof(struct JPT_node) + 3) & ~3);
+               + ((node_size + 3) & ~3)
+               + sizeof(void*);
+
+  if(memtable->info->flags & JPT_SKIPLIST)
+    space_needed += JPT_SKIPLIST_HEAD_SIZE + sizeof(void*);
+
+  value_space = (value_size + 3) & ~3;
 
-  if(info->buffer_util + space_needed > info->buffer_size)
+  if(flags & JPT_APPEND)
   {
-    if(!(flags & (JPT_REPLACE | JPT_APPEND)) && 0 == JPT_memtable_has_key(info, row, columnidx))
+    n = JPT_memtable_find(memtable, row, columnidx);
+
+    if(n && n->value != (void*) -1)
+      value_space = (JPT_memtable_append_extent(n, value_size) + 3) & ~3;
+  }
+
+  if(memtable->buffer_util
+  && memtable->buffer_util + space_needed + value_space > memtable->info->buffer_size)
+  {
+    if(!(flags & (JPT_REPLACE | JPT_APPEND)) && 0 == JPT_memtable_has_key(memtable, row, columnidx))
     {
       errno = EEXIST;
 
       return -1;
     }
     else if(flags & JPT_REPLACE)
-      JPT_memtable_remove(info, row, columnidx);
+      JPT_memtable_remove(memtable, row, columnidx);
 
-    if(-1 == JPT_compact(info))
+    if(-1 == JPT_freeze_memtable(memtable->info))
       return -1;
+
+    memtable = memtable->info->memtable;
+    value_space = (value_size + 3) & ~3;
   }
 
-  assert(info->buffer_util + space_needed <= info->buffer_size);
+  assert(memtable->buffer_util + space_needed <= memtable->info->buffer_size);
 
-  space_needed += ((value_size + 3) & ~3);
+  space_needed += value_space;
 
-  if(info->buffer_util + space_needed > info->buffer_size)
+  if(memtable->buffer_util + space_needed > memtable->info->buffer_size)
     must_compact = 1;
 
-@ @< Handle insertion into an empty tree (creating the root node) @>=
+  if(-1 == JPT_memtable_reserve_column(memtable, columnidx))
+    return -1;
+
+@ The head node of a skiplist is created together with the first node, and
+discarded along with the buffer when the memtable is compacted.
 
-  if(!info->root)
+New nodes are linked bottom-up.  Each link is published with a single release
+store after the node's own tower has been filled in, so a concurrent reader
+will never follow a link to a half-initialized node.
+
+@< Skiplist: Find existing node, or link new node and go to |done| @>=
+
+  struct JPT_skipnode* prev[JPT_SKIPLIST_MAX_HEIGHT];
+  struct JPT_skipnode* s;
+  unsigned int level;
+
+  if(!memtable->skiplist_head)
   {
-    assert(!info->node_count);
-    assert(!info->memtable_key_count);
-    assert(!info->memtable_key_size);
-    assert(!info->memtable_value_size);
+    memtable->buffer_util = (memtable->buffer_util + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
 
-    info->root = JPT_memtable_create_node(info, row, columnidx, value, value_size, must_compact);
-    info->root->timestamp = *timestamp;
-    info->node_count = 1;
-    info->memtable_key_count = 1;
-    info->memtable_key_size = strlen(row) + 1;
-    info->memtable_value_size = value_size;
+    s = JPT_memtable_buffer_alloc(memtable, JPT_SKIPLIST_HEAD_SIZE);
 
-    goto done;
+    if(!s)
+      return -1;
+
+    memset(s, 0, JPT_SKIPLIST_HEAD_SIZE);
+    s->height = JPT_SKIPLIST_MAX_HEIGHT;
+
+    memtable->skiplist_height = 1;
+    memtable->skiplist_head = s;
   }
 
-@ When replacing a previously removed value, we don't need to allocate room for
-a new node; we can just just the tombstone of the previous value.
+  for(level = 0; level < JPT_SKIPLIST_MAX_HEIGHT; ++level)
+    prev[level] = memtable->skiplist_head;
 
-@< Reuse existing node (value was previously removed) @>=
+  s = JPT_memtable_skiplist_seek(memtable, row, columnidx, prev);
 
-  if(must_compact)
-    n->data.value = (char*) value;
-  else
+  if(!s || JPT_memtable_skiplist_compare(s, row, columnidx))
   {
-    n->data.value = JPT_memtable_buffer_alloc(info, value_size);
-    memcpy(n->data.value, value, value_size);
-  }
+    n = JPT_memtable_create_node(memtable, node_size, row, columnidx,
+                                 value, value_size, must_compact);
+    n->timestamp = *timestamp;
 
-  n->timestamp = *timestamp;
-  n->data.value_size = value_size;
-  n->data.next = 0;
-  n->last = 0;
+    s = (struct JPT_skipnode*) n;
+    s->height = height;
 
-  info->memtable_value_size += value_size;
-  info->memtable_key_size += strlen(row) + 1;
-  ++info->node_count;
-  ++info->memtable_key_count;
+    for(level = 0; level < height; ++level)
+      s->next[level] = prev[level]->next[level];
 
-@ To append data to an existing node, we just have to create a new data node
-and add it at the end of the linked list belonging to the node.
+    for(level = 0; level < height; ++level)
+      __atomic_store_n(&prev[level]->next[level], s, __ATOMIC_RELEASE);
 
-@< Append value to current node @>=
+    if(height > memtable->skiplist_height)
+      __atomic_store_n(&memtable->skiplist_height, height, __ATOMIC_RELEASE);
 
-  struct JPT_node_data* d = JPT_memtable_buffer_alloc(info, sizeof(struct JPT_node_data));
+    @< Account for new node @>
 
-  if(!n->last)
-  {
-    n->data.next = d;
-    n->last = d;
-  }
-  else
-  {
-    assert(!n->last->next);
-    n->last->next = d;
-    n->last = d;
+    goto done;
   }
 
-  if(must_compact)
-    d->value = (char*) value;
-  else
-  {
-    d->value = JPT_memtable_buffer_alloc(info, value_size);
-    memcpy(d->value, value, value_size);
-  }
+  n = &s->node;
 
-  n->timestamp = *timestamp;
-  d->value_size = value_size;
-  d->next = 0;
+@ @< Handle insertion into an empty tree (creating the root node) @>=
 
-  info->memtable_value_size += value_size;
+  if(!memtable->root)
+  {
+    assert(!memtable->node_count);
+    assert(!memtable->key_count);
+    assert(!memtable->key_size);
+    assert(!memtable->value_size);
+
+    memtable->root = JPT_memtable_create_node(memtable, node_size, row, columnidx,
+                                          value, value_size, must_compact);
+    memtable->root->timestamp = *timestamp;
+    memtable->node_count = 1;
+    memtable->key_count = 1;
+    memtable->key_size = row_size;
+    memtable->value_size = value_size;
 
-@ When replacing a value, we start by using any previously allocated space,
-then create a new data node for the remaining part of the new value.
+    goto done;
+  }
 
-@< Replace value in current node @>=
+@ When replacing a previously removed value, we don't need to allocate room for
+a new node; we can just just the tombstone of the previous value.
 
-  struct JPT_node_data* d;
+A value is only stored outside the memtable when it is too large for an empty
+memtable, in which case the node is always new.  Existing nodes therefore
+always have their values in the memtable buffer.
 
-  d = &n->data;
+@< Reuse existing node (value was previously removed) @>=
 
-  @< Shrink data node if remainder of value fits inside @>
-  @< Overwrite data in current data node @>
+  assert(!must_compact);
 
-  n->last = 0;
-  d = d->next;
+  n->value = JPT_memtable_buffer_alloc(memtable, value_size);
+  n->value_size = value_size;
+  n->value_alloc = value_size;
+  n->timestamp = *timestamp;
 
-  while(d && value_size)
-  {
-    @< Shrink data node if remainder of value fits inside @>
-    @< Overwrite data in current data node @>
+  memcpy(n->value, value, value_size);
 
-    n->last = d;
-    d = d->next;
-  }
+  memtable->value_size += value_size;
+  memtable->key_size += strlen(row) + 1;
+  ++memtable->node_count;
+  ++memtable->key_count;
+  ++memtable->columns[columnidx].node_count;
 
-  @< Clear remaining data nodes starting at |d| @>
+@ To append data to an existing node, we copy it to the end of the node's value,
+moving the value to a larger extent first if necessary.  The size of the new
+extent was already accounted for when calculating the needed space.
 
-  if(!n->last)
-    n->data.next = 0;
+@< Append value to current node @>=
 
-  if(value_size)
-  {
-    d = JPT_memtable_buffer_alloc(info, sizeof(struct JPT_node_data));
+  size_t extent;
 
-    if(must_compact)
-      d->value = (char*) value;
-    else
-    {
-      d->value = JPT_memtable_buffer_alloc(info, value_size);
-      memcpy(d->value, value, value_size);
-    }
+  assert(!must_compact);
 
-    d->value_size = value_size;
-    d->next = 0;
+  if(0 != (extent = JPT_memtable_append_extent(n, value_size)))
+  {
+    void* new_value = JPT_memtable_buffer_alloc(memtable, extent);
 
-    info->memtable_value_size += value_size;
+    memcpy(new_value, n->value, n->value_size);
 
-    if(n->data.next)
-    {
-      n->last->next = d;
-      n->last = d;
-    }
-    else
-    {
-      n->data.next = d;
-      n->last = d;
-    }
+    n->value = new_value;
+    n->value_alloc = extent;
   }
-  else if(n->last)
-    n->last->next = 0;
 
+  memcpy((char*) n->value + n->value_size, value, value_size);
+
+  n->value_size += value_size;
   n->timestamp = *timestamp;
 
-@ @< Shrink data node if remainder of value fits inside @>=
+  memtable->value_size += value_size;
+
+@ When replacing a value, we reuse the old extent if the new value fits inside
+it.
 
-  if(d->value_size >= value_size)
+@< Replace value in current node @>=
+
+  assert(!must_compact);
+
+  if(value_size > n->value_alloc)
   {
-    info->memtable_value_size -= d->value_size;
-    info->memtable_value_size += value_size;
-    d->value_size = value_size;
+    n->value = JPT_memtable_buffer_alloc(memtable, value_size);
+    n->value_alloc = value_size;
   }
 
-@ @< Overwrite data in current data node @>=
+  memcpy(n->value, value, value_size);
 
-  memcpy(d->value, value, d->value_size);
+  memtable->value_size -= n->value_size;
+  memtable->value_size += value_size;
 
-  value = (char*) value + d->value_size;
-  value_size -= d->value_size;
+  n->value_size = value_size;
+  n->timestamp = *timestamp;
 
 @ The |JPT_memtable_remove| function finds the node belonging to the given key,
 and places a tombstone in its place.  A tombstone is a node with |value| equal
@@ -921,11 +1290,23 @@ to |(void*) -1|.
 @< Functions @>=
 
 int
-JPT_memtable_remove(struct JPT_info* info, const char* row, uint32_t columnidx)
+JPT_memtable_remove(struct JPT_memtable* memtable, const char* row, uint32_t columnidx)
 {
   struct JPT_node* n;
 
-  n = info->root;
+  if(memtable->info->flags & JPT_SKIPLIST)
+  {
+    n = JPT_memtable_skiplist_find(memtable, row, columnidx);
+
+    if(!n || n->value == (void*) -1)
+      return -1;
+
+    @< Place tombstone in current node @>
+
+    return 0;
+  }
+
+  n = memtable->root;
 
   while(n)
   {
@@ -947,18 +1328,9 @@ JPT_memtable_remove(struct JPT_info* info, const char* row, uint32_t columnidx)
       continue;
     }
 
-    if(n->data.value != (void*) -1)
+    if(n->value != (void*) -1)
     {
-      struct JPT_node_data* d = &n->data;
-
-      @< Clear remaining data nodes starting at |d| @>
-
-      info->memtable_key_size -= strlen(row) + 1;
-      --info->memtable_key_count;
-      --info->node_count;
-
-      n->data.value = (void*) -1;
-      n->data.next = 0;
+      @< Place tombstone in current node @>
 
       return 0;
     }
@@ -969,16 +1341,18 @@ JPT_memtable_remove(struct JPT_info* info, const char* row, uint32_t columnidx)
   return -1;
 }
 
-@ We keep track of the total data size at all times in order to make the
-process of creating disk tables more efficient.  This snippet handles the
-updating of the total value size when a value is replaced with a shorter value,
-or being removed.
+@ Tombstones keep their node, so that a later insert of the same key can reuse
+it.  In a skiplist, this also means we never have to unlink a node that a
+concurrent reader might be standing on.
 
-@< Clear remaining data nodes starting at |d| @>=
+@< Place tombstone in current node @>=
 
-  while(d)
-  {
-    info->memtable_value_size -= d->value_size;
+  memtable->value_size -= n->value_size;
+  memtable->key_size -= strlen(row) + 1;
+  --memtable->key_count;
+  --memtable->node_count;
+  --memtable->columns[n->columnidx].node_count;
 
-    d = d->next;
-  }
+  n->value = (void*) -1;
+  n->value_size = 0;
+  n->value_alloc = 0;
@@ -36,6 +36,33 @@ struct pat_node
   unsigned bitidx : PATRICIA_OFF_BITS __attribute__((packed));
 };
 
+/* State kept between calls to patricia_define_sorted.
+ *
+ * Bits are tested least significant first within each byte, so the order of
+ * the trie's leaves is not strcmp order, and the previous key alone is not
+ * enough to find the critical bit of a new key.  All keys sharing the first
+ * `d' bytes with the previous key are contiguous, however, and a new key
+ * differing from the previous key in byte `d' only differs from them in that
+ * byte.  For each depth `d', `seen' records which low-order bit patterns of
+ * byte `d' occur among those keys: bit (1 << b) - 2 + (c & ((1 << b) - 1))
+ * is set for each byte value `c' and each b = 1..8.  An entry is only
+ * filled in once a second distinct byte value shows up at its depth;
+ * until then, the previous key's byte is the only one.  */
+struct pat_sorted
+{
+  char* last_key;
+  size_t last_alloc;
+
+  /* Downward nodes on the search path of the previous key */
+  unsigned int* path;
+  size_t path_length;
+  size_t path_alloc;
+
+  unsigned char (*seen)[64];
+  unsigned char* seen_valid;
+  size_t depth_alloc;
+};
+
 struct patricia
 {
   patricia_key_callback get_key;
@@ -45,6 +72,8 @@ struct patricia
   unsigned int capacity;
   struct pat_node* nodes;
 
+  struct pat_sorted* sorted;
+
   int mapped;
 };
 
@@ -64,6 +93,7 @@ struct patricia* patricia_create(patricia_key_callback get_key, void* arg)
   result->nodes[0].right = 0;
   result->nodes[0].bitidx = 0;
 
+  result->sorted = 0;
   result->mapped = 0;
 
   return result;
@@ -157,6 +187,203 @@ unsigned int patricia_define(struct patricia* pat, const char* key)
   return pat->count - 2;
 }
 
+static void pat_seen_add(unsigned char* seen, unsigned char c)
+{
+  int b;
+
+  for(b = 1; b <= 8; ++b)
+  {
+    unsigned int bit = (1 << b) - 2 + (c & ((1 << b) - 1));
+
+    seen[bit >> 3] |= 1 << (bit & 7);
+  }
+}
+
+/* Returns the number of low-order bits `c' shares with the byte in `seen'
+ * that matches it best.  */
+static int pat_seen_match(const unsigned char* seen, unsigned char c)
+{
+  int b;
+
+  for(b = 1; b <= 8; ++b)
+  {
+    unsigned int bit = (1 << b) - 2 + (c & ((1 << b) - 1));
+
+    if(!(seen[bit >> 3] & (1 << (bit & 7))))
+      break;
+  }
+
+  return b - 1;
+}
+
+static struct pat_sorted* pat_sorted_create()
+{
+  struct pat_sorted* result = (struct pat_sorted*) calloc(1, sizeof(struct pat_sorted));
+
+  /* The root node stands for the empty key */
+  result->last_alloc = 64;
+  result->last_key = (char*) calloc(1, result->last_alloc);
+
+  result->path_alloc = 64;
+  result->path = (unsigned int*) malloc(result->path_alloc * sizeof(unsigned int));
+  result->path[result->path_length++] = 0;
+
+  return result;
+}
+
+static void pat_sorted_destroy(struct pat_sorted* sorted)
+{
+  if(!sorted)
+    return;
+
+  free(sorted->last_key);
+  free(sorted->path);
+  free(sorted->seen);
+  free(sorted->seen_valid);
+  free(sorted);
+}
+
+unsigned int patricia_define_sorted(struct patricia* pat, const char* key)
+{
+  struct pat_sorted* s;
+  struct pat_node* node;
+  struct pat_node* next;
+  size_t length, depth, i;
+  int bitidx;
+
+  assert(*key);
+  assert(pat->count <= PATRICIA_MAX_ENTRIES);
+  assert(!pat->mapped);
+
+  if(!pat->sorted)
+  {
+    assert(pat->count == 1);
+
+    pat->sorted = pat_sorted_create();
+  }
+
+  s = pat->sorted;
+
+  /* Find the first byte where the key differs from the previous key */
+  depth = 0;
+
+  while(key[depth] && key[depth] == s->last_key[depth])
+    ++depth;
+
+  if(!key[depth] && !s->last_key[depth])
+    return pat->count - 2;
+
+  assert((unsigned char) key[depth] > (unsigned char) s->last_key[depth]);
+
+  length = depth + strlen(key + depth);
+
+  assert(length <= PATRICIA_MAX_KEYLENGTH);
+
+  if(length + 1 > s->depth_alloc)
+  {
+    size_t old_alloc = s->depth_alloc;
+
+    s->depth_alloc = (length + 1) * 2;
+    s->seen = (unsigned char (*)[64]) realloc(s->seen, s->depth_alloc * 64);
+    s->seen_valid = (unsigned char*) realloc(s->seen_valid, s->depth_alloc);
+    memset(s->seen_valid + old_alloc, 0, s->depth_alloc - old_alloc);
+  }
+
+  if(!s->seen_valid[depth])
+  {
+    memset(s->seen[depth], 0, 64);
+    pat_seen_add(s->seen[depth], s->last_key[depth]);
+    s->seen_valid[depth] = 1;
+  }
+
+  bitidx = (depth << 3) + pat_seen_match(s->seen[depth], key[depth]) + 1;
+
+  assert(bitidx <= (depth << 3) + 8);
+
+  /* Nodes testing bits before byte `depth' are on the search path of both
+   * keys.  Below them, only bits in byte `depth' are tested before the
+   * critical bit.  */
+  while(pat->nodes[s->path[s->path_length - 1]].bitidx > (depth << 3))
+    --s->path_length;
+
+  node = pat->nodes + s->path[s->path_length - 1];
+
+  if(node->bitidx == 0 || getbit(key, node->bitidx))
+    next = pat->nodes + node->right;
+  else
+    next = pat->nodes + node->left;
+
+  if((pat->count + 1) * sizeof(struct pat_node) > pat->capacity)
+  {
+    size_t node_offset = node - pat->nodes, next_offset = next - pat->nodes;
+
+    pat->capacity = pat->capacity * 3 / 2 + sizeof(struct pat_node);
+    pat->nodes = (struct pat_node*) realloc(pat->nodes, pat->capacity);
+
+    node = pat->nodes + node_offset;
+    next = pat->nodes + next_offset;
+  }
+
+  if(s->path_length + 9 > s->path_alloc)
+  {
+    s->path_alloc = s->path_alloc * 2 + 9;
+    s->path = (unsigned int*) realloc(s->path, s->path_alloc * sizeof(unsigned int));
+  }
+
+  while(node->bitidx < next->bitidx && next->bitidx < bitidx)
+  {
+    node = next;
+    s->path[s->path_length++] = node - pat->nodes;
+
+    if(getbit(key, next->bitidx))
+      next = pat->nodes + next->right;
+    else
+      next = pat->nodes + next->left;
+  }
+
+  assert(next->bitidx != bitidx);
+
+  struct pat_node* new_node = pat->nodes + pat->count;
+
+  if(getbit(key, bitidx))
+  {
+    new_node->left = next - pat->nodes;
+    new_node->right = pat->count;
+  }
+  else
+  {
+    new_node->left = pat->count;
+    new_node->right = next - pat->nodes;
+  }
+
+  new_node->bitidx = bitidx;
+
+  if(node->bitidx == 0 || getbit(key, node->bitidx))
+    node->right = pat->count;
+  else
+    node->left = pat->count;
+
+  s->path[s->path_length++] = pat->count;
+
+  /* Keys sharing more than `depth' bytes with this key start new groups */
+  pat_seen_add(s->seen[depth], key[depth]);
+
+  for(i = depth + 1; i <= length; ++i)
+    s->seen_valid[i] = 0;
+
+  if(length + 1 > s->last_alloc)
+  {
+    s->last_alloc = (length + 1) * 2;
+    s->last_key = (char*) realloc(s->last_key, s->last_alloc);
+  }
+
+  memcpy(s->last_key + depth, key + depth, length - depth + 1);
+
+  ++pat->count;
+
+  return pat->count - 2;
+}
+
 unsigned int patricia_lookup(const struct patricia* pat, const char* key)
 {
   const struct pat_node* node = pat->nodes;
@@ -198,6 +425,11 @@ unsigned int patricia_lookup_prefix(const struct patricia* pat, const char* pref
   return 0;
 }
 
+size_t patricia_size(unsigned int count)
+{
+  return sizeof(unsigned int) + (count + 1) * sizeof(struct pat_node);
+}
+
 int patricia_write(const struct patricia* pat, int fd)
 {
   size_t amount;
@@ -213,6 +445,21 @@ int patricia_write(const struct patricia* pat, int fd)
   return sizeof(unsigned int) + amount;
 }
 
+int patricia_pwrite(const struct patricia* pat, int fd, off_t offset)
+{
+  size_t amount;
+
+  if(sizeof(unsigned int) != pwrite(fd, &pat->count, sizeof(unsigned int), offset))
+    return -1;
+
+  amount = pat->count * sizeof(struct pat_node);
+
+  if(amount != pwrite(fd, pat->nodes, amount, offset + sizeof(unsigned int)))
+    return -1;
+
+  return sizeof(unsigned int) + amount;
+}
+
 void patricia_read(struct patricia* pat, int fd)
 {
   unsigned int count;
@@ -232,6 +479,38 @@ void patricia_read(struct patricia* pat, int fd)
   pat->mapped = 0;
 }
 
+int patricia_pread(struct patricia* pat, int fd, off_t offset)
+{
+  unsigned int count;
+  struct pat_node* nodes;
+  size_t capacity;
+
+  if(sizeof(unsigned int) != pread(fd, &count, sizeof(unsigned int), offset))
+    return -1;
+
+  capacity = count * sizeof(struct pat_node);
+
+  if(!(nodes = (struct pat_node*) malloc(capacity ? capacity : 1)))
+    return -1;
+
+  if(capacity != pread(fd, nodes, capacity, offset + sizeof(unsigned int)))
+  {
+    free(nodes);
+
+    return -1;
+  }
+
+  if(!pat->mapped)
+    free(pat->nodes);
+
+  pat->count = count;
+  pat->capacity = capacity;
+  pat->nodes = nodes;
+  pat->mapped = 0;
+
+  return sizeof(unsigned int) + capacity;
+}
+
 size_t patricia_remap(struct patricia* pat, const void* data)
 {
   const char* c;
@@ -257,6 +536,8 @@ size_t patricia_remap(struct patricia* pat, const void* data)
 
 void patricia_destroy(struct patricia* pat)
 {
+  pat_sorted_destroy(pat->sorted);
+
   if(!pat->mapped)
     free(pat->nodes);
   free(pat);
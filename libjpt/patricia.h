@@ -19,6 +19,8 @@
 #ifndef PATRICIA_H_
 #define PATRICIA_H_ 1
 
+#include <sys/types.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -45,6 +47,19 @@ struct patricia* patricia_create(patricia_key_callback get_key, void* arg);
  */
 unsigned int patricia_define(struct patricia* pat, const char* key);
 
+/**
+ * Defines a key that sorts after all previously defined keys.
+ *
+ * Keys must arrive in strcmp order, and a trie built with this function must
+ * not be passed to patricia_define.  No key callback is needed: the trie is
+ * built in one left-to-right pass from the common prefix of each key and its
+ * predecessor.
+ *
+ * Returns the index of the key.  If `key' is equal to the previous key, the
+ * index of the previous key is returned.
+ */
+unsigned int patricia_define_sorted(struct patricia* pat, const char* key);
+
 /**
  * Returns the index of a key, as defined by a previous call to patricia_define.
  *
@@ -70,6 +85,12 @@ unsigned int patricia_lookup_prefix(const struct patricia* pat, const char* pref
  */
 void patricia_remove(const struct patricia* pat, const char* key);
 
+/**
+ * Returns the number of bytes patricia_write will write for a trie with
+ * `count' keys.
+ */
+size_t patricia_size(unsigned int count);
+
 /**
  * Write a PATRICIA trie to a file descriptor.
  *
@@ -77,11 +98,28 @@ void patricia_remove(const struct patricia* pat, const char* key);
  */
 int patricia_write(const struct patricia* pat, int fd);
 
+/**
+ * Write a PATRICIA trie to a file descriptor at a given offset, without
+ * changing the file position.
+ *
+ * Returns the number of bytes written, or -1 on error.
+ */
+int patricia_pwrite(const struct patricia* pat, int fd, off_t offset);
+
 /**
  * Recreate a PATRICIA trie previously written by patricia_write.
  */
 void patricia_read(struct patricia* pat, int fd);
 
+/**
+ * Recreate a PATRICIA trie previously written by patricia_write, reading it
+ * from a given offset without changing the file position.
+ *
+ * Returns the number of bytes read, or -1 on error.  The trie is unchanged
+ * on error.
+ */
+int patricia_pread(struct patricia* pat, int fd, off_t offset);
+
 /**
  * Recreate a PATRICIA trie previously written by patricia_write.
  *
@@ -5,3 +5,10 @@ size_t test_count = 0;
 #define WANT_FAILURE(x) if(-1 != (x)) { fprintf(stderr, #x " succeeded unexpectedly\n"); exit(EXIT_FAILURE); } ++test_count;
 #define WANT_TRUE(x)    if(!(x)) { fprintf(stderr, #x " was false, expected true\n"); exit(EXIT_FAILURE); } ++test_count;
 #define WANT_FALSE(x)   if((x)) { fprintf(stderr, #x " was true, expected false\n"); exit(EXIT_FAILURE); } ++test_count;
+
+/* For functions that may run in other threads than the main one, which must
+ * not touch `test_count'.  They return -1 on failure instead of exiting, and
+ * the main thread checks the result.  */
+#define CHECK_SUCCESS(x) if(-1 == (x)) { fprintf(stderr, #x " failed unexpectedly: %s\n", jpt_last_error()); return -1; }
+#define CHECK_FAILURE(x) if(-1 != (x)) { fprintf(stderr, #x " succeeded unexpectedly\n"); return -1; }
+#define CHECK_TRUE(x)    if(!(x)) { fprintf(stderr, #x " was false, expected true\n"); return -1; }
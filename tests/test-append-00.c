@@ -0,0 +1,161 @@
+/*  Test-case for appending to cells in jpt.
+    Copyright (C) 2007, 2008, 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jpt.h"
+
+#include "common.h"
+
+#define CELL_COUNT   16
+#define APPEND_COUNT 4000
+
+static size_t count;
+
+static int
+cell_callback(const char* row, const char* column, const void* data,
+              size_t data_size, uint64_t* timestamp, void* arg)
+{
+  const char* postings = data;
+  uint32_t posting;
+  size_t i, cell;
+
+  cell = strtol(row, 0, 10);
+
+  WANT_TRUE(cell == count++);
+  WANT_TRUE(data_size == APPEND_COUNT * sizeof(uint32_t));
+
+  /* Values in disktables need not be aligned */
+  for(i = 0; i < APPEND_COUNT; ++i)
+  {
+    memcpy(&posting, postings + i * sizeof(posting), sizeof(posting));
+    WANT_TRUE(posting == i * CELL_COUNT + cell);
+  }
+
+  return 0;
+}
+
+static void
+check(struct JPT_info* db)
+{
+  uint32_t* postings;
+  size_t size, i, cell;
+  char row[32];
+  uint32_t first[2];
+
+  for(cell = 0; cell < CELL_COUNT; ++cell)
+  {
+    sprintf(row, "%04zu", cell);
+
+    WANT_SUCCESS(jpt_get(db, row, "postings", (void**) &postings, &size));
+    WANT_TRUE(size == APPEND_COUNT * sizeof(uint32_t));
+
+    for(i = 0; i < APPEND_COUNT; ++i)
+      WANT_TRUE(postings[i] == i * CELL_COUNT + cell);
+
+    free(postings);
+
+    WANT_SUCCESS(jpt_get_fixed(db, row, "postings", first, sizeof(first)));
+    WANT_TRUE(first[0] == cell);
+    WANT_TRUE(first[1] == CELL_COUNT + cell);
+  }
+
+  count = 0;
+  WANT_SUCCESS(jpt_column_scan(db, "postings", cell_callback, 0));
+  WANT_TRUE(count == CELL_COUNT);
+}
+
+static void
+run(size_t buffer_size, int flags)
+{
+  struct JPT_info* db;
+  void* ret;
+  size_t retsize, i, cell;
+  char row[32];
+  uint32_t posting;
+
+  WANT_TRUE(0 == unlink("test-db.tab") || errno == ENOENT);
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", buffer_size, flags));
+
+  /* Many tiny appends, interleaved between cells */
+  for(i = 0; i < APPEND_COUNT; ++i)
+  {
+    for(cell = 0; cell < CELL_COUNT; ++cell)
+    {
+      sprintf(row, "%04zu", cell);
+      posting = i * CELL_COUNT + cell;
+
+      WANT_SUCCESS(jpt_insert(db, row, "postings", &posting, sizeof(posting), JPT_APPEND));
+    }
+  }
+
+  check(db);
+
+  /* Replacing with shorter and longer values */
+  WANT_SUCCESS(jpt_insert(db, "a", "other", "0123456789", 10, 0));
+  WANT_SUCCESS(jpt_insert(db, "a", "other", "abc", 3, JPT_REPLACE));
+  WANT_SUCCESS(jpt_insert(db, "a", "other", "de", 2, JPT_APPEND));
+  WANT_SUCCESS(jpt_get(db, "a", "other", &ret, &retsize));
+  WANT_TRUE(retsize == 5);
+  WANT_TRUE(!memcmp(ret, "abcde", 5));
+  free(ret);
+  WANT_SUCCESS(jpt_insert(db, "a", "other", "0123456789abcdef", 16, JPT_REPLACE));
+  WANT_SUCCESS(jpt_get(db, "a", "other", &ret, &retsize));
+  WANT_TRUE(retsize == 16);
+  WANT_TRUE(!memcmp(ret, "0123456789abcdef", 16));
+  free(ret);
+  WANT_SUCCESS(jpt_remove(db, "a", "other"));
+  WANT_SUCCESS(jpt_insert(db, "a", "other", "x", 1, JPT_APPEND));
+  WANT_SUCCESS(jpt_get(db, "a", "other", &ret, &retsize));
+  WANT_TRUE(retsize == 1);
+  WANT_TRUE(!memcmp(ret, "x", 1));
+  free(ret);
+
+  jpt_close(db);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", buffer_size, flags));
+  check(db);
+  WANT_SUCCESS(jpt_compact(db));
+  check(db);
+  jpt_close(db);
+
+  WANT_SUCCESS(unlink("test-db.tab"));
+  WANT_SUCCESS(unlink("test-db.tab.log"));
+}
+
+int
+main(int argc, char** argv)
+{
+  /* Everything fits in the memtable */
+  run(4 * 1024 * 1024, 0);
+  run(4 * 1024 * 1024, JPT_SKIPLIST);
+
+  /* Cells are split between the memtable and disktables */
+  run(16 * 1024, 0);
+  run(16 * 1024, JPT_SKIPLIST);
+
+  fprintf(stderr, "* passed all %zu test%s\n", test_count, (test_count != 1) ? "s" : "");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,200 @@
+/*  Test-case for asynchronous reads in jpt.
+    Copyright (C) 2007, 2008, 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jpt.h"
+
+#include "common.h"
+
+#define ROW_COUNT    4000
+#define THREAD_COUNT 4
+
+static int
+count_callback(const char* row, const char* column, const void* data,
+               size_t data_size, uint64_t* timestamp, void* arg)
+{
+  ++*(size_t*) arg;
+
+  return 0;
+}
+
+/* Every 3rd cell is appended to in a later disktable, and every 11th is
+ * removed */
+static void
+expected_value(char* target, size_t i)
+{
+  sprintf(target, "value %zu%s", i, (i % 3) ? "" : " appended");
+}
+
+static int
+check_rows(struct JPT_info* db, size_t first, size_t step)
+{
+  char row[32], expected[64], fixed[8];
+  void* value;
+  size_t i, value_size, fixed_size;
+
+  for(i = first; i < ROW_COUNT; i += step)
+  {
+    sprintf(row, "row%06zu", i);
+
+    if(!(i % 11))
+    {
+      CHECK_FAILURE(jpt_get(db, row, "column", &value, &value_size));
+      CHECK_TRUE(errno == ENOENT);
+
+      continue;
+    }
+
+    expected_value(expected, i);
+
+    CHECK_SUCCESS(jpt_get(db, row, "column", &value, &value_size));
+    CHECK_TRUE(value_size == strlen(expected));
+    CHECK_TRUE(!memcmp(value, expected, value_size));
+    free(value);
+
+    /* Values longer than the buffer are truncated */
+    fixed_size = (value_size < sizeof(fixed)) ? value_size : sizeof(fixed);
+    CHECK_TRUE(fixed_size == jpt_get_fixed(db, row, "column", fixed, sizeof(fixed)));
+    CHECK_TRUE(!memcmp(fixed, expected, fixed_size));
+  }
+
+  sprintf(row, "row%06d", ROW_COUNT);
+  CHECK_FAILURE(jpt_get(db, row, "column", &value, &value_size));
+
+  return 0;
+}
+
+struct check_arg
+{
+  struct JPT_info* db;
+  size_t first;
+};
+
+/* Returns non-null if a check failed */
+static void*
+check_thread(void* arg)
+{
+  struct check_arg* check_arg = arg;
+
+  if(-1 == check_rows(check_arg->db, check_arg->first, THREAD_COUNT))
+    return arg;
+
+  return 0;
+}
+
+static void
+check(struct JPT_info* db)
+{
+  pthread_t threads[THREAD_COUNT];
+  struct check_arg args[THREAD_COUNT];
+  void* failed;
+  size_t i, count = 0;
+
+  WANT_SUCCESS(check_rows(db, 0, 1));
+
+  for(i = 0; i < THREAD_COUNT; ++i)
+  {
+    args[i].db = db;
+    args[i].first = i;
+
+    WANT_TRUE(0 == pthread_create(&threads[i], 0, check_thread, &args[i]));
+  }
+
+  for(i = 0; i < THREAD_COUNT; ++i)
+  {
+    pthread_join(threads[i], &failed);
+    WANT_TRUE(!failed);
+  }
+
+  WANT_SUCCESS(jpt_column_scan(db, "column", count_callback, &count));
+  WANT_TRUE(count == ROW_COUNT - (ROW_COUNT + 10) / 11);
+}
+
+static void
+run(int flags)
+{
+  struct JPT_info* db;
+  char row[32], value[64];
+  size_t i;
+
+  WANT_TRUE(0 == unlink("test-db.tab") || errno == ENOENT);
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, flags));
+
+  for(i = 0; i < ROW_COUNT; ++i)
+  {
+    sprintf(row, "row%06zu", i);
+    sprintf(value, "value %zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, row, "column", value, strlen(value), 0));
+
+    if((i + 1) % 500 == 0)
+      WANT_SUCCESS(jpt_compact(db));
+  }
+
+  for(i = 0; i < ROW_COUNT; i += 3)
+  {
+    sprintf(row, "row%06zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, row, "column", " appended", 9, JPT_APPEND));
+  }
+
+  WANT_SUCCESS(jpt_compact(db));
+
+  for(i = 0; i < ROW_COUNT; i += 11)
+  {
+    sprintf(row, "row%06zu", i);
+
+    WANT_SUCCESS(jpt_remove(db, row, "column"));
+  }
+
+  check(db);
+
+  WANT_SUCCESS(jpt_compact(db));
+  check(db);
+
+  WANT_SUCCESS(jpt_major_compact(db));
+  check(db);
+
+  jpt_close(db);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, flags));
+  check(db);
+  jpt_close(db);
+
+  WANT_SUCCESS(unlink("test-db.tab"));
+  WANT_SUCCESS(unlink("test-db.tab.log"));
+}
+
+int
+main(int argc, char** argv)
+{
+  run(0);
+  run(JPT_ASYNC_READ);
+  run(JPT_ASYNC_READ | JPT_SKIPLIST);
+
+  fprintf(stderr, "* passed all %zu test%s\n", test_count, (test_count != 1) ? "s" : "");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,646 @@
+/*  Test-case for background compaction in jpt.
+    Copyright (C) 2007, 2008, 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jpt.h"
+#include "jpt_internal.h"
+
+#include "common.h"
+
+#define ROW_COUNT    4000
+#define THREAD_COUNT 3
+
+#define ROUND_COUNT      8
+#define ROUND_ROW_COUNT  16000
+#define ROUND_DISKTABLES 16
+
+#define REMOVED_COLUMN_COUNT 40
+#define REMOVED_ROW_COUNT    20000
+
+/* Every 3rd cell is appended to in a later disktable.  While the table is
+ * being compacted, every 7th cell is replaced, and every 11th and 13th is
+ * removed.  */
+static int
+expected_value(char* target, size_t i, int changed)
+{
+  if(!(i % 11) || (changed && !(i % 13)))
+    return 0;
+
+  if(changed && !(i % 7))
+    sprintf(target, "new %zu", i);
+  else
+    sprintf(target, "value %zu%s", i, (i % 3) ? "" : " appended");
+
+  return 1;
+}
+
+static int
+count_callback(const char* row, const char* column, const void* data,
+               size_t data_size, uint64_t* timestamp, void* arg)
+{
+  ++*(size_t*) arg;
+
+  return 0;
+}
+
+static int
+check_rows(struct JPT_info* db, size_t first, size_t step, int changed)
+{
+  char row[32], expected[64];
+  void* value;
+  size_t i, value_size;
+
+  for(i = first; i < ROW_COUNT; i += step)
+  {
+    sprintf(row, "row%06zu", i);
+
+    /* Cells being changed have no predictable value */
+    if(changed < 0 && (!(i % 7) || !(i % 13)))
+      continue;
+
+    if(!expected_value(expected, i, changed > 0))
+    {
+      CHECK_FAILURE(jpt_get(db, row, "column", &value, &value_size));
+      CHECK_TRUE(errno == ENOENT);
+
+      continue;
+    }
+
+    CHECK_SUCCESS(jpt_get(db, row, "column", &value, &value_size));
+    CHECK_TRUE(value_size == strlen(expected));
+    CHECK_TRUE(!memcmp(value, expected, value_size));
+    free(value);
+  }
+
+  return 0;
+}
+
+static void
+check(struct JPT_info* db, int changed)
+{
+  size_t i, expected_count = 0, count = 0;
+  char expected[64];
+
+  WANT_SUCCESS(check_rows(db, 0, 1, changed));
+
+  for(i = 0; i < ROW_COUNT; ++i)
+    expected_count += expected_value(expected, i, changed);
+
+  WANT_SUCCESS(jpt_column_scan(db, "column", count_callback, &count));
+  WANT_TRUE(count == expected_count);
+}
+
+static int done;
+
+static int
+read_some(struct JPT_info* db)
+{
+  size_t count = 0;
+
+  if(-1 == check_rows(db, rand() % 97, 97, -1))
+    return -1;
+
+  CHECK_SUCCESS(jpt_column_scan(db, "column", count_callback, &count));
+
+  return 0;
+}
+
+/* Returns non-null if a check failed */
+static void*
+read_thread(void* arg)
+{
+  struct JPT_info* db = arg;
+
+  while(!__atomic_load_n(&done, __ATOMIC_ACQUIRE))
+  {
+    if(-1 == read_some(db))
+      return arg;
+
+    /* Readers are preferred by the lock; let the writer in */
+    usleep(1000);
+  }
+
+  return 0;
+}
+
+static void
+run(int flags)
+{
+  struct JPT_compaction_policy policy;
+  struct JPT_info* db;
+  pthread_t threads[THREAD_COUNT];
+  char row[32], value[64];
+  void* failed;
+  size_t i, disktable_count, expected_count = 0, count = 0;
+
+  WANT_TRUE(0 == unlink("test-db.tab") || errno == ENOENT);
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, flags));
+
+  for(i = 0; i < ROW_COUNT; ++i)
+  {
+    sprintf(row, "row%06zu", i);
+    sprintf(value, "value %zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, row, "column", value, strlen(value), 0));
+
+    if((i + 1) % 250 == 0)
+      WANT_SUCCESS(jpt_compact(db));
+  }
+
+  for(i = 0; i < ROW_COUNT; i += 3)
+  {
+    sprintf(row, "row%06zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, row, "column", " appended", 9, JPT_APPEND));
+  }
+
+  WANT_SUCCESS(jpt_compact(db));
+
+  for(i = 0; i < ROW_COUNT; i += 11)
+  {
+    sprintf(row, "row%06zu", i);
+
+    WANT_SUCCESS(jpt_remove(db, row, "column"));
+  }
+
+  WANT_TRUE(db->disktable_count == ROW_COUNT / 250 + 1);
+
+  jpt_get_compaction_policy(db, &policy);
+  WANT_TRUE(policy.min_merge == 4);
+
+  policy.min_merge = 0;
+  WANT_FAILURE(jpt_set_compaction_policy(db, &policy));
+  WANT_TRUE(errno == EINVAL);
+
+  /* Nothing is merged until compaction is started */
+  jpt_compaction_wait(db);
+  WANT_TRUE(db->disktable_count == ROW_COUNT / 250 + 1);
+
+  policy.min_merge = 2;
+  policy.max_merge = 4;
+  policy.max_disktables = 3;
+  WANT_SUCCESS(jpt_set_compaction_policy(db, &policy));
+
+  jpt_compaction_wait(db);
+  WANT_TRUE(db->disktable_count <= 3);
+  check(db, 0);
+
+  /* Change cells while the new disktables they end up in are merged */
+  __atomic_store_n(&done, 0, __ATOMIC_RELEASE);
+
+  for(i = 0; i < THREAD_COUNT; ++i)
+    WANT_TRUE(0 == pthread_create(&threads[i], 0, read_thread, db));
+
+  for(i = 0; i < ROW_COUNT; ++i)
+  {
+    sprintf(row, "row%06zu", i);
+
+    if(!(i % 7) && (i % 11))
+      WANT_SUCCESS(jpt_insert(db, row, "column", "new", 3, JPT_REPLACE));
+
+    if(!(i % 13) && (i % 11))
+      WANT_SUCCESS(jpt_remove(db, row, "column"));
+
+    sprintf(row, "filler%06zu", i);
+    WANT_SUCCESS(jpt_insert(db, row, "filler", row, strlen(row), 0));
+
+    if((i + 1) % 100 == 0)
+      WANT_SUCCESS(jpt_compact(db));
+  }
+
+  /* Replacements shorter than the old value were done in place; put the
+   * number back */
+  for(i = 0; i < ROW_COUNT; i += 7)
+  {
+    if(!(i % 11) || !(i % 13))
+      continue;
+
+    sprintf(row, "row%06zu", i);
+    sprintf(value, "new %zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, row, "column", value, strlen(value), JPT_REPLACE));
+  }
+
+  WANT_SUCCESS(jpt_remove_column(db, "filler", 0));
+  WANT_SUCCESS(jpt_compact(db));
+
+  __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+
+  for(i = 0; i < THREAD_COUNT; ++i)
+  {
+    pthread_join(threads[i], &failed);
+    WANT_TRUE(!failed);
+  }
+
+  jpt_compaction_wait(db);
+  WANT_TRUE(db->disktable_count <= 3);
+  check(db, 1);
+
+  disktable_count = db->disktable_count;
+
+  jpt_close(db);
+
+  /* Merged disktables replace their sources when the table is opened */
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, flags));
+  WANT_TRUE(db->disktable_count == disktable_count);
+  check(db, 1);
+
+  /* A disktable with many removed keys is rewritten without them */
+  WANT_SUCCESS(jpt_major_compact(db));
+  WANT_TRUE(db->disktable_count == 1);
+
+  for(i = 0; i < ROW_COUNT; i += 2)
+  {
+    sprintf(row, "row%06zu", i);
+
+    if(-1 == jpt_remove(db, row, "column"))
+      WANT_TRUE(errno == ENOENT);
+  }
+
+  jpt_get_compaction_policy(db, &policy);
+  policy.max_removed_ratio = 0.25;
+  WANT_SUCCESS(jpt_set_compaction_policy(db, &policy));
+
+  jpt_compaction_wait(db);
+  WANT_TRUE(db->disktable_count == 1);
+  WANT_TRUE(!db->first_disktable->removed_count);
+
+  for(i = 1; i < ROW_COUNT; i += 2)
+    expected_count += expected_value(value, i, 1);
+
+  WANT_TRUE(db->first_disktable->key_info_count < ROW_COUNT);
+  WANT_SUCCESS(jpt_column_scan(db, "column", count_callback, &count));
+  WANT_TRUE(count == expected_count);
+
+  WANT_SUCCESS(check_rows(db, 1, 2, 1));
+
+  WANT_SUCCESS(jpt_set_compaction_policy(db, 0));
+
+  jpt_close(db);
+
+  WANT_SUCCESS(unlink("test-db.tab"));
+  WANT_SUCCESS(unlink("test-db.tab.log"));
+}
+
+/* In run_in_place, every 5th cell of a round is removed and every 3rd of
+ * the rest replaced by a shorter value while the round's disktables are
+ * merged.  */
+static int
+expected_in_place(char* target, size_t round, size_t i, int changed)
+{
+  if(changed && !(i % 5))
+    return 0;
+
+  if(changed && !(i % 3))
+    sprintf(target, "r %zu", i);
+  else
+    sprintf(target, "value %zu %zu", round, i);
+
+  return 1;
+}
+
+static size_t rounds_written;
+
+static int
+read_in_place(struct JPT_info* db, size_t round)
+{
+  char row[32], expected[64];
+  void* value;
+  size_t i, value_size;
+
+  i = rand() % ROUND_ROW_COUNT;
+
+  sprintf(row, "%02zu-%06zu", round, i);
+
+  /* Cells being changed are read too, so that their blocks are cached */
+  if(!(i % 3) || !(i % 5))
+  {
+    if(0 == jpt_get(db, row, "column", &value, &value_size))
+      free(value);
+
+    return 0;
+  }
+
+  expected_in_place(expected, round, i, 0);
+
+  CHECK_SUCCESS(jpt_get(db, row, "column", &value, &value_size));
+  CHECK_TRUE(value_size == strlen(expected));
+  CHECK_TRUE(!memcmp(value, expected, value_size));
+  free(value);
+
+  return 0;
+}
+
+/* Returns non-null if a check failed */
+static void*
+in_place_read_thread(void* arg)
+{
+  struct JPT_info* db = arg;
+  size_t round;
+
+  while(!__atomic_load_n(&done, __ATOMIC_ACQUIRE))
+  {
+    if(!(round = __atomic_load_n(&rounds_written, __ATOMIC_ACQUIRE)))
+    {
+      usleep(100);
+
+      continue;
+    }
+
+    if(-1 == read_in_place(db, round - 1))
+      return arg;
+
+    /* Readers are preferred by the lock; let the writer in */
+    usleep(10);
+  }
+
+  return 0;
+}
+
+static int
+merging(struct JPT_info* db)
+{
+  int result;
+
+  pthread_mutex_lock(&db->compaction_mutex);
+  result = db->compaction_merging;
+  pthread_mutex_unlock(&db->compaction_mutex);
+
+  return result;
+}
+
+static void
+check_in_place(struct JPT_info* db, size_t rounds)
+{
+  char row[32], expected[64];
+  void* value;
+  size_t i, round, value_size;
+
+  for(round = 0; round < rounds; ++round)
+  {
+    for(i = 0; i < ROUND_ROW_COUNT; ++i)
+    {
+      sprintf(row, "%02zu-%06zu", round, i);
+
+      if(!expected_in_place(expected, round, i, 1))
+      {
+        WANT_FAILURE(jpt_get(db, row, "column", &value, &value_size));
+        WANT_TRUE(errno == ENOENT);
+
+        continue;
+      }
+
+      WANT_SUCCESS(jpt_get(db, row, "column", &value, &value_size));
+      WANT_TRUE(value_size == strlen(expected));
+      WANT_TRUE(!memcmp(value, expected, value_size));
+      free(value);
+    }
+  }
+}
+
+/* Writes a round of rows into disktables of equal size, which the policy
+ * merges as soon as it is set */
+static void
+write_round(struct JPT_info* db, size_t round)
+{
+  char row[32], value[64];
+  size_t i;
+
+  for(i = 0; i < ROUND_ROW_COUNT; ++i)
+  {
+    sprintf(row, "%02zu-%06zu", round, i);
+    sprintf(value, "value %zu %zu", round, i);
+
+    WANT_SUCCESS(jpt_insert(db, row, "column", value, strlen(value), 0));
+
+    if((i + 1) % (ROUND_ROW_COUNT / ROUND_DISKTABLES) == 0)
+      WANT_SUCCESS(jpt_compact(db));
+  }
+}
+
+/* Cells are replaced and removed in place while the disktables holding them
+ * are merged, and while other threads read them through the block cache */
+static void
+run_in_place(int flags)
+{
+  struct JPT_compaction_policy policy;
+  struct JPT_info* db;
+  pthread_t threads[THREAD_COUNT];
+  char row[32], value[64];
+  uint64_t hits, misses, old_hits, old_misses;
+  void* failed;
+  size_t i, j, k, round, changes_during_merge = 0;
+
+  WANT_TRUE(0 == unlink("test-db.tab") || errno == ENOENT);
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, flags));
+
+  jpt_get_compaction_policy(db, &policy);
+  policy.min_merge = 2;
+  policy.max_merge = ROUND_DISKTABLES;
+  policy.max_disktables = 1;
+
+  __atomic_store_n(&rounds_written, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&done, 0, __ATOMIC_RELEASE);
+
+  for(i = 0; i < THREAD_COUNT; ++i)
+    WANT_TRUE(0 == pthread_create(&threads[i], 0, in_place_read_thread, db));
+
+  for(round = 0; round < ROUND_COUNT; ++round)
+  {
+    write_round(db, round);
+
+    __atomic_store_n(&rounds_written, round + 1, __ATOMIC_RELEASE);
+
+    WANT_SUCCESS(jpt_set_compaction_policy(db, &policy));
+
+    /* The merge may also be over before it is seen */
+    for(k = 0; k < 10000 && !merging(db); ++k)
+      usleep(10);
+
+    /* Start at a different place each round, so that the changes made
+     * while the merge runs are not always the same */
+    for(j = 0; j < ROUND_ROW_COUNT; ++j)
+    {
+      i = (j + round * ROUND_ROW_COUNT / ROUND_COUNT) % ROUND_ROW_COUNT;
+
+      sprintf(row, "%02zu-%06zu", round, i);
+
+      if(!(i % 5))
+      {
+        WANT_SUCCESS(jpt_remove(db, row, "column"));
+      }
+      else if(!(i % 3))
+      {
+        sprintf(value, "r %zu", i);
+
+        WANT_SUCCESS(jpt_insert(db, row, "column", value, strlen(value), JPT_REPLACE));
+      }
+      else
+        continue;
+
+      if(merging(db))
+        ++changes_during_merge;
+    }
+
+    jpt_compaction_wait(db);
+    WANT_TRUE(db->disktable_count == 1);
+
+    WANT_SUCCESS(jpt_set_compaction_policy(db, 0));
+
+    check_in_place(db, round + 1);
+  }
+
+  __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+
+  for(i = 0; i < THREAD_COUNT; ++i)
+  {
+    pthread_join(threads[i], &failed);
+    WANT_TRUE(!failed);
+  }
+
+  WANT_TRUE(changes_during_merge > 0);
+
+  jpt_close(db);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, flags));
+  check_in_place(db, ROUND_COUNT);
+
+  /* A merge reads its disktables without the block cache */
+  write_round(db, ROUND_COUNT);
+
+  jpt_cache_stats(db, &old_hits, &old_misses);
+
+  WANT_SUCCESS(jpt_set_compaction_policy(db, &policy));
+  jpt_compaction_wait(db);
+  WANT_TRUE(db->disktable_count == 1);
+
+  jpt_cache_stats(db, &hits, &misses);
+  WANT_TRUE(hits == old_hits);
+  WANT_TRUE(misses == old_misses);
+
+  WANT_SUCCESS(jpt_set_compaction_policy(db, 0));
+
+  jpt_close(db);
+
+  WANT_SUCCESS(unlink("test-db.tab"));
+  WANT_SUCCESS(unlink("test-db.tab.log"));
+}
+
+/* Columns are removed while the disktables holding them are merged, which
+ * hides their keys in place under the merge */
+static void
+run_remove_column(int flags)
+{
+  struct JPT_compaction_policy policy;
+  struct JPT_info* db;
+  char row[32], column[32], value[64];
+  void* data;
+  size_t i, j, data_size, count;
+
+  WANT_TRUE(0 == unlink("test-db.tab") || errno == ENOENT);
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 1024 * 1024, flags));
+
+  for(i = 0; i < ROW_COUNT; ++i)
+  {
+    sprintf(row, "row%06zu", i);
+    sprintf(value, "value %zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, row, "column", value, strlen(value), 0));
+  }
+
+  jpt_get_compaction_policy(db, &policy);
+  policy.min_merge = 2;
+  policy.max_merge = 64;
+  policy.max_disktables = 1;
+  WANT_SUCCESS(jpt_set_compaction_policy(db, &policy));
+
+  for(j = 0; j < REMOVED_COLUMN_COUNT; ++j)
+  {
+    sprintf(column, "removed%02zu", j);
+
+    for(i = 0; i < REMOVED_ROW_COUNT; ++i)
+    {
+      sprintf(row, "row%06zu", i);
+
+      WANT_SUCCESS(jpt_insert(db, row, column, "value", 5, 0));
+
+      if((i + 1) % (REMOVED_ROW_COUNT / 10) == 0)
+        WANT_SUCCESS(jpt_compact(db));
+    }
+
+    WANT_SUCCESS(jpt_remove_column(db, column, 0));
+  }
+
+  jpt_compaction_wait(db);
+  WANT_TRUE(db->disktable_count == 1);
+
+  for(j = 0; j < REMOVED_COLUMN_COUNT; j += 7)
+  {
+    sprintf(column, "removed%02zu", j);
+
+    WANT_FAILURE(jpt_get(db, "row000000", column, &data, &data_size));
+  }
+
+  for(i = 0; i < ROW_COUNT; ++i)
+  {
+    sprintf(row, "row%06zu", i);
+    sprintf(value, "value %zu", i);
+
+    WANT_SUCCESS(jpt_get(db, row, "column", &data, &data_size));
+    WANT_TRUE(data_size == strlen(value));
+    WANT_TRUE(!memcmp(data, value, data_size));
+    free(data);
+  }
+
+  count = 0;
+  WANT_SUCCESS(jpt_column_scan(db, "column", count_callback, &count));
+  WANT_TRUE(count == ROW_COUNT);
+
+  WANT_SUCCESS(jpt_set_compaction_policy(db, 0));
+
+  jpt_close(db);
+
+  WANT_SUCCESS(unlink("test-db.tab"));
+  WANT_SUCCESS(unlink("test-db.tab.log"));
+}
+
+int
+main(int argc, char** argv)
+{
+  run(0);
+  run(JPT_NO_MMAP);
+  run(JPT_SKIPLIST | JPT_ASYNC_READ);
+  run_in_place(JPT_NO_MMAP);
+  run_remove_column(0);
+  run_remove_column(JPT_NO_MMAP);
+
+  fprintf(stderr, "* passed all %zu test%s\n", test_count, (test_count != 1) ? "s" : "");
+
+  return EXIT_SUCCESS;
+}
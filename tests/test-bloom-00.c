@@ -0,0 +1,115 @@
+/*  Test-case for bloom filter sizes in jpt.
+    Copyright (C) 2007, 2008, 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jpt.h"
+
+#include "common.h"
+
+#define KEY_COUNT 20000
+
+static void
+check(struct JPT_info* db)
+{
+  char row[64], value[64];
+  size_t i;
+
+  for(i = 0; i < KEY_COUNT; ++i)
+  {
+    sprintf(row, "%zu", i * 2);
+
+    WANT_SUCCESS(jpt_get_fixed(db, row, "column", value, 8));
+    WANT_TRUE(!memcmp(value, row, strlen(row) < 8 ? strlen(row) : 8));
+
+    sprintf(row, "%zu", i * 2 + 1);
+
+    WANT_FAILURE(jpt_has_key(db, row, "column"));
+  }
+}
+
+/* Disktables of many sizes, written with different filter sizes */
+static void
+run(unsigned int bits_per_key)
+{
+  struct JPT_info* db;
+  char row[64];
+  size_t i;
+
+  WANT_TRUE(0 == unlink("test-db.tab") || errno == ENOENT);
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, 0));
+  WANT_SUCCESS(jpt_set_bloom_bits(db, bits_per_key));
+
+  for(i = 0; i < KEY_COUNT; ++i)
+  {
+    sprintf(row, "%zu", i * 2);
+
+    WANT_SUCCESS(jpt_insert(db, row, "column", row, strlen(row), 0));
+
+    /* Disktables of 1, 2, 4, ... keys */
+    if(!(i & (i + 1)))
+      WANT_SUCCESS(jpt_compact(db));
+  }
+
+  WANT_SUCCESS(jpt_compact(db));
+  check(db);
+  jpt_close(db);
+
+  /* Filter parameters are read back from the disktable headers */
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, 0));
+  check(db);
+  WANT_SUCCESS(jpt_major_compact(db));
+  check(db);
+  jpt_close(db);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, 0));
+  check(db);
+  jpt_close(db);
+
+  WANT_SUCCESS(unlink("test-db.tab"));
+  WANT_SUCCESS(unlink("test-db.tab.log"));
+}
+
+int
+main(int argc, char** argv)
+{
+  struct JPT_info* db;
+
+  WANT_TRUE(0 == unlink("test-db.tab") || errno == ENOENT);
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, 0));
+  WANT_FAILURE(jpt_set_bloom_bits(db, 0));
+  WANT_TRUE(errno == EINVAL);
+  WANT_FAILURE(jpt_set_bloom_bits(db, 65));
+  WANT_TRUE(errno == EINVAL);
+  jpt_close(db);
+
+  run(1);
+  run(10);
+  run(64);
+
+  fprintf(stderr, "* passed all %zu test%s\n", test_count, (test_count != 1) ? "s" : "");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,160 @@
+/*  Test-case for reading tables through the block cache in jpt.
+    Copyright (C) 2007, 2008, 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jpt.h"
+
+#include "common.h"
+
+#define ROW_COUNT 5000
+
+static int
+count_callback(const char* row, const char* column, const void* data,
+               size_t data_size, uint64_t* timestamp, void* arg)
+{
+  ++*(size_t*) arg;
+
+  return 0;
+}
+
+/* Every 7th cell of column "a" is removed, and every 5th cell of column "b"
+ * is replaced by a value of the same size */
+static void
+check(struct JPT_info* db, int have_b)
+{
+  char row[32], expected[32], value[32];
+  size_t i, count = 0;
+
+  for(i = 0; i < ROW_COUNT; ++i)
+  {
+    sprintf(row, "row%06zu", i);
+
+    if(!(i % 7))
+    {
+      WANT_FAILURE(jpt_has_key(db, row, "a"));
+    }
+    else
+    {
+      sprintf(expected, "a%08zu", i);
+      WANT_TRUE(9 == jpt_get_fixed(db, row, "a", value, sizeof(value)));
+      WANT_TRUE(!memcmp(value, expected, 9));
+    }
+
+    if(have_b)
+    {
+      sprintf(expected, "%c%08zu", (i % 5) ? 'b' : 'B', i);
+      WANT_TRUE(9 == jpt_get_fixed(db, row, "b", value, sizeof(value)));
+      WANT_TRUE(!memcmp(value, expected, 9));
+    }
+  }
+
+  WANT_SUCCESS(jpt_column_scan(db, "a", count_callback, &count));
+  WANT_TRUE(count == ROW_COUNT - (ROW_COUNT + 6) / 7);
+}
+
+static void
+run(size_t cache_size)
+{
+  struct JPT_info* db;
+  char row[32], value[32];
+  uint64_t hits, misses;
+  size_t i;
+
+  WANT_TRUE(0 == unlink("test-db.tab") || errno == ENOENT);
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+
+  WANT_POINTER(db = jpt_init_cache("test-db.tab", 1024 * 1024, cache_size, JPT_NO_MMAP));
+
+  for(i = 0; i < ROW_COUNT; ++i)
+  {
+    sprintf(row, "row%06zu", i);
+
+    sprintf(value, "a%08zu", i);
+    WANT_SUCCESS(jpt_insert(db, row, "a", value, strlen(value), 0));
+
+    sprintf(value, "b%08zu", i);
+    WANT_SUCCESS(jpt_insert(db, row, "b", value, strlen(value), 0));
+
+    if((i + 1) % 1000 == 0)
+      WANT_SUCCESS(jpt_compact(db));
+  }
+
+  /* Read everything once, so that the writes below hit cached blocks */
+  for(i = 0; i < ROW_COUNT; ++i)
+  {
+    sprintf(row, "row%06zu", i);
+
+    WANT_SUCCESS(jpt_has_key(db, row, "a"));
+    WANT_TRUE(9 == jpt_get_fixed(db, row, "b", value, sizeof(value)));
+  }
+
+  for(i = 0; i < ROW_COUNT; ++i)
+  {
+    sprintf(row, "row%06zu", i);
+
+    if(!(i % 7))
+      WANT_SUCCESS(jpt_remove(db, row, "a"));
+
+    if(!(i % 5))
+    {
+      sprintf(value, "B%08zu", i);
+      WANT_SUCCESS(jpt_insert(db, row, "b", value, strlen(value), JPT_REPLACE));
+    }
+  }
+
+  check(db, 1);
+
+  WANT_SUCCESS(jpt_compact(db));
+  check(db, 1);
+
+  WANT_SUCCESS(jpt_remove_column(db, "b", 0));
+  WANT_FAILURE(jpt_has_column(db, "b"));
+  check(db, 0);
+
+  WANT_SUCCESS(jpt_major_compact(db));
+  check(db, 0);
+
+  jpt_cache_stats(db, &hits, &misses);
+
+  WANT_TRUE(cache_size ? (hits > 0 && misses > 0) : (hits == 0 && misses == 0));
+
+  jpt_close(db);
+
+  WANT_POINTER(db = jpt_init_cache("test-db.tab", 1024 * 1024, cache_size, JPT_NO_MMAP));
+  check(db, 0);
+  jpt_close(db);
+
+  WANT_SUCCESS(unlink("test-db.tab"));
+  WANT_SUCCESS(unlink("test-db.tab.log"));
+}
+
+int
+main(int argc, char** argv)
+{
+  run(0);
+  run(64 * 1024);
+  run(16 * 1024 * 1024);
+
+  fprintf(stderr, "* passed all %zu test%s\n", test_count, (test_count != 1) ? "s" : "");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+/*  Test-case for scanning interleaved columns in the memtable of jpt.
+    Copyright (C) 2007, 2008, 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jpt.h"
+
+#include "common.h"
+
+#define KEY_COUNT    0x1000
+#define COLUMN_COUNT 5
+
+static size_t count;
+
+static int
+cell_callback(const char* row, const char* column, const void* data,
+              size_t data_size, uint64_t* timestamp, void* arg)
+{
+  size_t step = *(size_t*) arg;
+  char buf[64];
+
+  WANT_TRUE(data_size == strlen(column));
+  WANT_TRUE(0 == memcmp(column, data, data_size));
+
+  sprintf(buf, "%08zu", count);
+  count += step;
+
+  WANT_TRUE(0 == strcmp(row, buf));
+
+  return 0;
+}
+
+static void
+check(struct JPT_info* db)
+{
+  char column[64];
+  size_t step;
+
+  for(step = 1; step <= COLUMN_COUNT; ++step)
+  {
+    sprintf(column, "c%zu", step);
+
+    count = (step == 3) ? 3 : 0;
+    WANT_SUCCESS(jpt_column_scan(db, column, cell_callback, &step));
+    WANT_TRUE(count == (KEY_COUNT + step - 1) / step * step);
+  }
+
+  step = 1;
+  count = 0;
+  WANT_SUCCESS(jpt_column_scan(db, "c9", cell_callback, &step));
+  WANT_TRUE(count == 1);
+}
+
+/* Disktables are written every `compact_interval' rows, if non-zero */
+static void
+run(int flags, size_t compact_interval, int major_compact)
+{
+  struct JPT_info* db;
+  char row[64], column[64];
+  size_t i, step;
+
+  WANT_TRUE(0 == unlink("test-db.tab") || errno == ENOENT);
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+
+  /* Large enough that disktables are only written by jpt_compact */
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, flags));
+
+  /* Column `c<n>' holds every (n + 1)th row, in scrambled order */
+  for(i = 0; i < KEY_COUNT; ++i)
+  {
+    size_t r = i ^ 0x0555;
+
+    for(step = 1; step <= COLUMN_COUNT; ++step)
+    {
+      if(r % step)
+        continue;
+
+      sprintf(row, "%08zu", r);
+      sprintf(column, "c%zu", step);
+
+      WANT_SUCCESS(jpt_insert(db, row, column, column, strlen(column), 0));
+    }
+
+    if(compact_interval && !((i + 1) % compact_interval))
+      WANT_SUCCESS(jpt_compact(db));
+  }
+
+  /* A column that exists only in the last disktable */
+  WANT_SUCCESS(jpt_insert(db, "00000000", "c9", "c9", 2, 0));
+
+  if(compact_interval)
+    WANT_SUCCESS(jpt_compact(db));
+
+  WANT_SUCCESS(jpt_remove(db, "00000000", "c3"));
+
+  if(major_compact)
+    WANT_SUCCESS(jpt_major_compact(db));
+
+  check(db);
+  jpt_close(db);
+
+  /* Column directories are read back from the disktables */
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, flags));
+  check(db);
+
+  WANT_FAILURE(jpt_remove_column(db, "c2", JPT_REMOVE_IF_EMPTY));
+  WANT_TRUE(errno == ENOTEMPTY);
+  WANT_SUCCESS(jpt_remove_column(db, "c2", 0));
+  WANT_FAILURE(jpt_column_scan(db, "c2", cell_callback, &step));
+  WANT_FAILURE(jpt_has_key(db, "00000002", "c2"));
+  WANT_SUCCESS(jpt_has_key(db, "00000002", "c1"));
+
+  step = 4;
+  count = 0;
+  WANT_SUCCESS(jpt_column_scan(db, "c4", cell_callback, &step));
+  WANT_TRUE(count == KEY_COUNT);
+
+  jpt_close(db);
+
+  WANT_SUCCESS(unlink("test-db.tab"));
+  WANT_SUCCESS(unlink("test-db.tab.log"));
+}
+
+int
+main(int argc, char** argv)
+{
+  run(0, 0, 0);
+  run(JPT_SKIPLIST, 0, 0);
+  run(0, 0x300, 0);
+  run(0, 0x300, 1);
+  run(JPT_RANDOM_ACCESS | JPT_LOCK_INDEX, 0x300, 1);
+
+  fprintf(stderr, "* passed all %zu test%s\n", test_count, (test_count != 1) ? "s" : "");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,206 @@
+/*  Test-case for background memtable flushing in jpt.
+    Copyright (C) 2007, 2008, 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "jpt.h"
+
+#include "common.h"
+
+#define KEY_COUNT 0x4000
+
+static size_t count;
+
+static int
+cell_callback(const char* row, const char* column, const void* data,
+              size_t data_size, uint64_t* timestamp, void* arg)
+{
+  char buf[64];
+
+  sprintf(buf, "%08zu", count++);
+
+  WANT_TRUE(0 == strcmp(row, buf));
+  WANT_TRUE(data_size == strlen(row));
+  WANT_TRUE(0 == memcmp(row, data, data_size));
+
+  return 0;
+}
+
+static void
+check_keys(struct JPT_info* db, size_t limit)
+{
+  void* ret;
+  size_t retsize;
+  char buf[64];
+  size_t i;
+
+  for(i = 0; i < limit; ++i)
+  {
+    sprintf(buf, "%08zu", i);
+
+    WANT_SUCCESS(jpt_get(db, buf, "column", &ret, &retsize));
+    WANT_TRUE(retsize == strlen(buf));
+    WANT_TRUE(0 == memcmp(ret, buf, retsize));
+    free(ret);
+  }
+}
+
+static void
+remove_files()
+{
+  WANT_TRUE(0 == unlink("test-db.tab") || errno == ENOENT);
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+  WANT_TRUE(0 == unlink("test-db.tab.log.frozen") || errno == ENOENT);
+}
+
+int
+main(int argc, char** argv)
+{
+  struct JPT_info* db;
+  void* ret;
+  size_t retsize;
+  char buf[64];
+  size_t i;
+  pid_t child;
+  int status;
+
+  remove_files();
+
+  /* A small memtable, so that it is frozen and flushed many times */
+  WANT_POINTER(db = jpt_init("test-db.tab", 64 * 1024, 0));
+
+  for(i = 0; i < KEY_COUNT; ++i)
+  {
+    sprintf(buf, "%08zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, buf, "column", buf, strlen(buf), 0));
+
+    /* Recently inserted keys may live in the memtable being flushed */
+    if(i >= 16)
+    {
+      sprintf(buf, "%08zu", i - 16);
+
+      WANT_SUCCESS(jpt_get(db, buf, "column", &ret, &retsize));
+      WANT_TRUE(retsize == strlen(buf));
+      free(ret);
+
+      WANT_FAILURE(jpt_insert(db, buf, "column", "x", 1, 0));
+      WANT_TRUE(errno == EEXIST);
+    }
+  }
+
+  check_keys(db, KEY_COUNT);
+
+  WANT_SUCCESS(jpt_column_scan(db, "column", cell_callback, 0));
+  WANT_TRUE(count == KEY_COUNT);
+
+  /* Replace and remove keys while flushes are in progress */
+  for(i = 0; i < KEY_COUNT; ++i)
+  {
+    sprintf(buf, "%08zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, buf, "other", "a", 1, 0));
+
+    if(i >= 8)
+    {
+      sprintf(buf, "%08zu", i - 8);
+
+      if(i & 1)
+      {
+        WANT_SUCCESS(jpt_insert(db, buf, "other", "bc", 2, JPT_REPLACE));
+      }
+      else
+      {
+        WANT_SUCCESS(jpt_remove(db, buf, "other"));
+      }
+    }
+  }
+
+  for(i = 0; i < KEY_COUNT - 8; ++i)
+  {
+    sprintf(buf, "%08zu", i);
+
+    if((i + 8) & 1)
+    {
+      WANT_SUCCESS(jpt_get(db, buf, "other", &ret, &retsize));
+      WANT_TRUE(retsize == 2);
+      WANT_TRUE(0 == memcmp(ret, "bc", 2));
+      free(ret);
+    }
+    else
+    {
+      WANT_FAILURE(jpt_has_key(db, buf, "other"));
+    }
+  }
+
+  WANT_SUCCESS(jpt_remove_column(db, "other", 0));
+
+  jpt_close(db);
+
+  WANT_FAILURE(access("test-db.tab.log.frozen", F_OK));
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 64 * 1024, 0));
+  check_keys(db, KEY_COUNT);
+  WANT_FAILURE(jpt_has_key(db, "00000001", "other"));
+  jpt_close(db);
+
+  /* A process that dies while a flush may be in progress loses no data */
+  remove_files();
+
+  child = fork();
+
+  WANT_TRUE(child != -1);
+
+  if(!child)
+  {
+    db = jpt_init("test-db.tab", 64 * 1024, 0);
+
+    if(!db)
+      _exit(EXIT_FAILURE);
+
+    for(i = 0; i < KEY_COUNT; ++i)
+    {
+      sprintf(buf, "%08zu", i);
+
+      if(-1 == jpt_insert(db, buf, "column", buf, strlen(buf), 0))
+        _exit(EXIT_FAILURE);
+    }
+
+    _exit(EXIT_SUCCESS);
+  }
+
+  WANT_TRUE(child == waitpid(child, &status, 0));
+  WANT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 64 * 1024, 0));
+  check_keys(db, KEY_COUNT);
+  count = 0;
+  WANT_SUCCESS(jpt_column_scan(db, "column", cell_callback, 0));
+  WANT_TRUE(count == KEY_COUNT);
+  jpt_close(db);
+
+  remove_files();
+
+  fprintf(stderr, "* passed all %zu test%s\n", test_count, (test_count != 1) ? "s" : "");
+
+  return EXIT_SUCCESS;
+}
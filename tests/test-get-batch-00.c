@@ -0,0 +1,166 @@
+/*  Test-case for retrieving many cells at once in jpt.
+    Copyright (C) 2007, 2008, 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jpt.h"
+
+#include "common.h"
+
+#define ROW_COUNT  3000
+#define BATCH_SIZE 500
+
+static const char* columns[] = { "a", "b", "missing", "c" };
+
+/* Compares a batch against one jpt_get per cell */
+static void
+check(struct JPT_info* db, unsigned int seed)
+{
+  struct JPT_batch_cell cells[BATCH_SIZE];
+  char rows[BATCH_SIZE][32];
+  void* buffer;
+  void* value;
+  size_t i, value_size;
+  int found = 0;
+
+  srand(seed);
+
+  for(i = 0; i < BATCH_SIZE; ++i)
+  {
+    /* Every fourth row does not exist, and some cells are requested twice */
+    if(i && !(i % 7))
+      strcpy(rows[i], rows[i - 1]);
+    else
+      sprintf(rows[i], "row%06u", (unsigned int) (rand() % (ROW_COUNT * 4 / 3)));
+
+    cells[i].row = rows[i];
+    cells[i].column = columns[(i / 50) % 4];
+  }
+
+  WANT_SUCCESS(jpt_get_batch(db, cells, BATCH_SIZE, &buffer));
+
+  for(i = 0; i < BATCH_SIZE; ++i)
+  {
+    if(-1 == jpt_get(db, cells[i].row, cells[i].column, &value, &value_size))
+    {
+      WANT_TRUE(!cells[i].value);
+
+      continue;
+    }
+
+    WANT_TRUE(cells[i].value != 0);
+    WANT_TRUE(cells[i].value_size == value_size);
+    WANT_TRUE(!memcmp(cells[i].value, value, value_size));
+    WANT_TRUE(!((const char*) cells[i].value)[value_size]);
+
+    free(value);
+    ++found;
+  }
+
+  WANT_TRUE(found == jpt_get_batch(db, cells, BATCH_SIZE, &value));
+  WANT_TRUE(found > BATCH_SIZE / 3);
+
+  free(value);
+  free(buffer);
+}
+
+static void
+run(int flags)
+{
+  struct JPT_info* db;
+  struct JPT_batch_cell cell;
+  char row[32], value[64];
+  void* buffer;
+  size_t i;
+
+  WANT_TRUE(0 == unlink("test-db.tab") || errno == ENOENT);
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, flags));
+
+  WANT_SUCCESS(jpt_get_batch(db, 0, 0, &buffer));
+  free(buffer);
+
+  /* Cells in several disktables, some of them appended to in later ones */
+  for(i = 0; i < ROW_COUNT; ++i)
+  {
+    sprintf(row, "row%06zu", i);
+    sprintf(value, "a%zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, row, "a", value, strlen(value), 0));
+
+    if(i % 3)
+      WANT_SUCCESS(jpt_insert(db, row, "b", value + 1, strlen(value + 1), 0));
+
+    if((i + 1) % 1000 == 0)
+      WANT_SUCCESS(jpt_compact(db));
+  }
+
+  for(i = 0; i < ROW_COUNT; i += 5)
+  {
+    sprintf(row, "row%06zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, row, "a", "+", 1, JPT_APPEND));
+    WANT_SUCCESS(jpt_insert(db, row, "c", "", 0, 0));
+
+    if(i == ROW_COUNT / 2)
+      WANT_SUCCESS(jpt_compact(db));
+  }
+
+  for(i = 0; i < ROW_COUNT; i += 11)
+  {
+    sprintf(row, "row%06zu", i);
+
+    WANT_SUCCESS(jpt_remove(db, row, "a"));
+  }
+
+  check(db, 1);
+  check(db, 2);
+
+  cell.row = "row000001";
+  cell.column = "a";
+  WANT_TRUE(1 == jpt_get_batch(db, &cell, 1, &buffer));
+  WANT_TRUE(cell.value_size == 2);
+  WANT_TRUE(!strcmp(cell.value, "a1"));
+  free(buffer);
+
+  WANT_SUCCESS(jpt_major_compact(db));
+  check(db, 3);
+  jpt_close(db);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, flags));
+  check(db, 4);
+  jpt_close(db);
+
+  WANT_SUCCESS(unlink("test-db.tab"));
+  WANT_SUCCESS(unlink("test-db.tab.log"));
+}
+
+int
+main(int argc, char** argv)
+{
+  run(0);
+  run(JPT_SKIPLIST);
+
+  fprintf(stderr, "* passed all %zu test%s\n", test_count, (test_count != 1) ? "s" : "");
+
+  return EXIT_SUCCESS;
+}
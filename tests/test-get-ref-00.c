@@ -0,0 +1,165 @@
+/*  Test-case for zero-copy value retrieval in jpt.
+    Copyright (C) 2007, 2008, 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jpt.h"
+
+#include "common.h"
+
+#define ROW_COUNT 2000
+#define REF_COUNT 64
+
+/* Compares a referenced value against jpt_get */
+static void
+check(struct JPT_info* db, const char* row, const char* column,
+      const void* value, size_t value_size)
+{
+  void* expected;
+  size_t expected_size;
+
+  WANT_SUCCESS(jpt_get(db, row, column, &expected, &expected_size));
+  WANT_TRUE(value_size == expected_size);
+  WANT_TRUE(!memcmp(value, expected, value_size));
+
+  free(expected);
+}
+
+static void
+run(int flags)
+{
+  struct JPT_info* db;
+  struct JPT_ref* refs[REF_COUNT];
+  struct JPT_ref* ref;
+  struct JPT_ref* other_ref;
+  const void* values[REF_COUNT];
+  const void* value;
+  const void* other_value;
+  size_t sizes[REF_COUNT];
+  size_t value_size, other_size;
+  char row[32], data[64];
+  size_t i;
+
+  WANT_TRUE(0 == unlink("test-db.tab") || errno == ENOENT);
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, flags));
+
+  for(i = 0; i < ROW_COUNT; ++i)
+  {
+    sprintf(row, "row%06zu", i);
+    sprintf(data, "value %zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, row, "column", data, strlen(data), 0));
+  }
+
+  /* Values in the memtable are copied */
+  WANT_SUCCESS(jpt_get_ref(db, "row000001", "column", &value, &value_size, &ref));
+  WANT_TRUE(value_size == 7 && !memcmp(value, "value 1", 7));
+  jpt_release_ref(db, ref);
+
+  WANT_FAILURE(jpt_get_ref(db, "absent", "column", &value, &value_size, &ref));
+  WANT_TRUE(errno == ENOENT);
+  WANT_TRUE(!ref);
+  WANT_FAILURE(jpt_get_ref(db, "row000001", "absent", &value, &value_size, &ref));
+  WANT_TRUE(errno == ENOENT);
+
+  WANT_SUCCESS(jpt_compact(db));
+
+  /* Values stored once on disk are not copied */
+  WANT_SUCCESS(jpt_get_ref(db, "row000002", "column", &value, &value_size, &ref));
+  WANT_SUCCESS(jpt_get_ref(db, "row000002", "column", &other_value, &other_size, &other_ref));
+  WANT_TRUE(value == other_value);
+  check(db, "row000002", "column", value, value_size);
+  jpt_release_ref(db, other_ref);
+  jpt_release_ref(db, ref);
+
+  /* Values spread over two disktables are copied */
+  WANT_SUCCESS(jpt_insert(db, "row000003", "column", "+", 1, JPT_APPEND));
+  WANT_SUCCESS(jpt_compact(db));
+  WANT_SUCCESS(jpt_get_ref(db, "row000003", "column", &value, &value_size, &ref));
+  WANT_TRUE(value_size == 8 && !memcmp(value, "value 3+", 8));
+  jpt_release_ref(db, ref);
+
+  /* References survive the table growing and being rewritten */
+  for(i = 0; i < REF_COUNT; ++i)
+  {
+    sprintf(row, "row%06zu", i * 17);
+
+    WANT_SUCCESS(jpt_get_ref(db, row, "column", &values[i], &sizes[i], &refs[i]));
+    check(db, row, "column", values[i], sizes[i]);
+  }
+
+  for(i = 0; i < ROW_COUNT; ++i)
+  {
+    sprintf(row, "new%06zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, row, "column", row, strlen(row), 0));
+
+    if(i == ROW_COUNT / 2)
+      WANT_SUCCESS(jpt_compact(db));
+  }
+
+  WANT_SUCCESS(jpt_compact(db));
+
+  /* The mapping grows in place */
+  WANT_SUCCESS(jpt_get_ref(db, "row000000", "column", &value, &value_size, &ref));
+  WANT_TRUE(value == values[0]);
+  jpt_release_ref(db, ref);
+
+  for(i = 0; i < REF_COUNT / 2; ++i)
+  {
+    sprintf(row, "row%06zu", i * 17);
+    check(db, row, "column", values[i], sizes[i]);
+    jpt_release_ref(db, refs[i]);
+  }
+
+  WANT_SUCCESS(jpt_major_compact(db));
+
+  WANT_SUCCESS(jpt_get_ref(db, "row000002", "column", &value, &value_size, &ref));
+  check(db, "row000002", "column", value, value_size);
+
+  for(i = REF_COUNT / 2; i < REF_COUNT; ++i)
+  {
+    sprintf(row, "row%06zu", i * 17);
+    check(db, row, "column", values[i], sizes[i]);
+    jpt_release_ref(db, refs[i]);
+  }
+
+  jpt_release_ref(db, ref);
+
+  jpt_close(db);
+
+  WANT_SUCCESS(unlink("test-db.tab"));
+  WANT_SUCCESS(unlink("test-db.tab.log"));
+}
+
+int
+main(int argc, char** argv)
+{
+  run(0);
+  run(JPT_SKIPLIST);
+  run(JPT_RANDOM_ACCESS | JPT_LOCK_INDEX);
+
+  fprintf(stderr, "* passed all %zu test%s\n", test_count, (test_count != 1) ? "s" : "");
+
+  return EXIT_SUCCESS;
+}
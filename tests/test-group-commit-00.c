@@ -0,0 +1,184 @@
+/*  Test-case for concurrent writers sharing log writes.
+    Copyright (C) 2007, 2008, 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "jpt.h"
+#include "jpt_internal.h"
+
+#include "common.h"
+
+#define THREAD_COUNT    8
+#define ROWS_PER_THREAD 3000
+
+static int
+count_callback(const char* row, const char* column, const void* data,
+               size_t data_size, uint64_t* timestamp, void* arg)
+{
+  ++*(size_t*) arg;
+
+  return 0;
+}
+
+/* Every 7th row is removed after it has been inserted */
+static int
+write_rows(struct JPT_info* db, size_t thread)
+{
+  char row[32], value[64];
+  size_t i;
+
+  for(i = 0; i < ROWS_PER_THREAD; ++i)
+  {
+    sprintf(row, "t%02zu-%06zu", thread, i);
+    sprintf(value, "value %zu %zu", thread, i);
+
+    CHECK_SUCCESS(jpt_insert(db, row, "column", value, strlen(value), 0));
+
+    if(!(i % 7))
+    {
+      CHECK_SUCCESS(jpt_remove(db, row, "column"));
+    }
+  }
+
+  return 0;
+}
+
+/* Returns non-null if a check failed */
+static void*
+write_thread(void* arg)
+{
+  static size_t next_thread;
+  size_t thread;
+
+  thread = __sync_fetch_and_add(&next_thread, 1) % THREAD_COUNT;
+
+  if(-1 == write_rows(arg, thread))
+    return arg;
+
+  return 0;
+}
+
+static void
+check(struct JPT_info* db)
+{
+  char row[32], expected[64];
+  void* value;
+  size_t i, j, value_size, count = 0, expected_count = 0;
+
+  for(j = 0; j < THREAD_COUNT; ++j)
+  {
+    for(i = 0; i < ROWS_PER_THREAD; ++i)
+    {
+      sprintf(row, "t%02zu-%06zu", j, i);
+
+      if(!(i % 7))
+      {
+        WANT_FAILURE(jpt_get(db, row, "column", &value, &value_size));
+        WANT_TRUE(errno == ENOENT);
+
+        continue;
+      }
+
+      sprintf(expected, "value %zu %zu", j, i);
+      ++expected_count;
+
+      WANT_SUCCESS(jpt_get(db, row, "column", &value, &value_size));
+      WANT_TRUE(value_size == strlen(expected));
+      WANT_TRUE(!memcmp(value, expected, value_size));
+      free(value);
+    }
+  }
+
+  WANT_SUCCESS(jpt_column_scan(db, "column", count_callback, &count));
+  WANT_TRUE(count == expected_count);
+}
+
+/* The memtable is small, so that it is flushed, and the log moved aside,
+ * while other writers wait for their records to be written */
+static void
+write_all(int flags)
+{
+  struct JPT_info* db;
+  pthread_t threads[THREAD_COUNT];
+  void* failed;
+  size_t i;
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 256 * 1024, flags));
+
+  WANT_SUCCESS(jpt_create_column(db, "column", 0));
+
+  for(i = 0; i < THREAD_COUNT; ++i)
+    WANT_TRUE(0 == pthread_create(&threads[i], 0, write_thread, db));
+
+  for(i = 0; i < THREAD_COUNT; ++i)
+  {
+    pthread_join(threads[i], &failed);
+    WANT_TRUE(!failed);
+  }
+
+  WANT_TRUE(db->log_written == db->log_appended);
+  WANT_TRUE(!db->log_committers);
+
+  check(db);
+
+  /* Exits without closing the table, so that the log has to be replayed */
+  _exit(EXIT_SUCCESS);
+}
+
+static void
+run(int flags)
+{
+  struct JPT_info* db;
+  pid_t pid;
+  int status;
+
+  WANT_TRUE(0 == unlink("test-db.tab") || errno == ENOENT);
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+
+  fflush(stderr);
+
+  if(!(pid = fork()))
+    write_all(flags);
+
+  WANT_TRUE(pid == waitpid(pid, &status, 0));
+  WANT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 256 * 1024, flags));
+  check(db);
+
+  jpt_close(db);
+
+  WANT_SUCCESS(unlink("test-db.tab"));
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+}
+
+int
+main(int argc, char** argv)
+{
+  run(0);
+  run(JPT_SYNC);
+
+  fprintf(stderr, "* passed all %zu test%s\n", test_count, (test_count != 1) ? "s" : "");
+
+  return EXIT_SUCCESS;
+}
@@ -31,8 +31,9 @@ int
 main(int argc, char** argv)
 {
   struct JPT_info* db;
+  char row[32];
   void* ret;
-  size_t retsize;
+  size_t retsize, i;
 
   WANT_TRUE(0 == unlink("test-db.tab") || errno == ENOENT);
   WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
@@ -49,6 +50,58 @@ main(int argc, char** argv)
   WANT_SUCCESS(jpt_get(db, "row1", "col1", &ret, &retsize));
   WANT_TRUE(retsize == 5);
   free(ret);
+
+  /* Inserts replayed straight into the memtable, next to changes to cells in
+   * disktables */
+  WANT_SUCCESS(jpt_insert(db, "row2", "col2", "disk", 4, 0));
+  WANT_SUCCESS(jpt_insert(db, "row3", "col2", "gone", 4, 0));
+  WANT_SUCCESS(jpt_insert(db, "row4", "col3", "old", 3, 0));
+  WANT_SUCCESS(jpt_compact(db));
+
+  for(i = 0; i < 4000; ++i)
+  {
+    sprintf(row, "row%zu", i + 10);
+    WANT_SUCCESS(jpt_insert(db, row, (i & 1) ? "col1" : "col2", row, strlen(row), 0));
+  }
+
+  WANT_SUCCESS(jpt_append(db, "row10", "col2", "+", 1));
+  WANT_SUCCESS(jpt_replace(db, "row2", "col2", "memory", 6));
+  WANT_SUCCESS(jpt_remove(db, "row3", "col2"));
+  WANT_SUCCESS(jpt_insert(db, "row6", "col3", "old", 3, 0));
+  WANT_SUCCESS(jpt_remove_column(db, "col3", 0));
+  WANT_SUCCESS(jpt_insert(db, "row5", "col3", "new", 3, 0));
+
+  close(db->fd);
+  close(db->logfd);
+
+  /* The smaller memtable is compacted during replay */
+  WANT_POINTER(db = jpt_init("test-db.tab", 64 * 1024, 0))
+
+  for(i = 0; i < 4000; ++i)
+  {
+    sprintf(row, "row%zu", i + 10);
+    WANT_SUCCESS(jpt_get(db, row, (i & 1) ? "col1" : "col2", &ret, &retsize));
+    WANT_TRUE(retsize == strlen(row) + !i);
+    WANT_TRUE(!memcmp(ret, row, strlen(row)));
+    free(ret);
+  }
+
+  WANT_SUCCESS(jpt_get(db, "row10", "col2", &ret, &retsize));
+  WANT_TRUE(retsize == 6 && !memcmp(ret, "row10+", 6));
+  free(ret);
+
+  WANT_SUCCESS(jpt_get(db, "row2", "col2", &ret, &retsize));
+  WANT_TRUE(retsize == 6 && !memcmp(ret, "memory", 6));
+  free(ret);
+
+  WANT_FAILURE(jpt_get(db, "row3", "col2", &ret, &retsize));
+  WANT_FAILURE(jpt_get(db, "row4", "col3", &ret, &retsize));
+  WANT_FAILURE(jpt_get(db, "row6", "col3", &ret, &retsize));
+
+  WANT_SUCCESS(jpt_get(db, "row5", "col3", &ret, &retsize));
+  WANT_TRUE(retsize == 3 && !memcmp(ret, "new", 3));
+  free(ret);
+
   jpt_close(db);
 
   WANT_SUCCESS(unlink("test-db.tab"));
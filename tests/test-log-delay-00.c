@@ -0,0 +1,227 @@
+/*  Test-case for delayed log writes.
+    Copyright (C) 2007, 2008, 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "jpt.h"
+#include "jpt_internal.h"
+
+#include "common.h"
+
+#define ROW_COUNT 2000
+
+static void
+insert_rows(struct JPT_info* db, size_t first, size_t count)
+{
+  char row[32], value[64];
+  size_t i;
+
+  for(i = first; i < first + count; ++i)
+  {
+    sprintf(row, "row%06zu", i);
+    sprintf(value, "value %zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, row, "column", value, strlen(value), 0));
+  }
+}
+
+/* Returns the number of rows present, checking that they are a prefix of
+ * those inserted */
+static size_t
+count_prefix(struct JPT_info* db, size_t max)
+{
+  char row[32], expected[64];
+  void* value;
+  size_t i, value_size, count = max;
+
+  for(i = 0; i < max; ++i)
+  {
+    sprintf(row, "row%06zu", i);
+
+    if(-1 == jpt_get(db, row, "column", &value, &value_size))
+    {
+      WANT_TRUE(errno == ENOENT);
+
+      if(count == max)
+        count = i;
+
+      continue;
+    }
+
+    WANT_TRUE(i < count);
+
+    sprintf(expected, "value %zu", i);
+    WANT_TRUE(value_size == strlen(expected));
+    WANT_TRUE(!memcmp(value, expected, value_size));
+    free(value);
+  }
+
+  return count;
+}
+
+/* Waits until less than `slack' bytes of records are left unwritten */
+static void
+wait_written(struct JPT_info* db, uint64_t slack)
+{
+  size_t i;
+
+  for(i = 0; i < 500; ++i)
+  {
+    pthread_mutex_lock(&db->log_mutex);
+
+    if(db->log_appended - db->log_written <= slack)
+    {
+      pthread_mutex_unlock(&db->log_mutex);
+
+      return;
+    }
+
+    pthread_mutex_unlock(&db->log_mutex);
+
+    usleep(10000);
+  }
+
+  WANT_TRUE(!"log written in time");
+}
+
+static void
+write_child(int flags)
+{
+  struct JPT_info* db;
+  uint64_t written;
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 16 * 1024 * 1024, flags));
+
+  WANT_SUCCESS(jpt_create_column(db, "column", 0));
+
+  /* Nothing is written until the interval ends, or enough is waiting */
+  WANT_SUCCESS(jpt_set_log_delay(db, 3600 * 1000, 1024 * 1024 * 1024));
+  written = db->log_written;
+  insert_rows(db, 0, ROW_COUNT);
+  WANT_TRUE(db->log_written == written);
+  WANT_TRUE(db->log_appended > written);
+
+  WANT_SUCCESS(jpt_flush_log(db));
+  WANT_TRUE(db->log_written == db->log_appended);
+  WANT_TRUE(db->log_synced == db->log_appended);
+
+  WANT_SUCCESS(jpt_set_log_delay(db, 3600 * 1000, 4096));
+  insert_rows(db, ROW_COUNT, ROW_COUNT);
+  wait_written(db, 4096);
+  WANT_TRUE(db->log_written > db->log_synced || (flags & JPT_SYNC));
+
+  WANT_SUCCESS(jpt_set_log_delay(db, 10, 0));
+  insert_rows(db, 2 * ROW_COUNT, 10);
+  wait_written(db, 0);
+
+  /* Turning the delay off writes what is waiting */
+  WANT_SUCCESS(jpt_set_log_delay(db, 3600 * 1000, 0));
+  insert_rows(db, 2 * ROW_COUNT + 10, 10);
+  WANT_SUCCESS(jpt_set_log_delay(db, 0, 0));
+  WANT_TRUE(db->log_written == db->log_appended);
+
+  insert_rows(db, 2 * ROW_COUNT + 20, 10);
+  WANT_TRUE(db->log_written == db->log_appended);
+
+  /* Records still in memory are lost along with the process */
+  WANT_SUCCESS(jpt_set_log_delay(db, 3600 * 1000, 0));
+  insert_rows(db, 2 * ROW_COUNT + 30, ROW_COUNT);
+
+  _exit(EXIT_SUCCESS);
+}
+
+static void
+run(int flags)
+{
+  struct JPT_info* db;
+  struct stat st;
+  char* log;
+  size_t count, last_count;
+  off_t size;
+  pid_t pid;
+  int status, fd;
+
+  WANT_TRUE(0 == unlink("test-db.tab") || errno == ENOENT);
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+
+  fflush(stderr);
+
+  if(!(pid = fork()))
+    write_child(flags);
+
+  WANT_TRUE(pid == waitpid(pid, &status, 0));
+  WANT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+  WANT_SUCCESS(stat("test-db.tab.log", &st));
+  WANT_POINTER(log = malloc(st.st_size));
+  WANT_TRUE(-1 != (fd = open("test-db.tab.log", O_RDONLY)));
+  WANT_TRUE(st.st_size == read(fd, log, st.st_size));
+  close(fd);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 16 * 1024 * 1024, flags | JPT_DELAY_LOG));
+  WANT_TRUE(db->log_thread_started);
+  WANT_TRUE(2 * ROW_COUNT + 30 == count_prefix(db, 3 * ROW_COUNT + 30));
+
+  /* Closing the table writes the records kept in memory */
+  insert_rows(db, 2 * ROW_COUNT + 30, 10);
+  jpt_close(db);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 16 * 1024 * 1024, flags));
+  WANT_TRUE(2 * ROW_COUNT + 40 == count_prefix(db, 3 * ROW_COUNT + 30));
+  jpt_close(db);
+
+  /* A log cut anywhere is replayed up to the last whole record */
+  last_count = 0;
+
+  for(size = 0; size <= st.st_size; size += (size < 100 || size + 1000 > st.st_size) ? 1 : 997)
+  {
+    WANT_TRUE(-1 != (fd = open("test-db.tab.log", O_WRONLY | O_TRUNC)));
+    WANT_TRUE(size == write(fd, log, size));
+    close(fd);
+
+    WANT_POINTER(db = jpt_init("test-db.tab", 16 * 1024 * 1024, flags));
+    count = count_prefix(db, 2 * ROW_COUNT + 30);
+    WANT_TRUE(count >= last_count);
+    last_count = count;
+    jpt_close(db);
+  }
+
+  WANT_TRUE(last_count == 2 * ROW_COUNT + 30);
+
+  free(log);
+
+  WANT_SUCCESS(unlink("test-db.tab"));
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+}
+
+int
+main(int argc, char** argv)
+{
+  run(0);
+  run(JPT_SYNC);
+
+  fprintf(stderr, "* passed all %zu test%s\n", test_count, (test_count != 1) ? "s" : "");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,452 @@
+/*  Test-case for major compaction while the table is in use.
+    Copyright (C) 2007, 2008, 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jpt.h"
+#include "jpt_internal.h"
+
+#include "common.h"
+
+#define ROW_COUNT     40000
+#define NEW_ROW_COUNT 8000
+#define THREAD_COUNT  2
+
+#define PART_ROW_COUNT    32768
+#define PART_COLUMN_COUNT 8
+
+/* While the table is compacted, every 5th old cell is replaced by a shorter
+ * value, every 7th is removed, new rows are added and the column "doomed" is
+ * removed.  */
+static int
+expected_value(char* target, size_t i, int changed)
+{
+  if(changed && !(i % 7))
+    return 0;
+
+  if(changed && !(i % 5))
+    sprintf(target, "r %zu", i);
+  else
+    sprintf(target, "value %zu%s", i, (i % 3) ? "" : " appended");
+
+  return 1;
+}
+
+static int
+count_callback(const char* row, const char* column, const void* data,
+               size_t data_size, uint64_t* timestamp, void* arg)
+{
+  ++*(size_t*) arg;
+
+  return 0;
+}
+
+static void
+check(struct JPT_info* db)
+{
+  char row[32], expected[64];
+  void* value;
+  size_t i, value_size, count = 0, expected_count = 0;
+
+  for(i = 0; i < ROW_COUNT; ++i)
+  {
+    sprintf(row, "row%06zu", i);
+
+    if(!expected_value(expected, i, 1))
+    {
+      WANT_FAILURE(jpt_get(db, row, "column", &value, &value_size));
+      WANT_TRUE(errno == ENOENT);
+
+      continue;
+    }
+
+    ++expected_count;
+
+    WANT_SUCCESS(jpt_get(db, row, "column", &value, &value_size));
+    WANT_TRUE(value_size == strlen(expected));
+    WANT_TRUE(!memcmp(value, expected, value_size));
+    free(value);
+
+    if(!(i % 101))
+    {
+      WANT_FAILURE(jpt_get(db, row, "doomed", &value, &value_size));
+    }
+  }
+
+  for(i = 0; i < NEW_ROW_COUNT; ++i)
+  {
+    sprintf(row, "new%06zu", i);
+    sprintf(expected, "new value %zu", i);
+
+    WANT_SUCCESS(jpt_get(db, row, "column", &value, &value_size));
+    WANT_TRUE(value_size == strlen(expected));
+    WANT_TRUE(!memcmp(value, expected, value_size));
+    free(value);
+  }
+
+  WANT_SUCCESS(jpt_column_scan(db, "column", count_callback, &count));
+  WANT_TRUE(count == expected_count + NEW_ROW_COUNT);
+}
+
+/* The merge reads the disktables without the block cache, which readers
+ * could otherwise fill with cells that are about to change */
+static void
+major_compact_uncached(struct JPT_info* db)
+{
+  uint64_t hits, misses, old_hits, old_misses;
+
+  jpt_cache_stats(db, &old_hits, &old_misses);
+
+  WANT_SUCCESS(jpt_major_compact(db));
+
+  jpt_cache_stats(db, &hits, &misses);
+  WANT_TRUE(hits == old_hits);
+  WANT_TRUE(misses == old_misses);
+}
+
+static int compacting, done;
+static size_t published, writes_during_compaction;
+
+static int
+write_rows(struct JPT_info* db)
+{
+  char row[32], value[64];
+  size_t i;
+
+  for(i = 0; i < NEW_ROW_COUNT; ++i)
+  {
+    sprintf(row, "new%06zu", i);
+    sprintf(value, "new value %zu", i);
+
+    CHECK_SUCCESS(jpt_insert(db, row, "column", value, strlen(value), 0));
+
+    __atomic_store_n(&published, i + 1, __ATOMIC_RELEASE);
+
+    /* Each old row is changed once, spread over the new rows */
+    if(i * 5 < ROW_COUNT)
+    {
+      size_t j = i * 5;
+
+      sprintf(row, "row%06zu", j);
+
+      if(!(j % 7))
+      {
+        CHECK_SUCCESS(jpt_remove(db, row, "column"));
+      }
+      else
+      {
+        sprintf(value, "r %zu", j);
+
+        CHECK_SUCCESS(jpt_insert(db, row, "column", value, strlen(value), JPT_REPLACE));
+      }
+    }
+
+    for(size_t j = i * 5 + 1; j < (i + 1) * 5 && j < ROW_COUNT; ++j)
+    {
+      if(!(j % 7))
+      {
+        sprintf(row, "row%06zu", j);
+
+        CHECK_SUCCESS(jpt_remove(db, row, "column"));
+      }
+    }
+
+    if(i == NEW_ROW_COUNT / 2)
+    {
+      CHECK_SUCCESS(jpt_remove_column(db, "doomed", 0));
+    }
+
+    if((i + 1) % 500 == 0)
+    {
+      CHECK_SUCCESS(jpt_compact(db));
+    }
+
+    if(__atomic_load_n(&compacting, __ATOMIC_ACQUIRE))
+      ++writes_during_compaction;
+  }
+
+  return 0;
+}
+
+/* Returns non-null if a check failed */
+static void*
+write_thread(void* arg)
+{
+  if(-1 == write_rows(arg))
+    return arg;
+
+  return 0;
+}
+
+static int
+read_some(struct JPT_info* db)
+{
+  char row[32], expected[64];
+  void* value;
+  size_t i, n, value_size;
+
+  i = rand() % ROW_COUNT;
+
+  /* Cells being changed have no predictable value */
+  if((i % 5) && (i % 7))
+  {
+    sprintf(row, "row%06zu", i);
+    expected_value(expected, i, 0);
+
+    CHECK_SUCCESS(jpt_get(db, row, "column", &value, &value_size));
+    CHECK_TRUE(value_size == strlen(expected));
+    CHECK_TRUE(!memcmp(value, expected, value_size));
+    free(value);
+  }
+
+  if((n = __atomic_load_n(&published, __ATOMIC_ACQUIRE)))
+  {
+    i = rand() % n;
+
+    sprintf(row, "new%06zu", i);
+    sprintf(expected, "new value %zu", i);
+
+    CHECK_SUCCESS(jpt_get(db, row, "column", &value, &value_size));
+    CHECK_TRUE(value_size == strlen(expected));
+    CHECK_TRUE(!memcmp(value, expected, value_size));
+    free(value);
+  }
+
+  return 0;
+}
+
+/* Returns non-null if a check failed */
+static void*
+read_thread(void* arg)
+{
+  struct JPT_info* db = arg;
+
+  while(!__atomic_load_n(&done, __ATOMIC_ACQUIRE))
+  {
+    if(-1 == read_some(db))
+      return arg;
+
+    /* Readers are preferred by the lock; let the writer in */
+    usleep(100);
+  }
+
+  return 0;
+}
+
+static void
+run(int flags)
+{
+  struct JPT_info* db;
+  pthread_t writer, readers[THREAD_COUNT];
+  char row[32], value[64];
+  void* failed;
+  size_t i, disktable_count;
+
+  WANT_TRUE(0 == unlink("test-db.tab") || errno == ENOENT);
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 16 * 1024 * 1024, flags));
+
+  for(i = 0; i < ROW_COUNT; ++i)
+  {
+    sprintf(row, "row%06zu", i);
+    sprintf(value, "value %zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, row, "column", value, strlen(value), 0));
+
+    if(!(i % 101))
+      WANT_SUCCESS(jpt_insert(db, row, "doomed", value, strlen(value), 0));
+
+    if((i + 1) % (ROW_COUNT / 8) == 0)
+      WANT_SUCCESS(jpt_compact(db));
+  }
+
+  for(i = 0; i < ROW_COUNT; i += 3)
+  {
+    sprintf(row, "row%06zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, row, "column", " appended", 9, JPT_APPEND));
+  }
+
+  WANT_SUCCESS(jpt_compact(db));
+
+  __atomic_store_n(&published, 0, __ATOMIC_RELEASE);
+  writes_during_compaction = 0;
+  __atomic_store_n(&done, 0, __ATOMIC_RELEASE);
+
+  for(i = 0; i < THREAD_COUNT; ++i)
+    WANT_TRUE(0 == pthread_create(&readers[i], 0, read_thread, db));
+
+  WANT_TRUE(0 == pthread_create(&writer, 0, write_thread, db));
+
+  while(!__atomic_load_n(&published, __ATOMIC_ACQUIRE))
+    usleep(1000);
+
+  /* The writer finishes while compactions run, so some start after it */
+  while(__atomic_load_n(&published, __ATOMIC_ACQUIRE) < NEW_ROW_COUNT)
+  {
+    __atomic_store_n(&compacting, 1, __ATOMIC_RELEASE);
+    WANT_SUCCESS(jpt_major_compact(db));
+    __atomic_store_n(&compacting, 0, __ATOMIC_RELEASE);
+  }
+
+  pthread_join(writer, &failed);
+  WANT_TRUE(!failed);
+
+  __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+
+  for(i = 0; i < THREAD_COUNT; ++i)
+  {
+    pthread_join(readers[i], &failed);
+    WANT_TRUE(!failed);
+  }
+
+  WANT_TRUE(writes_during_compaction > 0);
+
+  check(db);
+
+  disktable_count = db->disktable_count;
+
+  jpt_close(db);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 16 * 1024 * 1024, flags));
+  WANT_TRUE(db->disktable_count == disktable_count);
+  check(db);
+
+  major_compact_uncached(db);
+  WANT_TRUE(db->disktable_count == 1);
+  check(db);
+
+  jpt_close(db);
+
+  WANT_SUCCESS(unlink("test-db.tab"));
+  WANT_SUCCESS(unlink("test-db.tab.log"));
+}
+
+static void
+check_parts(struct JPT_info* db)
+{
+  char row[32], column[32], expected[64];
+  void* value;
+  size_t i, j, value_size, count;
+
+  for(j = 0; j < PART_COLUMN_COUNT; ++j)
+  {
+    sprintf(column, "column%zu", j);
+
+    for(i = j; i < PART_ROW_COUNT; i += 13)
+    {
+      sprintf(row, "row%06zu", i);
+      sprintf(expected, "%zu %zu%s", i, j, (i % 3) ? "" : " appended");
+
+      WANT_SUCCESS(jpt_get(db, row, column, &value, &value_size));
+      WANT_TRUE(value_size == strlen(expected));
+      WANT_TRUE(!memcmp(value, expected, value_size));
+      free(value);
+    }
+
+    count = 0;
+    WANT_SUCCESS(jpt_column_scan(db, column, count_callback, &count));
+    WANT_TRUE(count == PART_ROW_COUNT);
+  }
+}
+
+/* A table with enough keys in enough columns is merged by several threads,
+ * each into a disktable of its own.  */
+static void
+run_parts(int flags)
+{
+  struct JPT_info* db;
+  char row[32], column[32], value[64];
+  size_t i, j;
+
+  WANT_TRUE(0 == unlink("test-db.tab") || errno == ENOENT);
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 64 * 1024 * 1024, flags));
+
+  for(j = 0; j < PART_COLUMN_COUNT; ++j)
+  {
+    sprintf(column, "column%zu", j);
+
+    for(i = 0; i < PART_ROW_COUNT; ++i)
+    {
+      sprintf(row, "row%06zu", i);
+      sprintf(value, "%zu %zu", i, j);
+
+      WANT_SUCCESS(jpt_insert(db, row, column, value, strlen(value), 0));
+    }
+
+    WANT_SUCCESS(jpt_compact(db));
+  }
+
+  for(j = 0; j < PART_COLUMN_COUNT; ++j)
+  {
+    sprintf(column, "column%zu", j);
+
+    for(i = 0; i < PART_ROW_COUNT; i += 3)
+    {
+      sprintf(row, "row%06zu", i);
+
+      WANT_SUCCESS(jpt_insert(db, row, column, " appended", 9, JPT_APPEND));
+    }
+  }
+
+  WANT_SUCCESS(jpt_compact(db));
+
+  db->major_compact_threads = 4;
+
+  major_compact_uncached(db);
+  WANT_TRUE(db->disktable_count == 4);
+  check_parts(db);
+
+  jpt_close(db);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 64 * 1024 * 1024, flags));
+  WANT_TRUE(db->disktable_count == 4);
+  check_parts(db);
+
+  /* With a single thread, everything ends up in one disktable */
+  db->major_compact_threads = 1;
+
+  major_compact_uncached(db);
+  WANT_TRUE(db->disktable_count == 1);
+  check_parts(db);
+
+  jpt_close(db);
+
+  WANT_SUCCESS(unlink("test-db.tab"));
+  WANT_SUCCESS(unlink("test-db.tab.log"));
+}
+
+int
+main(int argc, char** argv)
+{
+  run(0);
+  run(JPT_NO_MMAP);
+  run_parts(0);
+  run_parts(JPT_NO_MMAP);
+
+  fprintf(stderr, "* passed all %zu test%s\n", test_count, (test_count != 1) ? "s" : "");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,266 @@
+/*  Test-case for opening tables through the index of their disktables.
+    Copyright (C) 2007, 2008, 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "jpt.h"
+#include "jpt_internal.h"
+
+#include "common.h"
+
+#define DISKTABLE_COUNT 40
+#define ROW_COUNT       20000
+#define NEW_ROW_COUNT   500
+
+static int
+count_callback(const char* row, const char* column, const void* data,
+               size_t data_size, uint64_t* timestamp, void* arg)
+{
+  ++*(size_t*) arg;
+
+  return 0;
+}
+
+/* Every 3rd row has a value appended in a later disktable */
+static void
+check(struct JPT_info* db, size_t new_rows)
+{
+  char row[32], expected[64];
+  void* value;
+  size_t i, value_size, count = 0;
+
+  for(i = 0; i < ROW_COUNT; ++i)
+  {
+    sprintf(row, "row%06zu", i);
+    sprintf(expected, "value %zu%s", i, (i % 3) ? "" : " appended");
+
+    WANT_SUCCESS(jpt_get(db, row, "column", &value, &value_size));
+    WANT_TRUE(value_size == strlen(expected));
+    WANT_TRUE(!memcmp(value, expected, value_size));
+    free(value);
+  }
+
+  for(i = 0; i < new_rows; ++i)
+  {
+    sprintf(row, "new%06zu", i);
+
+    WANT_SUCCESS(jpt_get(db, row, "column", &value, &value_size));
+    WANT_TRUE(value_size == strlen(row));
+    WANT_TRUE(!memcmp(value, row, value_size));
+    free(value);
+  }
+
+  WANT_FAILURE(jpt_get(db, "absent", "column", &value, &value_size));
+  WANT_TRUE(errno == ENOENT);
+
+  WANT_SUCCESS(jpt_column_scan(db, "column", count_callback, &count));
+  WANT_TRUE(count == ROW_COUNT + new_rows);
+}
+
+static size_t
+lazy_count(struct JPT_info* db, int parts)
+{
+  struct JPT_disktable* disktable;
+  size_t count = 0;
+
+  for(disktable = db->first_disktable; disktable; disktable = disktable->next)
+  {
+    if(disktable->lazy & parts)
+      ++count;
+  }
+
+  return count;
+}
+
+static off_t
+file_size(const char* name)
+{
+  struct stat st;
+
+  WANT_SUCCESS(stat(name, &st));
+
+  return st.st_size;
+}
+
+static void
+insert_new_rows(struct JPT_info* db, size_t first, size_t count)
+{
+  char row[32];
+  size_t i;
+
+  for(i = first; i < first + count; ++i)
+  {
+    sprintf(row, "new%06zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, row, "column", row, strlen(row), 0));
+  }
+}
+
+static void
+run(int flags)
+{
+  struct JPT_info* db;
+  struct JPT_compaction_policy policy;
+  char row[32], value[64];
+  size_t i;
+  void* data;
+  size_t data_size;
+  pid_t pid;
+  int status;
+
+  WANT_TRUE(0 == unlink("test-db.tab") || errno == ENOENT);
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, flags));
+
+  for(i = 0; i < ROW_COUNT; ++i)
+  {
+    sprintf(row, "row%06zu", i);
+    sprintf(value, "value %zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, row, "column", value, strlen(value), 0));
+
+    if((i + 1) % (ROW_COUNT / DISKTABLE_COUNT) == 0)
+      WANT_SUCCESS(jpt_compact(db));
+  }
+
+  for(i = 0; i < ROW_COUNT; i += 3)
+  {
+    sprintf(row, "row%06zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, row, "column", " appended", 9, JPT_APPEND));
+  }
+
+  WANT_SUCCESS(jpt_compact(db));
+  WANT_TRUE(db->disktable_count == DISKTABLE_COUNT + 1);
+
+  jpt_close(db);
+
+  /* Nothing but the index is read when the table is opened */
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, flags));
+  WANT_TRUE(db->index_end == file_size("test-db.tab"));
+  WANT_TRUE(db->disktable_count == DISKTABLE_COUNT + 1);
+  WANT_TRUE(db->lazy_bloom_count == db->disktable_count);
+  WANT_TRUE(lazy_count(db, JPT_LAZY_ALL) == db->disktable_count);
+
+  /* A lookup reads every bloom filter, but only the tries of the disktables
+   * that may hold the key */
+  WANT_SUCCESS(jpt_get(db, "row000000", "column", &data, &data_size));
+  free(data);
+  WANT_TRUE(db->lazy_bloom_count == 0);
+  WANT_TRUE(lazy_count(db, JPT_LAZY_TRIE) > db->disktable_count / 2);
+  WANT_TRUE(lazy_count(db, JPT_LAZY_COLUMNS) == db->disktable_count);
+
+  check(db, 0);
+  WANT_TRUE(lazy_count(db, JPT_LAZY_ALL) == 0);
+
+  /* Cells in the log are kept along with the index */
+  insert_new_rows(db, 0, NEW_ROW_COUNT);
+
+  jpt_close(db);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, flags));
+  WANT_TRUE(db->index_end != 0);
+  check(db, NEW_ROW_COUNT);
+
+  /* A disktable written after the index hides it */
+  WANT_SUCCESS(jpt_compact(db));
+
+  jpt_close(db);
+
+  fflush(stderr);
+
+  if(!(pid = fork()))
+  {
+    WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, flags));
+    insert_new_rows(db, NEW_ROW_COUNT, NEW_ROW_COUNT);
+    WANT_SUCCESS(jpt_compact(db));
+
+    /* Exits without writing a new index */
+    _exit(EXIT_SUCCESS);
+  }
+
+  WANT_TRUE(pid == waitpid(pid, &status, 0));
+  WANT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, flags));
+  WANT_TRUE(db->index_end == 0);
+  WANT_TRUE(lazy_count(db, JPT_LAZY_ALL) == db->disktable_count);
+  check(db, 2 * NEW_ROW_COUNT);
+
+  /* Background merges read the disktables they merge */
+  jpt_get_compaction_policy(db, &policy);
+  policy.min_merge = 2;
+  policy.max_disktables = 3;
+  WANT_SUCCESS(jpt_set_compaction_policy(db, &policy));
+
+  jpt_compaction_wait(db);
+  WANT_TRUE(db->disktable_count <= 3);
+  check(db, 2 * NEW_ROW_COUNT);
+
+  WANT_SUCCESS(jpt_set_compaction_policy(db, 0));
+
+  jpt_close(db);
+
+  /* A damaged index is ignored */
+  WANT_SUCCESS(truncate("test-db.tab", file_size("test-db.tab") - 1));
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, flags));
+  WANT_TRUE(db->index_end == 0);
+  check(db, 2 * NEW_ROW_COUNT);
+
+  jpt_close(db);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, flags));
+  WANT_TRUE(db->index_end != 0);
+
+  WANT_SUCCESS(jpt_major_compact(db));
+  WANT_TRUE(db->disktable_count == 1);
+  check(db, 2 * NEW_ROW_COUNT);
+
+  jpt_close(db);
+
+  /* JPT_LOCK_INDEX reads everything when the table is opened */
+  WANT_POINTER(db = jpt_init("test-db.tab", 4 * 1024 * 1024, flags | JPT_LOCK_INDEX));
+  WANT_TRUE(db->index_end != 0);
+  WANT_TRUE(lazy_count(db, JPT_LAZY_ALL) == 0);
+  WANT_TRUE(db->lazy_bloom_count == 0);
+  check(db, 2 * NEW_ROW_COUNT);
+
+  jpt_close(db);
+
+  WANT_SUCCESS(unlink("test-db.tab"));
+  WANT_SUCCESS(unlink("test-db.tab.log"));
+}
+
+int
+main(int argc, char** argv)
+{
+  run(0);
+  run(JPT_NO_MMAP);
+  run(JPT_ASYNC_READ);
+
+  fprintf(stderr, "* passed all %zu test%s\n", test_count, (test_count != 1) ? "s" : "");
+
+  return EXIT_SUCCESS;
+}
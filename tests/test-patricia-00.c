@@ -0,0 +1,137 @@
+/*  Test-case for building PATRICIA tries from sorted keys.
+    Copyright (C) 2007, 2008, 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jpt.h"
+#include "patricia.h"
+
+#include "common.h"
+
+#define KEY_COUNT 20000
+
+static char* keys[KEY_COUNT];
+
+static const char*
+key_callback(unsigned int idx, void* arg)
+{
+  return keys[idx];
+}
+
+static int
+key_compare(const void* lhs, const void* rhs)
+{
+  return strcmp(*(char* const*) lhs, *(char* const*) rhs);
+}
+
+/* Returns the serialized form of a trie */
+static char*
+serialize(const struct patricia* pat, size_t* size)
+{
+  FILE* f;
+  char* result;
+
+  WANT_POINTER(f = tmpfile());
+  WANT_SUCCESS(*size = patricia_write(pat, fileno(f)));
+  WANT_POINTER(result = malloc(*size));
+  WANT_TRUE(*size == pread(fileno(f), result, *size, 0));
+  fclose(f);
+
+  return result;
+}
+
+static void
+run(const char* alphabet, size_t max_length)
+{
+  struct patricia* reference;
+  struct patricia* sorted;
+  char* reference_data;
+  char* sorted_data;
+  size_t reference_size, sorted_size;
+  size_t i, j, length, count;
+
+  for(i = 0; i < KEY_COUNT; ++i)
+  {
+    length = 1 + rand() % max_length;
+    keys[i] = malloc(length + 1);
+
+    for(j = 0; j < length; ++j)
+      keys[i][j] = alphabet[rand() % strlen(alphabet)];
+
+    keys[i][length] = 0;
+  }
+
+  qsort(keys, KEY_COUNT, sizeof(char*), key_compare);
+
+  for(i = 1, count = 1; i < KEY_COUNT; ++i)
+  {
+    if(strcmp(keys[i], keys[count - 1]))
+      keys[count++] = keys[i];
+    else
+      free(keys[i]);
+  }
+
+  reference = patricia_create(key_callback, 0);
+  sorted = patricia_create(0, 0);
+
+  for(i = 0; i < count; ++i)
+  {
+    WANT_TRUE(i == patricia_define(reference, keys[i]));
+    WANT_TRUE(i == patricia_define_sorted(sorted, keys[i]));
+
+    /* Duplicates of the previous key map to the same index */
+    if(i % 7 == 0)
+      WANT_TRUE(i == patricia_define_sorted(sorted, keys[i]));
+  }
+
+  for(i = 0; i < count; ++i)
+    WANT_TRUE(i == patricia_lookup(sorted, keys[i]));
+
+  reference_data = serialize(reference, &reference_size);
+  sorted_data = serialize(sorted, &sorted_size);
+
+  WANT_TRUE(reference_size == sorted_size);
+  WANT_TRUE(!memcmp(reference_data, sorted_data, sorted_size));
+
+  free(sorted_data);
+  free(reference_data);
+  patricia_destroy(sorted);
+  patricia_destroy(reference);
+
+  for(i = 0; i < count; ++i)
+    free(keys[i]);
+}
+
+int
+main(int argc, char** argv)
+{
+  /* Long shared prefixes, differing in few bits */
+  run("\001\002\003", 16);
+
+  /* Bytes whose sort order differs from their low-order bit order */
+  run("\001\002\003\004\005\006\007\010\011\017\020\177\200\201\376\377", 6);
+
+  /* Row keys behind column prefixes */
+  run("0123456789abcdef", 10);
+
+  fprintf(stderr, "* passed all %zu test%s\n", test_count, (test_count != 1) ? "s" : "");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,256 @@
+/*  Test-case for tables with the segmented layout.
+    Copyright (C) 2007, 2008, 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jpt.h"
+#include "jpt_internal.h"
+
+#include "common.h"
+
+#define ROW_COUNT 20000
+
+/* Every 3rd cell has a value appended, every 7th is removed once the table
+ * has been merged, and the column "doomed" is removed.  */
+static int
+expected_value(char* target, size_t i, int removed)
+{
+  if(removed && !(i % 7))
+    return 0;
+
+  sprintf(target, "value %zu%s", i, (i % 3) ? "" : " appended");
+
+  return 1;
+}
+
+static int
+count_callback(const char* row, const char* column, const void* data,
+               size_t data_size, uint64_t* timestamp, void* arg)
+{
+  ++*(size_t*) arg;
+
+  return 0;
+}
+
+static void
+check(struct JPT_info* db, int removed)
+{
+  char row[32], expected[64];
+  void* value;
+  size_t i, value_size, count = 0, expected_count = 0;
+
+  for(i = 0; i < ROW_COUNT; ++i)
+  {
+    sprintf(row, "row%06zu", i);
+
+    if(!expected_value(expected, i, removed))
+    {
+      WANT_FAILURE(jpt_get(db, row, "column", &value, &value_size));
+      WANT_TRUE(errno == ENOENT);
+
+      continue;
+    }
+
+    ++expected_count;
+
+    WANT_SUCCESS(jpt_get(db, row, "column", &value, &value_size));
+    WANT_TRUE(value_size == strlen(expected));
+    WANT_TRUE(!memcmp(value, expected, value_size));
+    free(value);
+
+    if(removed && !(i % 101))
+    {
+      WANT_FAILURE(jpt_get(db, row, "doomed", &value, &value_size));
+    }
+  }
+
+  WANT_SUCCESS(jpt_column_scan(db, "column", count_callback, &count));
+  WANT_TRUE(count == expected_count);
+}
+
+/* Returns non-zero if every disktable has a file of its own, and all of
+ * them exist.  */
+static int
+segments_exist(struct JPT_info* db)
+{
+  struct JPT_disktable* disktable;
+  char name[64];
+
+  for(disktable = db->first_disktable; disktable; disktable = disktable->next)
+  {
+    if(!disktable->segment)
+      return 0;
+
+    sprintf(name, "test-db.tab.%06llu",
+            (unsigned long long) disktable->segment->id);
+
+    if(-1 == access(name, F_OK))
+      return 0;
+  }
+
+  return 1;
+}
+
+static size_t
+segment_file_count(struct JPT_info* db)
+{
+  char name[64];
+  size_t count = 0;
+  uint64_t id;
+
+  for(id = 0; id < db->next_segment_id; ++id)
+  {
+    sprintf(name, "test-db.tab.%06llu", (unsigned long long) id);
+
+    if(0 == access(name, F_OK))
+      ++count;
+  }
+
+  return count;
+}
+
+static void
+unlink_segments(struct JPT_info* db)
+{
+  char name[64];
+  uint64_t id;
+
+  for(id = 0; id < db->next_segment_id; ++id)
+  {
+    sprintf(name, "test-db.tab.%06llu", (unsigned long long) id);
+    unlink(name);
+  }
+}
+
+static void
+run(int flags)
+{
+  struct JPT_info* db;
+  struct JPT_compaction_policy policy;
+  char row[32], value[64];
+  size_t i, disktable_count;
+  int fd;
+
+  WANT_TRUE(0 == unlink("test-db.tab") || errno == ENOENT);
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 1024 * 1024, flags));
+  WANT_TRUE(db->segmented);
+
+  for(i = 0; i < ROW_COUNT; ++i)
+  {
+    sprintf(row, "row%06zu", i);
+    sprintf(value, "value %zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, row, "column", value, strlen(value), 0));
+
+    if(!(i % 101))
+      WANT_SUCCESS(jpt_insert(db, row, "doomed", value, strlen(value), 0));
+
+    if((i + 1) % (ROW_COUNT / 8) == 0)
+      WANT_SUCCESS(jpt_compact(db));
+  }
+
+  for(i = 0; i < ROW_COUNT; i += 3)
+  {
+    sprintf(row, "row%06zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, row, "column", " appended", 9, JPT_APPEND));
+  }
+
+  WANT_SUCCESS(jpt_compact(db));
+
+  WANT_TRUE(db->disktable_count >= 8);
+  WANT_TRUE(segments_exist(db));
+  WANT_TRUE(segment_file_count(db) == db->disktable_count);
+  check(db, 0);
+
+  /* Merged disktables have their files deleted as soon as they are replaced */
+  jpt_get_compaction_policy(db, &policy);
+  policy.min_merge = 2;
+  policy.max_disktables = 3;
+  WANT_SUCCESS(jpt_set_compaction_policy(db, &policy));
+
+  jpt_compaction_wait(db);
+  WANT_TRUE(db->disktable_count <= 3);
+  WANT_TRUE(segments_exist(db));
+  WANT_TRUE(segment_file_count(db) == db->disktable_count);
+  check(db, 0);
+
+  WANT_SUCCESS(jpt_set_compaction_policy(db, 0));
+
+  for(i = 0; i < ROW_COUNT; i += 7)
+  {
+    sprintf(row, "row%06zu", i);
+
+    WANT_SUCCESS(jpt_remove(db, row, "column"));
+  }
+
+  WANT_SUCCESS(jpt_remove_column(db, "doomed", 0));
+
+  /* Cells still in the memtable are recovered from the log */
+  disktable_count = db->disktable_count;
+
+  jpt_close(db);
+
+  /* Files missing from the manifest are left over from an interrupted merge */
+  WANT_TRUE(-1 != (fd = open("test-db.tab.999999", O_CREAT | O_WRONLY, 0644)));
+  close(fd);
+
+  /* The layout is kept without JPT_SEGMENTED */
+  WANT_POINTER(db = jpt_init("test-db.tab", 1024 * 1024, flags & ~JPT_SEGMENTED));
+  WANT_TRUE(db->segmented);
+  WANT_TRUE(-1 == access("test-db.tab.999999", F_OK) && errno == ENOENT);
+  WANT_TRUE(db->disktable_count >= disktable_count);
+  WANT_TRUE(segments_exist(db));
+  check(db, 1);
+
+  WANT_SUCCESS(jpt_major_compact(db));
+  WANT_TRUE(db->disktable_count == 1);
+  WANT_TRUE(segments_exist(db));
+  WANT_TRUE(segment_file_count(db) == 1);
+  check(db, 1);
+
+  jpt_close(db);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 1024 * 1024, flags));
+  WANT_TRUE(db->disktable_count == 1);
+  check(db, 1);
+
+  unlink_segments(db);
+
+  jpt_close(db);
+
+  WANT_SUCCESS(unlink("test-db.tab"));
+  WANT_SUCCESS(unlink("test-db.tab.log"));
+}
+
+int
+main(int argc, char** argv)
+{
+  run(JPT_SEGMENTED);
+  run(JPT_SEGMENTED | JPT_NO_MMAP);
+
+  fprintf(stderr, "* passed all %zu test%s\n", test_count, (test_count != 1) ? "s" : "");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,171 @@
+/*  Test-case for the skiplist memtable in jpt.
+    Copyright (C) 2007, 2008, 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jpt.h"
+
+#include "common.h"
+
+#define KEY_COUNT    0x2000
+#define READER_COUNT 4
+
+static struct JPT_info* db;
+static size_t count;
+static size_t inserted;
+static int done;
+
+static int
+cell_callback(const char* row, const char* column, const void* data,
+              size_t data_size, uint64_t* timestamp, void* arg)
+{
+  char buf[64];
+
+  WANT_TRUE(!strcmp(column, "column"));
+  WANT_TRUE(data_size == strlen(row));
+  WANT_TRUE(0 == memcmp(row, data, data_size));
+
+  sprintf(buf, "%08zu", count++);
+
+  WANT_TRUE(0 == strcmp(row, buf));
+
+  return 0;
+}
+
+static void*
+reader_thread(void* arg)
+{
+  char buf[64];
+  void* ret;
+  size_t retsize;
+  size_t i, limit;
+
+  while(!__atomic_load_n(&done, __ATOMIC_ACQUIRE))
+  {
+    limit = __atomic_load_n(&inserted, __ATOMIC_ACQUIRE);
+
+    for(i = 0; i < limit; i += 7)
+    {
+      sprintf(buf, "%08zu", i);
+
+      if(-1 == jpt_get(db, buf, "threaded", &ret, &retsize))
+      {
+        fprintf(stderr, "jpt_get(\"%s\") failed unexpectedly: %s\n", buf, jpt_last_error());
+        exit(EXIT_FAILURE);
+      }
+
+      if(retsize != strlen(buf) || memcmp(ret, buf, retsize))
+      {
+        fprintf(stderr, "jpt_get(\"%s\") returned wrong value\n", buf);
+        exit(EXIT_FAILURE);
+      }
+
+      free(ret);
+    }
+  }
+
+  return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+  pthread_t readers[READER_COUNT];
+  void* ret;
+  size_t retsize;
+  char buf[64];
+  size_t i;
+
+  WANT_TRUE(0 == unlink("test-db.tab") || errno == ENOENT);
+  WANT_TRUE(0 == unlink("test-db.tab.log") || errno == ENOENT);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 128 * 1024, JPT_SKIPLIST));
+
+  WANT_SUCCESS(jpt_insert(db, "row1", "col1", "a", 1, JPT_APPEND));
+  WANT_SUCCESS(jpt_insert(db, "row1", "col1", "b", 1, JPT_APPEND));
+  WANT_FAILURE(jpt_insert(db, "row1", "col1", "x", 1, 0));
+  WANT_SUCCESS(jpt_get(db, "row1", "col1", &ret, &retsize));
+  WANT_TRUE(retsize == 2);
+  WANT_TRUE(!memcmp(ret, "ab", 2));
+  free(ret);
+  WANT_SUCCESS(jpt_remove(db, "row1", "col1"));
+  WANT_FAILURE(jpt_get(db, "row1", "col1", &ret, &retsize));
+  WANT_FAILURE(jpt_has_key(db, "row1", "col1"));
+  WANT_SUCCESS(jpt_insert(db, "row1", "col1", "c", 1, 0));
+  WANT_SUCCESS(jpt_insert(db, "row1", "col1", "defg", 4, JPT_REPLACE));
+  WANT_SUCCESS(jpt_has_key(db, "row1", "col1"));
+  WANT_SUCCESS(jpt_get(db, "row1", "col1", &ret, &retsize));
+  WANT_TRUE(retsize == 4);
+  WANT_TRUE(!memcmp(ret, "defg", 4));
+  free(ret);
+
+  /* Enough keys to fill the memtable several times, in scrambled order */
+  for(i = 0; i < KEY_COUNT; ++i)
+  {
+    sprintf(buf, "%08zu", i ^ 0x0AAA);
+
+    WANT_SUCCESS(jpt_insert(db, buf, "column", buf, strlen(buf), 0));
+  }
+
+  WANT_SUCCESS(jpt_column_scan(db, "column", cell_callback, 0));
+  WANT_TRUE(count == KEY_COUNT);
+
+  WANT_SUCCESS(jpt_major_compact(db));
+
+  count = 0;
+  WANT_SUCCESS(jpt_column_scan(db, "column", cell_callback, 0));
+  WANT_TRUE(count == KEY_COUNT);
+
+  /* Readers must always see keys that have been completely inserted */
+  for(i = 0; i < READER_COUNT; ++i)
+    WANT_TRUE(0 == pthread_create(&readers[i], 0, reader_thread, 0));
+
+  for(i = 0; i < KEY_COUNT; ++i)
+  {
+    sprintf(buf, "%08zu", i);
+
+    WANT_SUCCESS(jpt_insert(db, buf, "threaded", buf, strlen(buf), 0));
+
+    __atomic_store_n(&inserted, i + 1, __ATOMIC_RELEASE);
+  }
+
+  __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+
+  for(i = 0; i < READER_COUNT; ++i)
+    pthread_join(readers[i], 0);
+
+  jpt_close(db);
+
+  WANT_POINTER(db = jpt_init("test-db.tab", 128 * 1024, JPT_SKIPLIST));
+  WANT_SUCCESS(jpt_get(db, "00000123", "threaded", &ret, &retsize));
+  WANT_TRUE(retsize == 8);
+  free(ret);
+  jpt_close(db);
+
+  WANT_SUCCESS(unlink("test-db.tab"));
+  WANT_SUCCESS(unlink("test-db.tab.log"));
+
+  fprintf(stderr, "* passed all %zu test%s\n", test_count, (test_count != 1) ? "s" : "");
+
+  return EXIT_SUCCESS;
+}